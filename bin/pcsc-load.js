@@ -0,0 +1,373 @@
+#!/usr/bin/env node
+
+/*
+ * Load generator: it drives a set of readers with a mix of APDUs at a fixed
+ * rate and reports the achieved throughput, the latency percentiles, the depth
+ * of the reader queues and the event loop lag.
+ *
+ * The pacing is open loop: every reader sends on a fixed schedule no matter
+ * how long the previous APDUs take, and latencies are measured from the time
+ * an APDU was due, so a stalled stack shows up in the numbers instead of
+ * slowing the generator down.
+ */
+
+var pcsc = require('../index');
+
+var usage = [
+    'Usage: pcsc-load [options]',
+    '',
+    '  --readers N       Number of readers to drive (default 1)',
+    '  --rate R          APDUs per second and reader (default 10)',
+    '  --duration S      Seconds to run (default 10)',
+    '  --apdu HEX[:W]    APDU of the mix with its weight, repeatable (default 0084000008)',
+    '  --res-len N       Response buffer length (default 258)',
+    '  --max-inflight N  APDUs pending per reader before new ones are skipped (default 1000)',
+    '  --trace FILE      Drive N virtual readers replaying FILE instead of pcscd readers',
+    '  --speed X         Replay timing scale (default 1)',
+    '  --exclusive       Connect in exclusive mode',
+    '  --batch           Deliver the callbacks in batches (pcscd readers)',
+    '  --priority P      interactive, normal or bulk (default normal)',
+    '  --json            Print the final report as JSON'
+].join('\n');
+
+var priorities = ['interactive', 'normal', 'bulk'];
+
+/*
+ * It parses the APDU mix: a list of "HEX[:WEIGHT]" strings
+ */
+function parse_mix(list) {
+    return list.map(function(item) {
+        var parts = item.split(':');
+        var hex = parts[0].replace(/\s/g, '');
+        var weight = parts.length > 1 ? Number(parts[1]) : 1;
+        if (!/^([0-9a-fA-F]{2})+$/.test(hex) || hex.length < 8) {
+            throw new Error('Invalid APDU: ' + item);
+        }
+
+        if (!(weight > 0)) {
+            throw new Error('Invalid weight: ' + item);
+        }
+
+        return { data : new Buffer(hex, 'hex'), weight : weight };
+    });
+}
+
+/*
+ * It picks an APDU of the mix according to the weights
+ */
+function pick(mix, total) {
+    var r = Math.random() * total;
+    for (var i = 0; i < mix.length; ++ i) {
+        r -= mix[i].weight;
+        if (r < 0) {
+            return mix[i].data;
+        }
+    }
+
+    return mix[mix.length - 1].data;
+}
+
+/*
+ * It returns the p-th percentile of an array sorted in ascending order
+ */
+function percentile(sorted, p) {
+    if (sorted.length === 0) {
+        return 0;
+    }
+
+    var index = Math.ceil(p / 100 * sorted.length) - 1;
+    return sorted[Math.min(Math.max(index, 0), sorted.length - 1)];
+}
+
+function parse_args(argv) {
+    var options = {
+        readers : 1,
+        rate : 10,
+        duration : 10,
+        apdu : [],
+        res_len : 258,
+        max_inflight : 1000,
+        trace : null,
+        speed : 1,
+        exclusive : false,
+        batch : false,
+        priority : 'normal',
+        json : false
+    };
+
+    for (var i = 0; i < argv.length; ++ i) {
+        var arg = argv[i];
+        var value = argv[i + 1];
+        switch (arg) {
+            case '--readers': options.readers = Number(value); ++ i; break;
+            case '--rate': options.rate = Number(value); ++ i; break;
+            case '--duration': options.duration = Number(value); ++ i; break;
+            case '--apdu': options.apdu.push(value); ++ i; break;
+            case '--res-len': options.res_len = Number(value); ++ i; break;
+            case '--max-inflight': options.max_inflight = Number(value); ++ i; break;
+            case '--trace': options.trace = value; ++ i; break;
+            case '--speed': options.speed = Number(value); ++ i; break;
+            case '--priority': options.priority = value; ++ i; break;
+            case '--exclusive': options.exclusive = true; break;
+            case '--batch': options.batch = true; break;
+            case '--json': options.json = true; break;
+            case '--help':
+                console.log(usage);
+                process.exit(0);
+            break;
+
+            default:
+                throw new Error('Unknown option ' + arg);
+        }
+    }
+
+    if (!(options.readers >= 1) || !(options.rate > 0) || !(options.duration > 0)) {
+        throw new Error('--readers, --rate and --duration must be positive');
+    }
+
+    if (priorities.indexOf(options.priority) === -1) {
+        throw new Error('Unknown priority ' + options.priority);
+    }
+
+    if (options.apdu.length === 0) {
+        options.apdu.push('0084000008');
+    }
+
+    return options;
+}
+
+function now() {
+    var t = process.hrtime();
+    return t[0] * 1e3 + t[1] / 1e6;
+}
+
+/*
+ * It calls cb with the connected readers and their protocols
+ */
+function get_readers(options, cb) {
+    var p = null;
+    var readers = [];
+    var connect = function(reader) {
+        var share_mode = options.exclusive ? reader.SCARD_SHARE_EXCLUSIVE : reader.SCARD_SHARE_SHARED;
+        reader.connect({ share_mode : share_mode }, function(err, protocol) {
+            // Nothing would ever start without this reader
+            if (err) {
+                console.error('Cannot connect to', reader.name + ':', err.message);
+                process.exit(1);
+            }
+
+            readers.push({ reader : reader, protocol : protocol });
+            if (readers.length === options.readers) {
+                cb(p, readers);
+            }
+        });
+    };
+
+    if (options.trace) {
+        for (var i = 0; i < options.readers; ++ i) {
+            connect(pcsc.replay('Virtual reader ' + i, options.trace, { speed : options.speed }));
+        }
+
+        return;
+    }
+
+    // Take the first readers holding a card
+    var pending = options.readers;
+    p = pcsc({ batch : options.batch });
+    p.on('error', function(err) {
+        console.error('PCSC error', err.message);
+    });
+
+    p.on('reader', function(reader) {
+        reader.on('error', function(err) {
+            console.error('Error(', this.name, '):', err.message);
+        });
+
+        reader.on('status', function(status) {
+            if (pending > 0 && !this.connected && (status.state & this.SCARD_STATE_PRESENT)) {
+                -- pending;
+                connect(this);
+            }
+        });
+    });
+
+    console.error('Waiting for', options.readers, 'reader(s) with a card...');
+}
+
+function run(options) {
+    var mix = parse_mix(options.apdu);
+    var total_weight = mix.reduce(function(sum, m) {
+        return sum + m.weight;
+    }, 0);
+
+    get_readers(options, function(p, readers) {
+        var interval = 1000 / options.rate;
+        var priority = readers[0].reader['PRIORITY_' + options.priority.toUpperCase()];
+        var stats = {
+            sent : 0,
+            completed : 0,
+            errors : 0,
+            skipped : 0,
+            latencies : [],
+            queued : [],
+            lag : []
+        };
+
+        var start = now();
+        var end = start + options.duration * 1000;
+        var sending = true;
+
+        readers.forEach(function(r) {
+            r.next = 0;
+            r.inflight = 0;
+        });
+
+        var send = function(r, due) {
+            ++ stats.sent;
+            ++ r.inflight;
+            r.reader.transmit(pick(mix, total_weight), options.res_len, r.protocol, { priority : priority }, function(err) {
+                -- r.inflight;
+                ++ stats.completed;
+                if (err) {
+                    ++ stats.errors;
+                } else {
+                    stats.latencies.push(now() - due);
+                }
+            });
+        };
+
+        // Send whatever is due for every reader
+        var pacer = setInterval(function() {
+            var t = Math.min(now(), end);
+            readers.forEach(function(r) {
+                while (start + r.next * interval <= t) {
+                    var due = start + r.next * interval;
+                    ++ r.next;
+                    if (r.inflight >= options.max_inflight) {
+                        ++ stats.skipped;
+                    } else {
+                        send(r, due);
+                    }
+                }
+            });
+
+            if (t >= end) {
+                clearInterval(pacer);
+                sending = false;
+            }
+        }, Math.max(1, Math.min(interval, 10)));
+
+        // Event loop lag: how late a 10ms timer fires
+        var expected = now() + 10;
+        var lag_timer = setInterval(function() {
+            var t = now();
+            stats.lag.push(Math.max(0, t - expected));
+            expected = t + 10;
+        }, 10);
+
+        // Depth of the reader queues, in the threadpool or waiting for it
+        var last = { time : start, completed : 0 };
+        var sampler = setInterval(function() {
+            var queued = readers.reduce(function(sum, r) {
+                return sum + r.reader.getStats().queued;
+            }, 0);
+
+            stats.queued.push(queued);
+            var t = now();
+            if (!options.json) {
+                var rate = (stats.completed - last.completed) * 1000 / (t - last.time);
+                console.log('t=' + ((t - start) / 1000).toFixed(1) + 's',
+                            'sent=' + stats.sent,
+                            'done=' + stats.completed,
+                            'errors=' + stats.errors,
+                            'rate=' + rate.toFixed(1) + '/s',
+                            'queued=' + queued);
+            }
+
+            last = { time : t, completed : stats.completed };
+            var inflight = stats.sent - stats.completed;
+            if (!sending && (inflight === 0 || t > end + 5000)) {
+                clearInterval(sampler);
+                clearInterval(lag_timer);
+                report(options, stats, t - start, inflight);
+                readers.forEach(function(r) {
+                    r.reader.close();
+                });
+
+                if (p) {
+                    p.close();
+                }
+            }
+        }, 1000);
+    });
+}
+
+function summary(values) {
+    var sorted = values.slice().sort(function(a, b) {
+        return a - b;
+    });
+
+    var round = function(v) {
+        return Math.round(v * 1000) / 1000;
+    };
+
+    return {
+        p50 : round(percentile(sorted, 50)),
+        p90 : round(percentile(sorted, 90)),
+        p99 : round(percentile(sorted, 99)),
+        p999 : round(percentile(sorted, 99.9)),
+        max : round(sorted.length ? sorted[sorted.length - 1] : 0)
+    };
+}
+
+function report(options, stats, elapsed, unfinished) {
+    var result = {
+        readers : options.readers,
+        target_rate : options.rate * options.readers,
+        achieved_rate : Math.round((stats.completed - stats.errors) * 1e6 / elapsed) / 1000,
+        sent : stats.sent,
+        completed : stats.completed,
+        errors : stats.errors,
+        skipped : stats.skipped,
+        unfinished : unfinished,
+        latency_ms : summary(stats.latencies),
+        queued : {
+            mean : stats.queued.length ? stats.queued.reduce(function(a, b) {
+                return a + b;
+            }, 0) / stats.queued.length : 0,
+            max : Math.max.apply(null, stats.queued.concat(0))
+        },
+        event_loop_lag_ms : summary(stats.lag)
+    };
+
+    if (options.json) {
+        console.log(JSON.stringify(result, null, 2));
+        return;
+    }
+
+    console.log('');
+    console.log('Throughput:', result.achieved_rate, 'APDU/s of', result.target_rate, 'targeted');
+    console.log('APDUs:', result.sent, 'sent,', result.completed, 'completed,', result.errors, 'failed,',
+                result.skipped, 'skipped,', result.unfinished, 'unfinished');
+    console.log('Latency (ms): p50', result.latency_ms.p50, 'p90', result.latency_ms.p90,
+                'p99', result.latency_ms.p99, 'p99.9', result.latency_ms.p999, 'max', result.latency_ms.max);
+    console.log('Queued operations: mean', result.queued.mean.toFixed(1), 'max', result.queued.max);
+    console.log('Event loop lag (ms): p50', result.event_loop_lag_ms.p50, 'p99', result.event_loop_lag_ms.p99,
+                'max', result.event_loop_lag_ms.max);
+}
+
+module.exports = {
+    parse_mix : parse_mix,
+    parse_args : parse_args,
+    percentile : percentile
+};
+
+if (require.main === module) {
+    try {
+        run(parse_args(process.argv.slice(2)));
+    } catch (e) {
+        console.error(e.message);
+        console.error(usage);
+        process.exit(1);
+    }
+}
@@ -2,7 +2,7 @@
     'targets': [
         {
             'target_name': 'pcsclite',
-            'sources': [ 'src/addon.cpp', 'src/pcsclite.cpp', 'src/cardreader.cpp' ],
+            'sources': [ 'src/addon.cpp', 'src/pcsclite.cpp', 'src/cardreader.cpp', 'src/trace.cpp', 'src/batch.cpp', 'src/secure.cpp', 'src/errors.cpp', 'src/rules.cpp', 'src/statetable.cpp', 'src/dispatcher.cpp', 'src/digest.cpp' ],
             'cflags': [
                 '-Wall',
                 '-Wextra',
@@ -3,6 +3,13 @@ import { EventEmitter } from "events";
 type ConnectOptions = {
   share_mode?: number;
   protocol?: number;
+  priority?: number;
+};
+
+type OperationOptions = {
+  priority?: number;
+  plain?: boolean;
+  codeOnly?: boolean;
 };
 
 type Status = {
@@ -12,12 +19,50 @@ type Status = {
 
 type AnyOrNothing = any | undefined | null;
 
+type AtrFilter = {
+  atr?: Buffer;
+  mask?: Buffer;
+  states?: number;
+};
+
+type ReaderStats = {
+  events_delivered: number;
+  events_filtered: number;
+  resyncs: number;
+  recoveries: number;
+  card_recoveries: number;
+  failed_fast: number;
+  queued: number;
+  connections_opened: number;
+  connections_reused: number;
+  rules_run: number;
+  rules_allowed: number;
+};
+
+type DisconnectOptions = OperationOptions & {
+  release?: boolean;
+};
+
+type Resync = {
+  readers: CardReader[];
+  added: CardReader[];
+  removed: string[];
+};
+
 interface PCSCLite extends EventEmitter {
   on(type: "error", listener: (error: any) => void): this;
   once(type: "error", listener: (error: any) => void): this;
   on(type: "reader", listener: (reader: CardReader) => void): this;
   once(type: "reader", listener: (reader: CardReader) => void): this;
-  close(): void;
+  on(type: "group", listener: (group: ReaderGroup) => void): this;
+  once(type: "group", listener: (group: ReaderGroup) => void): this;
+  on(type: "resync", listener: (resync: Resync) => void): this;
+  once(type: "resync", listener: (resync: Resync) => void): this;
+  readers: { [name: string]: CardReader };
+  setAtrFilters(filters: AtrFilter[]): void;
+  submit(job: Job, cb: (err: AnyOrNothing, responses: Buffer[], reader: CardReader | null) => void): void;
+  close(callback?: (err: AnyOrNothing) => void): void;
+  closeAll(callback?: (err: AnyOrNothing) => void): void;
 }
 
 interface CardReader extends EventEmitter {
@@ -46,13 +91,22 @@ interface CardReader extends EventEmitter {
   SCARD_RESET_CARD: number;
   SCARD_UNPOWER_CARD: number;
   SCARD_EJECT_CARD: number;
+  // Operation priority
+  PRIORITY_INTERACTIVE: number;
+  PRIORITY_NORMAL: number;
+  PRIORITY_BULK: number;
   name: string;
   state: number;
+  atr: Buffer | null;
+  slot: number;
   connected: boolean;
+  group?: ReaderGroup;
   on(type: "error", listener: (this: CardReader, error: any) => void): this;
   once(type: "error", listener: (this: CardReader, error: any) => void): this;
   on(type: "end", listener: (this: CardReader) => void): this;
   once(type: "end", listener: (this: CardReader) => void): this;
+  on(type: "rule", listener: (this: CardReader, outcome: RuleOutcome) => void): this;
+  once(type: "rule", listener: (this: CardReader, outcome: RuleOutcome) => void): this;
   on(
     type: "status",
     listener: (this: CardReader, status: Status) => void
@@ -72,21 +126,336 @@ interface CardReader extends EventEmitter {
   ): void;
   disconnect(callback: (err: AnyOrNothing) => void): void;
   disconnect(disposition: number, callback: (err: AnyOrNothing) => void): void;
+  disconnect(
+    disposition: number,
+    options: DisconnectOptions,
+    callback: (err: AnyOrNothing) => void
+  ): void;
   transmit(
     data: Buffer,
     res_len: number,
     protocol: number,
     cb: (err: AnyOrNothing, response: Buffer) => void
   ): void;
+  transmit(
+    data: Buffer,
+    res_len: number,
+    protocol: number,
+    options: OperationOptions,
+    cb: (err: AnyOrNothing, response: Buffer) => void
+  ): void;
+  transmitChained(
+    header: Buffer,
+    data: Buffer,
+    res_len: number,
+    protocol: number,
+    cb: (err: AnyOrNothing, response: Buffer) => void
+  ): void;
+  transmitChained(
+    header: Buffer,
+    data: Buffer,
+    res_len: number,
+    protocol: number,
+    options: ChainOptions,
+    cb: (err: AnyOrNothing, response: Buffer) => void
+  ): void;
+  verify(
+    items: VerifyItem[],
+    res_len: number,
+    protocol: number,
+    cb: (err: AnyOrNothing, outcomes: VerifyOutcome[]) => void
+  ): void;
+  verify(
+    items: VerifyItem[],
+    res_len: number,
+    protocol: number,
+    options: OperationOptions,
+    cb: (err: AnyOrNothing, outcomes: VerifyOutcome[]) => void
+  ): void;
+  compileApdu(template: ApduTemplate): number;
+  transmitTemplate(
+    handle: number,
+    params: TemplateParams,
+    res_len: number,
+    protocol: number,
+    cb: (err: AnyOrNothing, response: Buffer) => void
+  ): void;
+  transmitTemplate(
+    handle: number,
+    params: TemplateParams,
+    res_len: number,
+    protocol: number,
+    options: OperationOptions,
+    cb: (err: AnyOrNothing, response: Buffer) => void
+  ): void;
+  transmitSweep(
+    handle: number,
+    params: SweepParams,
+    res_len: number,
+    protocol: number,
+    cb: (err: AnyOrNothing, responses: Buffer[]) => void
+  ): void;
+  transmitSweep(
+    handle: number,
+    params: SweepParams,
+    res_len: number,
+    protocol: number,
+    options: OperationOptions,
+    cb: (err: AnyOrNothing, responses: Buffer[]) => void
+  ): void;
   control(
     data: Buffer,
     control_code: number,
     res_len: number,
     cb: (err: AnyOrNothing, response: Buffer) => void
   ): void;
-  close(): void;
+  control(
+    data: Buffer,
+    control_code: number,
+    res_len: number,
+    options: OperationOptions,
+    cb: (err: AnyOrNothing, response: Buffer) => void
+  ): void;
+  controlBatch(commands: ControlCommand[], cb: (err: AnyOrNothing, outputs: Buffer[]) => void): void;
+  controlBatch(
+    commands: ControlCommand[],
+    options: OperationOptions,
+    cb: (err: AnyOrNothing, outputs: Buffer[]) => void
+  ): void;
+  getFeatures(cb: (err: AnyOrNothing, features: { [name: string]: number }) => void): void;
+  getFeatures(
+    options: OperationOptions,
+    cb: (err: AnyOrNothing, features: { [name: string]: number }) => void
+  ): void;
+  readMemory(start: number, length: number, cb: (err: AnyOrNothing, data: Buffer) => void): void;
+  readMemory(
+    start: number,
+    length: number,
+    options: MemoryOptions,
+    cb: (err: AnyOrNothing, data: Buffer) => void
+  ): void;
+  writeMemory(start: number, data: Buffer, cb: (err: AnyOrNothing) => void): void;
+  writeMemory(start: number, data: Buffer, options: MemoryOptions, cb: (err: AnyOrNothing) => void): void;
+  setSecureMessaging(session: SecureMessagingSession | null): void;
+  setRule(rule: AccessRule | null): void;
+  setRecovery(policy: RecoveryPolicy | null): void;
+  setAtrFilters(filters: AtrFilter[]): void;
+  getStats(): ReaderStats;
+  record(trace: string): void;
+  stopRecording(): { recorded: number; dropped: number };
+  close(callback?: (err: AnyOrNothing) => void): void;
+}
+
+type ReplayOptions = {
+  speed?: number;
+  loop?: boolean;
+};
+
+type BatchEvent = {
+  reader: CardReader;
+  type: 'status' | 'end' | 'connect' | 'disconnect' | 'transmit' | 'transmit_sweep' | 'transmit_chained' | 'verify' | 'job' | 'control' | 'control_batch' | 'features' | 'read_memory' | 'write_memory';
+  callback: (...args: any[]) => void;
+  args: any[];
+};
+
+type SecureMessagingSession = {
+  algorithm?: 'aes' | '3des';
+  encKey: Buffer;
+  macKey: Buffer;
+  ssc?: Buffer;
+};
+
+type AccessRule = {
+  apdu?: Buffer;
+  allow: Buffer[];
+  controlCode?: number;
+  onAllow?: Buffer;
+  onDeny?: Buffer;
+  initial?: boolean;
+};
+
+type RuleOutcome = {
+  uid: Buffer;
+  allowed: boolean;
+  sw: number;
+  elapsed: number;
+  error: pcsc.PCSCError | null;
+};
+
+type StateSlot = {
+  id: number;
+  name: string;
+  state: number;
+  atr: Buffer;
+  events: number;
+  timestamp: number;
+};
+
+type ChainOptions = OperationOptions & {
+  chunkSize?: number;
+  envelope?: boolean;
+  le?: number;
+};
+
+type RecoveryPolicy = {
+  setup?: Buffer[];
+  deadline?: number;
+};
+
+type VerifyItem = {
+  apdu: Buffer | Buffer[];
+  expected?: Buffer;
+  crc32?: number;
+  sha256?: Buffer;
+};
+
+type VerifyOutcome = {
+  ok: boolean;
+  sw: number | null;
+  offset: number | null;
+};
+
+type Job = {
+  atr?: Buffer;
+  mask?: Buffer;
+  apdus: Buffer[];
+  shareMode?: number;
+  protocol?: number;
+  disposition?: number;
+  resLen?: number;
+  priority?: number;
+  codeOnly?: boolean;
+  timeout?: number;
+};
+
+type ApduTemplate = {
+  cla: number;
+  ins: number;
+  p1: number | null;
+  p2: number | null;
+  data?: Buffer | null;
+  le?: number | null;
+};
+
+type TemplateParams = {
+  p1?: number;
+  p2?: number;
+  le?: number;
+  data?: Buffer;
+};
+
+type SweepParams = {
+  from: number;
+  to: number;
+  p2?: number;
+  le?: number;
+  data?: Buffer;
+};
+
+type ControlCommand = {
+  data: Buffer;
+  control_code: number;
+  res_len: number;
+};
+
+type MemoryOptions = OperationOptions & {
+  blockSize?: number;
+  chunkSize?: number;
+  key?: Buffer;
+  keyType?: 'A' | 'B';
+  keyNumber?: number;
+};
+
+type GroupStatus = Status & {
+  reader: CardReader;
+};
+
+interface ReaderGroup extends EventEmitter {
+  name: string;
+  readers: CardReader[];
+  active: CardReader | null;
+  connected: CardReader | null;
+  on(type: "status", listener: (this: ReaderGroup, status: GroupStatus) => void): this;
+  once(type: "status", listener: (this: ReaderGroup, status: GroupStatus) => void): this;
+  on(type: "reader", listener: (this: ReaderGroup, reader: CardReader) => void): this;
+  once(type: "reader", listener: (this: ReaderGroup, reader: CardReader) => void): this;
+  on(type: "end", listener: (this: ReaderGroup) => void): this;
+  once(type: "end", listener: (this: ReaderGroup) => void): this;
+  connect(callback: (err: AnyOrNothing, protocol: number, reader: CardReader) => void): void;
+  connect(
+    options: ConnectOptions,
+    callback: (err: AnyOrNothing, protocol: number, reader: CardReader) => void
+  ): void;
+  disconnect: CardReader["disconnect"];
+  transmit: CardReader["transmit"];
+  control: CardReader["control"];
+  controlBatch: CardReader["controlBatch"];
+  getFeatures: CardReader["getFeatures"];
+  readMemory: CardReader["readMemory"];
+  writeMemory: CardReader["writeMemory"];
+  close(callback?: (err: AnyOrNothing) => void): void;
 }
 
-declare function pcsc(): PCSCLite;
+type PCSCLiteOptions = {
+  debounce?: number;
+  keepAlive?: boolean;
+  recover?: boolean | number;
+  lazy?: boolean;
+  group?: boolean | ((name: string) => string | null);
+  batch?: boolean | ((events: BatchEvent[]) => void);
+};
+
+declare function pcsc(options?: PCSCLiteOptions): PCSCLite;
+
+declare namespace pcsc {
+  function replay(name: string, trace: string, options?: ReplayOptions): CardReader;
+  function dispatch(events: BatchEvent[]): void;
+  function stateTable(): StateTable;
+  function timeline(enable: boolean): boolean;
+  function serve(path: string, options?: PCSCLiteOptions & { pcsc?: PCSCLite; mode?: number }): Broker;
+  function connect(path: string): BrokerClient;
+  interface Broker extends EventEmitter {
+    on(type: "listening", listener: () => void): this;
+    on(type: "error", listener: (error: any) => void): this;
+    close(callback?: () => void): void;
+  }
+  interface BrokerClient extends EventEmitter {
+    readers: { [id: number]: RemoteReader };
+    on(type: "reader", listener: (reader: RemoteReader) => void): this;
+    on(type: "error", listener: (error: any) => void): this;
+    on(type: "close", listener: () => void): this;
+    close(): void;
+  }
+  interface RemoteReader extends EventEmitter {
+    name: string;
+    state: number;
+    atr: Buffer | null;
+    connected: boolean;
+    on(type: "status", listener: (status: Status) => void): this;
+    on(type: "end", listener: () => void): this;
+    connect(callback: (err: AnyOrNothing, protocol: number) => void): void;
+    connect(options: ConnectOptions, callback: (err: AnyOrNothing, protocol: number) => void): void;
+    transmit(data: Buffer, res_len: number, protocol: number, cb: (err: AnyOrNothing, response: Buffer) => void): void;
+    disconnect(callback: (err: AnyOrNothing) => void): void;
+    disconnect(disposition: number, callback: (err: AnyOrNothing) => void): void;
+  }
+  class StateTable {
+    constructor(buffer: SharedArrayBuffer);
+    buffer: SharedArrayBuffer;
+    slots: number;
+    find(name: string): number;
+    missed(): number;
+    state(slot: number): number;
+    present(slot: number): boolean;
+    read(slot: number): StateSlot | null;
+  }
+  class PCSCError extends Error {
+    constructor(method: string, code: number, name?: string, detail?: string);
+    code: number;
+    name: string;
+    method: string;
+    detail?: string;
+  }
+}
 
 export = pcsc;
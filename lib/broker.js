@@ -0,0 +1,578 @@
+/*
+ * Broker: a single process owns the readers through the addon and the other
+ * processes of the host use them over a Unix domain socket, so there's only
+ * one set of monitors and card connections per host.
+ *
+ * Every message is a frame:
+ *
+ *   u32 length of what follows | u8 type | u32 id | payload
+ *
+ * all integers big endian. The client sends requests with an id of its own
+ * choosing and can send as many as it wants without waiting for the results,
+ * which come back with the same id. The broker runs one request per reader at
+ * a time, taking them in turns from the clients that have some pending.
+ * Frames longer than MAX_PAYLOAD plus the header end the connection.
+ */
+
+var events = require('events');
+var fs = require('fs');
+var net = require('net');
+var util = require('util');
+
+/* Client to broker, id is the request id, payload starts with the reader id */
+var MSG_CONNECT = 0x01;         // u32 reader, u32 share mode, u32 protocol
+var MSG_TRANSMIT = 0x02;        // u32 reader, u32 protocol, u32 res len, APDU
+var MSG_DISCONNECT = 0x03;      // u32 reader, u32 disposition
+
+/* Broker to client */
+var MSG_RESULT = 0x81;          // id: request, u32 code (0 on success), data or error message
+var MSG_READER = 0x82;          // id: reader, name
+var MSG_END = 0x83;             // id: reader
+var MSG_STATUS = 0x84;          // id: reader, u32 state, ATR
+
+var HEADER_LEN = 9;
+var MAX_APDU = 65545;           // extended length: header, Lc, data and Le
+var MAX_RESPONSE = 65538;       // extended length data and SW
+var MAX_PAYLOAD = 12 + MAX_APDU; // a transmit, longer than its result
+var ERROR_CODE = 0xFFFFFFFF;    // errors that aren't PC/SC ones
+
+/* PC/SC values, the client doesn't load the addon */
+var SCARD_SHARE_SHARED = 2;
+var SCARD_PROTOCOL_ANY = 3;
+var SCARD_LEAVE_CARD = 0;
+var SCARD_E_SHARING_VIOLATION = 0x8010000B;
+
+function frame(type, id, payload) {
+    var buffer = new Buffer(HEADER_LEN + (payload ? payload.length : 0));
+    buffer.writeUInt32BE(buffer.length - 4, 0);
+    buffer.writeUInt8(type, 4);
+    buffer.writeUInt32BE(id >>> 0, 5);
+    if (payload) {
+        payload.copy(buffer, HEADER_LEN);
+    }
+
+    return buffer;
+}
+
+function uint32s(values, rest) {
+    var buffer = new Buffer(values.length * 4);
+    values.forEach(function(value, i) {
+        buffer.writeUInt32BE(value >>> 0, i * 4);
+    });
+
+    return rest ? Buffer.concat([buffer, rest]) : buffer;
+}
+
+/*
+ * It calls fn(type, id, payload) for every complete frame received on socket
+ */
+function read_frames(socket, fn) {
+    var pending = new Buffer(0);
+    socket.on('data', function(data) {
+        pending = pending.length ? Buffer.concat([pending, data]) : data;
+        while (pending.length >= 4) {
+            var len = pending.readUInt32BE(0);
+            if ((len < HEADER_LEN - 4) || (len > HEADER_LEN - 4 + MAX_PAYLOAD)) {
+                return socket.destroy(new Error('Malformed broker frame'));
+            }
+
+            if (pending.length < len + 4) {
+                break;
+            }
+
+            var type = pending.readUInt8(4);
+            var id = pending.readUInt32BE(5);
+            var payload = pending.slice(HEADER_LEN, len + 4);
+            pending = pending.slice(len + 4);
+            fn(type, id, payload);
+        }
+    });
+}
+
+function error_payload(err) {
+    var code = typeof err.code === 'number' ? err.code : ERROR_CODE;
+    return uint32s([code], new Buffer(String(err.message)));
+}
+
+/*
+ * The broker side of a reader: its clients' pending requests and the client
+ * that has the card, from its connect to its disconnect
+ */
+function Slot(reader, id) {
+    this.reader = reader;
+    this.id = id;
+    this.clients = [];          // with requests pending, in turn order
+    this.busy = false;
+    this.owner = null;
+    this.protocol = null;
+    this.status = null;
+}
+
+/*
+ * It serves the readers of p, a PCSCLite object, on the Unix socket at path,
+ * with the given file mode. If owned, closing the broker closes p as well.
+ */
+function Broker(p, path, owned, mode) {
+    events.EventEmitter.call(this);
+    var self = this;
+    this.pcsc = p;
+    this.owned = owned;
+    this.slots = {};
+    this.clients = [];
+    this.next_id = 1;
+    this.server = net.createServer(function(socket) {
+        self._accept(socket);
+    });
+
+    var probed = false;
+    this.server.on('error', function(err) {
+        if ((err.code !== 'EADDRINUSE') || probed) {
+            return self.emit('error', err);
+        }
+
+        // The socket of a broker that died is taken over, that of a live one
+        // isn't
+        probed = true;
+        var probe = net.connect(path);
+        probe.on('connect', function() {
+            probe.destroy();
+            self.emit('error', err);
+        });
+
+        probe.on('error', function() {
+            fs.unlink(path, function() {
+                self.server.listen(path);
+            });
+        });
+    });
+
+    this.server.on('listening', function() {
+        try {
+            fs.chmodSync(path, mode);
+        } catch (err) {
+            return self.emit('error', err);
+        }
+
+        self.emit('listening');
+    });
+
+    var add = function(reader) {
+        self._add(reader);
+    };
+
+    Object.keys(p.readers || {}).forEach(function(name) {
+        add(p.readers[name]);
+    });
+
+    p.on('reader', add);
+    this._detach = function() {
+        p.removeListener('reader', add);
+    };
+
+    this.server.listen(path);
+}
+
+util.inherits(Broker, events.EventEmitter);
+
+Broker.prototype._broadcast = function(buffer) {
+    this.clients.forEach(function(client) {
+        client.socket.write(buffer);
+    });
+};
+
+Broker.prototype._add = function(reader) {
+    var self = this;
+    var slot = new Slot(reader, this.next_id ++);
+    this.slots[slot.id] = slot;
+    this._broadcast(frame(MSG_READER, slot.id, new Buffer(reader.name)));
+
+    var on_status = function(status) {
+        slot.status = uint32s([status.state], status.atr);
+        self._broadcast(frame(MSG_STATUS, slot.id, slot.status));
+    };
+
+    reader.on('status', on_status);
+    reader.once('end', function() {
+        reader.removeListener('status', on_status);
+        delete self.slots[slot.id];
+        slot.clients.forEach(function(client) {
+            client.pending[slot.id].forEach(function(request) {
+                self._reply(client, request.id, new Error('Reader removed'));
+            });
+
+            delete client.pending[slot.id];
+        });
+
+        slot.clients = [];
+        self._broadcast(frame(MSG_END, slot.id));
+    });
+};
+
+Broker.prototype._accept = function(socket) {
+    var self = this;
+    var client = { socket : socket, pending : {}, connected : {} };
+    this.clients.push(client);
+
+    // The current readers and their last status
+    Object.keys(this.slots).forEach(function(id) {
+        var slot = self.slots[id];
+        socket.write(frame(MSG_READER, slot.id, new Buffer(slot.reader.name)));
+        if (slot.status) {
+            socket.write(frame(MSG_STATUS, slot.id, slot.status));
+        }
+    });
+
+    read_frames(socket, function(type, id, payload) {
+        self._request(client, type, id, payload);
+    });
+
+    socket.on('error', function() {
+        // 'close' follows
+    });
+
+    socket.on('close', function() {
+        self.clients.splice(self.clients.indexOf(client), 1);
+        client.pending = {};
+        Object.keys(self.slots).forEach(function(slot_id) {
+            var slot = self.slots[slot_id];
+            var turn = slot.clients.indexOf(client);
+            if (turn !== -1) {
+                slot.clients.splice(turn, 1);
+            }
+
+            // The card the client left connected is given back
+            if (client.connected[slot_id]) {
+                self._release(slot, SCARD_LEAVE_CARD, function() {});
+            }
+        });
+    });
+};
+
+Broker.prototype._reply = function(client, id, err, data) {
+    if (client.socket.destroyed) {
+        return;
+    }
+
+    client.socket.write(frame(MSG_RESULT, id, err ? error_payload(err) : uint32s([0], data)));
+};
+
+Broker.prototype._request = function(client, type, id, payload) {
+    var slot = payload.length >= 4 ? this.slots[payload.readUInt32BE(0)] : null;
+    if (!slot) {
+        return this._reply(client, id, new Error('Unknown reader'));
+    }
+
+    var request = { type : type, id : id, payload : payload };
+    var pending = client.pending[slot.id];
+    if (!pending) {
+        pending = client.pending[slot.id] = [];
+    }
+
+    pending.push(request);
+    if (pending.length === 1) {
+        slot.clients.push(client);
+    }
+
+    this._schedule(slot);
+};
+
+/*
+ * It runs the next request of the reader: the first one of the client whose
+ * turn it is, which then goes to the back of the line
+ */
+Broker.prototype._schedule = function(slot) {
+    var self = this;
+    if (slot.busy || slot.clients.length === 0) {
+        return;
+    }
+
+    var client = slot.clients.shift();
+    var pending = client.pending[slot.id];
+    var request = pending.shift();
+    if (pending.length) {
+        slot.clients.push(client);
+    }
+
+    slot.busy = true;
+    this._run(slot, client, request, function(err, data) {
+        slot.busy = false;
+        self._reply(client, request.id, err, data);
+        self._schedule(slot);
+    });
+};
+
+Broker.prototype._run = function(slot, client, request, cb) {
+    var self = this;
+    var payload = request.payload;
+    switch (request.type) {
+        case MSG_CONNECT:
+            if (payload.length < 12) {
+                return cb(new Error('Malformed request'));
+            }
+
+            if (client.connected[slot.id]) {
+                return cb(null, uint32s([slot.protocol]));
+            }
+
+            // Another client's APDUs must not get in between those of the
+            // one that has the card, whatever its share mode
+            if (slot.owner) {
+                var err = new Error('SCardConnect error: The card is in use by another client of the broker');
+                err.code = SCARD_E_SHARING_VIOLATION;
+                return cb(err);
+            }
+
+            slot.owner = client;
+            slot.reader.connect({
+                share_mode : payload.readUInt32BE(4),
+                protocol : payload.readUInt32BE(8)
+            }, function(err, protocol) {
+                if (err) {
+                    slot.owner = null;
+                    return cb(err);
+                }
+
+                slot.protocol = protocol;
+                if (client.socket.destroyed) {
+                    // Gone while connecting
+                    return self._release(slot, SCARD_LEAVE_CARD, cb);
+                }
+
+                client.connected[slot.id] = true;
+                cb(null, uint32s([protocol]));
+            });
+        break;
+
+        case MSG_TRANSMIT:
+            if (payload.length < 12) {
+                return cb(new Error('Malformed request'));
+            }
+
+            // The addon allocates the response up front
+            if (payload.readUInt32BE(8) > MAX_RESPONSE) {
+                return cb(new Error('Malformed request'));
+            }
+
+            if (!client.connected[slot.id]) {
+                return cb(new Error('Card Reader not connected'));
+            }
+
+            slot.reader.transmit(payload.slice(12),
+                                 payload.readUInt32BE(8),
+                                 payload.readUInt32BE(4),
+                                 cb);
+        break;
+
+        case MSG_DISCONNECT:
+            if (payload.length < 8) {
+                return cb(new Error('Malformed request'));
+            }
+
+            if (!client.connected[slot.id]) {
+                return cb(null);
+            }
+
+            delete client.connected[slot.id];
+            this._release(slot, payload.readUInt32BE(4), cb);
+        break;
+
+        default:
+            cb(new Error('Unknown request'));
+    }
+};
+
+/*
+ * The client that has the card is done with it: the connection is closed,
+ * and the card is free for the next one. The reader queue runs the disconnect
+ * before any later connect.
+ */
+Broker.prototype._release = function(slot, disposition, cb) {
+    slot.owner = null;
+    slot.protocol = null;
+    slot.reader.disconnect(disposition, function(err) {
+        cb(err);
+    });
+};
+
+Broker.prototype.close = function(cb) {
+    this._detach();
+    this.clients.forEach(function(client) {
+        client.socket.destroy();
+    });
+
+    this.server.close(cb);
+    if (this.owned) {
+        this.pcsc.close();
+    }
+};
+
+/*
+ * A reader of the broker: it has the events and operations of a CardReader
+ * that make sense across processes
+ */
+function RemoteReader(client, id, name) {
+    events.EventEmitter.call(this);
+    this._client = client;
+    this._id = id;
+    this.name = name;
+    this.state = 0;
+    this.atr = null;
+    this.connected = false;
+}
+
+util.inherits(RemoteReader, events.EventEmitter);
+
+RemoteReader.prototype.SCARD_SHARE_SHARED = SCARD_SHARE_SHARED;
+RemoteReader.prototype.SCARD_LEAVE_CARD = SCARD_LEAVE_CARD;
+
+RemoteReader.prototype.connect = function(options, cb) {
+    if (typeof options === 'function') {
+        cb = options;
+        options = undefined;
+    }
+
+    var self = this;
+    options = options || {};
+    var share_mode = options.share_mode || SCARD_SHARE_SHARED;
+    var protocol = options.protocol || SCARD_PROTOCOL_ANY;
+    this._client._send(MSG_CONNECT, uint32s([this._id, share_mode, protocol]), function(err, data) {
+        if (err) {
+            return cb(err);
+        }
+
+        self.connected = true;
+        cb(null, data.readUInt32BE(0));
+    });
+};
+
+RemoteReader.prototype.transmit = function(data, res_len, protocol, cb) {
+    if (!this.connected) {
+        return cb(new Error("Card Reader not connected"));
+    }
+
+    this._client._send(MSG_TRANSMIT, uint32s([this._id, protocol, res_len], data), cb);
+};
+
+RemoteReader.prototype.disconnect = function(disposition, cb) {
+    if (typeof disposition === 'function') {
+        cb = disposition;
+        disposition = undefined;
+    }
+
+    var self = this;
+    disposition = typeof disposition === 'number' ? disposition : SCARD_LEAVE_CARD;
+    this._client._send(MSG_DISCONNECT, uint32s([this._id, disposition]), function(err) {
+        self.connected = false;
+        cb(err);
+    });
+};
+
+/*
+ * The client side: it emits 'reader' for every reader of the broker, as
+ * PCSCLite does
+ */
+function BrokerClient(path) {
+    events.EventEmitter.call(this);
+    var self = this;
+    this.readers = {};
+    this._callbacks = {};
+    this._next_id = 1;
+    this._socket = net.connect(path);
+    this._socket.on('connect', function() {
+        self.emit('connect');
+    });
+
+    this._socket.on('error', function(err) {
+        self.emit('error', err);
+    });
+
+    this._socket.on('close', function() {
+        var callbacks = self._callbacks;
+        self._callbacks = {};
+        Object.keys(callbacks).forEach(function(id) {
+            callbacks[id](new Error('Broker connection closed'));
+        });
+
+        Object.keys(self.readers).forEach(function(id) {
+            self.readers[id].emit('end');
+        });
+
+        self.readers = {};
+        self.emit('close');
+    });
+
+    read_frames(this._socket, function(type, id, payload) {
+        self._receive(type, id, payload);
+    });
+}
+
+util.inherits(BrokerClient, events.EventEmitter);
+
+BrokerClient.prototype._send = function(type, payload, cb) {
+    var id = this._next_id;
+    this._next_id = (this._next_id % 0xFFFFFFFF) + 1;
+    this._callbacks[id] = cb;
+    this._socket.write(frame(type, id, payload));
+};
+
+BrokerClient.prototype._receive = function(type, id, payload) {
+    var reader = this.readers[id];
+    switch (type) {
+        case MSG_RESULT:
+            var cb = this._callbacks[id];
+            delete this._callbacks[id];
+            if (!cb) {
+                return;
+            }
+
+            var code = payload.readUInt32BE(0);
+            if (code === 0) {
+                return cb(null, payload.slice(4));
+            }
+
+            var err = new Error(payload.slice(4).toString());
+            if (code !== ERROR_CODE) {
+                err.code = code;
+            }
+
+            cb(err);
+        break;
+
+        case MSG_READER:
+            reader = new RemoteReader(this, id, payload.toString());
+            this.readers[id] = reader;
+            this.emit('reader', reader);
+        break;
+
+        case MSG_END:
+            if (reader) {
+                delete this.readers[id];
+                reader.connected = false;
+                reader.emit('end');
+            }
+        break;
+
+        case MSG_STATUS:
+            if (reader) {
+                var status = { state : payload.readUInt32BE(0) };
+                if (payload.length > 4) {
+                    status.atr = payload.slice(4);
+                }
+
+                reader.emit('status', status);
+                reader.state = status.state;
+                reader.atr = status.atr || null;
+            }
+        break;
+    }
+};
+
+BrokerClient.prototype.close = function() {
+    this._socket.end();
+};
+
+module.exports = {
+    Broker : Broker,
+    BrokerClient : BrokerClient,
+    RemoteReader : RemoteReader
+};
@@ -1,9 +1,62 @@
 var events = require('events');
+var broker = require('./broker');
+var StateTable = require('./statetable');
+var timeline = require('./timeline');
 
 /* Make sure we choose the correct build directory */
 var bindings = require('bindings')('pcsclite');
 var PCSCLite = bindings.PCSCLite;
 var CardReader = bindings.CardReader;
+
+/* Operation flags, they must match the ones in cardreader.h */
+var OP_PLAIN = 0x04;
+var OP_RELEASE = 0x08;
+var OP_CODE_ONLY = 0x10;
+
+/* Placeholders of an APDU template */
+var APDU_P1 = 0x01;
+var APDU_P2 = 0x02;
+var APDU_DATA = 0x04;
+var APDU_LE = 0x08;
+
+/* What reader.verify() compares, they must match Digest::Kind in digest.h */
+var DIGEST_BYTES = 0;
+var DIGEST_CRC32 = 1;
+var DIGEST_SHA256 = 2;
+
+/*
+ * Errors of the PC/SC calls. The addon creates them with this constructor too,
+ * so they all have the same shape: the message is built the first time it's
+ * read. The name is the symbolic one of the code.
+ */
+function PCSCError(method, code, name, detail) {
+    this.method = method;
+    this.code = code >>> 0;
+    this.name = name || bindings.error_name(this.code) || 'PCSCError';
+    if (detail !== undefined) {
+        this.detail = detail;
+    }
+}
+
+PCSCError.prototype = Object.create(Error.prototype, {
+    constructor : { value : PCSCError, writable : true, configurable : true },
+    message : {
+        configurable : true,
+        get : function() {
+            var message = this.method + ' error: ' + bindings.describe_error(this.code) +
+                          '(0x' + ('0000000' + this.code.toString(16)).slice(-8) + ')' +
+                          (this.detail ? ': ' + this.detail : '');
+            Object.defineProperty(this, 'message', { value : message, writable : true, configurable : true });
+            return message;
+        },
+        set : function(value) {
+            Object.defineProperty(this, 'message', { value : value, writable : true, configurable : true });
+        }
+    }
+});
+
+bindings.set_error_constructor(PCSCError);
+
 inherits(PCSCLite, events.EventEmitter);
 inherits(CardReader, events.EventEmitter);
 
@@ -33,13 +86,143 @@ function diff(a, b) {
     });
 };
 
-module.exports = function() {
+/*
+ * It starts monitoring the status of the reader
+ */
+function watch_reader(r) {
+    r.on('_end', function() {
+        r.removeAllListeners('status');
+        r.emit('end');
+    });
+
+    monitor_reader(r);
+}
+
+/*
+ * The state table has room for a fixed number of readers, say once when one
+ * gets left out
+ */
+var table_full_warned = false;
+function check_slot(r) {
+    if (r.slot === -1 && !table_full_warned && process.emitWarning) {
+        table_full_warned = true;
+        process.emitWarning('The reader state table is full, ' + r.name + ' and the next readers are not in it');
+    }
+}
+
+/*
+ * It monitors the reader once something listens to its status, or once
+ * r._watch() is called by what needs the monitor: a connection, an access rule
+ * or a job.
+ */
+function watch_reader_lazily(r) {
+    r.on('_end', function() {
+        r.removeListener('newListener', on_listener);
+        r.removeAllListeners('status');
+        r.emit('end');
+    });
+
+    var started = false;
+    var start = function() {
+        if (!started) {
+            started = true;
+            r.removeListener('newListener', on_listener);
+            monitor_reader(r);
+        }
+    };
+
+    var on_listener = function(event) {
+        if (event === 'status') {
+            r.removeListener('newListener', on_listener);
+            // Once the listener is in place
+            process.nextTick(start);
+        }
+    };
+
+    r.on('newListener', on_listener);
+    r._watch = start;
+}
+
+function monitor_reader(r) {
+    r.get_status(function(err, state, atr, rule, wakeup, handle_lost) {
+        if (err) {
+            return r.emit('error', err);
+        }
+
+        if (handle_lost) {
+            r.connected = false;
+        }
+
+        timeline.status(r, wakeup);
+
+        // An access rule done after its insertion was reported comes alone
+        if (state !== undefined) {
+            var status = { state : state };
+            if (atr) {
+                status.atr = atr;
+            }
+
+            r.emit('status', status);
+            r.state = state;
+            r.atr = atr || null;
+        }
+
+        if (rule) {
+            r.emit('rule', rule);
+        }
+    });
+}
+
+/*
+ * Default batch handler: it runs the queued callbacks in order. A callback
+ * that throws doesn't keep the rest from running, the first error is rethrown
+ * once they all did.
+ */
+function dispatch_batch(events) {
+    var error = null;
+    for (var i = 0; i < events.length; ++ i) {
+        var e = events[i];
+        try {
+            e.callback.apply(e.reader, e.args);
+        } catch (err) {
+            if (error === null) {
+                error = err;
+            }
+        }
+    }
+
+    if (error !== null) {
+        throw error;
+    }
+}
+
+module.exports = function(options) {
+
+    options = options || {};
+    var reader_options = {
+        debounce : options.debounce,
+        keep_alive : options.keepAlive,
+        recover : options.recover
+    };
+    var lazy = !!options.lazy;
+    if (options.batch) {
+        // The readers of this instance deliver to their own handler
+        reader_options.batch = CardReader.add_batch_handler(typeof options.batch === 'function' ?
+                                                            options.batch : dispatch_batch);
+    }
+
+    var group_key = options.group;
+    if (group_key && typeof group_key !== 'function') {
+        group_key = device_key;
+    }
 
     var readers = {};
-    var p = new PCSCLite();
+    var groups = {};
+    var lone = {};
+    var p = new PCSCLite(options);
     p.readers = readers;
     process.nextTick(function() {
-        p.start(function(err, data) {
+        p.start(function(err, data, resync, snapshot) {
             if (err) {
                 return p.emit('error', err);
             }
@@ -48,41 +231,395 @@ module.exports = function() {
             var current_names = Object.keys(readers);
             var new_names = diff(names, current_names);
             var removed_names = diff(current_names, names);
-            new_names.forEach(function(name) {
-                var r = new CardReader(name);
-                r.on('_end', function() {
-                    r.removeAllListeners('status');
-                    r.emit('end');
-                    delete readers[name];
-                });
-
+            var created = new_names.map(function(name) {
+                var r = new CardReader(name, reader_options);
                 readers[name] = r;
-                r.get_status(function(err, state, atr) {
-                    if (err) {
-                        return r.emit('error', err);
-                    }
+                check_slot(r);
+                // Known before the reader's own monitor reports anything
+                var initial = snapshot && snapshot[name];
+                if (initial) {
+                    r.state = initial.state;
+                    r.atr = initial.atr || null;
+                    // Until its monitor runs, the table and the jobs see the
+                    // snapshot
+                    r._seed(initial.state, r.atr);
+                }
 
-                    var status = { state : state };
-                    if (atr) {
-                        status.atr = atr;
-                    }
+                if (p._atr_filters) {
+                    r.setAtrFilters(p._atr_filters);
+                }
+
+                return r;
+            });
 
-                    r.emit('status', status);
-                    r.state = state;
+            var formed = group_key ? group_readers(groups, lone, created, group_key) : [];
+
+            // Group members first: they only share the monitor of their leader
+            // if they are watched before it starts
+            created.filter(function(r) {
+                return r.group && r !== r.group.readers[0];
+            }).concat(created.filter(function(r) {
+                return !r.group || r === r.group.readers[0];
+            })).forEach(function(r) {
+                // Group members stay eagerly watched, so they share their
+                // leader's monitor. Once there are jobs, they need every reader.
+                if (lazy && !r.group && !p._jobs) {
+                    watch_reader_lazily(r);
+                } else {
+                    watch_reader(r);
+                }
+
+                r.on('_end', function() {
+                    delete readers[r.name];
                 });
+            });
 
+            created.forEach(function(r) {
                 p.emit('reader', r);
             });
 
+            formed.forEach(function(group) {
+                p.emit('group', group);
+            });
+
             removed_names.forEach(function(name) {
                 readers[name].close();
             });
+
+            // pcscd came back: the card handles it gave are gone, and this
+            // reconciled list is what the application has to start over from
+            if (resync) {
+                var current = names.map(function(name) {
+                    var r = readers[name];
+                    r.connected = false;
+                    return r;
+                });
+
+                p.emit('resync', { readers : current, added : created, removed : removed_names });
+            }
         });
     });
 
     return p;
 };
 
+/*
+ * It sets the card filters of every current and future reader
+ */
+PCSCLite.prototype.setAtrFilters = function(filters) {
+    var self = this;
+    this._atr_filters = filters;
+    Object.keys(this.readers || {}).forEach(function(name) {
+        self.readers[name].setAtrFilters(filters);
+    });
+};
+
+/*
+ * It runs a sequence of APDUs on whichever reader has, or gets, an idle card
+ * matching job.atr under job.mask. The addon picks and claims the reader, and
+ * gives it back once the sequence is done. Closing this PCSCLite cancels the
+ * jobs still waiting.
+ */
+PCSCLite.prototype.submit = function(job, cb) {
+    var proto = CardReader.prototype;
+    var self = this;
+    this._jobs = true;
+    Object.keys(this.readers || {}).forEach(function(name) {
+        var r = self.readers[name];
+        if (r._watch) {
+            r._watch();
+        }
+    });
+
+    CardReader.submit_job(job.atr,
+                          job.mask,
+                          job.apdus,
+                          job.shareMode === undefined ? proto.SCARD_SHARE_SHARED : job.shareMode,
+                          job.protocol === undefined ? proto.SCARD_PROTOCOL_T0 | proto.SCARD_PROTOCOL_T1 : job.protocol,
+                          job.disposition === undefined ? proto.SCARD_LEAVE_CARD : job.disposition,
+                          job.resLen === undefined ? 258 : job.resLen,
+                          cb,
+                          op_flags(proto, job),
+                          this,
+                          job.timeout);
+};
+
+/*
+ * It closes every reader and this PCSCLite instance in parallel
+ */
+PCSCLite.prototype.closeAll = function(cb) {
+    var self = this;
+    var pending = 2;
+    var done = function() {
+        if (-- pending === 0 && cb) {
+            cb(null);
+        }
+    };
+
+    var readers = Object.keys(this.readers || {}).map(function(name) {
+        return self.readers[name];
+    });
+
+    CardReader.close_all(readers, done);
+    this.close(done);
+};
+
+/*
+ * pcsc-lite names the readers "<name> <device> <slot>" and each interface of a
+ * device may add its own "[...]" to the name, so the slots of a device have the
+ * same name once those are removed
+ */
+function device_key(name) {
+    var m = /^(.*) ([0-9A-F]{2}) [0-9A-F]{2}$/.exec(name);
+    if (!m) {
+        return null;
+    }
+
+    return m[1].replace(/ \[[^\]]*\]/g, '') + ' ' + m[2];
+}
+
+/*
+ * It adds the new readers to their groups. A reader waits alone until another
+ * one with the same key shows up, so only devices with several interfaces get
+ * a group. It returns the groups formed by these readers.
+ */
+function group_readers(groups, lone, created, key_of) {
+    var formed = [];
+    created.forEach(function(r) {
+        var key = key_of(r.name);
+        if (typeof key !== 'string') {
+            return;
+        }
+
+        var group = groups[key];
+        if (!group) {
+            var first = lone[key];
+            if (!first) {
+                lone[key] = r;
+                r.once('end', function() {
+                    if (lone[key] === r) {
+                        delete lone[key];
+                    }
+                });
+                return;
+            }
+
+            delete lone[key];
+            group = groups[key] = new ReaderGroup(key);
+            group.on('end', function() {
+                delete groups[key];
+            });
+            group._add(first);
+            formed.push(group);
+        }
+
+        group._add(r);
+    });
+
+    return formed;
+}
+
+function card_present(state) {
+    return (state & CardReader.prototype.SCARD_STATE_PRESENT) &&
+           !(state & CardReader.prototype.SCARD_STATE_MUTE);
+}
+
+/*
+ * The readers of one physical device, e.g. the contact and contactless
+ * interfaces of a dual interface reader. They run their operations one at a
+ * time from the queue of the first one, which also watches all of them in a
+ * single status wait, and the group keeps track of the one holding a card.
+ */
+function ReaderGroup(name) {
+    events.EventEmitter.call(this);
+    this.name = name;
+    this.readers = [];
+    this.active = null;
+    this.connected = null;
+}
+
+inherits(ReaderGroup, events.EventEmitter);
+
+ReaderGroup.prototype._add = function(reader) {
+    var self = this;
+    if (this.readers.length) {
+        reader._join(this.readers[0]);
+    }
+
+    this.readers.push(reader);
+    reader.group = this;
+    if (card_present(reader.state) && !this.active) {
+        this.active = reader;
+    }
+
+    reader.on('status', function(status) {
+        if (card_present(status.state)) {
+            self.active = reader;
+        } else if (self.active === reader) {
+            self.active = self.readers.filter(function(r) {
+                return r !== reader && card_present(r.state);
+            })[0] || null;
+        }
+
+        self.emit('status', { reader : reader, state : status.state, atr : status.atr });
+    });
+
+    reader.on('end', function() {
+        self.readers.splice(self.readers.indexOf(reader), 1);
+        if (self.active === reader) {
+            self.active = null;
+        }
+
+        if (self.connected === reader) {
+            self.connected = null;
+        }
+
+        if (self.readers.length === 0) {
+            self.emit('end');
+        }
+    });
+
+    if (this.readers.length > 2) {
+        this.emit('reader', reader);
+    }
+};
+
+/*
+ * It connects to the reader holding a card
+ */
+ReaderGroup.prototype.connect = function(options, cb) {
+    if (typeof options === 'function') {
+        cb = options;
+        options = undefined;
+    }
+
+    var self = this;
+    var reader = this.connected || this.active;
+    if (!reader) {
+        return cb(new Error("No card present in the group"));
+    }
+
+    reader.connect(options, function(err, protocol) {
+        if (!err) {
+            self.connected = reader;
+        }
+
+        cb(err, protocol, reader);
+    });
+};
+
+ReaderGroup.prototype.disconnect = function() {
+    var reader = this.connected;
+    if (!reader) {
+        var cb = arguments[arguments.length - 1];
+        return typeof cb === 'function' ? cb() : undefined;
+    }
+
+    this.connected = null;
+    reader.disconnect.apply(reader, arguments);
+};
+
+['transmit', 'control', 'controlBatch', 'getFeatures', 'readMemory', 'writeMemory'].forEach(function(method) {
+    ReaderGroup.prototype[method] = function() {
+        var reader = this.connected;
+        if (!reader) {
+            var err = new Error("Card Reader not connected");
+            var cb = arguments[arguments.length - 1];
+            if (typeof cb !== 'function') {
+                throw err;
+            }
+
+            return cb(err);
+        }
+
+        reader[method].apply(reader, arguments);
+    };
+});
+
+ReaderGroup.prototype.close = function(cb) {
+    CardReader.close_all(this.readers.slice(), cb);
+};
+
+module.exports.dispatch = dispatch_batch;
+module.exports.PCSCError = PCSCError;
+module.exports.StateTable = StateTable;
+
+/*
+ * It turns the timeline of the native operations on or off. It returns false
+ * if the runtime can't record it.
+ */
+module.exports.timeline = function(enable) {
+    CardReader.set_timeline(timeline.enable(enable));
+    return timeline.enabled;
+};
+
+// On by default when the category the measures go to is being traced
+try {
+    if (require('trace_events').getEnabledCategories().split(',').indexOf('node.perf.usertiming') !== -1) {
+        module.exports.timeline(true);
+    }
+} catch (e) {
+}
+
+/*
+ * It returns the table with the current state of every reader. Its buffer can
+ * be posted to worker threads and read there with a StateTable.
+ */
+var state_table = null;
+module.exports.stateTable = function() {
+    if (!state_table) {
+        var buffer = CardReader.state_table();
+        if (!buffer) {
+            throw new Error('SharedArrayBuffer is not supported');
+        }
+
+        state_table = new StateTable(buffer);
+    }
+
+    return state_table;
+};
+
+/*
+ * It shares the readers with the other processes of the host through a Unix
+ * socket, only open to the user by default. The readers are those of
+ * options.pcsc, or of a new PCSCLite created with options.
+ */
+module.exports.serve = function(path, options) {
+    options = options || {};
+    var mode = typeof options.mode === 'number' ? options.mode : parseInt('600', 8);
+    if (options.pcsc) {
+        return new broker.Broker(options.pcsc, path, false, mode);
+    }
+
+    return new broker.Broker(module.exports(options), path, true, mode);
+};
+
+/*
+ * It uses the readers of a broker started with pcsc.serve()
+ */
+module.exports.connect = function(path) {
+    return new broker.BrokerClient(path);
+};
+
+/*
+ * It creates a CardReader that replays a trace recorded with reader.record()
+ * instead of accessing a real reader
+ */
+module.exports.replay = function(name, trace, options) {
+    options = options || {};
+    var speed = typeof options.speed === 'number' ? options.speed : 1;
+    var loop = options.loop !== false;
+
+    var r = new CardReader(name);
+    check_slot(r);
+    r._replay(trace, speed, loop);
+    process.nextTick(function() {
+        watch_reader(r);
+    });
+
+    return r;
+};
+
 CardReader.prototype.connect = function(options, cb) {
     if (typeof options === 'function') {
         cb = options;
@@ -96,39 +633,191 @@ CardReader.prototype.connect = function(options, cb) {
         options.protocol = this.SCARD_PROTOCOL_T0 | this.SCARD_PROTOCOL_T1;
     }
 
+    // Failing fast and parking the connection need the monitor
+    if (this._watch) {
+        this._watch();
+    }
+
     if (!this.connected) {
-        this._connect(options.share_mode, options.protocol, cb);
+        this._connect(options.share_mode, options.protocol, cb, op_flags(this, options));
     } else {
         cb();
     }
 };
 
-CardReader.prototype.disconnect = function(disposition, cb) {
+CardReader.prototype.disconnect = function(disposition, options, cb) {
     if (typeof disposition === 'function') {
         cb = disposition;
         disposition = undefined;
+    } else if (typeof options === 'function') {
+        cb = options;
+        options = undefined;
     }
 
     if (typeof disposition !== 'number') {
         disposition = this.SCARD_UNPOWER_CARD;
     }
 
-    if (this.connected) {
-        this._disconnect(disposition, cb);
+    var release = options && options.release;
+    // A kept alive connection can be released after the logical disconnect
+    if (this.connected || release) {
+        this._disconnect(disposition, cb, op_flags(this, options) | (release ? OP_RELEASE : 0));
     } else {
         cb();
     }
 };
 
-CardReader.prototype.transmit = function(data, res_len, protocol, cb) {
+CardReader.prototype.transmit = function(data, res_len, protocol, options, cb) {
+    if (typeof options === 'function') {
+        cb = options;
+        options = undefined;
+    }
+
+    if (!this.connected) {
+        return cb(new Error("Card Reader not connected"));
+    }
+
+    this._transmit(data, res_len, protocol, timeline.transmit(this, cb), op_flags(this, options));
+};
+
+/*
+ * It sends data too long for a short APDU split in several commands with the
+ * header, chained or in ENVELOPE commands, in a single operation. Only the last
+ * response is returned.
+ */
+CardReader.prototype.transmitChained = function(header, data, res_len, protocol, options, cb) {
+    if (typeof options === 'function') {
+        cb = options;
+        options = undefined;
+    }
+
+    if (!this.connected) {
+        return cb(new Error("Card Reader not connected"));
+    }
+
+    var opts = options || {};
+    this._transmit_chained(header,
+                           data,
+                           opts.chunkSize || 255,
+                           !!opts.envelope,
+                           typeof opts.le === 'number' ? opts.le : -1,
+                           res_len,
+                           protocol,
+                           cb,
+                           op_flags(this, options));
+};
+
+/*
+ * It reads back data and checks it against the expected bytes, or their
+ * CRC32 or SHA-256, in the addon: only the outcome of every read comes back.
+ * An item may read its data with several APDUs.
+ */
+CardReader.prototype.verify = function(items, res_len, protocol, options, cb) {
+    if (typeof options === 'function') {
+        cb = options;
+        options = undefined;
+    }
+
+    if (!this.connected) {
+        return cb(new Error("Card Reader not connected"));
+    }
+
+    var apdus = [];
+    var kinds = [];
+    var expected = [];
+    for (var i = 0; i < items.length; ++ i) {
+        var item = items[i];
+        apdus.push(Buffer.isBuffer(item.apdu) ? [ item.apdu ] : item.apdu);
+        if (typeof item.crc32 === 'number') {
+            var crc = new Buffer(4);
+            crc.writeUInt32BE(item.crc32 >>> 0, 0);
+            kinds.push(DIGEST_CRC32);
+            expected.push(crc);
+        } else if (item.sha256) {
+            kinds.push(DIGEST_SHA256);
+            expected.push(item.sha256);
+        } else {
+            kinds.push(DIGEST_BYTES);
+            expected.push(item.expected);
+        }
+    }
+
+    this._verify(apdus, kinds, expected, res_len, protocol, cb, op_flags(this, options));
+};
+
+/*
+ * It compiles an APDU template once so that every call only passes the fields
+ * that change. Fields set to null are placeholders filled in by
+ * transmitTemplate(), data and le may be left undefined if the APDU has none.
+ */
+CardReader.prototype.compileApdu = function(template) {
+    var header = new Buffer([
+        template.cla,
+        template.ins,
+        template.p1 === null ? 0 : template.p1,
+        template.p2 === null ? 0 : template.p2
+    ]);
+
+    var mask = (template.p1 === null ? APDU_P1 : 0) |
+               (template.p2 === null ? APDU_P2 : 0) |
+               (template.data === null ? APDU_DATA : 0) |
+               (template.le === null ? APDU_LE : 0);
+
+    var le = (template.le === null || template.le === undefined) ? -1 : template.le;
+    return this._compile_apdu(header, mask, template.data || undefined, le);
+};
+
+CardReader.prototype.transmitTemplate = function(handle, params, res_len, protocol, options, cb) {
+    if (typeof options === 'function') {
+        cb = options;
+        options = undefined;
+    }
+
     if (!this.connected) {
         return cb(new Error("Card Reader not connected"));
     }
 
-    this._transmit(data, res_len, protocol, cb);
+    this._transmit_template(handle, params.p1, params.p2, params.le, params.data,
+                            res_len, protocol, timeline.transmit(this, cb), op_flags(this, options));
 };
 
-CardReader.prototype.control = function(data, control_code, res_len, cb) {
+/*
+ * It sends the template once for every P1 from params.from to params.to in a
+ * single operation, stopping at the first response that isn't 90 00.
+ */
+CardReader.prototype.transmitSweep = function(handle, params, res_len, protocol, options, cb) {
+    if (typeof options === 'function') {
+        cb = options;
+        options = undefined;
+    }
+
+    if (!this.connected) {
+        return cb(new Error("Card Reader not connected"));
+    }
+
+    this._transmit_sweep(handle, params.from, params.p2, params.le, params.data,
+                         res_len, protocol, function(err, data, lengths) {
+        if (err) {
+            return cb(err);
+        }
+
+        var responses = [];
+        var offset = 0;
+        lengths.forEach(function(len) {
+            responses.push(data.slice(offset, offset + len));
+            offset += len;
+        });
+
+        cb(null, responses);
+    }, op_flags(this, options), params.to);
+};
+
+CardReader.prototype.control = function(data, control_code, res_len, options, cb) {
+    if (typeof options === 'function') {
+        cb = options;
+        options = undefined;
+    }
+
     if (!this.connected) {
         return cb(new Error("Card Reader not connected"));
     }
@@ -140,9 +829,143 @@ CardReader.prototype.control = function(data, control_code, res_len, cb) {
         }
 
         cb(err, output.slice(0, len));
+    }, op_flags(this, options));
+};
+
+/*
+ * It runs several escape commands back to back in a single threadpool request.
+ * commands is an array of { data, control_code, res_len } objects.
+ */
+CardReader.prototype.controlBatch = function(commands, options, cb) {
+    if (typeof options === 'function') {
+        cb = options;
+        options = undefined;
+    }
+
+    if (!this.connected) {
+        return cb(new Error("Card Reader not connected"));
+    }
+
+    this._control_batch(commands, cb, op_flags(this, options));
+};
+
+/*
+ * It returns the PC/SC part 10 features of the reader as a map of feature name
+ * to control code. They are only asked to the reader the first time.
+ */
+CardReader.prototype.getFeatures = function(options, cb) {
+    if (typeof options === 'function') {
+        cb = options;
+        options = undefined;
+    }
+
+    if (!this.connected) {
+        return cb(new Error("Card Reader not connected"));
+    }
+
+    this._get_features(cb, op_flags(this, options));
+};
+
+CardReader.prototype.readMemory = function(start, length, options, cb) {
+    if (typeof options === 'function') {
+        cb = options;
+        options = undefined;
+    }
+
+    if (!this.connected) {
+        return cb(new Error("Card Reader not connected"));
+    }
+
+    this._read_memory(start, length, memory_options(options), cb, op_flags(this, options));
+};
+
+CardReader.prototype.writeMemory = function(start, data, options, cb) {
+    if (typeof options === 'function') {
+        cb = options;
+        options = undefined;
+    }
+
+    if (!this.connected) {
+        return cb(new Error("Card Reader not connected"));
+    }
+
+    this._write_memory(start, data, memory_options(options), cb, op_flags(this, options));
+};
+
+/*
+ * It starts (or ends, with null) protecting the APDUs of the current connection
+ * with ISO 7816-4 secure messaging. The session keys come from the key
+ * agreement the application ran with the card.
+ */
+CardReader.prototype.setSecureMessaging = function(session) {
+    if (!session) {
+        return this._set_secure_messaging(null);
+    }
+
+    var algorithm = session.algorithm || 'aes';
+    var ssc = session.ssc || new Buffer(algorithm === 'aes' ? 16 : 8).fill(0);
+    this._set_secure_messaging({
+        algorithm : algorithm,
+        enc_key : session.encKey,
+        mac_key : session.macKey,
+        ssc : ssc
     });
 };
 
+CardReader.prototype.record = function(trace) {
+    this._record(trace);
+};
+
+CardReader.prototype.stopRecording = function() {
+    return this._stop_recording();
+};
+
+CardReader.prototype.setAtrFilters = function(filters) {
+    this._set_filters(filters || []);
+};
+
+/*
+ * It sets the rule run natively on every card insertion, null removes it
+ */
+CardReader.prototype.setRule = function(rule) {
+    if (!rule) {
+        return this._set_rule(null);
+    }
+
+    this._set_rule({
+        apdu : rule.apdu || new Buffer([0xFF, 0xCA, 0x00, 0x00, 0x00]),
+        uids : rule.allow || [],
+        control_code : rule.controlCode,
+        on_allow : rule.onAllow,
+        on_deny : rule.onDeny,
+        initial : !!rule.initial
+    });
+
+    // The monitor is what runs the rule
+    if (this._watch) {
+        this._watch();
+    }
+};
+
+/*
+ * It makes transmits ride out a reset or swapped card: the addon reconnects,
+ * sends the setup APDUs again and retries the command, null turns it off
+ */
+CardReader.prototype.setRecovery = function(policy) {
+    if (!policy) {
+        return this._set_recovery(null);
+    }
+
+    this._set_recovery({
+        setup : policy.setup || [],
+        deadline : policy.deadline || 2000
+    });
+};
+
+CardReader.prototype.getStats = function() {
+    return this._get_stats();
+};
+
 CardReader.prototype.SCARD_CTL_CODE = function(code)  {
     var isWin = /^win/.test(process.platform);
     if (isWin) {
@@ -152,6 +975,40 @@ CardReader.prototype.SCARD_CTL_CODE = function(code)  {
     }
 };
 
+/*
+ * It builds the flags passed to the native operations from the options object
+ */
+function op_flags(reader, options) {
+    var priority = options && options.priority;
+    if (typeof priority !== 'number') {
+        priority = reader.PRIORITY_NORMAL;
+    }
+
+    return priority | (options && options.plain ? OP_PLAIN : 0) |
+                      (options && options.codeOnly ? OP_CODE_ONLY : 0);
+}
+
+/*
+ * It builds the options passed to the native memory operations
+ */
+function memory_options(options) {
+    options = options || {};
+    var key_type = options.keyType;
+    if (key_type === 'A' || key_type === undefined) {
+        key_type = 0x60;
+    } else if (key_type === 'B') {
+        key_type = 0x61;
+    }
+
+    return {
+        block_size : options.blockSize,
+        chunk_size : options.chunkSize,
+        key : options.key,
+        key_type : key_type,
+        key_number : options.keyNumber
+    };
+}
+
 // extend prototype
 function inherits(target, source) {
     for (var k in source.prototype) {
@@ -0,0 +1,131 @@
+/*
+ * Reader of the table the monitor threads keep with the current state of every
+ * reader (see src/statetable.h for the layout). It only needs the
+ * SharedArrayBuffer, so it can run in worker threads that got the buffer with
+ * postMessage() without loading the addon.
+ */
+
+var HEADER_MAGIC = 0;
+var HEADER_VERSION = 1;
+var HEADER_SLOTS = 2;
+var HEADER_SLOT_WORDS = 3;
+var HEADER_MISSED = 4;
+var HEADER_WORDS = 16;
+
+var SLOT_SEQ = 0;
+var SLOT_ID = 1;
+var SLOT_STATE = 2;
+var SLOT_EVENTS = 3;
+var SLOT_TIME = 4;
+var SLOT_ATR_LEN = 6;
+var SLOT_ATR = 7;
+var SLOT_NAME_LEN = 16;
+var SLOT_NAME = 17;
+
+var MAGIC = 0x50435343;
+var VERSION = 1;
+
+/* SCARD_STATE_PRESENT */
+var STATE_PRESENT = 0x0020;
+
+function StateTable(buffer) {
+    this.words = new Uint32Array(buffer);
+    this.bytes = new Uint8Array(buffer);
+    this.times = new Float64Array(buffer);
+    if (this.words[HEADER_MAGIC] !== MAGIC || this.words[HEADER_VERSION] !== VERSION) {
+        throw new Error('Not a reader state table');
+    }
+
+    this.buffer = buffer;
+    this.slots = this.words[HEADER_SLOTS];
+    this.slot_words = this.words[HEADER_SLOT_WORDS];
+}
+
+/*
+ * It calls fn with the offset of the slot until the slot wasn't written
+ * meanwhile, and returns what fn returned
+ */
+StateTable.prototype._read = function(slot, fn) {
+    var base = HEADER_WORDS + slot * this.slot_words;
+    for (;;) {
+        var seq = Atomics.load(this.words, base + SLOT_SEQ);
+        if (seq & 1) {
+            continue;
+        }
+
+        var value = fn.call(this, base);
+        if (Atomics.load(this.words, base + SLOT_SEQ) === seq) {
+            return value;
+        }
+    }
+};
+
+function read_state(base) {
+    return this.words[base + SLOT_ID] ? this.words[base + SLOT_STATE] : -1;
+}
+
+function read_slot(base) {
+    var words = this.words;
+    if (!words[base + SLOT_ID]) {
+        return null;
+    }
+
+    var name = base + SLOT_NAME;
+    var atr = base + SLOT_ATR;
+    return {
+        id : words[base + SLOT_ID],
+        name : new Buffer(this.bytes.slice(name * 4, name * 4 + words[base + SLOT_NAME_LEN])).toString(),
+        state : words[base + SLOT_STATE],
+        atr : new Buffer(this.bytes.slice(atr * 4, atr * 4 + words[base + SLOT_ATR_LEN])),
+        events : words[base + SLOT_EVENTS],
+        timestamp : this.times[(base + SLOT_TIME) / 2]
+    };
+}
+
+/*
+ * It returns the slot of the reader, or -1. A reader that was replaced under
+ * the same name may still hold its slot for a moment: the newest one wins.
+ */
+StateTable.prototype.find = function(name) {
+    var found = -1;
+    var id = 0;
+    for (var i = 0; i < this.slots; ++ i) {
+        var slot = this.read(i);
+        if (slot && slot.name === name && slot.id > id) {
+            found = i;
+            id = slot.id;
+        }
+    }
+
+    return found;
+};
+
+/*
+ * It returns how many readers got no slot because the table was full
+ */
+StateTable.prototype.missed = function() {
+    return Atomics.load(this.words, HEADER_MISSED);
+};
+
+/*
+ * It returns the dwEventState of the reader in the slot, or -1 if the slot is
+ * free. It doesn't allocate.
+ */
+StateTable.prototype.state = function(slot) {
+    return this._read(slot, read_state);
+};
+
+StateTable.prototype.present = function(slot) {
+    var state = this.state(slot);
+    return state !== -1 && (state & STATE_PRESENT) !== 0;
+};
+
+/*
+ * It returns a consistent copy of the slot: { id, name, state, atr, events,
+ * timestamp }, or null if the slot is free
+ */
+StateTable.prototype.read = function(slot) {
+    return this._read(slot, read_slot);
+};
+
+module.exports = StateTable;
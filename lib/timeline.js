@@ -0,0 +1,81 @@
+/*
+ * Timeline of the native operations as User Timing measures, which Node
+ * records in the node.perf.usertiming trace events category. The addon passes
+ * the timings, on the uv_hrtime() clock in milliseconds, to the callbacks
+ * only while the timeline is on, so it costs nothing otherwise.
+ */
+
+var performance = null;
+try {
+    performance = require('perf_hooks').performance;
+} catch (e) {
+}
+
+var timeline = module.exports = {
+    enabled : false
+};
+
+/* performance.now() minus process.hrtime() in milliseconds */
+var offset = 0;
+
+function hrtime_ms() {
+    var t = process.hrtime();
+    return t[0] * 1e3 + t[1] / 1e6;
+}
+
+function measure(name, reader, start, end) {
+    try {
+        performance.measure(name, { start : start + offset, end : end + offset, detail : { reader : reader.name } });
+        performance.clearMeasures(name);
+    } catch (e) {
+        // Measures with explicit times need Node 16
+        timeline.enabled = false;
+    }
+}
+
+/*
+ * It returns whether it could be turned on
+ */
+timeline.enable = function(enable) {
+    timeline.enabled = !!enable && !!performance;
+    if (timeline.enabled) {
+        offset = performance.now() - hrtime_ms();
+    }
+
+    return timeline.enabled;
+};
+
+/*
+ * It wraps the callback of a transmit to measure, from the timings the addon
+ * appended: the wait for the threadpool and the reader, the time with the
+ * card and the wait for the callback to run
+ */
+timeline.transmit = function(reader, cb) {
+    if (!timeline.enabled) {
+        return cb;
+    }
+
+    return function(err, data, timings) {
+        if (timings && timeline.enabled) {
+            var now = hrtime_ms();
+            measure('pcsc.transmit.wait', reader, timings[0], timings[1]);
+            measure('pcsc.transmit.card', reader, timings[2], timings[3]);
+            measure('pcsc.transmit.dispatch', reader, timings[3], now);
+        }
+
+        if (err) {
+            return cb(err);
+        }
+
+        cb(err, data);
+    };
+};
+
+/*
+ * The time from the monitor thread waking up to the status reaching JS
+ */
+timeline.status = function(reader, wakeup) {
+    if (wakeup && timeline.enabled) {
+        measure('pcsc.status.dispatch', reader, wakeup, hrtime_ms());
+    }
+};
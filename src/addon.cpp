@@ -1,5 +1,6 @@
 #include "pcsclite.h"
 #include "cardreader.h"
+#include "errors.h"
 
 using namespace v8;
 using namespace node;
@@ -7,6 +8,7 @@ using namespace node;
 void init_all(Local<Object> target) {
     PCSCLite::init(target);
     CardReader::init(target);
+    PCSCError::init(target);
 }
 
 #if NODE_MAJOR_VERSION >= 10
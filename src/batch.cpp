@@ -0,0 +1,120 @@
+#include "batch.h"
+#include <assert.h>
+
+using namespace v8;
+
+bool EventBatch::s_initialized = false;
+uv_async_t EventBatch::s_async;
+uv_check_t EventBatch::s_check;
+uv_mutex_t EventBatch::s_mutex;
+std::vector<std::pair<EventBatch::PostedFunction, void*> > EventBatch::s_posted;
+std::vector<EventBatch::Channel*> EventBatch::s_channels;
+
+NAN_METHOD(EventBatch::AddHandler) {
+
+    Nan::HandleScope scope;
+
+    if (!info[0]->IsFunction()) {
+        return Nan::ThrowError("First argument must be a function");
+    }
+
+    if (!s_initialized) {
+        assert(uv_mutex_init(&s_mutex) == 0);
+        uv_async_init(uv_default_loop(), &s_async, (uv_async_cb)AsyncCallback);
+        // Posting doesn't keep the loop alive, the readers' handles do
+        uv_unref(reinterpret_cast<uv_handle_t*>(&s_async));
+        uv_check_init(uv_default_loop(), &s_check);
+        s_initialized = true;
+    }
+
+    Channel* channel = new Channel();
+    channel->handler.Reset(Local<Function>::Cast(info[0]));
+    channel->events.Reset(Nan::New<Array>());
+    s_channels.push_back(channel);
+    info.GetReturnValue().Set(Nan::New<Number>(static_cast<int>(s_channels.size() - 1)));
+}
+
+void EventBatch::Post(PostedFunction fn, void* data) {
+
+    uv_mutex_lock(&s_mutex);
+    s_posted.push_back(std::make_pair(fn, data));
+    uv_mutex_unlock(&s_mutex);
+    uv_async_send(&s_async);
+}
+
+void EventBatch::Push(int channel,
+                      Local<Object> recv,
+                      const char* type,
+                      Local<Function> callback,
+                      int argc,
+                      Local<Value> argv[]) {
+
+    Local<Array> args = Nan::New<Array>(argc);
+    for (int i = 0; i < argc; ++ i) {
+        Nan::Set(args, i, argv[i]);
+    }
+
+    Local<Object> event = Nan::New<Object>();
+    Nan::Set(event, Nan::New("reader").ToLocalChecked(), recv);
+    Nan::Set(event, Nan::New("type").ToLocalChecked(), Nan::New(type).ToLocalChecked());
+    Nan::Set(event, Nan::New("callback").ToLocalChecked(), callback);
+    Nan::Set(event, Nan::New("args").ToLocalChecked(), args);
+
+    Local<Array> events = Nan::New(s_channels[channel]->events);
+    Nan::Set(events, events->Length(), event);
+
+    // Flush once the current loop iteration has run every pending completion
+    if (!uv_is_active(reinterpret_cast<uv_handle_t*>(&s_check))) {
+        uv_check_start(&s_check, (uv_check_cb)CheckCallback);
+    }
+}
+
+void EventBatch::Flush() {
+
+    Nan::HandleScope scope;
+
+    std::vector<std::pair<PostedFunction, void*> > posted;
+    uv_mutex_lock(&s_mutex);
+    posted.swap(s_posted);
+    uv_mutex_unlock(&s_mutex);
+
+    for (size_t i = 0; i < posted.size(); ++ i) {
+        posted[i].first(posted[i].second);
+    }
+
+    // Events pushed by the handlers themselves go to the next flush. A
+    // handler that throws doesn't keep the other channels from theirs: the
+    // first exception is reported once they all ran.
+    uv_check_stop(&s_check);
+    Local<Value> error;
+    for (size_t i = 0; i < s_channels.size(); ++ i) {
+        Channel* channel = s_channels[i];
+        Local<Array> events = Nan::New(channel->events);
+        if (events->Length() == 0) {
+            continue;
+        }
+
+        channel->events.Reset(Nan::New<Array>());
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { events };
+        Nan::TryCatch try_catch;
+        Nan::Call(Nan::Callback(Nan::New(channel->handler)), argc, argv);
+        if (try_catch.HasCaught() && error.IsEmpty()) {
+            error = try_catch.Exception();
+        }
+    }
+
+    if (!error.IsEmpty()) {
+        Nan::TryCatch try_catch;
+        v8::Isolate::GetCurrent()->ThrowException(error);
+        Nan::FatalException(try_catch);
+    }
+}
+
+void EventBatch::AsyncCallback(uv_async_t* handle, int status) {
+    Flush();
+}
+
+void EventBatch::CheckCallback(uv_check_t* handle, int status) {
+    Flush();
+}
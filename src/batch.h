@@ -0,0 +1,60 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <nan.h>
+#include <utility>
+#include <vector>
+
+/*
+ * Delivery queues for the callbacks of the readers. Every batch handler gets
+ * a channel and the readers set up to deliver to it don't call into JS one by
+ * one: their completions are queued and flushed once per event loop iteration
+ * with a single call to the handler, which gets an array of
+ * { reader, type, callback, args } events.
+ *
+ * Push() and AddHandler() must be called from the main thread and Post() from
+ * any thread. The channels share one wakeup, bound to the default loop.
+ */
+class EventBatch {
+
+    public:
+
+        typedef void (*PostedFunction)(void* data);
+
+        // It returns the channel of a new handler
+        static NAN_METHOD(AddHandler);
+
+        static bool IsEnabled(int channel) { return channel >= 0; }
+
+        // Run fn(data) in the main thread right before the next flush. A single
+        // wakeup serves everything posted in the meantime.
+        static void Post(PostedFunction fn, void* data);
+
+        // Queue callback.apply(recv, argv) in the channel for the next flush
+        static void Push(int channel,
+                         v8::Local<v8::Object> recv,
+                         const char* type,
+                         v8::Local<v8::Function> callback,
+                         int argc,
+                         v8::Local<v8::Value> argv[]);
+
+    private:
+
+        struct Channel {
+            Nan::Persistent<v8::Function> handler;
+            Nan::Persistent<v8::Array> events;
+        };
+
+        static void Flush();
+        static void AsyncCallback(uv_async_t* handle, int status);
+        static void CheckCallback(uv_check_t* handle, int status);
+
+        static bool s_initialized;
+        static uv_async_t s_async;
+        static uv_check_t s_check;
+        static uv_mutex_t s_mutex;
+        static std::vector<std::pair<PostedFunction, void*> > s_posted;
+        static std::vector<Channel*> s_channels;
+};
+
+#endif /* BATCH_H */
@@ -1,10 +1,58 @@
 #include "cardreader.h"
 #include "common.h"
+#include <algorithm>
 
 using namespace v8;
 using namespace node;
 
+#ifdef _WIN32
+#define CM_IOCTL_GET_FEATURE_REQUEST (0x31 << 16 | 3400 << 2)
+#else
+#define CM_IOCTL_GET_FEATURE_REQUEST (0x42000000 + 3400)
+#endif
+
+namespace {
+
+    // PC/SC part 10 feature tags
+    const char* feature_name(BYTE tag) {
+        static const char* names[] = {
+            NULL,
+            "FEATURE_VERIFY_PIN_START",
+            "FEATURE_VERIFY_PIN_FINISH",
+            "FEATURE_MODIFY_PIN_START",
+            "FEATURE_MODIFY_PIN_FINISH",
+            "FEATURE_GET_KEY_PRESSED",
+            "FEATURE_VERIFY_PIN_DIRECT",
+            "FEATURE_MODIFY_PIN_DIRECT",
+            "FEATURE_MCT_READER_DIRECT",
+            "FEATURE_MCT_UNIVERSAL",
+            "FEATURE_IFD_PIN_PROPERTIES",
+            "FEATURE_ABORT",
+            "FEATURE_SET_SPE_MESSAGE",
+            "FEATURE_VERIFY_PIN_DIRECT_APP_ID",
+            "FEATURE_MODIFY_PIN_DIRECT_APP_ID",
+            "FEATURE_WRITE_DISPLAY",
+            "FEATURE_GET_KEY",
+            "FEATURE_IFD_DISPLAY_PROPERTIES",
+            "FEATURE_GET_TLV_PROPERTIES",
+            "FEATURE_CCID_ESC_COMMAND",
+            "FEATURE_EXECUTE_PACE"
+        };
+
+        return tag < sizeof(names) / sizeof(names[0]) ? names[tag] : NULL;
+    }
+}
+
 Nan::Persistent<Function> CardReader::constructor;
+std::atomic<bool> CardReader::s_timeline(false);
+
+namespace {
+
+    // uv_hrtime() in milliseconds, the clock of the timeline
+    double timeline_now() {
+        return uv_hrtime() / 1e6;
+    }
+}
 
 void CardReader::init(Local<Object> target) {
 
@@ -24,6 +72,25 @@ void CardReader::init(Local<Object> target) {
     Nan::SetPrototypeTemplate(tpl, "_transmit", Nan::New<FunctionTemplate>(Transmit));
     Nan::SetPrototypeTemplate(tpl, "_control", Nan::New<FunctionTemplate>(Control));
     Nan::SetPrototypeTemplate(tpl, "close", Nan::New<FunctionTemplate>(Close));
+    Nan::SetPrototypeTemplate(tpl, "_record", Nan::New<FunctionTemplate>(Record));
+    Nan::SetPrototypeTemplate(tpl, "_stop_recording", Nan::New<FunctionTemplate>(StopRecording));
+    Nan::SetPrototypeTemplate(tpl, "_replay", Nan::New<FunctionTemplate>(Replay));
+    Nan::SetPrototypeTemplate(tpl, "_set_filters", Nan::New<FunctionTemplate>(SetFilters));
+    Nan::SetPrototypeTemplate(tpl, "_get_stats", Nan::New<FunctionTemplate>(GetStats));
+    Nan::SetPrototypeTemplate(tpl, "_read_memory", Nan::New<FunctionTemplate>(ReadMemory));
+    Nan::SetPrototypeTemplate(tpl, "_write_memory", Nan::New<FunctionTemplate>(WriteMemory));
+    Nan::SetPrototypeTemplate(tpl, "_set_secure_messaging", Nan::New<FunctionTemplate>(SetSecureMessaging));
+    Nan::SetPrototypeTemplate(tpl, "_control_batch", Nan::New<FunctionTemplate>(ControlBatch));
+    Nan::SetPrototypeTemplate(tpl, "_get_features", Nan::New<FunctionTemplate>(GetFeatures));
+    Nan::SetPrototypeTemplate(tpl, "_join", Nan::New<FunctionTemplate>(Join));
+    Nan::SetPrototypeTemplate(tpl, "_set_rule", Nan::New<FunctionTemplate>(SetRule));
+    Nan::SetPrototypeTemplate(tpl, "_seed", Nan::New<FunctionTemplate>(Seed));
+    Nan::SetPrototypeTemplate(tpl, "_set_recovery", Nan::New<FunctionTemplate>(SetRecovery));
+    Nan::SetPrototypeTemplate(tpl, "_compile_apdu", Nan::New<FunctionTemplate>(CompileApdu));
+    Nan::SetPrototypeTemplate(tpl, "_transmit_template", Nan::New<FunctionTemplate>(TransmitTemplate));
+    Nan::SetPrototypeTemplate(tpl, "_transmit_sweep", Nan::New<FunctionTemplate>(TransmitSweep));
+    Nan::SetPrototypeTemplate(tpl, "_transmit_chained", Nan::New<FunctionTemplate>(TransmitChained));
+    Nan::SetPrototypeTemplate(tpl, "_verify", Nan::New<FunctionTemplate>(Verify));
 
     // PCSCLite constants
     // Share Mode
@@ -55,29 +122,112 @@ void CardReader::init(Local<Object> target) {
     Nan::SetPrototypeTemplate(tpl, "SCARD_UNPOWER_CARD", Nan::New(SCARD_UNPOWER_CARD));
     Nan::SetPrototypeTemplate(tpl, "SCARD_EJECT_CARD", Nan::New(SCARD_EJECT_CARD));
 
+    // Operation priority
+    Nan::SetPrototypeTemplate(tpl, "PRIORITY_INTERACTIVE", Nan::New(OperationQueue<Baton>::PRIORITY_INTERACTIVE));
+    Nan::SetPrototypeTemplate(tpl, "PRIORITY_NORMAL", Nan::New(OperationQueue<Baton>::PRIORITY_NORMAL));
+    Nan::SetPrototypeTemplate(tpl, "PRIORITY_BULK", Nan::New(OperationQueue<Baton>::PRIORITY_BULK));
+
     Local<Function> newfunc = Nan::GetFunction(tpl).ToLocalChecked();
+    Nan::SetMethod(newfunc, "close_all", CloseAll);
+    Nan::SetMethod(newfunc, "add_batch_handler", EventBatch::AddHandler);
+    Nan::SetMethod(newfunc, "state_table", StateTable::GetBuffer);
+    Nan::SetMethod(newfunc, "set_timeline", SetTimeline);
+    Nan::SetMethod(newfunc, "submit_job", SubmitJob);
+    Dispatcher::Init(StartJob, FailJob);
     constructor.Reset(newfunc);
     Nan::Set(target, Nan::New("CardReader").ToLocalChecked(), newfunc);
 }
 
 CardReader::CardReader(const std::string &reader_name): m_card_context(0),
+                                                        m_status_card_context(0),
                                                         m_card_handle(0),
+                                                        m_card_protocol(0),
+                                                        m_pref_protocol(0),
+                                                        m_share_mode(0),
+                                                        m_atrlen(0),
+                                                        m_keep_alive(false),
+                                                        m_batch(-1),
+                                                        m_parked(false),
+                                                        m_parked_disposition(SCARD_LEAVE_CARD),
+                                                        m_connections_opened(0),
+                                                        m_connections_reused(0),
                                                         m_name(reader_name),
-                                                        m_state(0) {
+                                                        m_slot(StateTable::Acquire(reader_name)),
+                                                        m_status_thread(0),
+                                                        m_state(0),
+                                                        m_monitor_running(false),
+                                                        m_closing(false),
+                                                        m_leader(this),
+                                                        m_shared_baton(NULL),
+                                                        m_shared_monitor(false),
+                                                        m_player(NULL),
+                                                        m_wrapper(NULL),
+                                                        m_rule_started(false),
+                                                        m_rule_running(false),
+                                                        m_apdu(4 + 1 + 255 + 1),
+                                                        m_rules_run(0),
+                                                        m_rules_allowed(0),
+                                                        m_features_cached(false),
+                                                        m_card_matched(false),
+                                                        m_events_delivered(0),
+                                                        m_events_filtered(0),
+                                                        m_debounce(0),
+                                                        m_resyncs(0),
+                                                        m_handle_lost(false),
+                                                        m_recover(0),
+                                                        m_recoveries(0),
+                                                        m_recovering(false),
+                                                        m_recovery_failed(false),
+                                                        m_recovered_protocol(0),
+                                                        m_card_recoveries(0),
+                                                        m_session_lost(false),
+                                                        m_seen_atrlen(0),
+                                                        m_failed_fast(0) {
+    m_recovery.deadline = 0;
     assert(uv_mutex_init(&m_mutex) == 0);
     assert(uv_cond_init(&m_cond) == 0);
+    assert(uv_mutex_init(&m_io_mutex) == 0);
+    assert(uv_mutex_init(&m_queue_mutex) == 0);
+    Dispatcher::AddReader(this);
 }
 
 CardReader::~CardReader() {
     if (m_status_thread) {
-        SCardCancel(m_card_context);
+        // As on close: its wait is on the status context, and a debounce or
+        // a replay has to be woken up too
+        CancelMonitor();
         assert(uv_thread_join(&m_status_thread) == 0);
     }
 
+    JoinRule();
     if (m_card_context) {
         SCardReleaseContext(m_card_context);
     }
 
+    StateTable::Release(m_slot);
+    Dispatcher::RemoveReader(this);
+    m_recorder.Stop();
+    delete m_player;
+    delete m_wrapper;
+    for (size_t i = 0; i < m_templates.size(); ++ i) {
+        delete m_templates[i];
+    }
+
+    if (m_leader != this) {
+        uv_mutex_lock(&m_leader->m_mutex);
+        std::vector<CardReader*>::iterator it = std::find(m_leader->m_members.begin(),
+                                                          m_leader->m_members.end(),
+                                                          this);
+        if (it != m_leader->m_members.end()) {
+            m_leader->m_members.erase(it);
+        }
+
+        uv_mutex_unlock(&m_leader->m_mutex);
+        m_leader_handle.Reset();
+    }
+
+    uv_mutex_destroy(&m_queue_mutex);
+    uv_mutex_destroy(&m_io_mutex);
     uv_cond_destroy(&m_cond);
     uv_mutex_destroy(&m_mutex);
 }
@@ -93,6 +243,33 @@ NAN_METHOD(CardReader::New) {
              Nan::New(name_symbol),
              Nan::New(*reader_name).ToLocalChecked());
     Nan::Set(obj->handle(), Nan::New(connected_symbol), Nan::False());
+    Nan::Set(obj->handle(), Nan::New("slot").ToLocalChecked(), Nan::New(obj->m_slot));
+
+    // The optional second argument holds the options
+    if (info[1]->IsObject()) {
+        Local<Object> options = Nan::To<Object>(info[1]).ToLocalChecked();
+        Local<Value> debounce = Nan::Get(options, Nan::New("debounce").ToLocalChecked()).ToLocalChecked();
+        if (debounce->IsUint32()) {
+            obj->m_debounce = Nan::To<uint32_t>(debounce).ToChecked();
+        }
+
+        Local<Value> recover = Nan::Get(options, Nan::New("recover").ToLocalChecked()).ToLocalChecked();
+        if (recover->IsUint32()) {
+            uint32_t delay = Nan::To<uint32_t>(recover).ToChecked();
+            obj->m_recover = (delay && (delay < RECOVER_MIN_DELAY)) ? RECOVER_MIN_DELAY : delay;
+        } else if (recover->IsTrue()) {
+            obj->m_recover = RECOVER_MAX_DELAY;
+        }
+
+        Local<Value> keep_alive = Nan::Get(options, Nan::New("keep_alive").ToLocalChecked()).ToLocalChecked();
+        obj->m_keep_alive = Nan::To<bool>(keep_alive).FromJust();
+
+        // The batch channel of the PCSCLite instance that created it
+        Local<Value> batch = Nan::Get(options, Nan::New("batch").ToLocalChecked()).ToLocalChecked();
+        if (batch->IsInt32()) {
+            obj->m_batch = Nan::To<int32_t>(batch).FromJust();
+        }
+    }
 
     info.GetReturnValue().Set(info.Holder());
 }
@@ -104,12 +281,32 @@ NAN_METHOD(CardReader::GetStatus) {
     CardReader* obj = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
     Local<Function> cb = Local<Function>::Cast(info[0]);
 
+    // Monitoring may start lazily, after the reader was closed
+    if (obj->m_state || obj->m_status_thread || obj->m_shared_monitor) {
+        return;
+    }
+
     AsyncBaton *async_baton = new AsyncBaton();
     async_baton->async.data = async_baton;
     async_baton->callback.Reset(cb);
     async_baton->reader = obj;
 
     uv_async_init(uv_default_loop(), &async_baton->async, (uv_async_cb)HandleReaderStatusChange);
+    obj->m_monitor_running = true;
+
+    // A group member is watched by the leader thread in the same wait as the
+    // rest of the group, unless the leader is already running on its own
+    CardReader* leader = obj->m_leader;
+    if ((leader != obj) && !leader->m_status_thread) {
+        async_baton->async_result = new AsyncResult();
+        async_baton->async_result->do_exit = false;
+        uv_mutex_lock(&leader->m_mutex);
+        obj->m_shared_baton = async_baton;
+        obj->m_shared_monitor = true;
+        uv_mutex_unlock(&leader->m_mutex);
+        return;
+    }
+
     int ret = uv_thread_create(&obj->m_status_thread, HandlerFunction, async_baton);
     assert(ret == 0);
 }
@@ -131,6 +328,16 @@ NAN_METHOD(CardReader::Connect) {
         return Nan::ThrowError("Third argument must be a callback function");
     }
 
+    // The optional fourth argument holds the operation flags
+    uint32_t flags = OperationQueue<Baton>::PRIORITY_NORMAL;
+    if (info.Length() > 3 && !info[3]->IsUndefined()) {
+        if (!info[3]->IsUint32()) {
+            return Nan::ThrowError("Fourth argument must be an integer");
+        }
+
+        flags = Nan::To<uint32_t>(info[3]).ToChecked();
+    }
+
     ConnectInput* ci = new ConnectInput();
     ci->share_mode = Nan::To<uint32_t>(info[0]).ToChecked();
     ci->pref_protocol = Nan::To<uint32_t>(info[1]).ToChecked();
@@ -143,14 +350,10 @@ NAN_METHOD(CardReader::Connect) {
     baton->reader = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
     baton->input = ci;
 
-    // Schedule our work request with libuv. Here you can specify the functions
+    // Queue our work request in the reader. Here you can specify the functions
     // that should be executed in the threadpool and back in the main thread
     // after the threadpool function completed.
-    int status = uv_queue_work(uv_default_loop(),
-                               &baton->request,
-                               DoConnect,
-                               reinterpret_cast<uv_after_work_cb>(AfterConnect));
-    assert(status == 0);
+    QueueOperation(baton, DoConnect, reinterpret_cast<uv_after_work_cb>(AfterConnect), flags);
 
 
 }
@@ -167,24 +370,32 @@ NAN_METHOD(CardReader::Disconnect) {
         return Nan::ThrowError("Second argument must be a callback function");
     }
 
-    DWORD disposition = Nan::To<uint32_t>(info[0]).ToChecked();
+    // The optional third argument holds the operation flags
+    uint32_t flags = OperationQueue<Baton>::PRIORITY_NORMAL;
+    if (info.Length() > 2 && !info[2]->IsUndefined()) {
+        if (!info[2]->IsUint32()) {
+            return Nan::ThrowError("Third argument must be an integer");
+        }
+
+        flags = Nan::To<uint32_t>(info[2]).ToChecked();
+    }
+
+    DisconnectInput* di = new DisconnectInput();
+    di->disposition = Nan::To<uint32_t>(info[0]).ToChecked();
+    di->release = (flags & OP_RELEASE) != 0;
     Local<Function> cb = Local<Function>::Cast(info[1]);
 
     // This creates our work request, including the libuv struct.
     Baton* baton = new Baton();
-    baton->input = reinterpret_cast<void*>(new DWORD(disposition));
+    baton->input = di;
     baton->request.data = baton;
     baton->callback.Reset(cb);
     baton->reader = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
 
-    // Schedule our work request with libuv. Here you can specify the functions
+    // Queue our work request in the reader. Here you can specify the functions
     // that should be executed in the threadpool and back in the main thread
     // after the threadpool function completed.
-    int status = uv_queue_work(uv_default_loop(),
-                               &baton->request,
-                               DoDisconnect,
-                               reinterpret_cast<uv_after_work_cb>(AfterDisconnect));
-    assert(status == 0);
+    QueueOperation(baton, DoDisconnect, reinterpret_cast<uv_after_work_cb>(AfterDisconnect), flags);
 
 
 }
@@ -213,6 +424,16 @@ NAN_METHOD(CardReader::Transmit) {
         return Nan::ThrowError("Fourth argument must be a callback function");
     }
 
+    // The optional fifth argument holds the operation flags
+    uint32_t flags = OperationQueue<Baton>::PRIORITY_NORMAL;
+    if (info.Length() > 4 && !info[4]->IsUndefined()) {
+        if (!info[4]->IsUint32()) {
+            return Nan::ThrowError("Fifth argument must be an integer");
+        }
+
+        flags = Nan::To<uint32_t>(info[4]).ToChecked();
+    }
+
     Local<Object> buffer_data = Nan::To<Object>(info[0]).ToLocalChecked();
     uint32_t out_len = Nan::To<uint32_t>(info[1]).ToChecked();
     uint32_t protocol = Nan::To<uint32_t>(info[2]).ToChecked();
@@ -230,16 +451,18 @@ NAN_METHOD(CardReader::Transmit) {
     memcpy(ti->in_data, Buffer::Data(buffer_data), ti->in_len);
 
     ti->out_len = out_len;
+    ti->plain = (flags & OP_PLAIN) != 0;
+    if (s_timeline.load(std::memory_order_relaxed)) {
+        ti->queued = timeline_now();
+    }
+
     baton->input = ti;
+    PROBE_TRANSMIT_ENQUEUE(baton->reader->m_name.c_str(), baton, ti->in_len);
 
-    // Schedule our work request with libuv. Here you can specify the functions
+    // Queue our work request in the reader. Here you can specify the functions
     // that should be executed in the threadpool and back in the main thread
     // after the threadpool function completed.
-    int status = uv_queue_work(uv_default_loop(),
-                               &baton->request,
-                               DoTransmit,
-                               reinterpret_cast<uv_after_work_cb>(AfterTransmit));
-    assert(status == 0);
+    QueueOperation(baton, DoTransmit, reinterpret_cast<uv_after_work_cb>(AfterTransmit), flags);
 
 
 }
@@ -268,6 +491,16 @@ NAN_METHOD(CardReader::Control) {
         return Nan::ThrowError("Fourth argument must be a callback function");
     }
 
+    // The optional fifth argument holds the operation flags
+    uint32_t flags = OperationQueue<Baton>::PRIORITY_NORMAL;
+    if (info.Length() > 4 && !info[4]->IsUndefined()) {
+        if (!info[4]->IsUint32()) {
+            return Nan::ThrowError("Fifth argument must be an integer");
+        }
+
+        flags = Nan::To<uint32_t>(info[4]).ToChecked();
+    }
+
     Local<Object> in_buf = Nan::To<Object>(info[0]).ToLocalChecked();
     DWORD control_code = Nan::To<uint32_t>(info[1]).ToChecked();
     Local<Object> out_buf = Nan::To<Object>(info[2]).ToLocalChecked();
@@ -286,14 +519,10 @@ NAN_METHOD(CardReader::Control) {
     ci->out_len = Buffer::Length(out_buf);
     baton->input = ci;
 
-    // Schedule our work request with libuv. Here you can specify the functions
+    // Queue our work request in the reader. Here you can specify the functions
     // that should be executed in the threadpool and back in the main thread
     // after the threadpool function completed.
-    int status = uv_queue_work(uv_default_loop(),
-                               &baton->request,
-                               DoControl,
-                               reinterpret_cast<uv_after_work_cb>(AfterControl));
-    assert(status == 0);
+    QueueOperation(baton, DoControl, reinterpret_cast<uv_after_work_cb>(AfterControl), flags);
 
 
 }
@@ -302,375 +531,3517 @@ NAN_METHOD(CardReader::Close) {
 
     Nan::HandleScope scope;
 
-    LONG result = SCARD_S_SUCCESS;
     CardReader* obj = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
 
-    if (obj->m_status_thread) {
-        uv_mutex_lock(&obj->m_mutex);
-        if (obj->m_state == 0) {
-            int ret;
-            int times = 0;
-            obj->m_state = 1;
-            do {
-                result = SCardCancel(obj->m_status_card_context);
-                ret = uv_cond_timedwait(&obj->m_cond, &obj->m_mutex, 10000000);
-            } while ((ret != 0) && (++ times < 5));
+    // The status thread is only cancelled here, waiting for it to finish
+    // happens in a helper thread (see QueueClose) so neither the event loop
+    // nor the threadpool is blocked.
+    LONG result = obj->CancelMonitor();
+    QueueClose(std::vector<CardReader*>(1, obj), info[0]);
+
+    info.GetReturnValue().Set(Nan::New<Number>(result));
+}
+
+NAN_METHOD(CardReader::CloseAll) {
+
+    Nan::HandleScope scope;
+
+    // The first argument is an array of readers
+    if (!info[0]->IsArray()) {
+        return Nan::ThrowError("First argument must be an array");
+    }
+
+    // Cancel every reader first so they all tear down in parallel
+    Local<Array> list = Local<Array>::Cast(info[0]);
+    std::vector<CardReader*> readers;
+    for (uint32_t i = 0; i < list->Length(); ++ i) {
+        Local<Value> item = Nan::Get(list, i).ToLocalChecked();
+        if (!item->IsObject()) {
+            return Nan::ThrowError("Readers must be CardReader objects");
         }
 
-        uv_mutex_unlock(&obj->m_mutex);
-        assert(uv_thread_join(&obj->m_status_thread) == 0);
-        obj->m_status_thread = 0;
+        CardReader* obj = Nan::ObjectWrap::Unwrap<CardReader>(Nan::To<Object>(item).ToLocalChecked());
+        obj->CancelMonitor();
+        readers.push_back(obj);
     }
 
-    info.GetReturnValue().Set(Nan::New<Number>(result));
+    QueueClose(readers, info[1]);
 }
 
-void CardReader::HandleReaderStatusChange(uv_async_t *handle, int status) {
+NAN_METHOD(CardReader::Record) {
 
     Nan::HandleScope scope;
 
-    AsyncBaton* async_baton = static_cast<AsyncBaton*>(handle->data);
-    CardReader* reader = async_baton->reader;
+    // The first argument is the path of the trace file
+    if (!info[0]->IsString()) {
+        return Nan::ThrowError("First argument must be a string");
+    }
 
-    if (reader->m_status_thread) {
-        uv_mutex_lock(&reader->m_mutex);
+    CardReader* obj = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    Nan::Utf8String path(info[0]);
+    int ret = obj->m_recorder.Start(*path);
+    if (ret != 0) {
+        std::string msg = std::string("Cannot open trace file ") + *path + ": " + strerror(ret);
+        return Nan::ThrowError(msg.c_str());
     }
+}
 
-    AsyncResult* ar = async_baton->async_result;
+NAN_METHOD(CardReader::StopRecording) {
 
-    if (reader->m_state == 1) {
-        // Swallow events : Listening thread was cancelled by user.
-    } else if ((ar->result == SCARD_S_SUCCESS) ||
-               (ar->result == (LONG)SCARD_E_NO_READERS_AVAILABLE) ||
-               (ar->result == (LONG)SCARD_E_UNKNOWN_READER)) { // Card reader was unplugged, it's not an error
-        if (ar->status != 0) {
-            const unsigned int argc = 3;
-            Local<Value> argv[argc] = {
-                Nan::Undefined(), // argument
-                Nan::New<Number>(ar->status),
-                Nan::CopyBuffer(reinterpret_cast<char*>(ar->atr), ar->atrlen).ToLocalChecked()
-            };
+    Nan::HandleScope scope;
 
-            Nan::Call(Nan::Callback(Nan::New(async_baton->callback)), argc, argv);
-        }
-    } else {
-        Local<Value> err = Nan::Error(error_msg("SCardGetStatusChange", ar->result).c_str());
-        // Prepare the parameters for the callback function.
-        const unsigned int argc = 1;
-        Local<Value> argv[argc] = { err };
-        Nan::Call(Nan::Callback(Nan::New(async_baton->callback)), argc, argv);
+    CardReader* obj = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    obj->m_recorder.Stop();
+
+    Local<Object> stats = Nan::New<Object>();
+    Nan::Set(stats,
+             Nan::New("recorded").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(obj->m_recorder.Recorded())));
+    Nan::Set(stats,
+             Nan::New("dropped").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(obj->m_recorder.Dropped())));
+    info.GetReturnValue().Set(stats);
+}
+
+NAN_METHOD(CardReader::Replay) {
+
+    Nan::HandleScope scope;
+
+    // The first argument is the path of the trace file
+    if (!info[0]->IsString()) {
+        return Nan::ThrowError("First argument must be a string");
     }
 
-    if (ar->do_exit) {
-        uv_close(reinterpret_cast<uv_handle_t*>(&async_baton->async), CloseCallback); // necessary otherwise UV will block
+    // The second argument is the speed factor
+    if (!info[1]->IsNumber()) {
+        return Nan::ThrowError("Second argument must be a number");
+    }
 
-        /* Emit end event */
-        Local<Value> argv[1] = {
-            Nan::New("_end").ToLocalChecked(), // event name
-        };
+    // The third argument tells whether to loop over the recorded operations
+    if (!info[2]->IsBoolean()) {
+        return Nan::ThrowError("Third argument must be a boolean");
+    }
 
-        Nan::MakeCallback(async_baton->reader->handle(), "emit", 1, argv);
+    CardReader* obj = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    if (obj->m_player || obj->m_status_thread || obj->m_shared_monitor || (obj->m_leader != obj)) {
+        return Nan::ThrowError("Replay must be set up before the reader is used");
     }
 
-    if (reader->m_status_thread) {
-        uv_mutex_unlock(&reader->m_mutex);
+    Nan::Utf8String path(info[0]);
+    TracePlayer* player = new TracePlayer(Nan::To<double>(info[1]).FromJust(),
+                                          Nan::To<bool>(info[2]).FromJust());
+    int ret = player->Load(*path);
+    if (ret != 0) {
+        delete player;
+        std::string msg = std::string("Cannot load trace file ") + *path + ": " +
+                          (ret == -1 ? "invalid format" : strerror(ret));
+        return Nan::ThrowError(msg.c_str());
     }
+
+    obj->m_player = player;
 }
 
-void CardReader::HandlerFunction(void* arg) {
+NAN_METHOD(CardReader::SetFilters) {
 
-    AsyncBaton* async_baton = static_cast<AsyncBaton*>(arg);
-    CardReader* reader = async_baton->reader;
-    async_baton->async_result = new AsyncResult();
-    async_baton->async_result->do_exit = false;
+    Nan::HandleScope scope;
 
-    LONG result = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &reader->m_status_card_context);
+    // The first argument is an array of { atr, mask, states } objects
+    if (!info[0]->IsArray()) {
+        return Nan::ThrowError("First argument must be an array");
+    }
 
-    SCARD_READERSTATE card_reader_state = SCARD_READERSTATE();
-    card_reader_state.szReader = reader->m_name.c_str();
-    card_reader_state.dwCurrentState = SCARD_STATE_UNAWARE;
+    Local<Array> list = Local<Array>::Cast(info[0]);
+    std::vector<AtrFilter> filters;
+    for (uint32_t i = 0; i < list->Length(); ++ i) {
+        Local<Value> item = Nan::Get(list, i).ToLocalChecked();
+        if (!item->IsObject()) {
+            return Nan::ThrowError("Filters must be objects");
+        }
 
-    while (!reader->m_state) {
+        Local<Object> obj = Nan::To<Object>(item).ToLocalChecked();
+        Local<Value> atr = Nan::Get(obj, Nan::New("atr").ToLocalChecked()).ToLocalChecked();
+        Local<Value> mask = Nan::Get(obj, Nan::New("mask").ToLocalChecked()).ToLocalChecked();
+        Local<Value> states = Nan::Get(obj, Nan::New("states").ToLocalChecked()).ToLocalChecked();
 
-        result = SCardGetStatusChange(reader->m_status_card_context, INFINITE, &card_reader_state, 1);
+        AtrFilter filter = AtrFilter();
+        if (!atr->IsUndefined()) {
+            if (!Buffer::HasInstance(atr) || (Buffer::Length(atr) > MAX_ATR_SIZE)) {
+                return Nan::ThrowError("Filter atr must be a Buffer of up to 33 bytes");
+            }
 
-        uv_mutex_lock(&reader->m_mutex);
-        if (reader->m_state == 1) {
-            // Exit requested by user. Notify close method about SCardStatusChange was interrupted.
-            uv_cond_signal(&reader->m_cond);
-        } else if (result != (LONG)SCARD_S_SUCCESS) {
-            // Exit this loop due to errors
-            reader->m_state = 2;
+            filter.atrlen = Buffer::Length(atr);
+            memcpy(filter.atr, Buffer::Data(atr), filter.atrlen);
         }
 
-        async_baton->async_result->do_exit = (reader->m_state != 0);
-        async_baton->async_result->result = result;
-        if (card_reader_state.dwEventState == card_reader_state.dwCurrentState) {
-            async_baton->async_result->status = 0;
+        if (mask->IsUndefined()) {
+            memset(filter.mask, 0xff, MAX_ATR_SIZE);
+        } else if (!Buffer::HasInstance(mask) || (Buffer::Length(mask) != filter.atrlen)) {
+            return Nan::ThrowError("Filter mask must be a Buffer as long as the atr");
         } else {
-            async_baton->async_result->status = card_reader_state.dwEventState;
+            memcpy(filter.mask, Buffer::Data(mask), filter.atrlen);
         }
-        memcpy(async_baton->async_result->atr, card_reader_state.rgbAtr, card_reader_state.cbAtr);
-        async_baton->async_result->atrlen = card_reader_state.cbAtr;
 
-        uv_mutex_unlock(&reader->m_mutex);
+        if (!states->IsUndefined()) {
+            if (!states->IsUint32()) {
+                return Nan::ThrowError("Filter states must be an integer");
+            }
 
-        uv_async_send(&async_baton->async);
-        card_reader_state.dwCurrentState = card_reader_state.dwEventState;
+            filter.state_mask = Nan::To<uint32_t>(states).ToChecked();
+        }
+
+        filters.push_back(filter);
     }
 
-    // Exit flag set in keepwatching and handled in following uv_async_send
+    CardReader* reader = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    uv_mutex_lock(&reader->m_mutex);
+    reader->m_filters.swap(filters);
+    uv_mutex_unlock(&reader->m_mutex);
 }
 
-void CardReader::DoConnect(uv_work_t* req) {
+NAN_METHOD(CardReader::GetStats) {
 
-    Baton* baton = static_cast<Baton*>(req->data);
-    ConnectInput *ci = static_cast<ConnectInput*>(baton->input);
+    Nan::HandleScope scope;
 
-    DWORD card_protocol;
-    LONG result = SCARD_S_SUCCESS;
-    CardReader* obj = baton->reader;
+    CardReader* reader = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    Local<Object> stats = Nan::New<Object>();
+
+    uv_mutex_lock(&reader->m_mutex);
+    Nan::Set(stats, Nan::New("events_delivered").ToLocalChecked(), Nan::New<Number>(reader->m_events_delivered));
+    Nan::Set(stats, Nan::New("events_filtered").ToLocalChecked(), Nan::New<Number>(reader->m_events_filtered));
+    Nan::Set(stats, Nan::New("resyncs").ToLocalChecked(), Nan::New<Number>(reader->m_resyncs));
+    Nan::Set(stats, Nan::New("recoveries").ToLocalChecked(), Nan::New<Number>(reader->m_recoveries));
+    Nan::Set(stats, Nan::New("card_recoveries").ToLocalChecked(), Nan::New<Number>(reader->m_card_recoveries));
+    Nan::Set(stats, Nan::New("failed_fast").ToLocalChecked(), Nan::New<Number>(reader->m_failed_fast));
+    Nan::Set(stats, Nan::New("connections_opened").ToLocalChecked(), Nan::New<Number>(reader->m_connections_opened));
+    Nan::Set(stats, Nan::New("connections_reused").ToLocalChecked(), Nan::New<Number>(reader->m_connections_reused));
+    Nan::Set(stats, Nan::New("rules_run").ToLocalChecked(), Nan::New<Number>(reader->m_rules_run));
+    Nan::Set(stats, Nan::New("rules_allowed").ToLocalChecked(), Nan::New<Number>(reader->m_rules_allowed));
+    uv_mutex_unlock(&reader->m_mutex);
+
+    CardReader* leader = reader->m_leader;
+    uv_mutex_lock(&leader->m_queue_mutex);
+    Nan::Set(stats, Nan::New("queued").ToLocalChecked(), Nan::New<Number>(leader->m_queue.Size()));
+    uv_mutex_unlock(&leader->m_queue_mutex);
+
+    info.GetReturnValue().Set(stats);
+}
 
-    /* Lock mutex */
-    uv_mutex_lock(&obj->m_mutex);
-    /* Is context established */
-    if (!obj->m_card_context) {
-        result = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &obj->m_card_context);
-    }
+NAN_METHOD(CardReader::ReadMemory) {
 
-    /* Connect */
-    if (result == SCARD_S_SUCCESS) {
-        result = SCardConnect(obj->m_card_context,
-                              obj->m_name.c_str(),
-                              ci->share_mode,
-                              ci->pref_protocol,
-                              &obj->m_card_handle,
-                              &card_protocol);
-    }
+    Nan::HandleScope scope;
 
-    /* Unlock the mutex */
-    uv_mutex_unlock(&obj->m_mutex);
+    // The first argument is the first block to read
+    if (!info[0]->IsUint32()) {
+        return Nan::ThrowError("First argument must be an integer");
+    }
 
-    ConnectResult *cr = new ConnectResult();
-    cr->result = result;
-    if (!result) {
-        cr->card_protocol = card_protocol;
+    // The second argument is the number of bytes to read
+    if (!info[1]->IsUint32()) {
+        return Nan::ThrowError("Second argument must be an integer");
     }
 
-    baton->result = cr;
+    MemoryInput* mi = new MemoryInput();
+    mi->write = false;
+    mi->start = Nan::To<uint32_t>(info[0]).ToChecked();
+    mi->length = Nan::To<uint32_t>(info[1]).ToChecked();
+    QueueMemory(info, mi, 2);
 }
 
-void CardReader::AfterConnect(uv_work_t* req, int status) {
+NAN_METHOD(CardReader::WriteMemory) {
 
     Nan::HandleScope scope;
-    Baton* baton = static_cast<Baton*>(req->data);
-    ConnectInput *ci = static_cast<ConnectInput*>(baton->input);
-    ConnectResult *cr = static_cast<ConnectResult*>(baton->result);
 
-    if (cr->result) {
-        Local<Value> err = Nan::Error(error_msg("SCardConnect", cr->result).c_str());
-        // Prepare the parameters for the callback function.
-        const unsigned argc = 1;
-        Local<Value> argv[argc] = { err };
-        Nan::Call(Nan::Callback(Nan::New(baton->callback)), argc, argv);
-    } else {
-        Nan::Set(baton->reader->handle(), Nan::New(connected_symbol), Nan::True());
-        const unsigned argc = 2;
-        Local<Value> argv[argc] = {
-            Nan::Null(),
-            Nan::New<Number>(cr->card_protocol)
-        };
+    // The first argument is the first block to write
+    if (!info[0]->IsUint32()) {
+        return Nan::ThrowError("First argument must be an integer");
+    }
 
-        Nan::Call(Nan::Callback(Nan::New(baton->callback)), argc, argv);
+    // The second argument is the buffer to be written
+    if (!Buffer::HasInstance(info[1])) {
+        return Nan::ThrowError("Second argument must be a Buffer");
     }
 
-    // The callback is a permanent handle, so we have to dispose of it manually.
-    baton->callback.Reset();
-    delete ci;
-    delete cr;
-    delete baton;
+    Local<Object> buffer_data = Nan::To<Object>(info[1]).ToLocalChecked();
+    const BYTE* data = reinterpret_cast<const BYTE*>(Buffer::Data(buffer_data));
+    MemoryInput* mi = new MemoryInput();
+    mi->write = true;
+    mi->start = Nan::To<uint32_t>(info[0]).ToChecked();
+    mi->length = Buffer::Length(buffer_data);
+    mi->data.assign(data, data + mi->length);
+    QueueMemory(info, mi, 2);
 }
 
-void CardReader::DoDisconnect(uv_work_t* req) {
+NAN_METHOD(CardReader::SetSecureMessaging) {
 
-    Baton* baton = static_cast<Baton*>(req->data);
-    DWORD* disposition = reinterpret_cast<DWORD*>(baton->input);
+    Nan::HandleScope scope;
 
-    LONG result = SCARD_S_SUCCESS;
-    CardReader* obj = baton->reader;
+    CardReader* reader = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    SessionWrapper* wrapper = NULL;
+
+    // The first argument holds the session keys, null ends secure messaging
+    if (info[0]->IsObject()) {
+        Local<Object> options = Nan::To<Object>(info[0]).ToLocalChecked();
+        Local<Value> algorithm = Nan::Get(options, Nan::New("algorithm").ToLocalChecked()).ToLocalChecked();
+        Local<Value> keys[3] = {
+            Nan::Get(options, Nan::New("enc_key").ToLocalChecked()).ToLocalChecked(),
+            Nan::Get(options, Nan::New("mac_key").ToLocalChecked()).ToLocalChecked(),
+            Nan::Get(options, Nan::New("ssc").ToLocalChecked()).ToLocalChecked()
+        };
 
-    /* Lock mutex */
-    uv_mutex_lock(&obj->m_mutex);
-    /* Connect */
-    if (obj->m_card_handle) {
-        result = SCardDisconnect(obj->m_card_handle, *disposition);
-        if (result == SCARD_S_SUCCESS) {
-            obj->m_card_handle = 0;
+        std::vector<uint8_t> values[3];
+        KeyWiper wiper(values, 3);
+        for (int i = 0; i < 3; ++ i) {
+            if (!Buffer::HasInstance(keys[i])) {
+                return Nan::ThrowError("Keys and counter must be Buffers");
+            }
+
+            const uint8_t* data = reinterpret_cast<const uint8_t*>(Buffer::Data(keys[i]));
+            values[i].assign(data, data + Buffer::Length(keys[i]));
         }
-    }
 
-    /* Unlock the mutex */
-    uv_mutex_unlock(&obj->m_mutex);
+        Nan::Utf8String name(algorithm);
+        SecureMessaging::Algorithm alg;
+        if (strcmp(*name, "aes") == 0) {
+            alg = SecureMessaging::SM_AES;
+        } else if (strcmp(*name, "3des") == 0) {
+            alg = SecureMessaging::SM_3DES;
+        } else {
+            return Nan::ThrowError("Algorithm must be 'aes' or '3des'");
+        }
 
-    baton->result = reinterpret_cast<void*>(new LONG(result));
+        wrapper = SecureMessaging::Create(alg, values[0], values[1], values[2]);
+        if (wrapper == NULL) {
+            return Nan::ThrowError("Invalid key or counter length for the algorithm");
+        }
+    } else if (!info[0]->IsNull() && !info[0]->IsUndefined()) {
+        return Nan::ThrowError("First argument must be an object or null");
+    }
+
+    // Operations already queued use the session in place when they run
+    uv_mutex_lock(&reader->m_mutex);
+    delete reader->m_wrapper;
+    reader->m_wrapper = wrapper;
+    uv_mutex_unlock(&reader->m_mutex);
 }
 
-void CardReader::AfterDisconnect(uv_work_t* req, int status) {
+NAN_METHOD(CardReader::ControlBatch) {
 
     Nan::HandleScope scope;
-    Baton* baton = static_cast<Baton*>(req->data);
-    LONG* result = reinterpret_cast<LONG*>(baton->result);
 
-    if (*result) {
-        Local<Value> err = Nan::Error(error_msg("SCardDisconnect", *result).c_str());
-
-        // Prepare the parameters for the callback function.
-        const unsigned argc = 1;
-        Local<Value> argv[argc] = { err };
-        Nan::Call(Nan::Callback(Nan::New(baton->callback)), argc, argv);
-    } else {
-        Nan::Set(baton->reader->handle(), Nan::New(connected_symbol), Nan::False());
-        const unsigned argc = 1;
-        Local<Value> argv[argc] = {
-            Nan::Null()
-        };
+    // The first argument is an array of { data, control_code, res_len } objects
+    if (!info[0]->IsArray()) {
+        return Nan::ThrowError("First argument must be an array");
+    }
 
-        Nan::Call(Nan::Callback(Nan::New(baton->callback)), argc, argv);
+    if (!info[1]->IsFunction()) {
+        return Nan::ThrowError("Second argument must be a callback function");
     }
 
-    // The callback is a permanent handle, so we have to dispose of it manually.
-    baton->callback.Reset();
-    DWORD* disposition = reinterpret_cast<DWORD*>(baton->input);
-    delete disposition;
-    delete result;
-    delete baton;
-}
+    // The optional third argument holds the operation flags
+    uint32_t flags = OperationQueue<Baton>::PRIORITY_NORMAL;
+    if (info.Length() > 2 && !info[2]->IsUndefined()) {
+        if (!info[2]->IsUint32()) {
+            return Nan::ThrowError("Third argument must be an integer");
+        }
 
-void CardReader::DoTransmit(uv_work_t* req) {
+        flags = Nan::To<uint32_t>(info[2]).ToChecked();
+    }
 
-    Baton* baton = static_cast<Baton*>(req->data);
-    TransmitInput *ti = static_cast<TransmitInput*>(baton->input);
-    CardReader* obj = baton->reader;
+    Local<Array> list = Local<Array>::Cast(info[0]);
+    std::vector<ControlCommand>* commands = new std::vector<ControlCommand>(list->Length());
+    for (uint32_t i = 0; i < list->Length(); ++ i) {
+        Local<Value> item = Nan::Get(list, i).ToLocalChecked();
+        Local<Value> data, code, res_len;
+        if (item->IsObject()) {
+            Local<Object> obj = Nan::To<Object>(item).ToLocalChecked();
+            data = Nan::Get(obj, Nan::New("data").ToLocalChecked()).ToLocalChecked();
+            code = Nan::Get(obj, Nan::New("control_code").ToLocalChecked()).ToLocalChecked();
+            res_len = Nan::Get(obj, Nan::New("res_len").ToLocalChecked()).ToLocalChecked();
+        }
 
-    TransmitResult *tr = new TransmitResult();
-    tr->data = new unsigned char[ti->out_len];
-    tr->len = ti->out_len;
-    LONG result = SCARD_E_INVALID_HANDLE;
+        if (!item->IsObject() || !Buffer::HasInstance(data) || !code->IsUint32() || !res_len->IsUint32()) {
+            delete commands;
+            return Nan::ThrowError("Commands must have a data Buffer, a control code and a response length");
+        }
 
-    /* Lock mutex */
-    uv_mutex_lock(&obj->m_mutex);
-    /* Connected? */
-    // Under windows, SCARD_IO_REQUEST param must be NULL. Else error RPC_X_BAD_STUB_DATA / 0x06F7 on each call.
-    if (obj->m_card_handle) {
-        SCARD_IO_REQUEST send_pci = { ti->card_protocol, sizeof(SCARD_IO_REQUEST) };
-        result = SCardTransmit(obj->m_card_handle, &send_pci, ti->in_data, ti->in_len,
-                               NULL, tr->data, &tr->len);
+        ControlCommand& command = (*commands)[i];
+        const BYTE* bytes = reinterpret_cast<const BYTE*>(Buffer::Data(data));
+        command.control_code = Nan::To<uint32_t>(code).ToChecked();
+        command.in.assign(bytes, bytes + Buffer::Length(data));
+        command.out_len = Nan::To<uint32_t>(res_len).ToChecked();
     }
 
-    /* Unlock the mutex */
-    uv_mutex_unlock(&obj->m_mutex);
+    Baton* baton = new Baton();
+    baton->request.data = baton;
+    baton->callback.Reset(Local<Function>::Cast(info[1]));
+    baton->reader = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    baton->input = commands;
 
-    tr->result = result;
+    QueueOperation(baton, DoControlBatch, reinterpret_cast<uv_after_work_cb>(AfterControlBatch), flags);
+}
 
-    baton->result = tr;
+NAN_METHOD(CardReader::SetTimeline) {
+
+    Nan::HandleScope scope;
+
+    // The first argument tells whether to pass the timings to the callbacks
+    s_timeline.store(Nan::To<bool>(info[0]).FromJust(), std::memory_order_relaxed);
 }
 
-void CardReader::AfterTransmit(uv_work_t* req, int status) {
+NAN_METHOD(CardReader::TransmitChained) {
 
     Nan::HandleScope scope;
-    Baton* baton = static_cast<Baton*>(req->data);
-    TransmitInput *ti = static_cast<TransmitInput*>(baton->input);
-    TransmitResult *tr = static_cast<TransmitResult*>(baton->result);
 
-    if (tr->result) {
-        Local<Value> err = Nan::Error(error_msg("SCardTransmit", tr->result).c_str());
+    // The first argument is the header: CLA INS P1 P2
+    if (!Buffer::HasInstance(info[0]) || (Buffer::Length(info[0]) != 4)) {
+        return Nan::ThrowError("First argument must be a 4 bytes Buffer");
+    }
 
-        // Prepare the parameters for the callback function.
-        const unsigned argc = 1;
-        Local<Value> argv[argc] = { err };
-        Nan::Call(Nan::Callback(Nan::New(baton->callback)), argc, argv);
-    } else {
-        const unsigned argc = 2;
-        Local<Value> argv[argc] = {
-            Nan::Null(),
-            Nan::CopyBuffer(reinterpret_cast<char*>(tr->data), tr->len).ToLocalChecked()
-        };
+    // The second argument is the data
+    if (!Buffer::HasInstance(info[1])) {
+        return Nan::ThrowError("Second argument must be a Buffer");
+    }
 
-        Nan::Call(Nan::Callback(Nan::New(baton->callback)), argc, argv);
+    // The third argument is the size of the chunks
+    if (!info[2]->IsUint32() ||
+        (Nan::To<uint32_t>(info[2]).FromJust() == 0) ||
+        (Nan::To<uint32_t>(info[2]).FromJust() > 255)) {
+        return Nan::ThrowError("Third argument must be a chunk size between 1 and 255");
     }
 
+    // The fourth one tells whether to use ENVELOPE instead of chaining and
+    // the fifth one is the Le of the last command, -1 if there's none
+    if (!info[4]->IsInt32() ||
+        (Nan::To<int32_t>(info[4]).FromJust() < -1) ||
+        (Nan::To<int32_t>(info[4]).FromJust() > 256)) {
+        return Nan::ThrowError("Fifth argument must be -1 or an integer from 0 to 256");
+    }
 
-    // The callback is a permanent handle, so we have to dispose of it manually.
+    // The enveloped command has at most an extended Lc
+    if (Nan::To<bool>(info[3]).FromJust() && (Buffer::Length(info[1]) > 65535)) {
+        return Nan::ThrowError("ENVELOPE data must be up to 65535 bytes");
+    }
+
+    // Then the length of the response, the protocol, the callback and the
+    // optional operation flags, as in Transmit()
+    if (!info[5]->IsUint32() || !info[6]->IsUint32()) {
+        return Nan::ThrowError("Response length and protocol must be integers");
+    }
+
+    if (!info[7]->IsFunction()) {
+        return Nan::ThrowError("Eighth argument must be a callback function");
+    }
+
+    uint32_t flags = OperationQueue<Baton>::PRIORITY_NORMAL;
+    if (!info[8]->IsUndefined()) {
+        if (!info[8]->IsUint32()) {
+            return Nan::ThrowError("Ninth argument must be an integer");
+        }
+
+        flags = Nan::To<uint32_t>(info[8]).ToChecked();
+    }
+
+    ChainInput* ci = new ChainInput();
+    memcpy(ci->header, Buffer::Data(info[0]), sizeof(ci->header));
+    const BYTE* data = reinterpret_cast<const BYTE*>(Buffer::Data(info[1]));
+    ci->data.assign(data, data + Buffer::Length(info[1]));
+    ci->chunk = Nan::To<uint32_t>(info[2]).FromJust();
+    ci->envelope = Nan::To<bool>(info[3]).FromJust();
+    ci->le = Nan::To<int32_t>(info[4]).FromJust();
+    ci->out_len = Nan::To<uint32_t>(info[5]).FromJust();
+    ci->card_protocol = Nan::To<uint32_t>(info[6]).FromJust();
+    ci->plain = (flags & OP_PLAIN) != 0;
+
+    Baton* baton = new Baton();
+    baton->request.data = baton;
+    baton->callback.Reset(Local<Function>::Cast(info[7]));
+    baton->reader = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    baton->input = ci;
+
+    QueueOperation(baton, DoChained, reinterpret_cast<uv_after_work_cb>(AfterChained), flags);
+}
+
+NAN_METHOD(CardReader::Verify) {
+
+    Nan::HandleScope scope;
+
+    // The first three arguments are arrays as long as each other: the read
+    // APDUs of every item (an array of them), the digest kinds and the
+    // expected data or digests
+    if (!info[0]->IsArray() || !info[1]->IsArray() || !info[2]->IsArray()) {
+        return Nan::ThrowError("First three arguments must be arrays");
+    }
+
+    Local<Array> apdus = Local<Array>::Cast(info[0]);
+    Local<Array> kinds = Local<Array>::Cast(info[1]);
+    Local<Array> expected = Local<Array>::Cast(info[2]);
+    if ((kinds->Length() != apdus->Length()) || (expected->Length() != apdus->Length())) {
+        return Nan::ThrowError("First three arguments must have the same length");
+    }
+
+    // Then the length of the response, the protocol, the callback and the
+    // optional operation flags, as in Transmit()
+    if (!info[3]->IsUint32() || !info[4]->IsUint32()) {
+        return Nan::ThrowError("Response length and protocol must be integers");
+    }
+
+    if (!info[5]->IsFunction()) {
+        return Nan::ThrowError("Sixth argument must be a callback function");
+    }
+
+    uint32_t flags = OperationQueue<Baton>::PRIORITY_NORMAL;
+    if (!info[6]->IsUndefined()) {
+        if (!info[6]->IsUint32()) {
+            return Nan::ThrowError("Seventh argument must be an integer");
+        }
+
+        flags = Nan::To<uint32_t>(info[6]).ToChecked();
+    }
+
+    VerifyInput* vi = new VerifyInput();
+    vi->items.resize(apdus->Length());
+    for (uint32_t i = 0; i < apdus->Length(); ++ i) {
+        Local<Value> apdu = Nan::Get(apdus, i).ToLocalChecked();
+        Local<Value> kind = Nan::Get(kinds, i).ToLocalChecked();
+        Local<Value> value = Nan::Get(expected, i).ToLocalChecked();
+        if (!apdu->IsArray() || (Local<Array>::Cast(apdu)->Length() == 0) ||
+            !Buffer::HasInstance(value) || !kind->IsUint32() ||
+            (Nan::To<uint32_t>(kind).FromJust() > Digest::SHA256)) {
+            delete vi;
+            return Nan::ThrowError("Every item needs APDUs, a digest kind and a Buffer to compare");
+        }
+
+        VerifyItem& item = vi->items[i];
+        Local<Array> list = Local<Array>::Cast(apdu);
+        item.apdus.resize(list->Length());
+        for (uint32_t j = 0; j < list->Length(); ++ j) {
+            Local<Value> command = Nan::Get(list, j).ToLocalChecked();
+            if (!Buffer::HasInstance(command) || (Buffer::Length(command) < 4)) {
+                delete vi;
+                return Nan::ThrowError("Every APDU must be a Buffer");
+            }
+
+            const BYTE* data = reinterpret_cast<const BYTE*>(Buffer::Data(command));
+            item.apdus[j].assign(data, data + Buffer::Length(command));
+        }
+
+        item.kind = static_cast<Digest::Kind>(Nan::To<uint32_t>(kind).FromJust());
+        if ((item.kind != Digest::BYTES) && (Buffer::Length(value) != Digest::Length(item.kind))) {
+            delete vi;
+            return Nan::ThrowError("Expected digest has the wrong length");
+        }
+
+        const BYTE* data = reinterpret_cast<const BYTE*>(Buffer::Data(value));
+        item.expected.assign(data, data + Buffer::Length(value));
+    }
+
+    vi->out_len = Nan::To<uint32_t>(info[3]).FromJust();
+    vi->card_protocol = Nan::To<uint32_t>(info[4]).FromJust();
+    vi->plain = (flags & OP_PLAIN) != 0;
+
+    Baton* baton = new Baton();
+    baton->request.data = baton;
+    baton->callback.Reset(Local<Function>::Cast(info[5]));
+    baton->reader = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    baton->input = vi;
+
+    QueueOperation(baton, DoVerify, reinterpret_cast<uv_after_work_cb>(AfterVerify), flags);
+}
+
+// Any ATR a reader reports fits in the dispatcher
+static_assert(MAX_ATR_SIZE <= Dispatcher::MAX_ATR, "Dispatcher::MAX_ATR is too small");
+
+NAN_METHOD(CardReader::SubmitJob) {
+
+    Nan::HandleScope scope;
+
+    // The first two arguments are the ATR and mask of the cards the job is for
+    BYTE atr[MAX_ATR_SIZE] = { 0 };
+    BYTE mask[MAX_ATR_SIZE];
+    DWORD atrlen = 0;
+    memset(mask, 0xff, sizeof(mask));
+    if (!info[0]->IsUndefined()) {
+        if (!Buffer::HasInstance(info[0]) || (Buffer::Length(info[0]) > MAX_ATR_SIZE)) {
+            return Nan::ThrowError("First argument must be an ATR Buffer");
+        }
+
+        atrlen = Buffer::Length(info[0]);
+        memcpy(atr, Buffer::Data(info[0]), atrlen);
+    }
+
+    if (!info[1]->IsUndefined()) {
+        if (!Buffer::HasInstance(info[1]) || (Buffer::Length(info[1]) != atrlen)) {
+            return Nan::ThrowError("Second argument must be a Buffer as long as the ATR");
+        }
+
+        memcpy(mask, Buffer::Data(info[1]), atrlen);
+    }
+
+    // The third argument is the array of APDUs
+    if (!info[2]->IsArray()) {
+        return Nan::ThrowError("Third argument must be an array of Buffers");
+    }
+
+    // Then the share mode, the preferred protocols, the disposition and the
+    // length of the responses
+    for (int i = 3; i < 7; ++ i) {
+        if (!info[i]->IsUint32()) {
+            return Nan::ThrowError("Share mode, protocol, disposition and response length must be integers");
+        }
+    }
+
+    // The eighth argument is the callback function
+    if (!info[7]->IsFunction()) {
+        return Nan::ThrowError("Eighth argument must be a callback function");
+    }
+
+    uint32_t flags = OperationQueue<Baton>::PRIORITY_NORMAL;
+    if (!info[8]->IsUndefined()) {
+        if (!info[8]->IsUint32()) {
+            return Nan::ThrowError("Ninth argument must be an integer");
+        }
+
+        flags = Nan::To<uint32_t>(info[8]).ToChecked();
+    }
+
+    // The PCSCLite the job was submitted to, which cancels it when closed,
+    // and how long it may wait for a reader
+    if (!info[9]->IsObject()) {
+        return Nan::ThrowError("Tenth argument must be the PCSCLite object");
+    }
+
+    const void* owner = Nan::ObjectWrap::Unwrap<Nan::ObjectWrap>(Nan::To<Object>(info[9]).ToLocalChecked());
+    uint32_t timeout = 0;
+    if (!info[10]->IsUndefined()) {
+        if (!info[10]->IsUint32()) {
+            return Nan::ThrowError("Eleventh argument must be an integer");
+        }
+
+        timeout = Nan::To<uint32_t>(info[10]).ToChecked();
+    }
+
+    Local<Array> apdus = Local<Array>::Cast(info[2]);
+    JobInput* ji = new JobInput();
+    ji->apdus.resize(apdus->Length());
+    for (uint32_t i = 0; i < apdus->Length(); ++ i) {
+        Local<Value> apdu = Nan::Get(apdus, i).ToLocalChecked();
+        if (!Buffer::HasInstance(apdu)) {
+            delete ji;
+            return Nan::ThrowError("Every APDU must be a Buffer");
+        }
+
+        const BYTE* data = reinterpret_cast<const BYTE*>(Buffer::Data(apdu));
+        ji->apdus[i].assign(data, data + Buffer::Length(apdu));
+    }
+
+    ji->share_mode = Nan::To<uint32_t>(info[3]).ToChecked();
+    ji->pref_protocol = Nan::To<uint32_t>(info[4]).ToChecked();
+    ji->disposition = Nan::To<uint32_t>(info[5]).ToChecked();
+    ji->res_len = Nan::To<uint32_t>(info[6]).ToChecked();
+
+    // The reader is only known once the dispatcher picks one
+    Baton* baton = new Baton();
+    baton->request.data = baton;
+    baton->callback.Reset(Local<Function>::Cast(info[7]));
+    baton->reader = NULL;
+    baton->input = ji;
+    baton->flags = flags;
+    Dispatcher::Submit(atr, mask, atrlen, baton, owner, timeout);
+}
+
+NAN_METHOD(CardReader::CompileApdu) {
+
+    Nan::HandleScope scope;
+
+    // The first argument is the header: CLA INS P1 P2
+    if (!Buffer::HasInstance(info[0]) || (Buffer::Length(info[0]) != 4)) {
+        return Nan::ThrowError("First argument must be a 4 bytes Buffer");
+    }
+
+    // The second argument tells which fields are placeholders
+    if (!info[1]->IsUint32()) {
+        return Nan::ThrowError("Second argument must be an integer");
+    }
+
+    // The third argument is the fixed data, if any
+    if (!Buffer::HasInstance(info[2]) && !info[2]->IsUndefined() && !info[2]->IsNull()) {
+        return Nan::ThrowError("Third argument must be a Buffer");
+    }
+
+    // The fourth argument is the fixed Le, -1 if there's none
+    if (!info[3]->IsInt32() || (Nan::To<int32_t>(info[3]).FromJust() > 256)) {
+        return Nan::ThrowError("Fourth argument must be an integer up to 256");
+    }
+
+    if (Buffer::HasInstance(info[2]) && (Buffer::Length(info[2]) > 255)) {
+        return Nan::ThrowError("Only short APDUs are supported");
+    }
+
+    CardReader* obj = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    ApduTemplate* tpl = new ApduTemplate();
+    memcpy(tpl->header, Buffer::Data(info[0]), sizeof(tpl->header));
+    tpl->mask = Nan::To<uint32_t>(info[1]).FromJust();
+    if (Buffer::HasInstance(info[2])) {
+        const BYTE* data = reinterpret_cast<const BYTE*>(Buffer::Data(info[2]));
+        tpl->data.assign(data, data + Buffer::Length(info[2]));
+    }
+
+    int32_t le = Nan::To<int32_t>(info[3]).FromJust();
+    tpl->has_le = (le >= 0);
+    tpl->le = static_cast<BYTE>(le);
+
+    obj->m_templates.push_back(tpl);
+    info.GetReturnValue().Set(Nan::New<Number>(obj->m_templates.size() - 1));
+}
+
+bool CardReader::ParseTemplateArgs(Nan::NAN_METHOD_ARGS_TYPE info, TransmitInput* ti, uint32_t* flags) {
+
+    CardReader* obj = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+
+    // The first argument is the template handle
+    if (!info[0]->IsUint32() || (Nan::To<uint32_t>(info[0]).FromJust() >= obj->m_templates.size())) {
+        Nan::ThrowError("First argument must be a template handle");
+        return false;
+    }
+
+    const ApduTemplate* tpl = obj->m_templates[Nan::To<uint32_t>(info[0]).FromJust()];
+
+    // The next ones are P1, P2, Le and the data, only read if they are placeholders
+    const uint32_t fields[3] = { ApduTemplate::P1, ApduTemplate::P2, ApduTemplate::LE };
+    BYTE values[3] = { 0, 0, 0 };
+    for (int i = 0; i < 3; ++ i) {
+        if (tpl->mask & fields[i]) {
+            uint32_t max = fields[i] == ApduTemplate::LE ? 256 : 255;
+            if (!info[i + 1]->IsUint32() || (Nan::To<uint32_t>(info[i + 1]).FromJust() > max)) {
+                Nan::ThrowError("P1, P2 and Le must be bytes");
+                return false;
+            }
+
+            values[i] = static_cast<BYTE>(Nan::To<uint32_t>(info[i + 1]).FromJust());
+        }
+    }
+
+    if (tpl->mask & ApduTemplate::DATA) {
+        if (!Buffer::HasInstance(info[4]) || (Buffer::Length(info[4]) > 255)) {
+            Nan::ThrowError("Data must be a Buffer of up to 255 bytes");
+            return false;
+        }
+
+        ti->in_len = Buffer::Length(info[4]);
+        ti->in_data = new unsigned char[ti->in_len];
+        memcpy(ti->in_data, Buffer::Data(info[4]), ti->in_len);
+    }
+
+    // Then the length of the data to be received, the protocol, the callback
+    // and the optional operation flags, as in Transmit()
+    if (!info[5]->IsUint32() || !info[6]->IsUint32()) {
+        Nan::ThrowError("Response length and protocol must be integers");
+        return false;
+    }
+
+    if (!info[7]->IsFunction()) {
+        Nan::ThrowError("Eighth argument must be a callback function");
+        return false;
+    }
+
+    *flags = OperationQueue<Baton>::PRIORITY_NORMAL;
+    if (!info[8]->IsUndefined()) {
+        if (!info[8]->IsUint32()) {
+            Nan::ThrowError("Ninth argument must be an integer");
+            return false;
+        }
+
+        *flags = Nan::To<uint32_t>(info[8]).ToChecked();
+    }
+
+    ti->apdu_template = tpl;
+    ti->p1 = values[0];
+    ti->p2 = values[1];
+    ti->le = values[2];
+    ti->out_len = Nan::To<uint32_t>(info[5]).ToChecked();
+    ti->card_protocol = Nan::To<uint32_t>(info[6]).ToChecked();
+    ti->plain = (*flags & OP_PLAIN) != 0;
+    return true;
+}
+
+NAN_METHOD(CardReader::TransmitTemplate) {
+
+    Nan::HandleScope scope;
+
+    TransmitInput* ti = new TransmitInput();
+    uint32_t flags;
+    if (!ParseTemplateArgs(info, ti, &flags)) {
+        delete [] ti->in_data;
+        delete ti;
+        return;
+    }
+
+    if (s_timeline.load(std::memory_order_relaxed)) {
+        ti->queued = timeline_now();
+    }
+
+    Baton* baton = new Baton();
+    baton->request.data = baton;
+    baton->callback.Reset(Local<Function>::Cast(info[7]));
+    baton->reader = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    baton->input = ti;
+    PROBE_TRANSMIT_ENQUEUE(baton->reader->m_name.c_str(), baton, ti->in_len);
+
+    // The APDU is assembled by DoTransmit in the reader buffer
+    QueueOperation(baton, DoTransmit, reinterpret_cast<uv_after_work_cb>(AfterTransmit), flags);
+}
+
+NAN_METHOD(CardReader::TransmitSweep) {
+
+    Nan::HandleScope scope;
+
+    SweepInput* si = new SweepInput();
+    uint32_t flags;
+    if (!ParseTemplateArgs(info, &si->transmit, &flags)) {
+        delete [] si->transmit.in_data;
+        delete si;
+        return;
+    }
+
+    // The tenth argument is the last P1 of the sweep, the first one is the P1
+    if (!(si->transmit.apdu_template->mask & ApduTemplate::P1) ||
+        !info[9]->IsUint32() ||
+        (Nan::To<uint32_t>(info[9]).FromJust() > 255) ||
+        (Nan::To<uint32_t>(info[9]).FromJust() < si->transmit.p1)) {
+        delete [] si->transmit.in_data;
+        delete si;
+        return Nan::ThrowError("A sweep needs a P1 placeholder and a P1 range");
+    }
+
+    if (si->transmit.out_len < 2) {
+        delete [] si->transmit.in_data;
+        delete si;
+        return Nan::ThrowError("Response length must hold the status word");
+    }
+
+    si->first = si->transmit.p1;
+    si->last = static_cast<BYTE>(Nan::To<uint32_t>(info[9]).FromJust());
+
+    Baton* baton = new Baton();
+    baton->request.data = baton;
+    baton->callback.Reset(Local<Function>::Cast(info[7]));
+    baton->reader = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    baton->input = si;
+
+    QueueOperation(baton, DoSweep, reinterpret_cast<uv_after_work_cb>(AfterSweep), flags);
+}
+
+NAN_METHOD(CardReader::GetFeatures) {
+
+    Nan::HandleScope scope;
+
+    if (!info[0]->IsFunction()) {
+        return Nan::ThrowError("First argument must be a callback function");
+    }
+
+    // The optional second argument holds the operation flags
+    uint32_t flags = OperationQueue<Baton>::PRIORITY_NORMAL;
+    if (info.Length() > 1 && !info[1]->IsUndefined()) {
+        if (!info[1]->IsUint32()) {
+            return Nan::ThrowError("Second argument must be an integer");
+        }
+
+        flags = Nan::To<uint32_t>(info[1]).ToChecked();
+    }
+
+    Baton* baton = new Baton();
+    baton->request.data = baton;
+    baton->callback.Reset(Local<Function>::Cast(info[0]));
+    baton->reader = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    baton->input = NULL;
+
+    QueueOperation(baton, DoGetFeatures, reinterpret_cast<uv_after_work_cb>(AfterGetFeatures), flags);
+}
+
+NAN_METHOD(CardReader::Join) {
+
+    Nan::HandleScope scope;
+
+    // The first argument is the group leader
+    if (!info[0]->IsObject()) {
+        return Nan::ThrowError("First argument must be a CardReader");
+    }
+
+    CardReader* obj = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    CardReader* leader = Nan::ObjectWrap::Unwrap<CardReader>(Nan::To<Object>(info[0]).ToLocalChecked());
+    if ((leader == obj) || (leader->m_leader != leader) || !obj->m_members.empty()) {
+        return Nan::ThrowError("Groups have a single leader");
+    }
+
+    if ((obj->m_leader != obj) || obj->m_player || leader->m_player ||
+        obj->m_status_thread || obj->m_shared_monitor) {
+        return Nan::ThrowError("A reader must join its group before it's used");
+    }
+
+    obj->m_leader = leader;
+    obj->m_leader_handle.Reset(Nan::To<Object>(info[0]).ToLocalChecked());
+    uv_mutex_lock(&leader->m_mutex);
+    leader->m_members.push_back(obj);
+    uv_mutex_unlock(&leader->m_mutex);
+}
+
+NAN_METHOD(CardReader::SetRule) {
+
+    Nan::HandleScope scope;
+
+    CardReader* reader = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    std::shared_ptr<const AccessRule> rule;
+
+    // The first argument holds the rule, null removes it
+    if (info[0]->IsObject()) {
+        Local<Object> options = Nan::To<Object>(info[0]).ToLocalChecked();
+        Local<Value> control_code = Nan::Get(options, Nan::New("control_code").ToLocalChecked()).ToLocalChecked();
+        Local<Value> uids = Nan::Get(options, Nan::New("uids").ToLocalChecked()).ToLocalChecked();
+        Local<Value> initial = Nan::Get(options, Nan::New("initial").ToLocalChecked()).ToLocalChecked();
+        Local<Value> buffers[3] = {
+            Nan::Get(options, Nan::New("apdu").ToLocalChecked()).ToLocalChecked(),
+            Nan::Get(options, Nan::New("on_allow").ToLocalChecked()).ToLocalChecked(),
+            Nan::Get(options, Nan::New("on_deny").ToLocalChecked()).ToLocalChecked()
+        };
+
+        std::vector<BYTE> values[3];
+        for (int i = 0; i < 3; ++ i) {
+            if (Buffer::HasInstance(buffers[i])) {
+                const BYTE* data = reinterpret_cast<const BYTE*>(Buffer::Data(buffers[i]));
+                values[i].assign(data, data + Buffer::Length(buffers[i]));
+            } else if ((i == 0) || !buffers[i]->IsUndefined()) {
+                return Nan::ThrowError("The APDU and the commands must be Buffers");
+            }
+        }
+
+        if (values[0].size() < 4) {
+            return Nan::ThrowError("The APDU is too short");
+        }
+
+        if (!control_code->IsUint32() && !(values[1].empty() && values[2].empty())) {
+            return Nan::ThrowError("The control code must be a number");
+        }
+
+        if (!uids->IsArray()) {
+            return Nan::ThrowError("The allow list must be an array");
+        }
+
+        AccessRule* access = new AccessRule(values[0],
+                                            control_code->IsUint32() ? Nan::To<uint32_t>(control_code).FromJust() : 0,
+                                            values[1],
+                                            values[2],
+                                            Nan::To<bool>(initial).FromJust());
+        Local<Array> list = Local<Array>::Cast(uids);
+        for (uint32_t i = 0; i < list->Length(); ++ i) {
+            Local<Value> uid = Nan::Get(list, i).ToLocalChecked();
+            if (!Buffer::HasInstance(uid)) {
+                delete access;
+                return Nan::ThrowError("The allow list must hold Buffers");
+            }
+
+            access->Allow(reinterpret_cast<const BYTE*>(Buffer::Data(uid)), Buffer::Length(uid));
+        }
+
+        rule.reset(access);
+    } else if (!info[0]->IsNull() && !info[0]->IsUndefined()) {
+        return Nan::ThrowError("First argument must be an object or null");
+    }
+
+    // A rule already running keeps its own reference
+    uv_mutex_lock(&reader->m_mutex);
+    reader->m_rule = rule;
+    uv_mutex_unlock(&reader->m_mutex);
+}
+
+NAN_METHOD(CardReader::Seed) {
+
+    Nan::HandleScope scope;
+
+    CardReader* reader = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+
+    // The first argument is the state of the snapshot, the second its ATR
+    if (!info[0]->IsUint32()) {
+        return Nan::ThrowError("First argument must be an integer");
+    }
+
+    if (!info[1]->IsNull() && !info[1]->IsUndefined() &&
+        (!Buffer::HasInstance(info[1]) || (Buffer::Length(info[1]) > MAX_ATR_SIZE))) {
+        return Nan::ThrowError("Second argument must be an ATR Buffer");
+    }
+
+    // Once monitored, the monitor has the say
+    if (reader->m_state || reader->m_status_thread || reader->m_shared_monitor) {
+        return;
+    }
+
+    DWORD state = Nan::To<uint32_t>(info[0]).FromJust();
+    const uint8_t* atr = NULL;
+    size_t atrlen = 0;
+    if (Buffer::HasInstance(info[1])) {
+        atr = reinterpret_cast<const uint8_t*>(Buffer::Data(info[1]));
+        atrlen = Buffer::Length(info[1]);
+    }
+
+    StateTable::Update(reader->m_slot, state, atr, atrlen);
+    Dispatcher::Update(reader,
+                       (state & SCARD_STATE_PRESENT) && !(state & SCARD_STATE_MUTE),
+                       atr,
+                       atrlen);
+}
+
+NAN_METHOD(CardReader::SetRecovery) {
+
+    Nan::HandleScope scope;
+
+    CardReader* reader = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    RecoveryPolicy policy;
+    policy.deadline = 0;
+
+    // The first argument holds the setup APDUs and the deadline, null turns
+    // recovery off
+    if (info[0]->IsObject()) {
+        Local<Object> options = Nan::To<Object>(info[0]).ToLocalChecked();
+        Local<Value> setup = Nan::Get(options, Nan::New("setup").ToLocalChecked()).ToLocalChecked();
+        Local<Value> deadline = Nan::Get(options, Nan::New("deadline").ToLocalChecked()).ToLocalChecked();
+        if (!setup->IsArray()) {
+            return Nan::ThrowError("The setup APDUs must be an array");
+        }
+
+        if (!deadline->IsUint32() || (Nan::To<uint32_t>(deadline).FromJust() == 0)) {
+            return Nan::ThrowError("The deadline must be a positive integer");
+        }
+
+        Local<Array> list = Local<Array>::Cast(setup);
+        for (uint32_t i = 0; i < list->Length(); ++ i) {
+            Local<Value> apdu = Nan::Get(list, i).ToLocalChecked();
+            if (!Buffer::HasInstance(apdu) || (Buffer::Length(apdu) < 4)) {
+                return Nan::ThrowError("The setup APDUs must be Buffers");
+            }
+
+            const BYTE* data = reinterpret_cast<const BYTE*>(Buffer::Data(apdu));
+            policy.setup.push_back(std::vector<BYTE>(data, data + Buffer::Length(apdu)));
+        }
+
+        policy.deadline = Nan::To<uint32_t>(deadline).FromJust();
+    } else if (!info[0]->IsNull() && !info[0]->IsUndefined()) {
+        return Nan::ThrowError("First argument must be an object or null");
+    }
+
+    uv_mutex_lock(&reader->m_mutex);
+    reader->m_recovery.setup.swap(policy.setup);
+    reader->m_recovery.deadline = policy.deadline;
+    uv_mutex_unlock(&reader->m_mutex);
+}
+
+void CardReader::HandleReaderStatusChange(uv_async_t *handle, int status) {
+
+    Nan::HandleScope scope;
+
+    AsyncBaton* async_baton = static_cast<AsyncBaton*>(handle->data);
+    CardReader* reader = async_baton->reader;
+
+    bool monitored = reader->m_status_thread || reader->m_shared_monitor;
+    if (monitored) {
+        uv_mutex_lock(&reader->m_mutex);
+    }
+
+    AsyncResult ar = *async_baton->async_result;
+    // A later wake up only carries what happened since
+    async_baton->async_result->handle_lost = false;
+    async_baton->async_result->rule_run = false;
+    async_baton->async_result->status = 0;
+    int state = reader->m_state;
+
+    if (monitored) {
+        uv_mutex_unlock(&reader->m_mutex);
+    }
+
+    DeliverStatus(async_baton, ar, state);
+}
+
+void CardReader::NotifyStatus(AsyncBaton* async_baton) {
+
+    if (!EventBatch::IsEnabled(async_baton->reader->m_batch)) {
+        uv_async_send(&async_baton->async);
+        return;
+    }
+
+    // Every batched change is delivered, so post a copy the next one can't
+    // overwrite
+    CardReader* reader = async_baton->reader;
+    StatusEvent* event = new StatusEvent();
+    event->async_baton = async_baton;
+    uv_mutex_lock(&reader->m_mutex);
+    event->result = *async_baton->async_result;
+    async_baton->async_result->handle_lost = false;
+    async_baton->async_result->rule_run = false;
+    async_baton->async_result->status = 0;
+    uv_mutex_unlock(&reader->m_mutex);
+    EventBatch::Post(DeliverStatusEvent, event);
+}
+
+void CardReader::DeliverStatusEvent(void* data) {
+
+    StatusEvent* event = static_cast<StatusEvent*>(data);
+    CardReader* reader = event->async_baton->reader;
+
+    uv_mutex_lock(&reader->m_mutex);
+    int state = reader->m_state;
+    uv_mutex_unlock(&reader->m_mutex);
+
+    DeliverStatus(event->async_baton, event->result, state);
+    delete event;
+}
+
+void CardReader::DeliverStatus(AsyncBaton* async_baton, const AsyncResult& ar, int state) {
+
+    CardReader* reader = async_baton->reader;
+    Local<Function> callback = Nan::New(async_baton->callback);
+
+    PROBE_STATUS_DELIVER(reader->m_name.c_str(), ar.status, ar.result);
+    if (state == 1) {
+        // Swallow events : Listening thread was cancelled by user.
+    } else if ((ar.result == SCARD_S_SUCCESS) ||
+               (ar.result == (LONG)SCARD_E_NO_READERS_AVAILABLE) ||
+               (ar.result == (LONG)SCARD_E_UNKNOWN_READER)) { // Card reader was unplugged, it's not an error
+        // A rule finishing after its insertion was delivered comes alone,
+        // with no state
+        if ((ar.status != 0) || ar.rule_run) {
+            unsigned int argc = 3;
+            Local<Value> argv[6] = {
+                Nan::Undefined(), // argument
+                Nan::Undefined(),
+                Nan::Undefined(),
+                Nan::Undefined(),
+                Nan::Undefined(),
+                Nan::Undefined()
+            };
+
+            if (ar.status != 0) {
+                argv[1] = Nan::New<Number>(ar.status);
+                argv[2] = Nan::CopyBuffer(reinterpret_cast<const char*>(ar.atr), ar.atrlen).ToLocalChecked();
+            }
+
+            // What the access rule did with this card
+            if (ar.rule_run) {
+                Local<Object> rule = Nan::New<Object>();
+                Nan::Set(rule, Nan::New("uid").ToLocalChecked(),
+                         Nan::CopyBuffer(reinterpret_cast<const char*>(ar.rule.uid), ar.rule.uidlen).ToLocalChecked());
+                Nan::Set(rule, Nan::New("allowed").ToLocalChecked(), Nan::New<Boolean>(ar.rule.allowed));
+                Nan::Set(rule, Nan::New("sw").ToLocalChecked(), Nan::New<Number>(ar.rule.sw));
+                Nan::Set(rule, Nan::New("elapsed").ToLocalChecked(), Nan::New<Number>(ar.rule.elapsed));
+                Nan::Set(rule, Nan::New("error").ToLocalChecked(),
+                         ar.rule.result ? PCSCError::New(ar.rule.method, ar.rule.result) : Local<Value>(Nan::Null()));
+                argv[3] = rule;
+                argc = 4;
+            }
+
+            // When the monitor thread woke up, for the timeline
+            if (ar.wakeup && s_timeline.load(std::memory_order_relaxed)) {
+                argv[4] = Nan::New<Number>(ar.wakeup);
+                argc = 5;
+            }
+
+            // The reader came back within the debounce window, but its card
+            // connection didn't
+            if (ar.handle_lost) {
+                argv[5] = Nan::True();
+                argc = 6;
+            }
+
+            Dispatch(reader, "status", callback, argc, argv);
+        }
+    } else {
+        Local<Value> err = PCSCError::New("SCardGetStatusChange", ar.result);
+        // Prepare the parameters for the callback function.
+        const unsigned int argc = 1;
+        Local<Value> argv[argc] = { err };
+        Dispatch(reader, "status", callback, argc, argv);
+    }
+
+    if (ar.do_exit) {
+        uv_close(reinterpret_cast<uv_handle_t*>(&async_baton->async), CloseCallback); // necessary otherwise UV will block
+        reader->Retire();
+
+        /* Emit end event */
+        Local<Value> argv[1] = {
+            Nan::New("_end").ToLocalChecked(), // event name
+        };
+
+        if (EventBatch::IsEnabled(reader->m_batch)) {
+            // Keep it behind the status events of the same batch
+            Local<Value> emit = Nan::Get(reader->handle(), Nan::New("emit").ToLocalChecked()).ToLocalChecked();
+            EventBatch::Push(reader->m_batch, reader->handle(), "end", Local<Function>::Cast(emit), 1, argv);
+        } else {
+            Nan::MakeCallback(reader->handle(), "emit", 1, argv);
+        }
+    }
+}
+
+Local<Value> CardReader::ErrorValue(Baton* baton, const char* method, LONG result, const char* detail) {
+    if (baton->flags & OP_CODE_ONLY) {
+        return Nan::New<Number>(static_cast<uint32_t>(result));
+    }
+
+    return PCSCError::New(method, result, detail);
+}
+
+void CardReader::Dispatch(CardReader* reader,
+                          const char* type,
+                          Local<Function> callback,
+                          int argc,
+                          Local<Value> argv[]) {
+
+    if (EventBatch::IsEnabled(reader->m_batch)) {
+        EventBatch::Push(reader->m_batch, reader->handle(), type, callback, argc, argv);
+    } else {
+        Nan::Call(Nan::Callback(callback), argc, argv);
+    }
+}
+
+void CardReader::HandlerFunction(void* arg) {
+
+    AsyncBaton* async_baton = static_cast<AsyncBaton*>(arg);
+    CardReader* reader = async_baton->reader;
+    async_baton->async_result = new AsyncResult();
+    async_baton->async_result->do_exit = false;
+
+    if (reader->m_player) {
+        return ReplayStatus(async_baton);
+    }
+
+    LONG result = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &reader->m_status_card_context);
+
+    // The leader comes first, then the members that share this thread
+    std::vector<AsyncBaton*> watched(1, async_baton);
+    uv_mutex_lock(&reader->m_mutex);
+    for (size_t i = 0; i < reader->m_members.size(); ++ i) {
+        if (reader->m_members[i]->m_shared_baton) {
+            watched.push_back(reader->m_members[i]->m_shared_baton);
+        }
+    }
+
+    uv_mutex_unlock(&reader->m_mutex);
+
+    std::vector<SCARD_READERSTATE> states(watched.size());
+    for (size_t i = 0; i < watched.size(); ++ i) {
+        CardReader* member = watched[i]->reader;
+        states[i] = SCARD_READERSTATE();
+        states[i].szReader = member->m_name.c_str();
+        states[i].dwCurrentState = SCARD_STATE_UNAWARE;
+        if (member != reader) {
+            // Cancelling a member interrupts the shared wait
+            uv_mutex_lock(&member->m_mutex);
+            member->m_status_card_context = reader->m_status_card_context;
+            uv_mutex_unlock(&member->m_mutex);
+        }
+    }
+
+    while (!watched.empty()) {
+
+        // A reader closed before the wait started may have missed its cancel
+        bool closing = false;
+        for (size_t i = 0; i < watched.size(); ++ i) {
+            CardReader* member = watched[i]->reader;
+            uv_mutex_lock(&member->m_mutex);
+            closing = closing || (member->m_state != 0);
+            uv_mutex_unlock(&member->m_mutex);
+            states[i].dwEventState = states[i].dwCurrentState & ~SCARD_STATE_CHANGED;
+        }
+
+        if (closing) {
+            result = SCARD_E_CANCELLED;
+        } else {
+            result = SCardGetStatusChange(reader->m_status_card_context, INFINITE, &states[0], states.size());
+        }
+
+        PROBE_STATUS_WAKEUP(reader->m_name.c_str(), result);
+
+        // pcscd went away: wait for it with a new context and watch again
+        // from the last known states, so whatever changed meanwhile is
+        // reported once
+        if (reader->m_recover && service_lost(result) && reader->RecoverMonitor(watched)) {
+            for (size_t i = 0; i < states.size(); ++ i) {
+                states[i].dwCurrentState &= 0xFFFF & ~SCARD_STATE_CHANGED;
+            }
+
+            continue;
+        }
+
+        // With several readers in the wait, a missing one makes the whole call
+        // fail: find out which, so the rest of the group keeps going
+        std::vector<LONG> results(watched.size(), result);
+        if ((result == (LONG)SCARD_E_UNKNOWN_READER) && (watched.size() > 1)) {
+            for (size_t i = 0; i < watched.size(); ++ i) {
+                SCARD_READERSTATE probe = states[i];
+                LONG probed = SCardGetStatusChange(reader->m_status_card_context, 0, &probe, 1);
+                if ((probed == SCARD_S_SUCCESS) || (probed == (LONG)SCARD_E_TIMEOUT)) {
+                    results[i] = SCARD_S_SUCCESS;
+                }
+            }
+        }
+
+        bool cancelled = (result == (LONG)SCARD_E_CANCELLED);
+        for (size_t i = 0; i < watched.size(); ) {
+            CardReader* member = watched[i]->reader;
+            if (!cancelled) {
+                member->CheckSession(&states[i], results[i]);
+            }
+
+            uv_mutex_lock(&member->m_mutex);
+            bool member_closing = (member->m_state != 0);
+            uv_mutex_unlock(&member->m_mutex);
+
+            // A cancel only concerns the readers being closed and, in a
+            // group, the untouched readers have nothing to report
+            bool changed = member_closing ||
+                           (!cancelled &&
+                            ((watched.size() == 1) ||
+                             (results[i] != SCARD_S_SUCCESS) ||
+                             (states[i].dwEventState & SCARD_STATE_CHANGED)));
+            if (changed && !member->UpdateStatus(watched[i], &states[i], results[i])) {
+                member->EndMonitor();
+                watched.erase(watched.begin() + i);
+                states.erase(states.begin() + i);
+            } else {
+                ++ i;
+            }
+        }
+    }
+
+    // Exit flag set in keepwatching and handled in following uv_async_send
+
+    // The members may outlive their leader in the wait, so the context goes
+    // with the thread rather than with the leader's monitor
+    SCardReleaseContext(reader->m_status_card_context);
+}
+
+bool CardReader::RecoverMonitor(const std::vector<AsyncBaton*>& watched) {
+
+    uint32_t delay = RECOVER_MIN_DELAY;
+    for (;;) {
+        // Sleep in slices so closing a reader isn't held by the backoff
+        for (uint32_t slept = 0; slept < delay; slept += 20) {
+            for (size_t i = 0; i < watched.size(); ++ i) {
+                CardReader* member = watched[i]->reader;
+                uv_mutex_lock(&member->m_mutex);
+                bool closing = (member->m_state != 0);
+                uv_mutex_unlock(&member->m_mutex);
+                if (closing) {
+                    return false;
+                }
+            }
+
+            Sleep(20);
+        }
+
+        SCARDCONTEXT context;
+        if (SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &context) == SCARD_S_SUCCESS) {
+            // The leader may have left the wait already, the wait still runs
+            // on its context
+            uv_mutex_lock(&m_mutex);
+            SCARDCONTEXT stale = m_status_card_context;
+            m_status_card_context = context;
+            uv_mutex_unlock(&m_mutex);
+            for (size_t i = 0; i < watched.size(); ++ i) {
+                CardReader* member = watched[i]->reader;
+                uv_mutex_lock(&member->m_mutex);
+                member->m_status_card_context = context;
+                ++ member->m_recoveries;
+                uv_mutex_unlock(&member->m_mutex);
+            }
+
+            SCardReleaseContext(stale);
+            return true;
+        }
+
+        delay = delay * 2 < m_recover ? delay * 2 : m_recover;
+    }
+}
+
+bool CardReader::UpdateStatus(AsyncBaton* async_baton, SCARD_READERSTATE* state, LONG result) {
+
+    uint64_t now = uv_hrtime();
+    m_recorder.Record(TRACE_STATUS, result, state->dwEventState, now, now,
+                      NULL, 0, state->rgbAtr, state->cbAtr);
+
+    // The reader is gone: if it comes back within the debounce window keep
+    // this thread and context, and re-sync against the last known state
+    if (m_debounce && !m_state &&
+        ((result == (LONG)SCARD_E_UNKNOWN_READER) ||
+         ((result == SCARD_S_SUCCESS) && (state->dwEventState & SCARD_STATE_UNKNOWN)))) {
+        if (WaitReaderBack()) {
+            // The connection didn't survive: report the state afresh, with
+            // the news
+            uv_mutex_lock(&m_mutex);
+            if (m_handle_lost) {
+                state->dwCurrentState = SCARD_STATE_UNAWARE;
+            }
+
+            uv_mutex_unlock(&m_mutex);
+            return true;
+        }
+
+        result = SCARD_E_UNKNOWN_READER;
+    }
+
+    // The state table sees every change, filtered or not
+    StateTable::Update(m_slot,
+                       result == SCARD_S_SUCCESS ? state->dwEventState : SCARD_STATE_UNAVAILABLE,
+                       state->rgbAtr,
+                       result == SCARD_S_SUCCESS ? state->cbAtr : 0);
+    Dispatcher::Update(this,
+                       (result == SCARD_S_SUCCESS) &&
+                       (state->dwEventState & SCARD_STATE_PRESENT) &&
+                       !(state->dwEventState & SCARD_STATE_MUTE),
+                       state->rgbAtr,
+                       state->cbAtr);
+
+    uv_mutex_lock(&m_mutex);
+    CheckParked(result, state->dwEventState, state->rgbAtr, state->cbAtr);
+    if (m_state == 1) {
+        // Exit requested by user. Notify close method about SCardStatusChange was interrupted.
+        uv_cond_signal(&m_cond);
+    } else if (result != (LONG)SCARD_S_SUCCESS) {
+        // Exit this loop due to errors
+        m_state = 2;
+    }
+
+    // Filtered events don't touch the pending result nor wake up the loop
+    bool deliver = (m_state != 0) ||
+                   FilterStatus(result,
+                                state->dwCurrentState,
+                                state->dwEventState,
+                                state->rgbAtr,
+                                state->cbAtr);
+
+    // Only for the cards that got through the filters
+    if (deliver && !m_state) {
+        StartRule(async_baton, state, result);
+    }
+
+    if (deliver) {
+        // Sticky until JS hears about it, events may coalesce
+        async_baton->async_result->handle_lost |= m_handle_lost;
+        m_handle_lost = false;
+        async_baton->async_result->do_exit = (m_state != 0);
+        async_baton->async_result->result = result;
+        async_baton->async_result->wakeup = now / 1e6;
+        if (state->dwEventState == state->dwCurrentState) {
+            async_baton->async_result->status = 0;
+        } else {
+            async_baton->async_result->status = state->dwEventState;
+        }
+        memcpy(async_baton->async_result->atr, state->rgbAtr, state->cbAtr);
+        async_baton->async_result->atrlen = state->cbAtr;
+    }
+
+    bool done = (m_state != 0);
+    uv_mutex_unlock(&m_mutex);
+
+    // A rule still running reports to the async handle the last event closes
+    if (done) {
+        JoinRule();
+    }
+
+    if (deliver) {
+        NotifyStatus(async_baton);
+    }
+
+    state->dwCurrentState = state->dwEventState;
+    return !done;
+}
+
+DWORD CardReader::BuildApdu(const TransmitInput* ti, BYTE p1) {
+
+    // The caller holds m_mutex
+    const ApduTemplate* tpl = ti->apdu_template;
+    const BYTE* data = tpl->data.empty() ? NULL : &tpl->data[0];
+    DWORD data_len = tpl->data.size();
+    if (tpl->mask & ApduTemplate::DATA) {
+        data = ti->in_data;
+        data_len = ti->in_len;
+    }
+
+    BYTE* apdu = &m_apdu[0];
+    memcpy(apdu, tpl->header, sizeof(tpl->header));
+    if (tpl->mask & ApduTemplate::P1) {
+        apdu[2] = p1;
+    }
+
+    if (tpl->mask & ApduTemplate::P2) {
+        apdu[3] = ti->p2;
+    }
+
+    DWORD len = sizeof(tpl->header);
+    if (data_len) {
+        apdu[len ++] = static_cast<BYTE>(data_len);
+        memcpy(apdu + len, data, data_len);
+        len += data_len;
+    }
+
+    if (tpl->mask & ApduTemplate::LE) {
+        apdu[len ++] = ti->le;
+    } else if (tpl->has_le) {
+        apdu[len ++] = tpl->le;
+    }
+
+    return len;
+}
+
+void CardReader::Retire() {
+
+    // The monitor is done with the slot and the jobs can't use the reader
+    // anymore. A new reader can take the slot while this one waits for the
+    // garbage collector.
+    Dispatcher::RemoveReader(this);
+    StateTable::Release(m_slot);
+    m_slot = -1;
+    Nan::Set(handle(), Nan::New("slot").ToLocalChecked(), Nan::New(m_slot));
+}
+
+void CardReader::StartRule(AsyncBaton* async_baton, const SCARD_READERSTATE* state, LONG result) {
+
+    // The caller holds m_mutex. Only on card insertions, and on the card
+    // found by the first wait if the rule asks for it.
+    if (!m_rule ||
+        (result != SCARD_S_SUCCESS) ||
+        !(state->dwEventState & SCARD_STATE_PRESENT) ||
+        (state->dwEventState & SCARD_STATE_MUTE) ||
+        (state->dwCurrentState & SCARD_STATE_PRESENT) ||
+        ((state->dwCurrentState == SCARD_STATE_UNAWARE) && !m_rule->Initial())) {
+        return;
+    }
+
+    // A card swapped while the last one is still handled is left alone
+    if (m_rule_running) {
+        return;
+    }
+
+    // Done with everything but returning
+    if (m_rule_started) {
+        assert(uv_thread_join(&m_rule_thread) == 0);
+        m_rule_started = false;
+    }
+
+    RuleTask* task = new RuleTask();
+    task->reader = this;
+    task->async_baton = async_baton;
+    task->rule = m_rule;
+    m_rule_running = true;
+    if (uv_thread_create(&m_rule_thread, RuleFunction, task) != 0) {
+        m_rule_running = false;
+        delete task;
+        return;
+    }
+
+    m_rule_started = true;
+}
+
+void CardReader::RuleFunction(void* arg) {
+
+    RuleTask* task = static_cast<RuleTask*>(arg);
+    CardReader* reader = task->reader;
+    AccessRule::Outcome outcome;
+
+    // The queued operations of the reader (or its group) wait meanwhile. The
+    // rule has a PC/SC context of its own, released when it's done.
+    uv_mutex_lock(&reader->m_leader->m_io_mutex);
+    if (reader->m_player) {
+        ReplayChannel channel(reader);
+        task->rule->Run(&channel, &outcome);
+    } else {
+        AccessRule::PCSCChannel channel(reader->m_name.c_str());
+        task->rule->Run(&channel, &outcome);
+    }
+
+    uv_mutex_unlock(&reader->m_leader->m_io_mutex);
+
+    // JS always hears about the rules that ran, unless the reader is closing
+    uv_mutex_lock(&reader->m_mutex);
+    ++ reader->m_rules_run;
+    reader->m_rules_allowed += outcome.allowed;
+    bool notify = !reader->m_state;
+    if (notify) {
+        task->async_baton->async_result->rule_run = true;
+        task->async_baton->async_result->rule = outcome;
+    }
+
+    uv_mutex_unlock(&reader->m_mutex);
+    if (notify) {
+        NotifyStatus(task->async_baton);
+    }
+
+    uv_mutex_lock(&reader->m_mutex);
+    reader->m_rule_running = false;
+    uv_mutex_unlock(&reader->m_mutex);
+    delete task;
+}
+
+LONG CardReader::ReplayChannel::Connect(DWORD* protocol, const char** method) {
+
+    BYTE data[4] = { 0 };
+    DWORD len = sizeof(data);
+    *method = "SCardConnect";
+    LONG result = m_reader->ReplayOperation(TRACE_CONNECT, data, &len);
+    *protocol = data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
+    return result;
+}
+
+LONG CardReader::ReplayChannel::Transmit(DWORD protocol, const BYTE* in, DWORD in_len, LPBYTE out, DWORD* out_len) {
+    return m_reader->ReplayOperation(TRACE_TRANSMIT, out, out_len);
+}
+
+LONG CardReader::ReplayChannel::Control(DWORD control_code,
+                                        const BYTE* in,
+                                        DWORD in_len,
+                                        LPBYTE out,
+                                        DWORD out_size,
+                                        DWORD* out_len) {
+    *out_len = out_size;
+    return m_reader->ReplayOperation(TRACE_CONTROL, out, out_len);
+}
+
+void CardReader::JoinRule() {
+
+    if (m_rule_started) {
+        assert(uv_thread_join(&m_rule_thread) == 0);
+        m_rule_started = false;
+    }
+}
+
+void CardReader::EndMonitor() {
+
+    uv_mutex_lock(&m_mutex);
+    m_monitor_running = false;
+    uv_cond_signal(&m_cond);
+    uv_mutex_unlock(&m_mutex);
+}
+
+void CardReader::ReplayStatus(AsyncBaton* async_baton) {
+
+    CardReader* reader = async_baton->reader;
+    AsyncResult* ar = async_baton->async_result;
+    const TraceEntry* prev = NULL;
+    const TraceEntry* entry;
+
+    DWORD current = SCARD_STATE_UNAWARE;
+    while (!reader->m_state && ((entry = reader->m_player->Next(TRACE_STATUS)) != NULL)) {
+        reader->m_player->WaitGap(prev, entry);
+        prev = entry;
+
+        StateTable::Update(reader->m_slot,
+                           entry->arg,
+                           entry->out.empty() ? NULL : &entry->out[0],
+                           entry->out.size() < MAX_ATR_SIZE ? entry->out.size() : MAX_ATR_SIZE);
+        SCARD_READERSTATE state;
+        memset(&state, 0, sizeof(state));
+        state.dwCurrentState = current;
+        state.dwEventState = entry->arg;
+        state.cbAtr = entry->out.size() < MAX_ATR_SIZE ? entry->out.size() : MAX_ATR_SIZE;
+        if (state.cbAtr) {
+            memcpy(state.rgbAtr, &entry->out[0], state.cbAtr);
+        }
+
+        reader->CheckSession(&state, entry->result);
+        uv_mutex_lock(&reader->m_mutex);
+        bool deliver = !reader->m_state &&
+                       reader->FilterStatus(entry->result,
+                                            current,
+                                            entry->arg,
+                                            entry->out.empty() ? NULL : &entry->out[0],
+                                            entry->out.size());
+        if (deliver) {
+            reader->StartRule(async_baton, &state, entry->result);
+        }
+
+        current = entry->arg;
+        if (deliver) {
+            ar->result = entry->result;
+            ar->status = entry->arg;
+            ar->atrlen = entry->out.size() < MAX_ATR_SIZE ? entry->out.size() : MAX_ATR_SIZE;
+            if (ar->atrlen) {
+                memcpy(ar->atr, &entry->out[0], ar->atrlen);
+            }
+        }
+
+        uv_mutex_unlock(&reader->m_mutex);
+        if (deliver) {
+            NotifyStatus(async_baton);
+        }
+    }
+
+    // Keep the reader alive until closed, as a real one would be
+    reader->m_player->WaitCancel();
+    reader->JoinRule();
+
+    uv_mutex_lock(&reader->m_mutex);
+    reader->m_monitor_running = false;
+    uv_cond_signal(&reader->m_cond);
+    ar->do_exit = true;
+    ar->status = 0;
+    uv_mutex_unlock(&reader->m_mutex);
+    NotifyStatus(async_baton);
+}
+
+void CardReader::DoConnect(uv_work_t* req) {
+
+    Baton* baton = static_cast<Baton*>(req->data);
+    ConnectInput *ci = static_cast<ConnectInput*>(baton->input);
+
+    DWORD card_protocol;
+    LONG result = SCARD_S_SUCCESS;
+    CardReader* obj = baton->reader;
+
+    if (obj->m_player) {
+        BYTE protocol[4] = { 0 };
+        DWORD len = sizeof(protocol);
+        result = obj->ReplayOperation(TRACE_CONNECT, protocol, &len);
+        if (result == SCARD_S_SUCCESS) {
+            uv_mutex_lock(&obj->m_mutex);
+            obj->m_session_lost = false;
+            obj->m_recovery_failed = false;
+            uv_mutex_unlock(&obj->m_mutex);
+        }
+
+        ConnectResult *cr = new ConnectResult();
+        cr->result = result;
+        cr->card_protocol = protocol[0] | (protocol[1] << 8) | (protocol[2] << 16) | (protocol[3] << 24);
+        baton->result = cr;
+        return;
+    }
+
+    uint64_t start = uv_hrtime();
+    /* Lock mutex */
+    uv_mutex_lock(&obj->m_mutex);
+    /* Is the last connection still good */
+    if (obj->m_parked && obj->ReuseParked(ci->share_mode, ci->pref_protocol)) {
+        card_protocol = obj->m_card_protocol;
+    } else {
+        /* Is context established */
+        if (!obj->m_card_context) {
+            result = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &obj->m_card_context);
+        }
+
+        /* Connect */
+        if (result == SCARD_S_SUCCESS) {
+            result = SCardConnect(obj->m_card_context,
+                                  obj->m_name.c_str(),
+                                  ci->share_mode,
+                                  ci->pref_protocol,
+                                  &obj->m_card_handle,
+                                  &card_protocol);
+        }
+
+        /* pcscd restarted since the context was established: retry once with a new one */
+        if (obj->m_recover && service_lost(result)) {
+            SCardReleaseContext(obj->m_card_context);
+            obj->m_card_context = 0;
+            result = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &obj->m_card_context);
+            if (result == SCARD_S_SUCCESS) {
+                result = SCardConnect(obj->m_card_context,
+                                      obj->m_name.c_str(),
+                                      ci->share_mode,
+                                      ci->pref_protocol,
+                                      &obj->m_card_handle,
+                                      &card_protocol);
+            } else {
+                obj->m_card_context = 0;
+            }
+        }
+
+        if (result == SCARD_S_SUCCESS) {
+            obj->m_card_protocol = card_protocol;
+            obj->m_pref_protocol = ci->pref_protocol;
+            obj->m_share_mode = ci->share_mode;
+            ++ obj->m_connections_opened;
+            // Remember the card the connection is for, to park it or to
+            // recover it
+            DWORD state, protocol;
+            DWORD name_len = 0;
+            obj->m_atrlen = MAX_ATR_SIZE;
+            if (SCardStatus(obj->m_card_handle, NULL, &name_len, &state, &protocol,
+                            obj->m_atr, &obj->m_atrlen) != SCARD_S_SUCCESS) {
+                obj->m_atrlen = 0;
+            }
+        }
+    }
+
+    /* A new session, whether the connection is new or reused */
+    if (result == SCARD_S_SUCCESS) {
+        obj->m_session_lost = false;
+        obj->m_recovery_failed = false;
+    }
+
+    /* Unlock the mutex */
+    uv_mutex_unlock(&obj->m_mutex);
+
+    ConnectResult *cr = new ConnectResult();
+    cr->result = result;
+    if (!result) {
+        cr->card_protocol = card_protocol;
+    }
+
+    if (obj->m_recorder.IsActive()) {
+        BYTE protocol[4] = { 0 };
+        if (!result) {
+            protocol[0] = card_protocol & 0xff;
+            protocol[1] = (card_protocol >> 8) & 0xff;
+            protocol[2] = (card_protocol >> 16) & 0xff;
+            protocol[3] = (card_protocol >> 24) & 0xff;
+        }
+
+        obj->m_recorder.Record(TRACE_CONNECT, result, ci->share_mode, start, uv_hrtime(),
+                               NULL, 0, protocol, sizeof(protocol));
+    }
+
+    baton->result = cr;
+}
+
+void CardReader::AfterConnect(uv_work_t* req, int status) {
+
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+    ConnectInput *ci = static_cast<ConnectInput*>(baton->input);
+    ConnectResult *cr = static_cast<ConnectResult*>(baton->result);
+
+    if (cr->result) {
+        Local<Value> err = ErrorValue(baton, "SCardConnect", cr->result);
+        // Prepare the parameters for the callback function.
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { err };
+        Dispatch(baton->reader, "connect", Nan::New(baton->callback), argc, argv);
+    } else {
+        Nan::Set(baton->reader->handle(), Nan::New(connected_symbol), Nan::True());
+        Dispatcher::SetConnected(baton->reader, true);
+        const unsigned argc = 2;
+        Local<Value> argv[argc] = {
+            Nan::Null(),
+            Nan::New<Number>(cr->card_protocol)
+        };
+
+        Dispatch(baton->reader, "connect", Nan::New(baton->callback), argc, argv);
+    }
+
+    // The callback is a permanent handle, so we have to dispose of it manually.
+    baton->callback.Reset();
+    delete ci;
+    delete cr;
+    delete baton;
+}
+
+void CardReader::DoDisconnect(uv_work_t* req) {
+
+    Baton* baton = static_cast<Baton*>(req->data);
+    DisconnectInput* di = static_cast<DisconnectInput*>(baton->input);
+
+    LONG result = SCARD_S_SUCCESS;
+    CardReader* obj = baton->reader;
+
+    if (obj->m_player) {
+        DWORD len = 0;
+        result = obj->ReplayOperation(TRACE_DISCONNECT, NULL, &len);
+        baton->result = reinterpret_cast<void*>(new LONG(result));
+        return;
+    }
+
+    uint64_t start = uv_hrtime();
+    /* Lock mutex */
+    uv_mutex_lock(&obj->m_mutex);
+    /* Connect */
+    if (obj->m_card_handle && !obj->m_parked) {
+        if (obj->m_keep_alive && !di->release && obj->m_atrlen) {
+            // Keep the card powered and the handle around for the next connect
+            obj->m_parked = true;
+            obj->m_parked_disposition = di->disposition;
+        } else {
+            result = SCardDisconnect(obj->m_card_handle, di->disposition);
+            if (result == SCARD_S_SUCCESS) {
+                obj->m_card_handle = 0;
+            }
+        }
+
+        if (result == SCARD_S_SUCCESS) {
+            // The secure messaging session doesn't outlive the connection
+            delete obj->m_wrapper;
+            obj->m_wrapper = NULL;
+        }
+    } else if (obj->m_parked && di->release) {
+        obj->m_parked_disposition = di->disposition;
+        obj->ReleaseParked();
+    }
+
+    /* Unlock the mutex */
+    uv_mutex_unlock(&obj->m_mutex);
+
+    obj->m_recorder.Record(TRACE_DISCONNECT, result, di->disposition, start, uv_hrtime(),
+                           NULL, 0, NULL, 0);
+
+    baton->result = reinterpret_cast<void*>(new LONG(result));
+}
+
+void CardReader::AfterDisconnect(uv_work_t* req, int status) {
+
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+    LONG* result = reinterpret_cast<LONG*>(baton->result);
+
+    if (*result) {
+        Local<Value> err = ErrorValue(baton, "SCardDisconnect", *result);
+
+        // Prepare the parameters for the callback function.
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { err };
+        Dispatch(baton->reader, "disconnect", Nan::New(baton->callback), argc, argv);
+    } else {
+        Nan::Set(baton->reader->handle(), Nan::New(connected_symbol), Nan::False());
+        Dispatcher::SetConnected(baton->reader, false);
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = {
+            Nan::Null()
+        };
+
+        Dispatch(baton->reader, "disconnect", Nan::New(baton->callback), argc, argv);
+    }
+
+    // The callback is a permanent handle, so we have to dispose of it manually.
+    baton->callback.Reset();
+    DisconnectInput* di = static_cast<DisconnectInput*>(baton->input);
+    delete di;
+    delete result;
+    delete baton;
+}
+
+void CardReader::DoTransmit(uv_work_t* req) {
+
+    Baton* baton = static_cast<Baton*>(req->data);
+    TransmitInput *ti = static_cast<TransmitInput*>(baton->input);
+    CardReader* obj = baton->reader;
+
+    TransmitResult *tr = new TransmitResult();
+    tr->data = new unsigned char[ti->out_len];
+    tr->len = ti->out_len;
+    tr->wrap_error = NULL;
+
+    /* Lock mutex */
+    uv_mutex_lock(&obj->m_mutex);
+    PROBE_TRANSMIT_LOCKED(obj->m_name.c_str(), baton, ti->in_len);
+    if (ti->queued) {
+        tr->locked = timeline_now();
+    }
+
+    const BYTE* in = ti->in_data;
+    DWORD in_len = ti->in_len;
+    if (ti->apdu_template) {
+        in_len = obj->BuildApdu(ti, ti->p1);
+        in = &obj->m_apdu[0];
+    }
+
+    if (ti->queued) {
+        tr->start = timeline_now();
+    }
+
+    // Secure messaging runs here too, so the main thread only sees plaintext
+    if (obj->m_wrapper && !ti->plain) {
+        tr->result = obj->TransmitWrapped(ti->card_protocol, in, in_len,
+                                          tr->data, &tr->len, &tr->wrap_error);
+    } else {
+        tr->result = obj->TransmitApdu(ti->card_protocol, in, in_len,
+                                       tr->data, &tr->len);
+    }
+
+    if (ti->queued) {
+        tr->end = timeline_now();
+    }
+
+    /* Unlock the mutex */
+    uv_mutex_unlock(&obj->m_mutex);
+
+    baton->result = tr;
+}
+
+void CardReader::AfterTransmit(uv_work_t* req, int status) {
+
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+    TransmitInput *ti = static_cast<TransmitInput*>(baton->input);
+    TransmitResult *tr = static_cast<TransmitResult*>(baton->result);
+
+    PROBE_TRANSMIT_DISPATCH(baton->reader->m_name.c_str(), baton, tr->result);
+    Local<Value> argv[3];
+    unsigned argc;
+    if (tr->result) {
+        // Prepare the parameters for the callback function.
+        argv[0] = ErrorValue(baton, "SCardTransmit", tr->result);
+        argv[1] = Nan::Undefined();
+        argc = 1;
+    } else if (tr->wrap_error) {
+        argv[0] = ErrorValue(baton, "SecureMessaging", SCARD_W_SECURITY_VIOLATION, tr->wrap_error);
+        argv[1] = Nan::Undefined();
+        argc = 1;
+    } else {
+        argv[0] = Nan::Null();
+        argv[1] = Nan::CopyBuffer(reinterpret_cast<char*>(tr->data), tr->len).ToLocalChecked();
+        argc = 2;
+    }
+
+    // With the timeline on, the callback also gets when the operation was
+    // queued, got the reader and was done
+    if (ti->queued) {
+        Local<Array> timings = Nan::New<Array>(4);
+        Nan::Set(timings, 0, Nan::New<Number>(ti->queued));
+        Nan::Set(timings, 1, Nan::New<Number>(tr->locked));
+        Nan::Set(timings, 2, Nan::New<Number>(tr->start));
+        Nan::Set(timings, 3, Nan::New<Number>(tr->end));
+        argv[2] = timings;
+        argc = 3;
+    }
+
+    Dispatch(baton->reader, "transmit", Nan::New(baton->callback), argc, argv);
+
+    // The callback is a permanent handle, so we have to dispose of it manually.
+    baton->callback.Reset();
+    delete [] ti->in_data;
+    delete ti;
+    delete [] tr->data;
+    delete tr;
+    delete baton;
+}
+
+void CardReader::DoSweep(uv_work_t* req) {
+
+    Baton* baton = static_cast<Baton*>(req->data);
+    SweepInput* si = static_cast<SweepInput*>(baton->input);
+    const TransmitInput* ti = &si->transmit;
+    CardReader* obj = baton->reader;
+
+    // A single buffer for all the responses
+    SweepResult* sr = new SweepResult();
+    sr->result = SCARD_S_SUCCESS;
+    sr->wrap_error = NULL;
+    sr->data.resize((si->last - si->first + 1) * ti->out_len);
+    sr->lengths.reserve(si->last - si->first + 1);
+
+    DWORD offset = 0;
+    uv_mutex_lock(&obj->m_mutex);
+    for (DWORD p1 = si->first; p1 <= si->last; ++ p1) {
+        DWORD in_len = obj->BuildApdu(ti, static_cast<BYTE>(p1));
+        LPBYTE out = &sr->data[offset];
+        DWORD len = ti->out_len;
+        if (obj->m_wrapper && !ti->plain) {
+            sr->result = obj->TransmitWrapped(ti->card_protocol, &obj->m_apdu[0], in_len,
+                                              out, &len, &sr->wrap_error);
+        } else {
+            sr->result = obj->TransmitApdu(ti->card_protocol, &obj->m_apdu[0], in_len, out, &len);
+        }
+
+        if (sr->result || sr->wrap_error) {
+            break;
+        }
+
+        sr->lengths.push_back(len);
+        offset += len;
+        if ((len < 2) || (out[len - 2] != 0x90) || (out[len - 1] != 0x00)) {
+            break;
+        }
+    }
+
+    uv_mutex_unlock(&obj->m_mutex);
+
+    sr->data.resize(offset);
+    baton->result = sr;
+}
+
+void CardReader::AfterSweep(uv_work_t* req, int status) {
+
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+    SweepInput* si = static_cast<SweepInput*>(baton->input);
+    SweepResult* sr = static_cast<SweepResult*>(baton->result);
+
+    if (sr->result) {
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { ErrorValue(baton, "SCardTransmit", sr->result) };
+        Dispatch(baton->reader, "transmit_sweep", Nan::New(baton->callback), argc, argv);
+    } else if (sr->wrap_error) {
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { ErrorValue(baton, "SecureMessaging", SCARD_W_SECURITY_VIOLATION, sr->wrap_error) };
+        Dispatch(baton->reader, "transmit_sweep", Nan::New(baton->callback), argc, argv);
+    } else {
+        // The responses go back as one Buffer and their lengths
+        Local<Array> lengths = Nan::New<Array>(sr->lengths.size());
+        for (size_t i = 0; i < sr->lengths.size(); ++ i) {
+            Nan::Set(lengths, i, Nan::New<Number>(sr->lengths[i]));
+        }
+
+        const unsigned argc = 3;
+        Local<Value> argv[argc] = {
+            Nan::Null(),
+            Nan::CopyBuffer(reinterpret_cast<const char*>(sr->data.empty() ? NULL : &sr->data[0]),
+                            sr->data.size()).ToLocalChecked(),
+            lengths
+        };
+
+        Dispatch(baton->reader, "transmit_sweep", Nan::New(baton->callback), argc, argv);
+    }
+
+    baton->callback.Reset();
+    delete [] si->transmit.in_data;
+    delete si;
+    delete sr;
+    delete baton;
+}
+
+void CardReader::DoChained(uv_work_t* req) {
+
+    Baton* baton = static_cast<Baton*>(req->data);
+    ChainInput* ci = static_cast<ChainInput*>(baton->input);
+    CardReader* obj = baton->reader;
+
+    ChainResult* cr = new ChainResult();
+    cr->result = SCARD_S_SUCCESS;
+    cr->wrap_error = NULL;
+    cr->sent = 0;
+    cr->aborted = false;
+    baton->result = cr;
+
+    // With ENVELOPE, what gets split is the whole command, extended length
+    // if it doesn't fit a short one
+    std::vector<BYTE> envelope;
+    const std::vector<BYTE>* payload = &ci->data;
+    if (ci->envelope) {
+        bool extended = ci->data.size() > 255;
+        envelope.assign(ci->header, ci->header + sizeof(ci->header));
+        if (!ci->data.empty()) {
+            if (extended) {
+                envelope.push_back(0x00);
+                envelope.push_back(static_cast<BYTE>(ci->data.size() >> 8));
+            }
+
+            envelope.push_back(static_cast<BYTE>(ci->data.size()));
+            envelope.insert(envelope.end(), ci->data.begin(), ci->data.end());
+        }
+
+        if (ci->le >= 0) {
+            if (extended) {
+                if (ci->data.empty()) {
+                    envelope.push_back(0x00);
+                }
+
+                envelope.push_back(static_cast<BYTE>(ci->le >> 8));
+            }
+
+            envelope.push_back(static_cast<BYTE>(ci->le));
+        }
+
+        payload = &envelope;
+    }
+
+    std::vector<BYTE> out(ci->out_len);
+    size_t offset = 0;
+    bool last = false;
+    uv_mutex_lock(&obj->m_mutex);
+    do {
+        size_t len = payload->size() - offset;
+        if (len > ci->chunk) {
+            len = ci->chunk;
+        }
+
+        // An empty ENVELOPE tells the card the command is complete, and gets
+        // its response
+        bool terminator = ci->envelope && (offset == payload->size());
+        last = terminator || (!ci->envelope && (offset + len == payload->size()));
+        BYTE* apdu = &obj->m_apdu[0];
+        if (ci->envelope) {
+            apdu[0] = ci->header[0];
+            apdu[1] = 0xC2;
+            apdu[2] = 0x00;
+            apdu[3] = 0x00;
+        } else {
+            memcpy(apdu, ci->header, sizeof(ci->header));
+            if (!last) {
+                apdu[0] |= 0x10;
+            }
+        }
+
+        DWORD apdu_len = 4;
+        if (len) {
+            apdu[apdu_len ++] = static_cast<BYTE>(len);
+            memcpy(apdu + apdu_len, &(*payload)[offset], len);
+            apdu_len += len;
+        }
+
+        if (terminator) {
+            apdu[apdu_len ++] = 0x00;
+        } else if (last && (ci->le >= 0)) {
+            apdu[apdu_len ++] = static_cast<BYTE>(ci->le);
+        }
+
+        DWORD out_len = out.size();
+        if (obj->m_wrapper && !ci->plain) {
+            cr->result = obj->TransmitWrapped(ci->card_protocol, apdu, apdu_len,
+                                              out.empty() ? NULL : &out[0], &out_len, &cr->wrap_error);
+        } else {
+            cr->result = obj->TransmitApdu(ci->card_protocol, apdu, apdu_len,
+                                           out.empty() ? NULL : &out[0], &out_len);
+        }
+
+        ++ cr->sent;
+        offset += len;
+        if (cr->result || cr->wrap_error) {
+            break;
+        }
+
+        cr->response.assign(out.begin(), out.begin() + out_len);
+        if (!last && ((out_len != 2) || (out[0] != 0x90) || (out[1] != 0x00))) {
+            cr->aborted = true;
+            break;
+        }
+    } while (!last);
+
+    uv_mutex_unlock(&obj->m_mutex);
+}
+
+void CardReader::AfterChained(uv_work_t* req, int status) {
+
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+    ChainInput* ci = static_cast<ChainInput*>(baton->input);
+    ChainResult* cr = static_cast<ChainResult*>(baton->result);
+
+    Local<Value> response = Nan::CopyBuffer(reinterpret_cast<const char*>(cr->response.empty() ? NULL : &cr->response[0]),
+                                            cr->response.size()).ToLocalChecked();
+    if (cr->result) {
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { ErrorValue(baton, "SCardTransmit", cr->result) };
+        Dispatch(baton->reader, "transmit_chained", Nan::New(baton->callback), argc, argv);
+    } else if (cr->wrap_error) {
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { ErrorValue(baton, "SecureMessaging", SCARD_W_SECURITY_VIOLATION, cr->wrap_error) };
+        Dispatch(baton->reader, "transmit_chained", Nan::New(baton->callback), argc, argv);
+    } else if (cr->aborted) {
+        // The card refused a chunk: the error tells which, with its response
+        Local<Value> err = ErrorValue(baton, "SCardTransmit", SCARD_E_UNEXPECTED, "chained command refused by the card");
+        if (!(baton->flags & OP_CODE_ONLY)) {
+            Nan::Set(Nan::To<Object>(err).ToLocalChecked(),
+                     Nan::New("index").ToLocalChecked(),
+                     Nan::New<Number>(cr->sent - 1));
+        }
+
+        const unsigned argc = 2;
+        Local<Value> argv[argc] = { err, response };
+        Dispatch(baton->reader, "transmit_chained", Nan::New(baton->callback), argc, argv);
+    } else {
+        const unsigned argc = 2;
+        Local<Value> argv[argc] = { Nan::Null(), response };
+        Dispatch(baton->reader, "transmit_chained", Nan::New(baton->callback), argc, argv);
+    }
+
+    baton->callback.Reset();
+    delete ci;
+    delete cr;
+    delete baton;
+}
+
+void CardReader::DoVerify(uv_work_t* req) {
+
+    Baton* baton = static_cast<Baton*>(req->data);
+    VerifyInput* vi = static_cast<VerifyInput*>(baton->input);
+    CardReader* obj = baton->reader;
+
+    VerifyResult* vr = new VerifyResult();
+    vr->result = SCARD_S_SUCCESS;
+    vr->wrap_error = NULL;
+    baton->result = vr;
+
+    std::vector<BYTE> out(vi->out_len);
+    std::vector<BYTE> read;
+    BYTE digest[32];
+    uv_mutex_lock(&obj->m_mutex);
+    for (size_t i = 0; i < vi->items.size(); ++ i) {
+        const VerifyItem& item = vi->items[i];
+
+        // The data read is what precedes the status words, and the item
+        // stops at the first one that isn't 90 00
+        VerifyOutcome outcome;
+        outcome.sw = -1;
+        outcome.offset = -1;
+        read.clear();
+        for (size_t k = 0; k < item.apdus.size(); ++ k) {
+            const std::vector<BYTE>& apdu = item.apdus[k];
+            DWORD out_len = out.size();
+            if (obj->m_wrapper && !vi->plain) {
+                vr->result = obj->TransmitWrapped(vi->card_protocol, &apdu[0], apdu.size(),
+                                                  out.empty() ? NULL : &out[0], &out_len, &vr->wrap_error);
+            } else {
+                vr->result = obj->TransmitApdu(vi->card_protocol, &apdu[0], apdu.size(),
+                                               out.empty() ? NULL : &out[0], &out_len);
+            }
+
+            if (vr->result || vr->wrap_error) {
+                break;
+            }
+
+            size_t len = out_len;
+            outcome.sw = -1;
+            if (len >= 2) {
+                len -= 2;
+                outcome.sw = (out[len] << 8) | out[len + 1];
+            }
+
+            read.insert(read.end(), out.begin(), out.begin() + len);
+            if (outcome.sw != 0x9000) {
+                break;
+            }
+        }
+
+        if (vr->result || vr->wrap_error) {
+            break;
+        }
+
+        if (outcome.sw != 0x9000) {
+            outcome.ok = false;
+        } else if (item.kind == Digest::BYTES) {
+            size_t common = read.size() < item.expected.size() ? read.size() : item.expected.size();
+            size_t j = 0;
+            while ((j < common) && (read[j] == item.expected[j])) {
+                ++ j;
+            }
+
+            outcome.ok = (j == read.size()) && (j == item.expected.size());
+            if (!outcome.ok) {
+                outcome.offset = static_cast<long>(j);
+            }
+        } else {
+            outcome.ok = Digest::Compute(item.kind, read.empty() ? NULL : &read[0], read.size(), digest) &&
+                         (memcmp(digest, &item.expected[0], item.expected.size()) == 0);
+        }
+
+        vr->outcomes.push_back(outcome);
+    }
+
+    uv_mutex_unlock(&obj->m_mutex);
+}
+
+void CardReader::AfterVerify(uv_work_t* req, int status) {
+
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+    VerifyInput* vi = static_cast<VerifyInput*>(baton->input);
+    VerifyResult* vr = static_cast<VerifyResult*>(baton->result);
+
+    if (vr->result) {
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { ErrorValue(baton, "SCardTransmit", vr->result) };
+        Dispatch(baton->reader, "verify", Nan::New(baton->callback), argc, argv);
+    } else if (vr->wrap_error) {
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { ErrorValue(baton, "SecureMessaging", SCARD_W_SECURITY_VIOLATION, vr->wrap_error) };
+        Dispatch(baton->reader, "verify", Nan::New(baton->callback), argc, argv);
+    } else {
+        Local<Array> outcomes = Nan::New<Array>(vr->outcomes.size());
+        for (size_t i = 0; i < vr->outcomes.size(); ++ i) {
+            const VerifyOutcome& outcome = vr->outcomes[i];
+            Local<Object> item = Nan::New<Object>();
+            Nan::Set(item, Nan::New("ok").ToLocalChecked(), Nan::New<Boolean>(outcome.ok));
+            Nan::Set(item, Nan::New("sw").ToLocalChecked(),
+                     outcome.sw < 0 ? Local<Value>(Nan::Null()) : Local<Value>(Nan::New<Number>(outcome.sw)));
+            Nan::Set(item, Nan::New("offset").ToLocalChecked(),
+                     outcome.offset < 0 ? Local<Value>(Nan::Null()) : Local<Value>(Nan::New<Number>(outcome.offset)));
+            Nan::Set(outcomes, i, item);
+        }
+
+        const unsigned argc = 2;
+        Local<Value> argv[argc] = { Nan::Null(), outcomes };
+        Dispatch(baton->reader, "verify", Nan::New(baton->callback), argc, argv);
+    }
+
+    baton->callback.Reset();
+    delete vi;
+    delete vr;
+    delete baton;
+}
+
+void CardReader::StartJob(CardReader* reader, void* job) {
+
+    Baton* baton = static_cast<Baton*>(job);
+    baton->reader = reader;
+    QueueOperation(baton, DoJob, reinterpret_cast<uv_after_work_cb>(AfterJob), baton->flags);
+}
+
+void CardReader::FailJob(void* job, LONG result) {
+
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(job);
+
+    // It never got a reader
+    const unsigned argc = 3;
+    Local<Value> argv[argc] = {
+        ErrorValue(baton, "SCardGetStatusChange", result),
+        Nan::New<Array>(0),
+        Nan::Null()
+    };
+
+    Nan::Call(Nan::Callback(Nan::New(baton->callback)), argc, argv);
+
+    baton->callback.Reset();
+    delete static_cast<JobInput*>(baton->input);
+    delete baton;
+}
+
+void CardReader::DoJob(uv_work_t* req) {
+
+    Baton* baton = static_cast<Baton*>(req->data);
+    JobInput* ji = static_cast<JobInput*>(baton->input);
+    CardReader* obj = baton->reader;
+
+    JobResult* jr = new JobResult();
+    jr->result = SCARD_S_SUCCESS;
+    jr->method = NULL;
+    baton->result = jr;
+
+    // The job has its own connection, the reader's one isn't touched
+    SCARDHANDLE card_handle = 0;
+    DWORD card_protocol = 0;
+    uv_mutex_lock(&obj->m_mutex);
+    if (!obj->m_card_context) {
+        jr->method = "SCardEstablishContext";
+        jr->result = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &obj->m_card_context);
+    }
+
+    if (jr->result == SCARD_S_SUCCESS) {
+        jr->method = "SCardConnect";
+        jr->result = SCardConnect(obj->m_card_context,
+                                  obj->m_name.c_str(),
+                                  ji->share_mode,
+                                  ji->pref_protocol,
+                                  &card_handle,
+                                  &card_protocol);
+    }
+
+    uv_mutex_unlock(&obj->m_mutex);
+    if (jr->result != SCARD_S_SUCCESS) {
+        return;
+    }
+
+    // Stop at the first failed command
+    SCARD_IO_REQUEST send_pci = { card_protocol, sizeof(SCARD_IO_REQUEST) };
+    std::vector<BYTE> out(ji->res_len);
+    for (size_t i = 0; i < ji->apdus.size(); ++ i) {
+        DWORD len = ji->res_len;
+        PROBE_TRANSMIT_START(obj->m_name.c_str(), ji->apdus[i].size());
+        jr->result = SCardTransmit(card_handle,
+                                   &send_pci,
+                                   ji->apdus[i].empty() ? NULL : &ji->apdus[i][0],
+                                   ji->apdus[i].size(),
+                                   NULL,
+                                   out.empty() ? NULL : &out[0],
+                                   &len);
+        PROBE_TRANSMIT_END(obj->m_name.c_str(), jr->result, jr->result ? 0 : len);
+        if (jr->result != SCARD_S_SUCCESS) {
+            jr->method = "SCardTransmit";
+            break;
+        }
+
+        jr->responses.push_back(std::vector<BYTE>(out.begin(), out.begin() + len));
+        if ((len < 2) || (out[len - 2] != 0x90) || (out[len - 1] != 0x00)) {
+            break;
+        }
+    }
+
+    LONG result = SCardDisconnect(card_handle, ji->disposition);
+    if ((jr->result == SCARD_S_SUCCESS) && (result != SCARD_S_SUCCESS)) {
+        jr->method = "SCardDisconnect";
+        jr->result = result;
+    }
+}
+
+void CardReader::AfterJob(uv_work_t* req, int status) {
+
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+    JobInput* ji = static_cast<JobInput*>(baton->input);
+    JobResult* jr = static_cast<JobResult*>(baton->result);
+    CardReader* reader = baton->reader;
+
+    // The reader can take the next job, which is queued behind this callback
+    Dispatcher::Release(reader);
+
+    Local<Array> responses = Nan::New<Array>(jr->responses.size());
+    for (size_t i = 0; i < jr->responses.size(); ++ i) {
+        const std::vector<BYTE>& response = jr->responses[i];
+        Nan::Set(responses, i, Nan::CopyBuffer(reinterpret_cast<const char*>(response.empty() ? NULL : &response[0]),
+                                               response.size()).ToLocalChecked());
+    }
+
+    const unsigned argc = 3;
+    Local<Value> argv[argc] = {
+        jr->result ? ErrorValue(baton, jr->method, jr->result) : Local<Value>(Nan::Null()),
+        responses,
+        reader->handle()
+    };
+
+    Dispatch(reader, "job", Nan::New(baton->callback), argc, argv);
+
+    baton->callback.Reset();
+    delete ji;
+    delete jr;
+    delete baton;
+}
+
+void CardReader::DoControl(uv_work_t* req) {
+
+    Baton* baton = static_cast<Baton*>(req->data);
+    ControlInput *ci = static_cast<ControlInput*>(baton->input);
+    CardReader* obj = baton->reader;
+
+    ControlResult *cr = new ControlResult();
+
+    /* Lock mutex */
+    uv_mutex_lock(&obj->m_mutex);
+    cr->result = obj->ControlReader(ci->control_code, ci->in_data, ci->in_len,
+                                    ci->out_data, ci->out_len, &cr->len);
+    /* Unlock the mutex */
+    uv_mutex_unlock(&obj->m_mutex);
+
+    baton->result = cr;
+}
+
+void CardReader::AfterControl(uv_work_t* req, int status) {
+
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+    ControlInput *ci = static_cast<ControlInput*>(baton->input);
+    ControlResult *cr = static_cast<ControlResult*>(baton->result);
+
+    if (cr->result) {
+        Local<Value> err = ErrorValue(baton, "SCardControl", cr->result);
+
+        // Prepare the parameters for the callback function.
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { err };
+        Dispatch(baton->reader, "control", Nan::New(baton->callback), argc, argv);
+    } else {
+        const unsigned argc = 2;
+        Local<Value> argv[argc] = {
+            Nan::Null(),
+            Nan::New<Number>(cr->len)
+        };
+
+        Dispatch(baton->reader, "control", Nan::New(baton->callback), argc, argv);
+    }
+
+
+    // The callback is a permanent handle, so we have to dispose of it manually.
+    baton->callback.Reset();
+    delete ci;
+    delete cr;
+    delete baton;
+}
+
+void CardReader::DoControlBatch(uv_work_t* req) {
+
+    Baton* baton = static_cast<Baton*>(req->data);
+    std::vector<ControlCommand>* commands = static_cast<std::vector<ControlCommand>*>(baton->input);
+    CardReader* obj = baton->reader;
+
+    ControlBatchResult* cbr = new ControlBatchResult();
+    cbr->result = SCARD_S_SUCCESS;
+    cbr->failed = 0;
+    cbr->out.resize(commands->size());
+
+    /* Lock mutex */
+    uv_mutex_lock(&obj->m_mutex);
+    for (size_t i = 0; i < commands->size(); ++ i) {
+        ControlCommand& command = (*commands)[i];
+        std::vector<BYTE>& out = cbr->out[i];
+        DWORD len = 0;
+        out.resize(command.out_len);
+        cbr->result = obj->ControlReader(command.control_code,
+                                         command.in.empty() ? NULL : &command.in[0],
+                                         command.in.size(),
+                                         out.empty() ? NULL : &out[0],
+                                         out.size(),
+                                         &len);
+        if (cbr->result != SCARD_S_SUCCESS) {
+            cbr->failed = i;
+            break;
+        }
+
+        out.resize(len);
+    }
+
+    /* Unlock the mutex */
+    uv_mutex_unlock(&obj->m_mutex);
+
+    baton->result = cbr;
+}
+
+void CardReader::AfterControlBatch(uv_work_t* req, int status) {
+
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+    std::vector<ControlCommand>* commands = static_cast<std::vector<ControlCommand>*>(baton->input);
+    ControlBatchResult* cbr = static_cast<ControlBatchResult*>(baton->result);
+
+    if (cbr->result) {
+        Local<Value> err = ErrorValue(baton, "SCardControl", cbr->result);
+        Nan::Set(Nan::To<Object>(err).ToLocalChecked(),
+                 Nan::New("index").ToLocalChecked(),
+                 Nan::New<Number>(cbr->failed));
+
+        // Prepare the parameters for the callback function.
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { err };
+        Dispatch(baton->reader, "control_batch", Nan::New(baton->callback), argc, argv);
+    } else {
+        Local<Array> responses = Nan::New<Array>(cbr->out.size());
+        for (size_t i = 0; i < cbr->out.size(); ++ i) {
+            const std::vector<BYTE>& out = cbr->out[i];
+            Nan::Set(responses, i, Nan::CopyBuffer(reinterpret_cast<const char*>(out.empty() ? NULL : &out[0]),
+                                                   out.size()).ToLocalChecked());
+        }
+
+        const unsigned argc = 2;
+        Local<Value> argv[argc] = { Nan::Null(), responses };
+        Dispatch(baton->reader, "control_batch", Nan::New(baton->callback), argc, argv);
+    }
+
+    // The callback is a permanent handle, so we have to dispose of it manually.
+    baton->callback.Reset();
+    delete commands;
+    delete cbr;
+    delete baton;
+}
+
+void CardReader::DoGetFeatures(uv_work_t* req) {
+
+    Baton* baton = static_cast<Baton*>(req->data);
+    CardReader* obj = baton->reader;
+
+    FeaturesResult* fr = new FeaturesResult();
+    fr->result = SCARD_S_SUCCESS;
+
+    /* Lock mutex */
+    uv_mutex_lock(&obj->m_mutex);
+    // The features belong to the reader, so they are only asked for once
+    if (!obj->m_features_cached) {
+        BYTE out[256];
+        DWORD len = 0;
+        fr->result = obj->ControlReader(CM_IOCTL_GET_FEATURE_REQUEST, NULL, 0, out, sizeof(out), &len);
+        if (fr->result == SCARD_S_SUCCESS) {
+            // TLV list: tag, length 4 and the big endian control code
+            for (DWORD i = 0; i + 6 <= len; i += 6) {
+                if (out[i + 1] != 4) {
+                    break;
+                }
+
+                DWORD code = (out[i + 2] << 24) | (out[i + 3] << 16) | (out[i + 4] << 8) | out[i + 5];
+                obj->m_features.push_back(std::make_pair(out[i], code));
+            }
+
+            obj->m_features_cached = true;
+        }
+    }
+
+    fr->features = obj->m_features;
+    /* Unlock the mutex */
+    uv_mutex_unlock(&obj->m_mutex);
+
+    baton->result = fr;
+}
+
+void CardReader::AfterGetFeatures(uv_work_t* req, int status) {
+
+    Nan::HandleScope scope;
+    Baton* baton = static_cast<Baton*>(req->data);
+    FeaturesResult* fr = static_cast<FeaturesResult*>(baton->result);
+
+    if (fr->result) {
+        Local<Value> err = ErrorValue(baton, "SCardControl", fr->result);
+
+        // Prepare the parameters for the callback function.
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { err };
+        Dispatch(baton->reader, "features", Nan::New(baton->callback), argc, argv);
+    } else {
+        Local<Object> features = Nan::New<Object>();
+        for (size_t i = 0; i < fr->features.size(); ++ i) {
+            char unknown[8];
+            const char* name = feature_name(fr->features[i].first);
+            if (name == NULL) {
+                snprintf(unknown, sizeof(unknown), "0x%.2X", fr->features[i].first);
+                name = unknown;
+            }
+
+            Nan::Set(features, Nan::New(name).ToLocalChecked(), Nan::New<Number>(fr->features[i].second));
+        }
+
+        const unsigned argc = 2;
+        Local<Value> argv[argc] = { Nan::Null(), features };
+        Dispatch(baton->reader, "features", Nan::New(baton->callback), argc, argv);
+    }
+
+    // The callback is a permanent handle, so we have to dispose of it manually.
     baton->callback.Reset();
-    delete [] ti->in_data;
-    delete ti;
-    delete [] tr->data;
-    delete tr;
+    delete fr;
     delete baton;
 }
 
-void CardReader::DoControl(uv_work_t* req) {
+void CardReader::QueueMemory(Nan::NAN_METHOD_ARGS_TYPE info, MemoryInput* mi, int argn) {
+
+    // Arguments from argn on: options object, callback and optional flags
+    if (!info[argn]->IsObject()) {
+        delete mi;
+        return Nan::ThrowError("Options argument must be an object");
+    }
+
+    if (!info[argn + 1]->IsFunction()) {
+        delete mi;
+        return Nan::ThrowError("Callback argument must be a function");
+    }
+
+    uint32_t flags = OperationQueue<Baton>::PRIORITY_NORMAL;
+    if (info.Length() > argn + 2 && !info[argn + 2]->IsUndefined()) {
+        if (!info[argn + 2]->IsUint32()) {
+            delete mi;
+            return Nan::ThrowError("Flags argument must be an integer");
+        }
+
+        flags = Nan::To<uint32_t>(info[argn + 2]).ToChecked();
+    }
+
+    Local<Object> options = Nan::To<Object>(info[argn]).ToLocalChecked();
+    Local<Value> block_size = Nan::Get(options, Nan::New("block_size").ToLocalChecked()).ToLocalChecked();
+    Local<Value> chunk_size = Nan::Get(options, Nan::New("chunk_size").ToLocalChecked()).ToLocalChecked();
+    Local<Value> key = Nan::Get(options, Nan::New("key").ToLocalChecked()).ToLocalChecked();
+    Local<Value> key_type = Nan::Get(options, Nan::New("key_type").ToLocalChecked()).ToLocalChecked();
+    Local<Value> key_number = Nan::Get(options, Nan::New("key_number").ToLocalChecked()).ToLocalChecked();
+
+    mi->block_size = block_size->IsUint32() ? Nan::To<uint32_t>(block_size).ToChecked() : 16;
+    mi->chunk_size = chunk_size->IsUint32() ? Nan::To<uint32_t>(chunk_size).ToChecked() : mi->block_size;
+    if ((mi->block_size == 0) || (mi->chunk_size == 0) || (mi->chunk_size > 256) ||
+        (mi->chunk_size % mi->block_size != 0)) {
+        delete mi;
+        return Nan::ThrowError("Chunk size must be a multiple of the block size of up to 256 bytes");
+    }
+
+    mi->authenticate = !key->IsUndefined();
+    if (mi->authenticate) {
+        if (!Buffer::HasInstance(key) || (Buffer::Length(key) != sizeof(mi->key))) {
+            delete mi;
+            return Nan::ThrowError("Key must be a 6 bytes Buffer");
+        }
+
+        memcpy(mi->key, Buffer::Data(key), sizeof(mi->key));
+        mi->key_type = key_type->IsUint32() ? Nan::To<uint32_t>(key_type).ToChecked() : 0x60;
+        mi->key_number = key_number->IsUint32() ? Nan::To<uint32_t>(key_number).ToChecked() : 0;
+        // Sectors are authenticated block by block
+        if (mi->chunk_size != mi->block_size) {
+            delete mi;
+            return Nan::ThrowError("Chunk size must be the block size when authenticating");
+        }
+    }
+
+    if (mi->write && (mi->length % mi->chunk_size != 0)) {
+        delete mi;
+        return Nan::ThrowError("Data length must be a multiple of the chunk size");
+    }
+
+    if (mi->write && mi->authenticate) {
+        // Never overwrite the keys and access bits of a sector by accident
+        for (DWORD block = mi->start; block < mi->start + mi->length / mi->block_size; ++ block) {
+            if ((block < 128) ? (block % 4 == 3) : ((block - 128) % 16 == 15)) {
+                delete mi;
+                return Nan::ThrowError("Refusing to write a sector trailer");
+            }
+        }
+    }
+
+    Baton* baton = new Baton();
+    baton->request.data = baton;
+    baton->callback.Reset(Local<Function>::Cast(info[argn + 1]));
+    baton->reader = Nan::ObjectWrap::Unwrap<CardReader>(info.This());
+    baton->input = mi;
+
+    QueueOperation(baton, DoMemory, reinterpret_cast<uv_after_work_cb>(AfterMemory), flags);
+}
+
+void CardReader::DoMemory(uv_work_t* req) {
 
     Baton* baton = static_cast<Baton*>(req->data);
-    ControlInput *ci = static_cast<ControlInput*>(baton->input);
+    MemoryInput *mi = static_cast<MemoryInput*>(baton->input);
     CardReader* obj = baton->reader;
 
-    ControlResult *cr = new ControlResult();
-    LONG result = SCARD_E_INVALID_HANDLE;
+    MemoryResult *mr = new MemoryResult();
+    mr->result = SCARD_S_SUCCESS;
+    mr->sw = 0x9000;
+    mr->block = mi->start;
+    if (!mi->write) {
+        mr->data.reserve(mi->length);
+    }
+
+    std::vector<BYTE> apdu;
+    std::vector<BYTE> response(mi->chunk_size + 2);
+    DWORD len;
+    long sector = -1;
 
     /* Lock mutex */
     uv_mutex_lock(&obj->m_mutex);
-    /* Connected? */
-    if (obj->m_card_handle) {
-        result = SCardControl(obj->m_card_handle,
-                              ci->control_code,
-                              ci->in_data,
-                              ci->in_len,
-                              ci->out_data,
-                              ci->out_len,
-                              &cr->len);
+
+    if (mi->authenticate) {
+        // LOAD KEYS into the reader volatile memory
+        BYTE load_key[] = { 0xFF, 0x82, 0x00, mi->key_number, sizeof(mi->key) };
+        apdu.assign(load_key, load_key + sizeof(load_key));
+        apdu.insert(apdu.end(), mi->key, mi->key + sizeof(mi->key));
+        len = response.size();
+        mr->result = obj->TransmitApdu(obj->m_card_protocol, &apdu[0], apdu.size(), &response[0], &len);
+        if (mr->result == SCARD_S_SUCCESS) {
+            mr->sw = (len >= 2) ? (response[len - 2] << 8) | response[len - 1] : 0;
+        }
+    }
+
+    DWORD done = 0;
+    DWORD block = mi->start;
+    while ((mr->result == SCARD_S_SUCCESS) && (mr->sw == 0x9000) && (done < mi->length)) {
+        mr->block = block;
+        if (mi->authenticate) {
+            // MIFARE Classic 4K: 32 sectors of 4 blocks, then 8 of 16
+            long block_sector = (block < 128) ? block / 4 : 32 + (block - 128) / 16;
+            if (block_sector != sector) {
+                // GENERAL AUTHENTICATE
+                BYTE auth[] = { 0xFF, 0x86, 0x00, 0x00, 0x05,
+                                0x01, (BYTE)(block >> 8), (BYTE)block, mi->key_type, mi->key_number };
+                len = response.size();
+                mr->result = obj->TransmitApdu(obj->m_card_protocol, auth, sizeof(auth), &response[0], &len);
+                if (mr->result != SCARD_S_SUCCESS) {
+                    break;
+                }
+
+                mr->sw = (len >= 2) ? (response[len - 2] << 8) | response[len - 1] : 0;
+                if (mr->sw != 0x9000) {
+                    break;
+                }
+
+                sector = block_sector;
+            }
+        }
+
+        DWORD left = mi->length - done;
+        DWORD chunk = mi->chunk_size;
+        if (!mi->write && (left < chunk)) {
+            // Don't read past the last block
+            chunk = (left + mi->block_size - 1) / mi->block_size * mi->block_size;
+        }
+
+        if (mi->write) {
+            // UPDATE BINARY
+            BYTE update[] = { 0xFF, 0xD6, (BYTE)(block >> 8), (BYTE)block, (BYTE)chunk };
+            apdu.assign(update, update + sizeof(update));
+            apdu.insert(apdu.end(), mi->data.begin() + done, mi->data.begin() + done + chunk);
+        } else {
+            // READ BINARY, Le 0 means 256
+            BYTE read[] = { 0xFF, 0xB0, (BYTE)(block >> 8), (BYTE)block, (BYTE)(chunk & 0xFF) };
+            apdu.assign(read, read + sizeof(read));
+        }
+
+        len = response.size();
+        mr->result = obj->TransmitApdu(obj->m_card_protocol, &apdu[0], apdu.size(), &response[0], &len);
+        if (mr->result != SCARD_S_SUCCESS) {
+            break;
+        }
+
+        mr->sw = (len >= 2) ? (response[len - 2] << 8) | response[len - 1] : 0;
+        if (mr->sw != 0x9000) {
+            break;
+        }
+
+        if (!mi->write) {
+            DWORD got = len - 2 < left ? len - 2 : left;
+            mr->data.insert(mr->data.end(), response.begin(), response.begin() + got);
+            if (got < chunk && got < left) {
+                // Short read: the card has no more memory
+                mr->sw = 0x6B00;
+                break;
+            }
+        }
+
+        done += chunk;
+        block += chunk / mi->block_size;
     }
 
     /* Unlock the mutex */
     uv_mutex_unlock(&obj->m_mutex);
 
-    cr->result = result;
-
-    baton->result = cr;
+    baton->result = mr;
 }
 
-void CardReader::AfterControl(uv_work_t* req, int status) {
+void CardReader::AfterMemory(uv_work_t* req, int status) {
 
     Nan::HandleScope scope;
     Baton* baton = static_cast<Baton*>(req->data);
-    ControlInput *ci = static_cast<ControlInput*>(baton->input);
-    ControlResult *cr = static_cast<ControlResult*>(baton->result);
+    MemoryInput *mi = static_cast<MemoryInput*>(baton->input);
+    MemoryResult *mr = static_cast<MemoryResult*>(baton->result);
+    const char* type = mi->write ? "write_memory" : "read_memory";
 
-    if (cr->result) {
-        Local<Value> err = Nan::Error(error_msg("SCardControl", cr->result).c_str());
+    if (mr->result) {
+        Local<Value> err = ErrorValue(baton, "SCardTransmit", mr->result);
 
         // Prepare the parameters for the callback function.
         const unsigned argc = 1;
         Local<Value> argv[argc] = { err };
-        Nan::Call(Nan::Callback(Nan::New(baton->callback)), argc, argv);
+        Dispatch(baton->reader, type, Nan::New(baton->callback), argc, argv);
+    } else if (mr->sw != 0x9000) {
+        // The card refused a block: which one and why go along, unless only
+        // the code is wanted
+        Local<Value> err;
+        if (baton->flags & OP_CODE_ONLY) {
+            err = ErrorValue(baton, "SCardTransmit", SCARD_E_UNEXPECTED);
+        } else {
+            char detail[ERR_MSG_MAX_LEN];
+            snprintf(detail, ERR_MSG_MAX_LEN, "block %u refused with status word %.4X",
+                     (unsigned int)mr->block, (unsigned int)mr->sw);
+            err = PCSCError::New("SCardTransmit", SCARD_E_UNEXPECTED, detail);
+            Nan::Set(Nan::To<Object>(err).ToLocalChecked(), Nan::New("block").ToLocalChecked(), Nan::New<Number>(mr->block));
+            Nan::Set(Nan::To<Object>(err).ToLocalChecked(), Nan::New("sw").ToLocalChecked(), Nan::New<Number>(mr->sw));
+        }
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { err };
+        Dispatch(baton->reader, type, Nan::New(baton->callback), argc, argv);
+    } else if (mi->write) {
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { Nan::Null() };
+        Dispatch(baton->reader, type, Nan::New(baton->callback), argc, argv);
     } else {
         const unsigned argc = 2;
         Local<Value> argv[argc] = {
             Nan::Null(),
-            Nan::New<Number>(cr->len)
+            Nan::CopyBuffer(reinterpret_cast<const char*>(mr->data.empty() ? NULL : &mr->data[0]),
+                            mr->data.size()).ToLocalChecked()
         };
 
-        Nan::Call(Nan::Callback(Nan::New(baton->callback)), argc, argv);
+        Dispatch(baton->reader, type, Nan::New(baton->callback), argc, argv);
     }
 
-
     // The callback is a permanent handle, so we have to dispose of it manually.
     baton->callback.Reset();
-    delete ci;
-    delete cr;
+    delete mi;
+    delete mr;
     delete baton;
 }
 
+void CardReader::QueueOperation(Baton* baton,
+                                uv_work_cb work_cb,
+                                uv_after_work_cb after_cb,
+                                uint32_t flags) {
+
+    // The readers of a group take turns on the leader's queue
+    CardReader* obj = baton->reader->m_leader;
+    baton->work_cb = work_cb;
+    baton->after_cb = after_cb;
+    baton->flags = flags;
+
+    uv_mutex_lock(&obj->m_queue_mutex);
+    obj->m_queue.Push(baton, flags & OP_PRIORITY_MASK);
+    uv_mutex_unlock(&obj->m_queue_mutex);
+
+    // Every queued operation gets its own threadpool request, but which
+    // operation it runs is only decided once it starts (see DoQueued).
+    QueueSlot* slot = new QueueSlot();
+    slot->request.data = slot;
+    slot->reader = obj;
+    slot->baton = NULL;
+    int status = uv_queue_work(uv_default_loop(),
+                               &slot->request,
+                               DoQueued,
+                               reinterpret_cast<uv_after_work_cb>(AfterQueued));
+    assert(status == 0);
+}
+
+void CardReader::DoQueued(uv_work_t* req) {
+
+    QueueSlot* slot = static_cast<QueueSlot*>(req->data);
+    CardReader* obj = slot->reader;
+
+    // Hold the I/O lock while picking the operation so the reader serves them
+    // in priority order, no matter which threadpool thread comes first.
+    uv_mutex_lock(&obj->m_io_mutex);
+    uv_mutex_lock(&obj->m_queue_mutex);
+    slot->baton = obj->m_queue.Pop();
+    uv_mutex_unlock(&obj->m_queue_mutex);
+
+    assert(slot->baton != NULL);
+    slot->baton->work_cb(&slot->baton->request);
+    uv_mutex_unlock(&obj->m_io_mutex);
+}
+
+void CardReader::AfterQueued(uv_work_t* req, int status) {
+
+    Nan::HandleScope scope;
+    QueueSlot* slot = static_cast<QueueSlot*>(req->data);
+    Baton* baton = slot->baton;
+    CardReader* obj = baton->reader;
+    delete slot;
+
+    // A recovered card may have come back with another protocol, which the
+    // next operations have to use: tell it before the callback runs
+    uv_mutex_lock(&obj->m_mutex);
+    DWORD protocol = obj->m_recovered_protocol;
+    obj->m_recovered_protocol = 0;
+    uv_mutex_unlock(&obj->m_mutex);
+    if (protocol) {
+        Local<Value> argv[2] = {
+            Nan::New("protocol").ToLocalChecked(),
+            Nan::New<Number>(protocol)
+        };
+
+        Nan::MakeCallback(obj->handle(), "emit", 2, argv);
+    }
+
+    baton->after_cb(&baton->request, status);
+}
+
+LONG CardReader::ReplayOperation(uint8_t type, LPBYTE out, DWORD* out_len) {
+
+    const TraceEntry* entry = m_player->Next(type);
+    if (entry == NULL) {
+        // The recorded session is over
+        *out_len = 0;
+        return SCARD_E_NO_SMARTCARD;
+    }
+
+    m_player->WaitDuration(entry);
+    DWORD len = entry->out.size() < *out_len ? entry->out.size() : *out_len;
+    if (len) {
+        memcpy(out, &entry->out[0], len);
+    }
+
+    *out_len = len;
+    return entry->result;
+}
+
+LONG CardReader::TransmitApdu(DWORD protocol, const BYTE* in, DWORD in_len, LPBYTE out, DWORD* out_len) {
+
+    // The caller holds m_mutex. A replayed session is lost as a real one is,
+    // but not recovered.
+    if (m_player) {
+        if (SessionLost()) {
+            ++ m_failed_fast;
+            return SCARD_W_REMOVED_CARD;
+        }
+
+        // Recorded again, what was sent included
+        uint64_t start = uv_hrtime();
+        LONG result = ReplayOperation(TRACE_TRANSMIT, out, out_len);
+        m_recorder.Record(TRACE_TRANSMIT, result, protocol, start, uv_hrtime(),
+                          in, in_len, out, result ? 0 : *out_len);
+        return result;
+    }
+
+    if (!m_card_handle || m_parked) {
+        return SCARD_E_INVALID_HANDLE;
+    }
+
+    DWORD len = *out_len;
+    uint64_t start = uv_hrtime();
+    // Under windows, SCARD_IO_REQUEST param must be NULL. Else error RPC_X_BAD_STUB_DATA / 0x06F7 on each call.
+    SCARD_IO_REQUEST send_pci = { protocol, sizeof(SCARD_IO_REQUEST) };
+    LONG result;
+    if (SessionLost() && !m_recovering) {
+        // The monitor saw the card go: don't wait for PC/SC to tell
+        ++ m_failed_fast;
+        result = SCARD_W_REMOVED_CARD;
+    } else {
+        PROBE_TRANSMIT_START(m_name.c_str(), in_len);
+        result = SCardTransmit(m_card_handle, &send_pci, in, in_len, NULL, out, out_len);
+        PROBE_TRANSMIT_END(m_name.c_str(), result, result ? 0 : *out_len);
+        m_recorder.Record(TRACE_TRANSMIT, result, protocol, start, uv_hrtime(),
+                          in, in_len, out, result ? 0 : *out_len);
+    }
+
+    // The card was reset or swapped under us: get it back to where the
+    // session expects it and send the command again. Once that fails, the
+    // operations queued behind fail at once instead of each one waiting for
+    // the deadline again, until a connect starts a new session.
+    if (((result == (LONG)SCARD_W_RESET_CARD) || (result == (LONG)SCARD_W_REMOVED_CARD)) &&
+        m_recovery.deadline && !m_recovering && !m_recovery_failed && !m_wrapper) {
+        result = RecoverCard(result, &protocol);
+        if (result == SCARD_S_SUCCESS) {
+            // Only once
+            *out_len = len;
+            m_recovering = true;
+            result = TransmitApdu(protocol, in, in_len, out, out_len);
+            m_recovering = false;
+        } else {
+            m_session_lost = true;
+            m_recovery_failed = true;
+        }
+    }
+
+    return result;
+}
+
+LONG CardReader::RecoverCard(LONG result, DWORD* protocol) {
+
+    // The caller holds m_mutex. The setup APDUs go through TransmitApdu()
+    // like any other, but don't recover themselves. A card put back in is
+    // only taken if it has the ATR the session connected to.
+    if ((result == (LONG)SCARD_W_REMOVED_CARD) && !m_atrlen) {
+        return result;
+    }
+
+    m_recovering = true;
+    uint64_t deadline = uv_hrtime() + static_cast<uint64_t>(m_recovery.deadline) * 1000000;
+    std::vector<BYTE> response(258);
+    LONG failure = result;
+    while (uv_hrtime() < deadline) {
+        DWORD active;
+        result = SCardReconnect(m_card_handle, m_share_mode, m_pref_protocol, SCARD_LEAVE_CARD, &active);
+        if (result == SCARD_S_SUCCESS) {
+            BYTE atr[MAX_ATR_SIZE];
+            DWORD atrlen = MAX_ATR_SIZE;
+            DWORD state, current;
+            DWORD name_len = 0;
+            result = SCardStatus(m_card_handle, NULL, &name_len, &state, &current, atr, &atrlen);
+            if ((result == SCARD_S_SUCCESS) && m_atrlen &&
+                ((atrlen != m_atrlen) || (memcmp(atr, m_atr, atrlen) != 0))) {
+                // Another card: what the session did belongs to the old one
+                m_session_lost = true;
+                m_recovering = false;
+                return failure;
+            }
+        }
+
+        if (result == SCARD_S_SUCCESS) {
+            m_session_lost = false;
+            if (active != m_card_protocol) {
+                m_recovered_protocol = active;
+            }
+
+            m_card_protocol = active;
+            for (size_t i = 0; (i < m_recovery.setup.size()) && (result == SCARD_S_SUCCESS); ++ i) {
+                const std::vector<BYTE>& apdu = m_recovery.setup[i];
+                DWORD len = response.size();
+                result = TransmitApdu(active, &apdu[0], apdu.size(), &response[0], &len);
+                if ((result == SCARD_S_SUCCESS) &&
+                    ((len < 2) || (response[len - 2] != 0x90) || (response[len - 1] != 0x00))) {
+                    // The card doesn't take the setup, no point in retrying
+                    m_recovering = false;
+                    return failure;
+                }
+            }
+
+            if (result == SCARD_S_SUCCESS) {
+                ++ m_card_recoveries;
+                *protocol = active;
+                m_recovering = false;
+                return SCARD_S_SUCCESS;
+            }
+        }
+
+        // No card yet, or it was reset again during the setup
+        if ((result != (LONG)SCARD_W_RESET_CARD) && (result != (LONG)SCARD_W_REMOVED_CARD) &&
+            (result != (LONG)SCARD_E_NO_SMARTCARD) && (result != (LONG)SCARD_W_UNPOWERED_CARD)) {
+            break;
+        }
+
+        Sleep(20);
+    }
+
+    m_recovering = false;
+    return failure;
+}
+
+LONG CardReader::ControlReader(DWORD control_code,
+                               LPCVOID in,
+                               DWORD in_len,
+                               LPVOID out,
+                               DWORD out_len,
+                               DWORD* len) {
+
+    // The caller holds m_mutex
+    if (m_player) {
+        if (SessionLost()) {
+            ++ m_failed_fast;
+            *len = 0;
+            return SCARD_W_REMOVED_CARD;
+        }
+
+        *len = out_len;
+        return ReplayOperation(TRACE_CONTROL, static_cast<LPBYTE>(out), len);
+    }
+
+    if (!m_card_handle || m_parked) {
+        *len = 0;
+        return SCARD_E_INVALID_HANDLE;
+    }
+
+    if (SessionLost()) {
+        ++ m_failed_fast;
+        *len = 0;
+        return SCARD_W_REMOVED_CARD;
+    }
+
+    uint64_t start = uv_hrtime();
+    LONG result = SCardControl(m_card_handle, control_code, in, in_len, out, out_len, len);
+    m_recorder.Record(TRACE_CONTROL, result, control_code, start, uv_hrtime(),
+                      in, in_len, out, result ? 0 : *len);
+    return result;
+}
+
+LONG CardReader::TransmitWrapped(DWORD protocol,
+                                 const BYTE* in,
+                                 DWORD in_len,
+                                 LPBYTE out,
+                                 DWORD* out_len,
+                                 const char** wrap_error) {
+
+    // The caller holds m_mutex. What goes on the wire (and in the trace) is
+    // the protected APDU.
+    std::vector<uint8_t> command;
+    *wrap_error = m_wrapper->Wrap(in, in_len, command);
+    if (*wrap_error) {
+        return SCARD_S_SUCCESS;
+    }
+
+    std::vector<uint8_t> response(*out_len + SessionWrapper::MAX_OVERHEAD);
+    DWORD len = response.size();
+    LONG result = TransmitApdu(protocol, &command[0], command.size(), &response[0], &len);
+    if (result != SCARD_S_SUCCESS) {
+        return result;
+    }
+
+    std::vector<uint8_t> plain;
+    *wrap_error = m_wrapper->Unwrap(&response[0], len, plain);
+    if (*wrap_error) {
+        // The card aborts the session on errors as well
+        delete m_wrapper;
+        m_wrapper = NULL;
+        return SCARD_S_SUCCESS;
+    }
+
+    if (plain.size() > *out_len) {
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+
+    if (!plain.empty()) {
+        memcpy(out, &plain[0], plain.size());
+    }
+
+    *out_len = plain.size();
+    return SCARD_S_SUCCESS;
+}
+
+bool CardReader::FilterStatus(LONG result, DWORD current, DWORD event, const BYTE* atr, DWORD atrlen) {
+
+    // Errors, the initial state and events without changes are never filtered
+    // (the latter are dropped when handled anyway)
+    if ((result != SCARD_S_SUCCESS) || (current == SCARD_STATE_UNAWARE)) {
+        m_card_matched = (event & SCARD_STATE_PRESENT) != 0;
+        ++ m_events_delivered;
+        return true;
+    }
+
+    if ((current == event) || m_filters.empty()) {
+        m_events_delivered += (current != event);
+        return current != event;
+    }
+
+    bool matched = false;
+    for (size_t i = 0; (i < m_filters.size()) && !matched; ++ i) {
+        const AtrFilter& filter = m_filters[i];
+        if (filter.state_mask && !(event & filter.state_mask)) {
+            continue;
+        }
+
+        if (filter.atrlen == 0) {
+            matched = true;
+        } else if ((event & SCARD_STATE_PRESENT) && (filter.atrlen == atrlen)) {
+            matched = true;
+            for (DWORD j = 0; (j < atrlen) && matched; ++ j) {
+                matched = ((atr[j] ^ filter.atr[j]) & filter.mask[j]) == 0;
+            }
+        }
+    }
+
+    // The removal of a card that was reported is always reported too
+    bool deliver = matched || (m_card_matched && !(event & SCARD_STATE_PRESENT));
+    m_card_matched = matched && (event & SCARD_STATE_PRESENT);
+    if (deliver) {
+        ++ m_events_delivered;
+    } else {
+        ++ m_events_filtered;
+    }
+
+    return deliver;
+}
+
+bool CardReader::ReuseParked(DWORD share_mode, DWORD pref_protocol) {
+
+    // The caller holds m_mutex. SCardStatus fails if the card was removed or
+    // reset meanwhile, so there's no need to power it up again to check.
+    if ((share_mode == m_share_mode) && (m_card_protocol & pref_protocol)) {
+        BYTE atr[MAX_ATR_SIZE];
+        DWORD atrlen = MAX_ATR_SIZE;
+        DWORD state, protocol;
+        DWORD name_len = 0;
+        LONG result = SCardStatus(m_card_handle, NULL, &name_len, &state, &protocol, atr, &atrlen);
+        if ((result == SCARD_S_SUCCESS) && (atrlen == m_atrlen) && (memcmp(atr, m_atr, atrlen) == 0)) {
+            // Only SCARD_LEAVE_CARD carries what the last session did to the
+            // card (a verified PIN, an open channel) over to this one. Any
+            // other disposition is applied now, on the same handle.
+            if (m_parked_disposition != SCARD_LEAVE_CARD) {
+                DWORD init = m_parked_disposition == SCARD_UNPOWER_CARD ? SCARD_UNPOWER_CARD : SCARD_RESET_CARD;
+                result = SCardReconnect(m_card_handle, share_mode, pref_protocol, init, &protocol);
+                if (result == SCARD_S_SUCCESS) {
+                    m_card_protocol = protocol;
+                }
+            }
+
+            if (result == SCARD_S_SUCCESS) {
+                m_parked = false;
+                m_pref_protocol = pref_protocol;
+                ++ m_connections_reused;
+                return true;
+            }
+        }
+    }
+
+    ReleaseParked();
+    return false;
+}
+
+void CardReader::ReleaseParked() {
+
+    // The caller holds m_mutex
+    SCardDisconnect(m_card_handle, m_parked_disposition);
+    m_card_handle = 0;
+    m_parked = false;
+    m_atrlen = 0;
+}
+
+void CardReader::CheckParked(LONG result, DWORD event, const BYTE* atr, DWORD atrlen) {
+
+    // The caller holds m_mutex. Give the card back as soon as it's gone or
+    // replaced, or the monitor stops.
+    if (m_parked &&
+        ((result != SCARD_S_SUCCESS) || (event & SCARD_STATE_EMPTY) || !(event & SCARD_STATE_PRESENT) ||
+         (atrlen != m_atrlen) || (memcmp(atr, m_atr, atrlen) != 0))) {
+        ReleaseParked();
+    }
+}
+
+void CardReader::CheckSession(const SCARD_READERSTATE* state, LONG result) {
+
+    // The status thread, before it waits for m_mutex. The session's card is
+    // gone if the slot is empty or holds a card with another ATR, or one
+    // inserted since (the upper word of the state counts the insertions).
+    if (result != SCARD_S_SUCCESS) {
+        return;
+    }
+
+    DWORD current = state->dwCurrentState;
+    DWORD event = state->dwEventState;
+    if (event & SCARD_STATE_EMPTY) {
+        m_session_lost = true;
+        m_seen_atrlen = 0;
+    } else if (event & SCARD_STATE_PRESENT) {
+        if (m_seen_atrlen &&
+            ((state->cbAtr != m_seen_atrlen) || (memcmp(state->rgbAtr, m_seen_atr, m_seen_atrlen) != 0) ||
+             ((current & SCARD_STATE_PRESENT) && (current >> 16) && ((current >> 16) != (event >> 16))))) {
+            m_session_lost = true;
+        }
+
+        m_seen_atrlen = state->cbAtr <= MAX_ATR_SIZE ? state->cbAtr : 0;
+        memcpy(m_seen_atr, state->rgbAtr, m_seen_atrlen);
+    }
+}
+
+bool CardReader::SessionLost() const {
+
+    // The caller holds m_mutex. A direct connection talks to the reader, not
+    // to the card.
+    return m_session_lost && (m_share_mode != SCARD_SHARE_DIRECT);
+}
+
+LONG CardReader::CancelMonitor() {
+
+    LONG result = SCARD_S_SUCCESS;
+    if (m_player) {
+        m_player->Cancel();
+    }
+
+    uv_mutex_lock(&m_mutex);
+    if ((m_status_thread || m_shared_monitor) && (m_state == 0)) {
+        m_state = 1;
+        // Also ends a debounce wait
+        uv_cond_broadcast(&m_cond);
+        result = SCardCancel(m_status_card_context);
+    }
+
+    uv_mutex_unlock(&m_mutex);
+    return result;
+}
+
+void CardReader::QueueClose(const std::vector<CardReader*>& readers,
+                            Local<Value> callback) {
+
+    CloseBaton* baton = new CloseBaton();
+    baton->async.data = baton;
+    if (callback->IsFunction()) {
+        baton->callback.Reset(Local<Function>::Cast(callback));
+    }
+
+    // Only one close request joins a given status thread
+    for (size_t i = 0; i < readers.size(); ++ i) {
+        CardReader* obj = readers[i];
+        if ((obj->m_status_thread || obj->m_shared_monitor) && !obj->m_closing) {
+            obj->m_closing = true;
+            obj->Ref();
+            baton->readers.push_back(obj);
+        } else if (!obj->m_status_thread && !obj->m_shared_monitor && !obj->m_state) {
+            // No monitor to report the end of the reader
+            obj->m_state = 2;
+            obj->Ref();
+            baton->unwatched.push_back(obj);
+        }
+    }
+
+    baton->joined.resize(baton->readers.size(), true);
+    uv_async_init(uv_default_loop(), &baton->async, (uv_async_cb)AfterClose);
+    if (!baton->readers.empty()) {
+        int ret = uv_thread_create(&baton->thread, CloseFunction, baton);
+        assert(ret == 0);
+    } else {
+        uv_async_send(&baton->async);
+    }
+}
+
+void CardReader::CloseFunction(void* arg) {
+
+    CloseBaton* baton = static_cast<CloseBaton*>(arg);
+
+    for (size_t i = 0; i < baton->readers.size(); ++ i) {
+        CardReader* obj = baton->readers[i];
+        uv_mutex_lock(&obj->m_mutex);
+        // The cancel may have reached pcscd before the status thread started
+        // waiting, so keep cancelling until the thread is done.
+        while (obj->m_monitor_running) {
+            if (uv_cond_timedwait(&obj->m_cond, &obj->m_mutex, 10000000) != 0) {
+                SCardCancel(obj->m_status_card_context);
+            }
+        }
+
+        std::vector<CardReader*> members(obj->m_members);
+        uv_mutex_unlock(&obj->m_mutex);
+
+        // A leader's thread keeps watching the members still monitored, and
+        // is joined once the leader goes away
+        bool shared = false;
+        for (size_t j = 0; j < members.size(); ++ j) {
+            uv_mutex_lock(&members[j]->m_mutex);
+            shared = shared || (members[j]->m_shared_monitor && members[j]->m_monitor_running);
+            uv_mutex_unlock(&members[j]->m_mutex);
+        }
+
+        if (obj->m_status_thread && !shared) {
+            assert(uv_thread_join(&obj->m_status_thread) == 0);
+        }
+
+        baton->joined[i] = !shared;
+    }
+
+    uv_async_send(&baton->async);
+}
+
+void CardReader::AfterClose(uv_async_t* handle, int status) {
+
+    Nan::HandleScope scope;
+    CloseBaton* baton = static_cast<CloseBaton*>(handle->data);
+    if (!baton->readers.empty()) {
+        // Done by now, it only had to send the async
+        assert(uv_thread_join(&baton->thread) == 0);
+    }
+
+    for (size_t i = 0; i < baton->readers.size(); ++ i) {
+        CardReader* obj = baton->readers[i];
+        if (baton->joined[i]) {
+            obj->m_status_thread = 0;
+        }
+
+        obj->m_closing = false;
+        obj->Unref();
+    }
+
+    for (size_t i = 0; i < baton->unwatched.size(); ++ i) {
+        CardReader* obj = baton->unwatched[i];
+        obj->Retire();
+        Local<Value> argv[1] = { Nan::New("_end").ToLocalChecked() };
+        Nan::MakeCallback(obj->handle(), "emit", 1, argv);
+        obj->Unref();
+    }
+
+    if (!baton->callback.IsEmpty()) {
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { Nan::Null() };
+        Nan::Call(Nan::Callback(Nan::New(baton->callback)), argc, argv);
+    }
+
+    // The callback is a permanent handle, so we have to dispose of it manually.
+    baton->callback.Reset();
+    uv_close(reinterpret_cast<uv_handle_t*>(&baton->async), DeleteCloseBaton);
+}
+
+void CardReader::DeleteCloseBaton(uv_handle_t* handle) {
+    delete static_cast<CloseBaton*>(handle->data);
+}
+
+bool CardReader::WaitReaderBack() {
+
+    // Between probes it waits on m_cond, which CancelMonitor() signals, so a
+    // close doesn't wait for the debounce window
+    uint64_t deadline = uv_hrtime() + static_cast<uint64_t>(m_debounce) * 1000000;
+    bool back = false;
+    uv_mutex_lock(&m_mutex);
+    while (!back && !m_state) {
+        uint64_t now = uv_hrtime();
+        if (now >= deadline) {
+            break;
+        }
+
+        uv_cond_timedwait(&m_cond, &m_mutex, deadline - now < 20000000 ? deadline - now : 20000000);
+        if (m_state) {
+            break;
+        }
+
+        uv_mutex_unlock(&m_mutex);
+        SCARD_READERSTATE probe = SCARD_READERSTATE();
+        probe.szReader = m_name.c_str();
+        probe.dwCurrentState = SCARD_STATE_UNAWARE;
+        LONG result = SCardGetStatusChange(m_status_card_context, 0, &probe, 1);
+        uv_mutex_lock(&m_mutex);
+        back = (result == SCARD_S_SUCCESS) && !(probe.dwEventState & SCARD_STATE_UNKNOWN);
+    }
+
+    if (back) {
+        ++ m_resyncs;
+        // pcscd invalidated the card handles of the reader while it was away
+        if (m_parked) {
+            ReleaseParked();
+        } else if (m_card_handle) {
+            SCardDisconnect(m_card_handle, SCARD_LEAVE_CARD);
+            m_card_handle = 0;
+            delete m_wrapper;
+            m_wrapper = NULL;
+            m_handle_lost = true;
+            Dispatcher::SetConnected(this, false);
+        }
+    }
+
+    uv_mutex_unlock(&m_mutex);
+    return back;
+}
+
 void CardReader::CloseCallback(uv_handle_t *handle) {
 
     /* cleanup process */
@@ -678,6 +4049,5 @@ void CardReader::CloseCallback(uv_handle_t *handle) {
     AsyncResult* ar = async_baton->async_result;
     delete ar;
     async_baton->callback.Reset();
-    SCardReleaseContext(async_baton->reader->m_status_card_context);
     delete async_baton;
 }
@@ -3,7 +3,19 @@
 
 #include <nan.h>
 #include <node_version.h>
+#include <memory>
 #include <string>
+#include <vector>
+#include "batch.h"
+#include "digest.h"
+#include "dispatcher.h"
+#include "errors.h"
+#include "opqueue.h"
+#include "probes.h"
+#include "rules.h"
+#include "secure.h"
+#include "statetable.h"
+#include "trace.h"
 #ifdef __APPLE__
 #include <PCSC/winscard.h>
 #include <PCSC/wintypes.h>
@@ -15,6 +27,16 @@
 #define MAX_ATR_SIZE 33
 #endif
 
+// Flags accepted by the asynchronous operations. The lower bits hold the
+// priority of the operation in the reader queue.
+#define OP_PRIORITY_MASK 0x03
+// Transmit the APDU as is, even if the session uses secure messaging
+#define OP_PLAIN 0x04
+// Really disconnect, even if the reader keeps connections alive
+#define OP_RELEASE 0x08
+// Pass the callbacks just the numeric PC/SC code instead of an error object
+#define OP_CODE_ONLY 0x10
+
 static Nan::Persistent<v8::String> name_symbol;
 static Nan::Persistent<v8::String> connected_symbol;
 
@@ -27,6 +49,17 @@ class CardReader: public Nan::ObjectWrap {
         CardReader *reader;
         void *input;
         void *result;
+        uv_work_cb work_cb;
+        uv_after_work_cb after_cb;
+        uint32_t flags;
+    };
+
+    // A threadpool request for a reader. The operation to run is picked from
+    // the reader queue when the request starts, not when it's submitted.
+    struct QueueSlot {
+        uv_work_t request;
+        CardReader *reader;
+        Baton *baton;
     };
 
     struct ConnectInput {
@@ -39,17 +72,132 @@ class CardReader: public Nan::ObjectWrap {
         DWORD card_protocol;
     };
 
+    struct DisconnectInput {
+        DWORD disposition;
+        bool release;
+    };
+
+    // An APDU registered once and completed with the parameters of each call.
+    // The fields in mask are placeholders.
+    struct ApduTemplate {
+        enum { P1 = 1, P2 = 2, DATA = 4, LE = 8 };
+        BYTE header[4];
+        uint32_t mask;
+        std::vector<BYTE> data;
+        bool has_le;
+        BYTE le;
+    };
+
     struct TransmitInput {
         DWORD card_protocol;
         LPBYTE in_data;
         DWORD in_len;
         DWORD out_len;
+        bool plain;
+        // With a template, in_data only holds the data placeholder
+        const ApduTemplate* apdu_template;
+        BYTE p1;
+        BYTE p2;
+        BYTE le;
+        // Milliseconds on the uv_hrtime() clock, 0 unless the timeline is on
+        double queued;
+    };
+
+    // A template sent once per P1 in [first, last], stopping at the first
+    // response that isn't 90 00
+    struct SweepInput {
+        TransmitInput transmit;
+        BYTE first;
+        BYTE last;
+    };
+
+    struct SweepResult {
+        LONG result;
+        const char* wrap_error;
+        std::vector<BYTE> data;
+        std::vector<DWORD> lengths;
+    };
+
+    // Data too long for a short APDU sent in chunks of up to chunk bytes,
+    // either with command chaining or wrapped in ENVELOPE commands
+    struct ChainInput {
+        BYTE header[4];
+        std::vector<BYTE> data;
+        DWORD chunk;
+        bool envelope;
+        int le;                 // -1 if there's none
+        DWORD card_protocol;
+        DWORD out_len;
+        bool plain;
+    };
+
+    struct ChainResult {
+        LONG result;
+        const char* wrap_error;
+        std::vector<BYTE> response;
+        DWORD sent;             // number of commands sent
+        bool aborted;           // an intermediate command didn't get 90 00
+    };
+
+    // Reads checked against the expected data or its digest, in the
+    // threadpool, so the data read doesn't need to reach JavaScript. The
+    // data read by all the APDUs of an item is compared as a whole
+    struct VerifyItem {
+        std::vector<std::vector<BYTE> > apdus;
+        Digest::Kind kind;
+        std::vector<BYTE> expected;
+    };
+
+    struct VerifyInput {
+        std::vector<VerifyItem> items;
+        DWORD card_protocol;
+        DWORD out_len;
+        bool plain;
+    };
+
+    struct VerifyOutcome {
+        bool ok;
+        int sw;                 // -1 if the response had no status word
+        long offset;            // first mismatch comparing bytes, -1 otherwise
+    };
+
+    struct VerifyResult {
+        LONG result;
+        const char* wrap_error;
+        std::vector<VerifyOutcome> outcomes;
+    };
+
+    // What a transmit does when it finds the card reset or removed: reconnect,
+    // send the setup APDUs again and retry, until the deadline
+    struct RecoveryPolicy {
+        std::vector<std::vector<BYTE> > setup;
+        uint32_t deadline;      // ms, 0 if recovery is off
+    };
+
+    // A dispatcher job: an APDU sequence over its own connection to whichever
+    // reader got a matching card
+    struct JobInput {
+        DWORD share_mode;
+        DWORD pref_protocol;
+        DWORD disposition;
+        DWORD res_len;
+        std::vector<std::vector<BYTE> > apdus;
+    };
+
+    struct JobResult {
+        LONG result;
+        const char* method;
+        std::vector<std::vector<BYTE> > responses;
     };
 
     struct TransmitResult {
         LONG result;
+        const char* wrap_error;
         LPBYTE data;
         DWORD len;
+        double locked;
+        double start;
+        double end;
     };
 
     struct ControlInput {
@@ -65,12 +213,80 @@ class CardReader: public Nan::ObjectWrap {
         DWORD len;
     };
 
+    struct ControlCommand {
+        DWORD control_code;
+        std::vector<BYTE> in;
+        DWORD out_len;
+    };
+
+    // Escape commands run back to back in a single threadpool request, the
+    // first failure stops the batch
+    struct ControlBatchResult {
+        LONG result;
+        size_t failed;
+        std::vector<std::vector<BYTE> > out;
+    };
+
+    struct FeaturesResult {
+        LONG result;
+        std::vector<std::pair<BYTE, DWORD> > features;
+    };
+
+    // A run of PC/SC part 3 READ BINARY / UPDATE BINARY pseudo-APDUs. With
+    // authenticate set, a MIFARE Classic key is loaded first and every sector
+    // is authenticated before its first block is accessed.
+    struct MemoryInput {
+        bool write;
+        DWORD start;
+        DWORD length;
+        DWORD block_size;
+        DWORD chunk_size;
+        bool authenticate;
+        BYTE key[6];
+        BYTE key_type;
+        BYTE key_number;
+        std::vector<BYTE> data;
+    };
+
+    struct MemoryResult {
+        LONG result;
+        uint16_t sw;
+        DWORD block;
+        std::vector<BYTE> data;
+    };
+
     struct AsyncResult {
         LONG result;
         DWORD status;
         BYTE atr[MAX_ATR_SIZE];
         DWORD atrlen;
         bool do_exit;
+        bool handle_lost;   // the card connection went with the reader
+        bool rule_run;
+        AccessRule::Outcome rule;
+        double wakeup;
+    };
+
+    // Card presence filter: an event passes when its ATR matches atr under mask
+    // and, if state_mask is not 0, its state has any of those bits set. An
+    // empty atr matches any card.
+    struct AtrFilter {
+        BYTE atr[MAX_ATR_SIZE];
+        BYTE mask[MAX_ATR_SIZE];
+        DWORD atrlen;
+        DWORD state_mask;
+    };
+
+    // Readers being closed: their status threads are joined in a thread of
+    // its own, not in the threadpool, and the result comes back through the
+    // async handle
+    struct CloseBaton {
+        uv_async_t async;
+        uv_thread_t thread;
+        Nan::Persistent<v8::Function> callback;
+        std::vector<CardReader*> readers;
+        std::vector<bool> joined;               // a leader still watching members isn't
+        std::vector<CardReader*> unwatched;     // never monitored, they end here
     };
 
     struct AsyncBaton {
@@ -80,6 +296,42 @@ class CardReader: public Nan::ObjectWrap {
         AsyncResult *async_result;
     };
 
+    // A copy of a status change posted to the shared batch queue
+    struct StatusEvent {
+        AsyncBaton *async_baton;
+        AsyncResult result;
+    };
+
+    // An access rule run for an inserted card, in a thread of its own
+    struct RuleTask {
+        CardReader* reader;
+        AsyncBaton* async_baton;
+        std::shared_ptr<const AccessRule> rule;
+    };
+
+    // The rule of a replayed reader gets the recorded connect, transmit and
+    // control, as they're what a rule sends
+    class ReplayChannel: public AccessRule::Channel {
+
+        public:
+
+            ReplayChannel(CardReader* reader): m_reader(reader) {}
+
+            LONG Connect(DWORD* protocol, const char** method);
+            LONG Transmit(DWORD protocol, const BYTE* in, DWORD in_len, LPBYTE out, DWORD* out_len);
+            LONG Control(DWORD control_code,
+                         const BYTE* in,
+                         DWORD in_len,
+                         LPBYTE out,
+                         DWORD out_size,
+                         DWORD* out_len);
+            void Disconnect() {}
+
+        private:
+
+            CardReader* m_reader;
+    };
+
     public:
 
         static void init(v8::Local<v8::Object> target);
@@ -93,6 +345,8 @@ class CardReader: public Nan::ObjectWrap {
         ~CardReader();
 
         static Nan::Persistent<v8::Function> constructor;
+        // Pass the timings of the operations to JS, see SetTimeline()
+        static std::atomic<bool> s_timeline;
 
         static NAN_METHOD(New);
         static NAN_METHOD(GetStatus);
@@ -101,30 +355,189 @@ class CardReader: public Nan::ObjectWrap {
         static NAN_METHOD(Transmit);
         static NAN_METHOD(Control);
         static NAN_METHOD(Close);
+        static NAN_METHOD(CloseAll);
+        static NAN_METHOD(SetTimeline);
+        static NAN_METHOD(SubmitJob);
+        static NAN_METHOD(TransmitChained);
+        static NAN_METHOD(Verify);
+        static NAN_METHOD(Record);
+        static NAN_METHOD(StopRecording);
+        static NAN_METHOD(Replay);
+        static NAN_METHOD(SetFilters);
+        static NAN_METHOD(GetStats);
+        static NAN_METHOD(ReadMemory);
+        static NAN_METHOD(WriteMemory);
+        static NAN_METHOD(SetSecureMessaging);
+        static NAN_METHOD(ControlBatch);
+        static NAN_METHOD(GetFeatures);
+        static NAN_METHOD(Join);
+        static NAN_METHOD(SetRule);
+        static NAN_METHOD(Seed);
+        static NAN_METHOD(SetRecovery);
+        static NAN_METHOD(CompileApdu);
+        static NAN_METHOD(TransmitTemplate);
+        static NAN_METHOD(TransmitSweep);
 
         static void HandleReaderStatusChange(uv_async_t *handle, int status);
+        static void NotifyStatus(AsyncBaton* async_baton);
+        static void DeliverStatusEvent(void* data);
+        static void DeliverStatus(AsyncBaton* async_baton, const AsyncResult& ar, int state);
+        static v8::Local<v8::Value> ErrorValue(Baton* baton,
+                                               const char* method,
+                                               LONG result,
+                                               const char* detail = NULL);
+        static void Dispatch(CardReader* reader,
+                             const char* type,
+                             v8::Local<v8::Function> callback,
+                             int argc,
+                             v8::Local<v8::Value> argv[]);
         static void HandlerFunction(void* arg);
+        static void ReplayStatus(AsyncBaton* async_baton);
         static void DoConnect(uv_work_t* req);
         static void DoDisconnect(uv_work_t* req);
         static void DoTransmit(uv_work_t* req);
         static void DoControl(uv_work_t* req);
+        static void DoMemory(uv_work_t* req);
+        static void DoControlBatch(uv_work_t* req);
+        static void DoGetFeatures(uv_work_t* req);
+        static void DoSweep(uv_work_t* req);
+        static void DoJob(uv_work_t* req);
+        static void DoChained(uv_work_t* req);
+        static void DoVerify(uv_work_t* req);
+        static void StartJob(CardReader* reader, void* job);
+        static void FailJob(void* job, LONG result);
         static void CloseCallback(uv_handle_t *handle);
+        static void QueueClose(const std::vector<CardReader*>& readers,
+                               v8::Local<v8::Value> callback);
+        static void CloseFunction(void* arg);
+        static void RuleFunction(void* arg);
+        static void AfterClose(uv_async_t* handle, int status);
+        static void DeleteCloseBaton(uv_handle_t* handle);
+        static void QueueOperation(Baton* baton,
+                                   uv_work_cb work_cb,
+                                   uv_after_work_cb after_cb,
+                                   uint32_t flags);
+        static void DoQueued(uv_work_t* req);
+        static void AfterQueued(uv_work_t* req, int status);
+
+        LONG ReplayOperation(uint8_t type, LPBYTE out, DWORD* out_len);
+        LONG TransmitApdu(DWORD protocol, const BYTE* in, DWORD in_len, LPBYTE out, DWORD* out_len);
+        LONG RecoverCard(LONG result, DWORD* protocol);
+        LONG ControlReader(DWORD control_code,
+                           LPCVOID in,
+                           DWORD in_len,
+                           LPVOID out,
+                           DWORD out_len,
+                           DWORD* len);
+        LONG TransmitWrapped(DWORD protocol,
+                             const BYTE* in,
+                             DWORD in_len,
+                             LPBYTE out,
+                             DWORD* out_len,
+                             const char** wrap_error);
+        bool FilterStatus(LONG result, DWORD current, DWORD event, const BYTE* atr, DWORD atrlen);
+        bool UpdateStatus(AsyncBaton* async_baton, SCARD_READERSTATE* state, LONG result);
+        void EndMonitor();
+        bool RecoverMonitor(const std::vector<AsyncBaton*>& watched);
+        DWORD BuildApdu(const TransmitInput* ti, BYTE p1);
+        void Retire();
+        void StartRule(AsyncBaton* async_baton, const SCARD_READERSTATE* state, LONG result);
+        void JoinRule();
+        bool WaitReaderBack();
+        LONG CancelMonitor();
+        bool ReuseParked(DWORD share_mode, DWORD pref_protocol);
+        void ReleaseParked();
+        void CheckParked(LONG result, DWORD event, const BYTE* atr, DWORD atrlen);
+        void CheckSession(const SCARD_READERSTATE* state, LONG result);
+        bool SessionLost() const;
 
         static void AfterConnect(uv_work_t* req, int status);
         static void AfterDisconnect(uv_work_t* req, int status);
         static void AfterTransmit(uv_work_t* req, int status);
         static void AfterControl(uv_work_t* req, int status);
+        static void AfterMemory(uv_work_t* req, int status);
+        static void AfterControlBatch(uv_work_t* req, int status);
+        static void AfterGetFeatures(uv_work_t* req, int status);
+        static void AfterSweep(uv_work_t* req, int status);
+        static void AfterJob(uv_work_t* req, int status);
+        static void AfterChained(uv_work_t* req, int status);
+        static void AfterVerify(uv_work_t* req, int status);
+        static bool ParseTemplateArgs(Nan::NAN_METHOD_ARGS_TYPE info, TransmitInput* ti, uint32_t* flags);
+        static void QueueMemory(Nan::NAN_METHOD_ARGS_TYPE info, MemoryInput* mi, int argn);
 
     private:
 
         SCARDCONTEXT m_card_context;
         SCARDCONTEXT m_status_card_context;
         SCARDHANDLE m_card_handle;
+        DWORD m_card_protocol;
+        DWORD m_pref_protocol;
+        DWORD m_share_mode;
+        // The card the connection is for
+        BYTE m_atr[MAX_ATR_SIZE];
+        DWORD m_atrlen;
+        bool m_keep_alive;
+        int m_batch;            // batch channel, -1 if none
+        bool m_parked;
+        DWORD m_parked_disposition;
+        double m_connections_opened;
+        double m_connections_reused;
         std::string m_name;
+        int m_slot;             // in the StateTable
         uv_thread_t m_status_thread;
         uv_mutex_t m_mutex;
         uv_cond_t m_cond;
         int m_state;
+        bool m_monitor_running;
+        bool m_closing;
+        uv_mutex_t m_io_mutex;
+        uv_mutex_t m_queue_mutex;
+        OperationQueue<Baton> m_queue;
+        // Readers of the same device share the I/O queue of the group leader
+        // and, if they join it before it starts monitoring, its status thread
+        CardReader* m_leader;
+        Nan::Persistent<v8::Object> m_leader_handle;
+        std::vector<CardReader*> m_members;
+        AsyncBaton* m_shared_baton;
+        bool m_shared_monitor;
+        TraceRecorder m_recorder;
+        TracePlayer* m_player;
+        SessionWrapper* m_wrapper;
+        std::shared_ptr<const AccessRule> m_rule;
+        // Started and joined by the status thread, m_rule_running is set
+        // with m_mutex held
+        uv_thread_t m_rule_thread;
+        bool m_rule_started;
+        bool m_rule_running;
+        // Templates live as long as the reader, m_apdu is where they are
+        // assembled (with m_mutex held)
+        std::vector<ApduTemplate*> m_templates;
+        std::vector<BYTE> m_apdu;
+        double m_rules_run;
+        double m_rules_allowed;
+        std::vector<std::pair<BYTE, DWORD> > m_features;
+        bool m_features_cached;
+        std::vector<AtrFilter> m_filters;
+        bool m_card_matched;
+        double m_events_delivered;
+        double m_events_filtered;
+        uint32_t m_debounce;
+        double m_resyncs;
+        bool m_handle_lost;
+        uint32_t m_recover;     // max backoff in ms, 0 if off
+        double m_recoveries;
+        RecoveryPolicy m_recovery;
+        bool m_recovering;
+        bool m_recovery_failed;         // no more tries until a connect
+        DWORD m_recovered_protocol;     // to tell JavaScript, 0 if unchanged
+        double m_card_recoveries;
+        // Set by the status thread without m_mutex, as a transmit may hold
+        // it, when the card of the session goes. m_seen_atr is the card it
+        // last saw, and is only touched by that thread.
+        std::atomic<bool> m_session_lost;
+        BYTE m_seen_atr[MAX_ATR_SIZE];
+        DWORD m_seen_atrlen;
+        double m_failed_fast;
 };
 
 #endif /* CARDREADER_H */
@@ -1,8 +1,15 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stdint.h>
+#include <string>
+
 #define ERR_MSG_MAX_LEN 512
 
+// Bounds of the backoff while waiting for pcscd to come back, in ms
+#define RECOVER_MIN_DELAY 100
+#define RECOVER_MAX_DELAY 5000
+
 #ifdef _WIN32
 #include <windows.h>
 #else
@@ -16,8 +23,8 @@
 
 namespace {
 
-    std::string error_msg(const char* method, LONG result) {
-        char msg[ERR_MSG_MAX_LEN];
+    // Description of a PC/SC return code
+    std::string error_text(LONG result) {
 #ifdef _WIN32
         LPVOID lpMsgBuf;
         FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER |
@@ -29,29 +36,29 @@ namespace {
                        (LPTSTR) &lpMsgBuf,
                        1,
                        NULL);
-        snprintf(msg,
-                 ERR_MSG_MAX_LEN,
-                 "%s error: %s(0x%.8lx)",
-                 method,
-                 lpMsgBuf,
-                 result);
-
+        std::string text(static_cast<const char*>(lpMsgBuf));
         LocalFree(lpMsgBuf);
-#elif  __APPLE__
-        snprintf(msg,
-                 ERR_MSG_MAX_LEN,
-                 "%s error: %s(0x%.8x)",
-                 method,
-                 pcsc_stringify_error(result),
-                 result);   
+        return text;
 #else
+        return pcsc_stringify_error(result);
+#endif
+    }
+
+    // pcscd went away, or came back and the contexts opened before are stale
+    bool service_lost(LONG result) {
+        return (result == (LONG)SCARD_E_NO_SERVICE) ||
+               (result == (LONG)SCARD_E_SERVICE_STOPPED) ||
+               (result == (LONG)SCARD_E_INVALID_HANDLE);
+    }
+
+    std::string error_msg(const char* method, LONG result) {
+        char msg[ERR_MSG_MAX_LEN];
         snprintf(msg,
                  ERR_MSG_MAX_LEN,
                  "%s error: %s(0x%.8lx)",
                  method,
-                 pcsc_stringify_error(result),
-                 result);
-#endif
+                 error_text(result).c_str(),
+                 (unsigned long)(uint32_t)result);
 
         return msg;
     }
@@ -0,0 +1,59 @@
+#include "digest.h"
+#include <openssl/evp.h>
+
+namespace {
+
+    struct Crc32Table {
+        uint32_t entries[256];
+
+        Crc32Table() {
+            for (uint32_t i = 0; i < 256; ++ i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++ k) {
+                    c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+                }
+
+                entries[i] = c;
+            }
+        }
+    };
+}
+
+size_t Digest::Length(Kind kind) {
+    switch (kind) {
+        case CRC32: return 4;
+        case SHA256: return 32;
+        default: return 0;
+    }
+}
+
+bool Digest::Compute(Kind kind, const uint8_t* data, size_t len, uint8_t* out) {
+
+    if (kind == CRC32) {
+        uint32_t crc = Crc32(data, len);
+        out[0] = (uint8_t)(crc >> 24);
+        out[1] = (uint8_t)(crc >> 16);
+        out[2] = (uint8_t)(crc >> 8);
+        out[3] = (uint8_t)crc;
+        return true;
+    }
+
+    if (kind == SHA256) {
+        unsigned int out_len = 0;
+        return (EVP_Digest(data, len, out, &out_len, EVP_sha256(), NULL) == 1) && (out_len == 32);
+    }
+
+    return false;
+}
+
+uint32_t Digest::Crc32(const uint8_t* data, size_t len) {
+
+    // Built on first use, local statics are initialized once across threads
+    static const Crc32Table table;
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; ++ i) {
+        crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xFFFFFFFF;
+}
@@ -0,0 +1,32 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Checksums of the data read back by CardReader::Verify(), computed in the
+ * threadpool so only the outcome crosses into JavaScript.
+ */
+class Digest {
+
+    public:
+
+        enum Kind {
+            BYTES = 0,          // no digest, the expected data itself
+            CRC32 = 1,          // ISO 3309 / zlib CRC-32, big endian
+            SHA256 = 2
+        };
+
+        // Size of the digest of that kind, 0 for BYTES
+        static size_t Length(Kind kind);
+
+        // It writes Length(kind) bytes to out, false if it can't be computed
+        static bool Compute(Kind kind, const uint8_t* data, size_t len, uint8_t* out);
+
+    private:
+
+        static uint32_t Crc32(const uint8_t* data, size_t len);
+};
+
+#endif /* DIGEST_H */
@@ -0,0 +1,324 @@
+#include "dispatcher.h"
+#include <assert.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+bool Dispatcher::s_initialized = false;
+Dispatcher::StartFunction Dispatcher::s_start = NULL;
+Dispatcher::FailFunction Dispatcher::s_fail = NULL;
+uv_async_t Dispatcher::s_async;
+uv_timer_t Dispatcher::s_timer;
+uv_mutex_t Dispatcher::s_mutex;
+size_t Dispatcher::s_pending = 0;
+std::map<std::string, Dispatcher::Profile*> Dispatcher::s_profiles;
+std::unordered_map<CardReader*, Dispatcher::Entry> Dispatcher::s_readers;
+
+void Dispatcher::Init(StartFunction start, FailFunction fail) {
+
+    if (s_initialized) {
+        return;
+    }
+
+    assert(uv_mutex_init(&s_mutex) == 0);
+    uv_async_init(uv_default_loop(), &s_async, (uv_async_cb)AsyncCallback);
+    // Only waiting jobs keep the loop alive
+    uv_unref(reinterpret_cast<uv_handle_t*>(&s_async));
+    uv_timer_init(uv_default_loop(), &s_timer);
+    uv_unref(reinterpret_cast<uv_handle_t*>(&s_timer));
+    s_start = start;
+    s_fail = fail;
+    s_initialized = true;
+}
+
+void Dispatcher::AddReader(CardReader* reader) {
+
+    uv_mutex_lock(&s_mutex);
+    Entry entry = Entry();
+    s_readers[reader] = entry;
+    uv_mutex_unlock(&s_mutex);
+}
+
+void Dispatcher::RemoveReader(CardReader* reader) {
+
+    uv_mutex_lock(&s_mutex);
+    s_readers.erase(reader);
+    for (std::map<std::string, Profile*>::iterator it = s_profiles.begin(); it != s_profiles.end(); ++ it) {
+        it->second->idle.erase(reader);
+    }
+
+    uv_mutex_unlock(&s_mutex);
+}
+
+void Dispatcher::Update(CardReader* reader, bool present, const uint8_t* atr, size_t atrlen) {
+
+    uv_mutex_lock(&s_mutex);
+    std::unordered_map<CardReader*, Entry>::iterator it = s_readers.find(reader);
+    bool wanted = false;
+    if (it != s_readers.end()) {
+        Entry& entry = it->second;
+        entry.present = present;
+        entry.atrlen = (present && atrlen <= MAX_ATR) ? atrlen : 0;
+        if (entry.atrlen) {
+            memcpy(entry.atr, atr, entry.atrlen);
+        }
+
+        // A claimed reader is indexed again when it's released
+        wanted = !entry.claimed && Index(reader, entry);
+    }
+
+    uv_mutex_unlock(&s_mutex);
+    if (wanted) {
+        uv_async_send(&s_async);
+    }
+}
+
+void Dispatcher::SetConnected(CardReader* reader, bool connected) {
+
+    uv_mutex_lock(&s_mutex);
+    std::unordered_map<CardReader*, Entry>::iterator it = s_readers.find(reader);
+    bool wanted = false;
+    if (it != s_readers.end()) {
+        it->second.connected = connected;
+        wanted = !it->second.claimed && Index(reader, it->second);
+    }
+
+    uv_mutex_unlock(&s_mutex);
+    if (wanted) {
+        uv_async_send(&s_async);
+    }
+}
+
+void Dispatcher::Submit(const uint8_t* atr,
+                        const uint8_t* mask,
+                        size_t atrlen,
+                        void* job,
+                        const void* owner,
+                        uint32_t timeout) {
+
+    assert(atrlen <= MAX_ATR);
+    std::string key(reinterpret_cast<const char*>(atr), atrlen);
+    key.append(reinterpret_cast<const char*>(mask), atrlen);
+
+    Job pending;
+    pending.job = job;
+    pending.owner = owner;
+    pending.deadline = timeout ? uv_now(uv_default_loop()) + timeout : 0;
+
+    uv_mutex_lock(&s_mutex);
+    Profile*& profile = s_profiles[key];
+    if (!profile) {
+        // A new profile starts with the idle readers that match it
+        profile = new Profile();
+        memcpy(profile->atr, atr, atrlen);
+        memcpy(profile->mask, mask, atrlen);
+        profile->atrlen = atrlen;
+        for (std::unordered_map<CardReader*, Entry>::iterator it = s_readers.begin(); it != s_readers.end(); ++ it) {
+            if (!it->second.claimed && Matches(profile, it->second)) {
+                profile->idle.insert(it->first);
+            }
+        }
+    }
+
+    profile->pending.push_back(pending);
+    if (s_pending ++ == 0) {
+        uv_ref(reinterpret_cast<uv_handle_t*>(&s_async));
+    }
+
+    uv_mutex_unlock(&s_mutex);
+    Pump();
+}
+
+void Dispatcher::Cancel(const void* owner) {
+
+    if (!s_initialized) {
+        return;
+    }
+
+    std::vector<void*> jobs;
+    uv_mutex_lock(&s_mutex);
+    Take(owner, 0, &jobs);
+    uv_mutex_unlock(&s_mutex);
+
+    for (size_t i = 0; i < jobs.size(); ++ i) {
+        s_fail(jobs[i], SCARD_E_CANCELLED);
+    }
+
+    Schedule();
+}
+
+void Dispatcher::Release(CardReader* reader) {
+
+    uv_mutex_lock(&s_mutex);
+    std::unordered_map<CardReader*, Entry>::iterator it = s_readers.find(reader);
+    if (it != s_readers.end()) {
+        it->second.claimed = false;
+        Index(reader, it->second);
+    }
+
+    uv_mutex_unlock(&s_mutex);
+    Pump();
+}
+
+size_t Dispatcher::Pending() {
+
+    uv_mutex_lock(&s_mutex);
+    size_t pending = s_pending;
+    uv_mutex_unlock(&s_mutex);
+    return pending;
+}
+
+bool Dispatcher::Matches(const Profile* profile, const Entry& entry) {
+
+    // The application's own connection isn't shared with the jobs
+    if (!entry.present || entry.connected) {
+        return false;
+    }
+
+    if (profile->atrlen == 0) {
+        return true;
+    }
+
+    if (profile->atrlen != entry.atrlen) {
+        return false;
+    }
+
+    for (size_t i = 0; i < entry.atrlen; ++ i) {
+        if ((entry.atr[i] ^ profile->atr[i]) & profile->mask[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Dispatcher::Index(CardReader* reader, const Entry& entry) {
+
+    // The caller holds s_mutex
+    bool wanted = false;
+    for (std::map<std::string, Profile*>::iterator it = s_profiles.begin(); it != s_profiles.end(); ++ it) {
+        Profile* profile = it->second;
+        if (Matches(profile, entry)) {
+            profile->idle.insert(reader);
+            wanted = wanted || !profile->pending.empty();
+        } else {
+            profile->idle.erase(reader);
+        }
+    }
+
+    return wanted;
+}
+
+void Dispatcher::Pump() {
+
+    // Claim the readers under the lock, start the jobs without it
+    std::vector<std::pair<CardReader*, void*> > started;
+    uv_mutex_lock(&s_mutex);
+    for (std::map<std::string, Profile*>::iterator it = s_profiles.begin(); it != s_profiles.end(); ) {
+        Profile* profile = it->second;
+        while (!profile->pending.empty() && !profile->idle.empty()) {
+            CardReader* reader = *profile->idle.begin();
+            s_readers[reader].claimed = true;
+            for (std::map<std::string, Profile*>::iterator p = s_profiles.begin(); p != s_profiles.end(); ++ p) {
+                p->second->idle.erase(reader);
+            }
+
+            started.push_back(std::make_pair(reader, profile->pending.front().job));
+            profile->pending.pop_front();
+        }
+
+        // Only the profiles with waiting jobs are kept up to date
+        if (profile->pending.empty()) {
+            delete profile;
+            s_profiles.erase(it ++);
+        } else {
+            ++ it;
+        }
+    }
+
+    s_pending -= started.size();
+    if (!started.empty() && (s_pending == 0)) {
+        uv_unref(reinterpret_cast<uv_handle_t*>(&s_async));
+    }
+
+    uv_mutex_unlock(&s_mutex);
+
+    for (size_t i = 0; i < started.size(); ++ i) {
+        s_start(started[i].first, started[i].second);
+    }
+
+    Schedule();
+}
+
+void Dispatcher::Take(const void* owner, uint64_t now, std::vector<void*>* jobs) {
+
+    // The caller holds s_mutex
+    for (std::map<std::string, Profile*>::iterator it = s_profiles.begin(); it != s_profiles.end(); ) {
+        Profile* profile = it->second;
+        std::deque<Job> kept;
+        for (size_t i = 0; i < profile->pending.size(); ++ i) {
+            const Job& job = profile->pending[i];
+            bool taken = now ? (job.deadline && job.deadline <= now) : (!owner || job.owner == owner);
+            if (taken) {
+                jobs->push_back(job.job);
+            } else {
+                kept.push_back(job);
+            }
+        }
+
+        profile->pending.swap(kept);
+        if (profile->pending.empty()) {
+            delete profile;
+            s_profiles.erase(it ++);
+        } else {
+            ++ it;
+        }
+    }
+
+    s_pending -= jobs->size();
+    if (!jobs->empty() && (s_pending == 0)) {
+        uv_unref(reinterpret_cast<uv_handle_t*>(&s_async));
+    }
+}
+
+void Dispatcher::Schedule() {
+
+    // The timer fires for the job due first
+    uint64_t next = 0;
+    uv_mutex_lock(&s_mutex);
+    for (std::map<std::string, Profile*>::iterator it = s_profiles.begin(); it != s_profiles.end(); ++ it) {
+        const std::deque<Job>& pending = it->second->pending;
+        for (size_t i = 0; i < pending.size(); ++ i) {
+            if (pending[i].deadline && (!next || pending[i].deadline < next)) {
+                next = pending[i].deadline;
+            }
+        }
+    }
+
+    uv_mutex_unlock(&s_mutex);
+    if (!next) {
+        uv_timer_stop(&s_timer);
+        return;
+    }
+
+    uint64_t now = uv_now(uv_default_loop());
+    uv_timer_start(&s_timer, (uv_timer_cb)TimerCallback, next > now ? next - now : 0, 0);
+}
+
+void Dispatcher::AsyncCallback(uv_async_t* handle, int status) {
+    Pump();
+}
+
+void Dispatcher::TimerCallback(uv_timer_t* handle, int status) {
+
+    std::vector<void*> jobs;
+    uv_mutex_lock(&s_mutex);
+    Take(NULL, uv_now(uv_default_loop()), &jobs);
+    uv_mutex_unlock(&s_mutex);
+
+    for (size_t i = 0; i < jobs.size(); ++ i) {
+        s_fail(jobs[i], SCARD_E_TIMEOUT);
+    }
+
+    Schedule();
+}
@@ -0,0 +1,118 @@
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+
+#include <nan.h>
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#ifdef __APPLE__
+#include <PCSC/winscard.h>
+#include <PCSC/wintypes.h>
+#else
+#include <winscard.h>
+#endif
+
+class CardReader;
+
+/*
+ * Routes jobs to whichever reader holds a matching card. It keeps, for every
+ * ATR profile (an ATR and a mask) jobs are waiting for, the set of idle
+ * readers whose card matches it, updated by the monitor threads as cards come
+ * and go. Picking a reader for a job is then taking any of them, no matter how
+ * many readers there are. A reader is claimed by a single job at a time and
+ * only becomes idle again once the job is released. A reader the application
+ * is connected to isn't idle either.
+ *
+ * Update() and SetConnected() may be called from any thread, the rest from the
+ * main thread. The jobs are opaque: the start function passed to Init() runs
+ * them, and the fail function ends the ones that timed out or were cancelled.
+ */
+class Dispatcher {
+
+    public:
+
+        typedef void (*StartFunction)(CardReader* reader, void* job);
+        typedef void (*FailFunction)(void* job, LONG result);
+
+        // MAX_ATR_SIZE is 33 in pcsc-lite but 36 on Windows
+        enum { MAX_ATR = 36 };
+
+        static void Init(StartFunction start, FailFunction fail);
+
+        static void AddReader(CardReader* reader);
+        static void RemoveReader(CardReader* reader);
+
+        // The card of the reader changed, present is false when there's none
+        static void Update(CardReader* reader, bool present, const uint8_t* atr, size_t atrlen);
+
+        // The application opened or closed its own connection to the reader
+        static void SetConnected(CardReader* reader, bool connected);
+
+        // The job waits for an idle reader whose card matches atr under mask,
+        // for timeout ms if it's not 0. An empty atr matches any card.
+        static void Submit(const uint8_t* atr,
+                           const uint8_t* mask,
+                           size_t atrlen,
+                           void* job,
+                           const void* owner,
+                           uint32_t timeout);
+
+        // It fails the waiting jobs of owner with SCARD_E_CANCELLED
+        static void Cancel(const void* owner);
+
+        // The job that claimed the reader is done
+        static void Release(CardReader* reader);
+
+        static size_t Pending();
+
+    private:
+
+        struct Job {
+            void* job;
+            const void* owner;
+            uint64_t deadline;  // uv_now() ms, 0 if it waits forever
+        };
+
+        struct Profile {
+            uint8_t atr[MAX_ATR];
+            uint8_t mask[MAX_ATR];
+            size_t atrlen;
+            std::unordered_set<CardReader*> idle;
+            std::deque<Job> pending;
+        };
+
+        struct Entry {
+            bool present;
+            bool claimed;
+            bool connected;
+            uint8_t atr[MAX_ATR];
+            size_t atrlen;
+        };
+
+        static bool Matches(const Profile* profile, const Entry& entry);
+        // They return whether a job is waiting for the reader
+        static bool Index(CardReader* reader, const Entry& entry);
+        static void Pump();
+        // With s_mutex held, it takes the jobs of owner (all of them if NULL)
+        // or those due by now (if not 0) out of the profiles
+        static void Take(const void* owner, uint64_t now, std::vector<void*>* jobs);
+        static void Schedule();
+        static void AsyncCallback(uv_async_t* handle, int status);
+        static void TimerCallback(uv_timer_t* handle, int status);
+
+        static bool s_initialized;
+        static StartFunction s_start;
+        static FailFunction s_fail;
+        static uv_async_t s_async;
+        static uv_timer_t s_timer;
+        static uv_mutex_t s_mutex;
+        static size_t s_pending;
+        static std::map<std::string, Profile*> s_profiles;
+        static std::unordered_map<CardReader*, Entry> s_readers;
+};
+
+#endif /* DISPATCHER_H */
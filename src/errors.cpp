@@ -0,0 +1,167 @@
+#include "errors.h"
+#include "common.h"
+
+using namespace v8;
+
+Nan::Persistent<Function> PCSCError::constructor;
+
+namespace {
+
+    // Indexed by code - 0x80100000
+    const char* error_names[] = {
+        "SCARD_S_SUCCESS",
+        "SCARD_F_INTERNAL_ERROR",
+        "SCARD_E_CANCELLED",
+        "SCARD_E_INVALID_HANDLE",
+        "SCARD_E_INVALID_PARAMETER",
+        "SCARD_E_INVALID_TARGET",
+        "SCARD_E_NO_MEMORY",
+        "SCARD_F_WAITED_TOO_LONG",
+        "SCARD_E_INSUFFICIENT_BUFFER",
+        "SCARD_E_UNKNOWN_READER",
+        "SCARD_E_TIMEOUT",
+        "SCARD_E_SHARING_VIOLATION",
+        "SCARD_E_NO_SMARTCARD",
+        "SCARD_E_UNKNOWN_CARD",
+        "SCARD_E_CANT_DISPOSE",
+        "SCARD_E_PROTO_MISMATCH",
+        "SCARD_E_NOT_READY",
+        "SCARD_E_INVALID_VALUE",
+        "SCARD_E_SYSTEM_CANCELLED",
+        "SCARD_F_COMM_ERROR",
+        "SCARD_F_UNKNOWN_ERROR",
+        "SCARD_E_INVALID_ATR",
+        "SCARD_E_NOT_TRANSACTED",
+        "SCARD_E_READER_UNAVAILABLE",
+        "SCARD_P_SHUTDOWN",
+        "SCARD_E_PCI_TOO_SMALL",
+        "SCARD_E_READER_UNSUPPORTED",
+        "SCARD_E_DUPLICATE_READER",
+        "SCARD_E_CARD_UNSUPPORTED",
+        "SCARD_E_NO_SERVICE",
+        "SCARD_E_SERVICE_STOPPED",
+        "SCARD_E_UNEXPECTED",
+        "SCARD_E_ICC_INSTALLATION",
+        "SCARD_E_ICC_CREATEORDER",
+        "SCARD_E_UNSUPPORTED_FEATURE",
+        "SCARD_E_DIR_NOT_FOUND",
+        "SCARD_E_FILE_NOT_FOUND",
+        "SCARD_E_NO_DIR",
+        "SCARD_E_NO_FILE",
+        "SCARD_E_NO_ACCESS",
+        "SCARD_E_WRITE_TOO_MANY",
+        "SCARD_E_BAD_SEEK",
+        "SCARD_E_INVALID_CHV",
+        "SCARD_E_UNKNOWN_RES_MNG",
+        "SCARD_E_NO_SUCH_CERTIFICATE",
+        "SCARD_E_CERTIFICATE_UNAVAILABLE",
+        "SCARD_E_NO_READERS_AVAILABLE",
+        "SCARD_E_COMM_DATA_LOST",
+        "SCARD_E_NO_KEY_CONTAINER",
+        "SCARD_E_SERVER_TOO_BUSY"
+    };
+
+    // Indexed by code - 0x80100065
+    const char* warning_names[] = {
+        "SCARD_W_UNSUPPORTED_CARD",
+        "SCARD_W_UNRESPONSIVE_CARD",
+        "SCARD_W_UNPOWERED_CARD",
+        "SCARD_W_RESET_CARD",
+        "SCARD_W_REMOVED_CARD",
+        "SCARD_W_SECURITY_VIOLATION",
+        "SCARD_W_WRONG_CHV",
+        "SCARD_W_CHV_BLOCKED",
+        "SCARD_W_EOF",
+        "SCARD_W_CANCELLED_BY_USER",
+        "SCARD_W_CARD_NOT_AUTHENTICATED"
+    };
+}
+
+void PCSCError::init(Local<Object> target) {
+    Nan::SetMethod(target, "set_error_constructor", SetConstructor);
+    Nan::SetMethod(target, "describe_error", Describe);
+    Nan::SetMethod(target, "error_name", GetName);
+}
+
+const char* PCSCError::Name(LONG code) {
+
+    uint32_t value = static_cast<uint32_t>(code);
+    if (value == 0) {
+        return error_names[0];
+    }
+
+    if ((value > 0x80100000) && (value < 0x80100000 + sizeof(error_names) / sizeof(error_names[0]))) {
+        return error_names[value - 0x80100000];
+    }
+
+    if ((value >= 0x80100065) && (value < 0x80100065 + sizeof(warning_names) / sizeof(warning_names[0]))) {
+        return warning_names[value - 0x80100065];
+    }
+
+    return NULL;
+}
+
+Local<Value> PCSCError::New(const char* method, LONG code, const char* detail) {
+
+    const char* name = Name(code);
+    if (constructor.IsEmpty()) {
+        // Not registered: a regular Error with the message already built
+        std::string msg = error_msg(method, code);
+        if (detail) {
+            msg = msg + ": " + detail;
+        }
+
+        Local<Object> err = Nan::To<Object>(Nan::Error(msg.c_str())).ToLocalChecked();
+        Nan::Set(err, Nan::New("code").ToLocalChecked(), Nan::New<Number>(static_cast<uint32_t>(code)));
+        Nan::Set(err, Nan::New("name").ToLocalChecked(), Nan::New(name ? name : "PCSCError").ToLocalChecked());
+        Nan::Set(err, Nan::New("method").ToLocalChecked(), Nan::New(method).ToLocalChecked());
+        return err;
+    }
+
+    const int argc = 4;
+    Local<Value> argv[argc] = {
+        Nan::New(method).ToLocalChecked(),
+        Nan::New<Number>(static_cast<uint32_t>(code)),
+        Nan::New(name ? name : "PCSCError").ToLocalChecked(),
+        detail ? Local<Value>(Nan::New(detail).ToLocalChecked()) : Local<Value>(Nan::Undefined())
+    };
+
+    return Nan::NewInstance(Nan::New(constructor), argc, argv).ToLocalChecked();
+}
+
+NAN_METHOD(PCSCError::SetConstructor) {
+
+    Nan::HandleScope scope;
+
+    if (!info[0]->IsFunction()) {
+        return Nan::ThrowError("First argument must be a function");
+    }
+
+    constructor.Reset(Local<Function>::Cast(info[0]));
+}
+
+NAN_METHOD(PCSCError::Describe) {
+
+    Nan::HandleScope scope;
+
+    if (!info[0]->IsNumber()) {
+        return Nan::ThrowError("First argument must be a number");
+    }
+
+    LONG code = static_cast<LONG>(Nan::To<uint32_t>(info[0]).FromJust());
+    info.GetReturnValue().Set(Nan::New(error_text(code)).ToLocalChecked());
+}
+
+NAN_METHOD(PCSCError::GetName) {
+
+    Nan::HandleScope scope;
+
+    if (!info[0]->IsNumber()) {
+        return Nan::ThrowError("First argument must be a number");
+    }
+
+    const char* name = Name(static_cast<LONG>(Nan::To<uint32_t>(info[0]).FromJust()));
+    if (name) {
+        info.GetReturnValue().Set(Nan::New(name).ToLocalChecked());
+    }
+}
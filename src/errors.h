@@ -0,0 +1,40 @@
+#ifndef ERRORS_H
+#define ERRORS_H
+
+#include <nan.h>
+#ifdef __APPLE__
+#include <PCSC/winscard.h>
+#include <PCSC/wintypes.h>
+#else
+#include <winscard.h>
+#endif
+
+/*
+ * Errors of the PC/SC calls. They carry the numeric code, its symbolic name
+ * and the failed method, and only build their message when it's read: they
+ * are built by the constructor registered from JS, whose prototype has a lazy
+ * message getter, so nothing formats strings nor captures stacks when they
+ * are created and they all share the same shape. Failures the addon detects
+ * itself get a PC/SC code too, and say what happened in detail.
+ */
+class PCSCError {
+
+    public:
+
+        static void init(v8::Local<v8::Object> target);
+
+        static v8::Local<v8::Value> New(const char* method, LONG code, const char* detail = NULL);
+
+        // It returns NULL for unknown codes
+        static const char* Name(LONG code);
+
+    private:
+
+        static NAN_METHOD(SetConstructor);
+        static NAN_METHOD(Describe);
+        static NAN_METHOD(GetName);
+
+        static Nan::Persistent<v8::Function> constructor;
+};
+
+#endif /* ERRORS_H */
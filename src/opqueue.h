@@ -0,0 +1,93 @@
+#ifndef OPQUEUE_H
+#define OPQUEUE_H
+
+#include <deque>
+#include <stddef.h>
+
+/*
+ * Per reader queue of pending operations. Operations are served from the
+ * highest priority level first and in FIFO order within a level. To avoid
+ * starving the lower levels, every time a level is passed over while it has
+ * work pending its skip counter grows, and once it reaches STARVATION_LIMIT the
+ * level is served next regardless of its priority.
+ *
+ * The queue is not thread safe: callers must hold the owner's lock.
+ */
+template <typename T>
+class OperationQueue {
+
+    public:
+
+        enum {
+            PRIORITY_INTERACTIVE = 0,
+            PRIORITY_NORMAL = 1,
+            PRIORITY_BULK = 2,
+            LEVELS = 3
+        };
+
+        enum { STARVATION_LIMIT = 8 };
+
+        OperationQueue(): m_size(0) {
+            for (int i = 0; i < LEVELS; ++ i) {
+                m_skipped[i] = 0;
+            }
+        }
+
+        void Push(T* item, int priority) {
+            if ((priority < 0) || (priority >= LEVELS)) {
+                priority = PRIORITY_NORMAL;
+            }
+
+            m_levels[priority].push_back(item);
+            ++ m_size;
+        }
+
+        T* Pop() {
+            if (m_size == 0) {
+                return NULL;
+            }
+
+            int level = -1;
+            /* A starved level wins, lowest priority first */
+            for (int i = LEVELS - 1; i >= 0; -- i) {
+                if (!m_levels[i].empty() && (m_skipped[i] >= STARVATION_LIMIT)) {
+                    level = i;
+                    break;
+                }
+            }
+
+            if (level == -1) {
+                for (int i = 0; i < LEVELS; ++ i) {
+                    if (!m_levels[i].empty()) {
+                        level = i;
+                        break;
+                    }
+                }
+            }
+
+            for (int i = 0; i < LEVELS; ++ i) {
+                if (i == level) {
+                    m_skipped[i] = 0;
+                } else if (!m_levels[i].empty()) {
+                    ++ m_skipped[i];
+                }
+            }
+
+            T* item = m_levels[level].front();
+            m_levels[level].pop_front();
+            -- m_size;
+            return item;
+        }
+
+        size_t Size() const { return m_size; }
+
+        size_t Size(int priority) const { return m_levels[priority].size(); }
+
+    private:
+
+        std::deque<T*> m_levels[LEVELS];
+        unsigned int m_skipped[LEVELS];
+        size_t m_size;
+};
+
+#endif /* OPQUEUE_H */
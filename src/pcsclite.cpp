@@ -1,5 +1,7 @@
 #include "pcsclite.h"
 #include "common.h"
+#include "dispatcher.h"
+#include "errors.h"
 
 using namespace v8;
 using namespace node;
@@ -24,7 +26,11 @@ void PCSCLite::init(Local<Object> target) {
 PCSCLite::PCSCLite(): m_card_context(0),
                       m_card_reader_state(),
                       m_status_thread(0),
-                      m_state(0) {
+                      m_state(0),
+                      m_monitor_running(false),
+                      m_closing(false),
+                      m_debounce(0),
+                      m_recover(0) {
 
     assert(uv_mutex_init(&m_mutex) == 0);
     assert(uv_cond_init(&m_cond) == 0);
@@ -70,6 +76,24 @@ NAN_METHOD(PCSCLite::New) {
     Nan::HandleScope scope;
     PCSCLite* obj = new PCSCLite();
     obj->Wrap(info.Holder());
+
+    // The optional first argument holds the options
+    if (info[0]->IsObject()) {
+        Local<Object> options = Nan::To<Object>(info[0]).ToLocalChecked();
+        Local<Value> debounce = Nan::Get(options, Nan::New("debounce").ToLocalChecked()).ToLocalChecked();
+        if (debounce->IsUint32()) {
+            obj->m_debounce = Nan::To<uint32_t>(debounce).ToChecked();
+        }
+
+        Local<Value> recover = Nan::Get(options, Nan::New("recover").ToLocalChecked()).ToLocalChecked();
+        if (recover->IsUint32()) {
+            uint32_t delay = Nan::To<uint32_t>(recover).ToChecked();
+            obj->m_recover = (delay && (delay < RECOVER_MIN_DELAY)) ? RECOVER_MIN_DELAY : delay;
+        } else if (recover->IsTrue()) {
+            obj->m_recover = RECOVER_MAX_DELAY;
+        }
+    }
+
     info.GetReturnValue().Set(info.Holder());
 }
 
@@ -86,6 +110,7 @@ NAN_METHOD(PCSCLite::Start) {
     async_baton->pcsclite = obj;
 
     uv_async_init(uv_default_loop(), &async_baton->async, (uv_async_cb)HandleReaderStatusChange);
+    obj->m_monitor_running = true;
     int ret = uv_thread_create(&obj->m_status_thread, HandlerFunction, async_baton);
     assert(ret == 0);
 
@@ -98,32 +123,95 @@ NAN_METHOD(PCSCLite::Close) {
 
     PCSCLite* obj = Nan::ObjectWrap::Unwrap<PCSCLite>(info.This());
 
+    // The monitor thread is only cancelled here, waiting for it to finish
+    // happens in a helper thread so neither the event loop nor the threadpool
+    // is blocked.
     LONG result = SCARD_S_SUCCESS;
-    if (obj->m_pnp) {
-        if (obj->m_status_thread) {
-            uv_mutex_lock(&obj->m_mutex);
-            if (obj->m_state == 0) {
-                int ret;
-                int times = 0;
-                obj->m_state = 1;
-                do {
-                    result = SCardCancel(obj->m_card_context);
-                    ret = uv_cond_timedwait(&obj->m_cond, &obj->m_mutex, 10000000);
-                } while ((ret != 0) && (++ times < 5));
-            }
-
-            uv_mutex_unlock(&obj->m_mutex);
+    uv_mutex_lock(&obj->m_mutex);
+    if (obj->m_state == 0) {
+        obj->m_state = 1;
+        if (obj->m_pnp && obj->m_status_thread) {
+            result = SCardCancel(obj->m_card_context);
         }
+
+        uv_cond_broadcast(&obj->m_cond);
+    }
+
+    uv_mutex_unlock(&obj->m_mutex);
+
+    // The jobs still waiting for a reader would keep the process alive
+    Dispatcher::Cancel(static_cast<Nan::ObjectWrap*>(obj));
+
+    CloseBaton* baton = new CloseBaton();
+    baton->async.data = baton;
+    baton->pcsclite = NULL;
+    if (info[0]->IsFunction()) {
+        baton->callback.Reset(Local<Function>::Cast(info[0]));
+    }
+
+    // Only one close request joins the monitor thread
+    if (obj->m_status_thread && !obj->m_closing) {
+        obj->m_closing = true;
+        obj->Ref();
+        baton->pcsclite = obj;
+    }
+
+    uv_async_init(uv_default_loop(), &baton->async, (uv_async_cb)AfterClose);
+    if (baton->pcsclite) {
+        int ret = uv_thread_create(&baton->thread, CloseFunction, baton);
+        assert(ret == 0);
     } else {
-        obj->m_state = 1;
+        uv_async_send(&baton->async);
     }
 
-    if (obj->m_status_thread) {
-        assert(uv_thread_join(&obj->m_status_thread) == 0);
+    info.GetReturnValue().Set(Nan::New<Number>(result));
+}
+
+void PCSCLite::CloseFunction(void* arg) {
+
+    CloseBaton* baton = static_cast<CloseBaton*>(arg);
+    PCSCLite* obj = baton->pcsclite;
+
+    uv_mutex_lock(&obj->m_mutex);
+    // The cancel may have reached pcscd before the monitor thread started
+    // waiting, so keep cancelling until the thread is done.
+    while (obj->m_monitor_running) {
+        if ((uv_cond_timedwait(&obj->m_cond, &obj->m_mutex, 10000000) != 0) && obj->m_pnp) {
+            SCardCancel(obj->m_card_context);
+        }
+    }
+
+    uv_mutex_unlock(&obj->m_mutex);
+    assert(uv_thread_join(&obj->m_status_thread) == 0);
+    uv_async_send(&baton->async);
+}
+
+void PCSCLite::AfterClose(uv_async_t* handle, int status) {
+
+    Nan::HandleScope scope;
+    CloseBaton* baton = static_cast<CloseBaton*>(handle->data);
+    PCSCLite* obj = baton->pcsclite;
+    if (obj) {
+        // Done by now, it only had to send the async
+        assert(uv_thread_join(&baton->thread) == 0);
         obj->m_status_thread = 0;
+        obj->m_closing = false;
+        obj->Unref();
     }
 
-    info.GetReturnValue().Set(Nan::New<Number>(result));
+    if (!baton->callback.IsEmpty()) {
+        const unsigned argc = 1;
+        Local<Value> argv[argc] = { Nan::Null() };
+        Nan::Call(Nan::Callback(Nan::New(baton->callback)), argc, argv);
+    }
+
+    // The callback is a permanent handle, so we have to dispose of it manually.
+    baton->callback.Reset();
+    uv_close(reinterpret_cast<uv_handle_t*>(&baton->async), DeleteCloseBaton);
+}
+
+void PCSCLite::DeleteCloseBaton(uv_handle_t* handle) {
+    delete static_cast<CloseBaton*>(handle->data);
 }
 
 void PCSCLite::HandleReaderStatusChange(uv_async_t *handle, int status) {
@@ -131,41 +219,53 @@ void PCSCLite::HandleReaderStatusChange(uv_async_t *handle, int status) {
     Nan::HandleScope scope;
 
     AsyncBaton* async_baton = static_cast<AsyncBaton*>(handle->data);
+    PCSCLite* pcsclite = async_baton->pcsclite;
     AsyncResult* ar = async_baton->async_result;
 
-    if (async_baton->pcsclite->m_state == 1) {
+    uv_mutex_lock(&pcsclite->m_mutex);
+    LONG result = ar->result;
+    bool do_exit = ar->do_exit;
+    Local<Value> argv[4];
+    if ((result == SCARD_S_SUCCESS) || (result == (LONG)SCARD_E_NO_READERS_AVAILABLE)) {
+        argv[0] = Nan::Undefined();
+        argv[1] = Nan::CopyBuffer(ar->readers_name.data(), ar->readers_name.size()).ToLocalChecked();
+        argv[2] = Nan::New<Boolean>(ar->resync);
+        // The state and ATR of every reader, keyed by name
+        Local<Object> snapshot = Nan::New<Object>();
+        for (size_t i = 0; i < ar->snapshot.size(); ++ i) {
+            const ReaderSnapshot& rs = ar->snapshot[i];
+            Local<Object> status = Nan::New<Object>();
+            Nan::Set(status, Nan::New("state").ToLocalChecked(), Nan::New<Number>(rs.state));
+            if (!rs.atr.empty()) {
+                Nan::Set(status,
+                         Nan::New("atr").ToLocalChecked(),
+                         Nan::CopyBuffer(reinterpret_cast<const char*>(&rs.atr[0]), rs.atr.size()).ToLocalChecked());
+            }
+
+            Nan::Set(snapshot, Nan::New(rs.name).ToLocalChecked(), status);
+        }
+
+        argv[3] = snapshot;
+    } else {
+        argv[0] = PCSCError::New(ar->err_method, result);
+    }
+
+    uv_mutex_unlock(&pcsclite->m_mutex);
+
+    if (pcsclite->m_state == 1) {
         // Swallow events : Listening thread was cancelled by user.
-    } else if ((ar->result == SCARD_S_SUCCESS) ||
-               (ar->result == (LONG)SCARD_E_NO_READERS_AVAILABLE)) {
-        const unsigned argc = 2;
-        Local<Value> argv[argc] = {
-            Nan::Undefined(), // argument
-            Nan::CopyBuffer(ar->readers_name, ar->readers_name_length).ToLocalChecked()
-        };
-
-        Nan::Call(Nan::Callback(Nan::New(async_baton->callback)), argc, argv);
+    } else if ((result == SCARD_S_SUCCESS) ||
+               (result == (LONG)SCARD_E_NO_READERS_AVAILABLE)) {
+        Nan::Call(Nan::Callback(Nan::New(async_baton->callback)), 4, argv);
     } else {
-        Local<Value> argv[1] = { Nan::Error(ar->err_msg.c_str()) };
         Nan::Call(Nan::Callback(Nan::New(async_baton->callback)), 1, argv);
     }
 
     // Do exit, after throwing last events
-    if (ar->do_exit) {
+    if (do_exit) {
         // necessary otherwise UV will block
         uv_close(reinterpret_cast<uv_handle_t*>(&async_baton->async), CloseCallback);
-        return;
     }
-
-    /* reset AsyncResult */
-#ifdef SCARD_AUTOALLOCATE
-    PCSCLite* pcsclite = async_baton->pcsclite;
-    SCardFreeMemory(pcsclite->m_card_context, ar->readers_name);
-#else
-    delete [] ar->readers_name;
-#endif
-    ar->readers_name = NULL;
-    ar->readers_name_length = 0;
-    ar->result = SCARD_S_SUCCESS;
 }
 
 void PCSCLite::HandlerFunction(void* arg) {
@@ -174,21 +274,49 @@ void PCSCLite::HandlerFunction(void* arg) {
     AsyncBaton* async_baton = static_cast<AsyncBaton*>(arg);
     PCSCLite* pcsclite = async_baton->pcsclite;
     async_baton->async_result = new AsyncResult();
+    async_baton->async_result->result = SCARD_S_SUCCESS;
+    async_baton->async_result->do_exit = false;
+    async_baton->async_result->err_method = NULL;
+    async_baton->async_result->resync = false;
+    bool resync = false;
 
     while (!pcsclite->m_state) {
         /* Get card readers */
-        result = pcsclite->get_card_readers(pcsclite, async_baton->async_result);
+        std::string readers_name;
+        result = pcsclite->get_card_readers(pcsclite, readers_name);
         if (result == (LONG)SCARD_E_NO_READERS_AVAILABLE) {
             result = SCARD_S_SUCCESS;
         }
 
+        /* pcscd is gone: wait for it instead of reporting the readers as removed */
+        if ((result != SCARD_S_SUCCESS) && pcsclite->recover(result)) {
+            resync = true;
+            continue;
+        }
+
+        if ((result == SCARD_S_SUCCESS) && pcsclite->m_debounce) {
+            pcsclite->debounce_readers(readers_name);
+        }
+
+        std::vector<ReaderSnapshot> snapshot;
+        if (result == SCARD_S_SUCCESS) {
+            pcsclite->snapshot_readers(readers_name, snapshot);
+        }
+
         /* Store the result in the baton */
+        uv_mutex_lock(&pcsclite->m_mutex);
         async_baton->async_result->result = result;
+        async_baton->async_result->readers_name.swap(readers_name);
+        async_baton->async_result->snapshot.swap(snapshot);
+        async_baton->async_result->resync = resync && (result == SCARD_S_SUCCESS);
         if (result != SCARD_S_SUCCESS) {
-            async_baton->async_result->err_msg = error_msg("SCardListReaders",
-                                                           result);
+            async_baton->async_result->err_method = "SCardListReaders";
+        } else {
+            resync = false;
         }
 
+        uv_mutex_unlock(&pcsclite->m_mutex);
+
         /* Notify the nodejs thread */
         uv_async_send(&async_baton->async);
 
@@ -197,11 +325,20 @@ void PCSCLite::HandlerFunction(void* arg) {
                 /* Set current status */
                 pcsclite->m_card_reader_state.dwCurrentState =
                     pcsclite->m_card_reader_state.dwEventState;
-                /* Start checking for status change */
+                /* Start checking for status change. Wake up too when a vanished
+                 * reader has to be reported as removed */
                 result = SCardGetStatusChange(pcsclite->m_card_context,
-                                              INFINITE,
+                                              pcsclite->debounce_timeout(),
                                               &pcsclite->m_card_reader_state,
                                               1);
+                if (result == (LONG)SCARD_E_TIMEOUT) {
+                    result = SCARD_S_SUCCESS;
+                }
+
+                if ((result != SCARD_S_SUCCESS) && !pcsclite->m_state && pcsclite->recover(result)) {
+                    resync = true;
+                    continue;
+                }
 
                 uv_mutex_lock(&pcsclite->m_mutex);
                 async_baton->async_result->result = result;
@@ -211,51 +348,126 @@ void PCSCLite::HandlerFunction(void* arg) {
 
                 if (result != SCARD_S_SUCCESS) {
                     pcsclite->m_state = 2;
-                    async_baton->async_result->err_msg =
-                      error_msg("SCardGetStatusChange", result);
+                    async_baton->async_result->err_method = "SCardGetStatusChange";
                 }
 
                 uv_mutex_unlock(&pcsclite->m_mutex);
             } else {
-                /*  If PnP is not supported, just wait for 1 second */
-                Sleep(1000);
+                /*  If PnP is not supported, just wait for 1 second or until closed */
+                uv_mutex_lock(&pcsclite->m_mutex);
+                if (!pcsclite->m_state) {
+                    uv_cond_timedwait(&pcsclite->m_cond, &pcsclite->m_mutex, 1000000000);
+                }
+
+                uv_mutex_unlock(&pcsclite->m_mutex);
             }
-        } else {
+        } else if (!pcsclite->m_state) {
             /* Error on last card access, stop monitoring */
             pcsclite->m_state = 2;
         }
     }
 
+    uv_mutex_lock(&pcsclite->m_mutex);
     async_baton->async_result->do_exit = true;
+    pcsclite->m_monitor_running = false;
+    uv_cond_broadcast(&pcsclite->m_cond);
+    uv_mutex_unlock(&pcsclite->m_mutex);
     uv_async_send(&async_baton->async);
 }
 
+bool PCSCLite::recover(LONG result) {
+
+    if (!m_recover || !service_lost(result)) {
+        return false;
+    }
+
+    // Bounded exponential backoff until a new context can be established
+    uint64_t delay = RECOVER_MIN_DELAY;
+    for (;;) {
+        uv_mutex_lock(&m_mutex);
+        if (!m_state) {
+            // Close() wakes it up
+            uv_cond_timedwait(&m_cond, &m_mutex, delay * 1000000);
+        }
+
+        bool closing = (m_state != 0);
+        uv_mutex_unlock(&m_mutex);
+        if (closing) {
+            return false;
+        }
+
+        SCARDCONTEXT context;
+        if (SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &context) == SCARD_S_SUCCESS) {
+            uv_mutex_lock(&m_mutex);
+            SCARDCONTEXT stale = m_card_context;
+            m_card_context = context;
+            m_card_reader_state.dwCurrentState = SCARD_STATE_UNAWARE;
+            uv_mutex_unlock(&m_mutex);
+            SCardReleaseContext(stale);
+            return true;
+        }
+
+        delay = delay * 2 < m_recover ? delay * 2 : m_recover;
+    }
+}
+
 void PCSCLite::CloseCallback(uv_handle_t *handle) {
 
     /* cleanup process */
     AsyncBaton* async_baton = static_cast<AsyncBaton*>(handle->data);
     AsyncResult* ar = async_baton->async_result;
-#ifdef SCARD_AUTOALLOCATE
-    PCSCLite* pcsclite = async_baton->pcsclite;
-    SCardFreeMemory(pcsclite->m_card_context, ar->readers_name);
-#else
-    delete [] ar->readers_name;
-#endif
     delete ar;
     async_baton->callback.Reset();
     delete async_baton;
 }
 
-LONG PCSCLite::get_card_readers(PCSCLite* pcsclite, AsyncResult* async_result) {
+void PCSCLite::snapshot_readers(const std::string& readers_name, std::vector<ReaderSnapshot>& snapshot) {
+
+    // One non blocking call for the whole list, so the readers are usable
+    // before their own monitors have started
+    std::vector<SCARD_READERSTATE> states;
+    for (size_t pos = 0; (pos < readers_name.size()) && readers_name[pos]; ) {
+        ReaderSnapshot rs;
+        rs.name = readers_name.c_str() + pos;
+        rs.state = 0;
+        pos += rs.name.size() + 1;
+        snapshot.push_back(rs);
+    }
+
+    if (snapshot.empty()) {
+        return;
+    }
+
+    states.resize(snapshot.size());
+    for (size_t i = 0; i < snapshot.size(); ++ i) {
+        states[i] = SCARD_READERSTATE();
+        states[i].szReader = snapshot[i].name.c_str();
+        states[i].dwCurrentState = SCARD_STATE_UNAWARE;
+    }
+
+    LONG result = SCardGetStatusChange(m_card_context, 0, &states[0], states.size());
+    if ((result != SCARD_S_SUCCESS) && (result != (LONG)SCARD_E_TIMEOUT)) {
+        // A reader went away meanwhile: the monitors will tell
+        snapshot.clear();
+        return;
+    }
+
+    for (size_t i = 0; i < snapshot.size(); ++ i) {
+        snapshot[i].state = states[i].dwEventState;
+        DWORD atrlen = states[i].cbAtr < MAX_ATR_SIZE ? states[i].cbAtr : MAX_ATR_SIZE;
+        snapshot[i].atr.assign(states[i].rgbAtr, states[i].rgbAtr + atrlen);
+    }
+}
+
+LONG PCSCLite::get_card_readers(PCSCLite* pcsclite, std::string& readers) {
 
     DWORD readers_name_length;
     LPTSTR readers_name;
 
     LONG result = SCARD_S_SUCCESS;
 
-    /* Reset the readers_name in the baton */
-    async_result->readers_name = NULL;
-    async_result->readers_name_length = 0;
+    /* Reset the readers */
+    readers.clear();
 
 #ifdef SCARD_AUTOALLOCATE
     readers_name_length = SCARD_AUTOALLOCATE;
@@ -287,19 +499,81 @@ LONG PCSCLite::get_card_readers(PCSCLite* pcsclite, AsyncResult* async_result) {
 #ifndef SCARD_AUTOALLOCATE
         delete [] readers_name;
 #endif
-        readers_name = NULL;
-        readers_name_length = 0;
 #ifndef SCARD_AUTOALLOCATE
         /* Retry in case of insufficient buffer error */
         if (result == (LONG)SCARD_E_INSUFFICIENT_BUFFER) {
-            result = get_card_readers(pcsclite, async_result);
+            result = get_card_readers(pcsclite, readers);
         }
 #endif
     } else {
-        /* Store the readers_name in the baton */
-        async_result->readers_name = readers_name;
-        async_result->readers_name_length = readers_name_length;
+        /* Store the readers_name */
+        readers.assign(readers_name, readers_name_length);
+#ifdef SCARD_AUTOALLOCATE
+        SCardFreeMemory(pcsclite->m_card_context, readers_name);
+#else
+        delete [] readers_name;
+#endif
     }
 
     return result;
 }
+
+void PCSCLite::debounce_readers(std::string& readers_name) {
+
+    uint64_t now = uv_hrtime();
+    std::set<std::string> current;
+    std::map<std::string, uint64_t>::iterator it;
+
+    /* Readers that came back within the window are not removed */
+    for (const char* name = readers_name.c_str(); *name; name += strlen(name) + 1) {
+        current.insert(name);
+        m_vanished.erase(name);
+    }
+
+    /* Readers that have just vanished get a deadline */
+    for (const char* name = m_readers_name.c_str(); *name; name += strlen(name) + 1) {
+        if ((current.find(name) == current.end()) &&
+            (m_vanished.find(name) == m_vanished.end())) {
+            m_vanished[name] = now + static_cast<uint64_t>(m_debounce) * 1000000;
+        }
+    }
+
+    /* Keep reporting the vanished readers until their deadline expires */
+    std::string reported;
+    for (const char* name = readers_name.c_str(); *name; name += strlen(name) + 1) {
+        reported.append(name);
+        reported.push_back('\0');
+    }
+
+    for (it = m_vanished.begin(); it != m_vanished.end();) {
+        if (it->second <= now) {
+            m_vanished.erase(it++);
+        } else {
+            reported.append(it->first);
+            reported.push_back('\0');
+            ++ it;
+        }
+    }
+
+    reported.push_back('\0');
+    m_readers_name = reported;
+    readers_name.swap(reported);
+}
+
+DWORD PCSCLite::debounce_timeout() const {
+
+    if (m_vanished.empty()) {
+        return INFINITE;
+    }
+
+    uint64_t now = uv_hrtime();
+    uint64_t deadline = m_vanished.begin()->second;
+    std::map<std::string, uint64_t>::const_iterator it;
+    for (it = m_vanished.begin(); it != m_vanished.end(); ++ it) {
+        if (it->second < deadline) {
+            deadline = it->second;
+        }
+    }
+
+    return deadline > now ? static_cast<DWORD>((deadline - now) / 1000000) + 1 : 0;
+}
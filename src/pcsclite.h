@@ -2,6 +2,10 @@
 #define PCSCLITE_H
 
 #include <nan.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
 #ifdef __APPLE__
 #include <PCSC/winscard.h>
 #include <PCSC/wintypes.h>
@@ -11,12 +15,29 @@
 
 class PCSCLite: public Nan::ObjectWrap {
 
+    // State of a reader when the list was taken, in the order of the list
+    struct ReaderSnapshot {
+        std::string name;
+        DWORD state;
+        std::vector<BYTE> atr;
+    };
+
     struct AsyncResult {
         LONG result;
-        LPSTR readers_name;
-        DWORD readers_name_length;
+        std::string readers_name;
+        std::vector<ReaderSnapshot> snapshot;
         bool do_exit;
-        std::string err_msg;
+        const char* err_method;
+        bool resync;            // first list after pcscd came back
+    };
+
+    // The join happens in a thread of its own, not in the threadpool, and
+    // the result comes back through the async handle
+    struct CloseBaton {
+        uv_async_t async;
+        uv_thread_t thread;
+        Nan::Persistent<v8::Function> callback;
+        PCSCLite *pcsclite;
     };
 
     struct AsyncBaton {
@@ -44,8 +65,15 @@ class PCSCLite: public Nan::ObjectWrap {
         static void HandleReaderStatusChange(uv_async_t *handle, int status);
         static void HandlerFunction(void* arg);
         static void CloseCallback(uv_handle_t *handle);
+        static void CloseFunction(void* arg);
+        static void AfterClose(uv_async_t* handle, int status);
+        static void DeleteCloseBaton(uv_handle_t* handle);
 
-        LONG get_card_readers(PCSCLite* pcsclite, AsyncResult* async_result);
+        LONG get_card_readers(PCSCLite* pcsclite, std::string& readers_name);
+        void debounce_readers(std::string& readers_name);
+        void snapshot_readers(const std::string& readers_name, std::vector<ReaderSnapshot>& snapshot);
+        DWORD debounce_timeout() const;
+        bool recover(LONG result);
 
     private:
 
@@ -56,6 +84,12 @@ class PCSCLite: public Nan::ObjectWrap {
         uv_cond_t m_cond;
         bool m_pnp;
         int m_state;
+        bool m_monitor_running;
+        bool m_closing;
+        uint32_t m_debounce;
+        uint32_t m_recover;     // max backoff in ms, 0 if off
+        std::string m_readers_name;
+        std::map<std::string, uint64_t> m_vanished;
 };
 
 #endif /* PCSCLITE_H */
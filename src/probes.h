@@ -0,0 +1,45 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Static tracepoints of the "pcsclite" provider. Where systemtap's
+ * <sys/sdt.h> is available they are USDT probes: a nop in the code and a note
+ * in the ELF file until bpftrace or perf attach to them, e.g.
+ *
+ *   bpftrace -e 'usdt:./build/Release/pcsclite.node:pcsclite:transmit__end { ... }'
+ *
+ * Elsewhere they compile to nothing. The first argument is always the reader
+ * name and the operations are identified by the address of their baton.
+ */
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PCSC_HAVE_USDT 1
+#endif
+#endif
+
+#ifdef PCSC_HAVE_USDT
+#define PCSC_PROBE2(name, a1, a2) DTRACE_PROBE2(pcsclite, name, a1, a2)
+#define PCSC_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(pcsclite, name, a1, a2, a3)
+#else
+#define PCSC_PROBE2(name, a1, a2) do {} while (0)
+#define PCSC_PROBE3(name, a1, a2, a3) do {} while (0)
+#endif
+
+// transmit__enqueue(reader, baton, apdu length): Transmit() queued the APDU
+#define PROBE_TRANSMIT_ENQUEUE(reader, baton, len) PCSC_PROBE3(transmit__enqueue, reader, baton, len)
+// transmit__locked(reader, baton, apdu length): DoTransmit() got the reader lock
+#define PROBE_TRANSMIT_LOCKED(reader, baton, len) PCSC_PROBE3(transmit__locked, reader, baton, len)
+// transmit__start(reader, apdu length): SCardTransmit() is called
+#define PROBE_TRANSMIT_START(reader, len) PCSC_PROBE2(transmit__start, reader, len)
+// transmit__end(reader, result, response length): SCardTransmit() returned
+#define PROBE_TRANSMIT_END(reader, result, len) PCSC_PROBE3(transmit__end, reader, result, len)
+// transmit__dispatch(reader, baton, result): AfterTransmit() runs the callback
+#define PROBE_TRANSMIT_DISPATCH(reader, baton, result) PCSC_PROBE3(transmit__dispatch, reader, baton, result)
+// status__wakeup(reader, result): SCardGetStatusChange() returned
+#define PROBE_STATUS_WAKEUP(reader, result) PCSC_PROBE2(status__wakeup, reader, result)
+// status__deliver(reader, state, result): the status change reaches JS
+#define PROBE_STATUS_DELIVER(reader, state, result) PCSC_PROBE3(status__deliver, reader, state, result)
+
+#endif /* PROBES_H */
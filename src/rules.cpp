@@ -0,0 +1,127 @@
+#include "rules.h"
+#include <string.h>
+#include <uv.h>
+
+AccessRule::AccessRule(const std::vector<BYTE>& apdu,
+                       DWORD control_code,
+                       const std::vector<BYTE>& on_allow,
+                       const std::vector<BYTE>& on_deny,
+                       bool initial): m_apdu(apdu),
+                                      m_control_code(control_code),
+                                      m_on_allow(on_allow),
+                                      m_on_deny(on_deny),
+                                      m_initial(initial) {
+}
+
+void AccessRule::Allow(const BYTE* uid, size_t len) {
+    m_uids.insert(std::string(reinterpret_cast<const char*>(uid), len));
+}
+
+AccessRule::PCSCChannel::PCSCChannel(const char* reader): m_reader(reader),
+                                                         m_context(0),
+                                                         m_card(0) {
+}
+
+AccessRule::PCSCChannel::~PCSCChannel() {
+    Disconnect();
+    if (m_context) {
+        SCardReleaseContext(m_context);
+    }
+}
+
+LONG AccessRule::PCSCChannel::Connect(DWORD* protocol, const char** method) {
+
+    LONG result = SCARD_S_SUCCESS;
+    if (!m_context) {
+        *method = "SCardEstablishContext";
+        result = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &m_context);
+        if (result != SCARD_S_SUCCESS) {
+            m_context = 0;
+            return result;
+        }
+    }
+
+    *method = "SCardConnect";
+    result = SCardConnect(m_context,
+                          m_reader,
+                          SCARD_SHARE_SHARED,
+                          SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1,
+                          &m_card,
+                          protocol);
+    if (result != SCARD_S_SUCCESS) {
+        m_card = 0;
+    }
+
+    return result;
+}
+
+LONG AccessRule::PCSCChannel::Transmit(DWORD protocol, const BYTE* in, DWORD in_len, LPBYTE out, DWORD* out_len) {
+    SCARD_IO_REQUEST send_pci = { protocol, sizeof(SCARD_IO_REQUEST) };
+    return SCardTransmit(m_card, &send_pci, in, in_len, NULL, out, out_len);
+}
+
+LONG AccessRule::PCSCChannel::Control(DWORD control_code,
+                                      const BYTE* in,
+                                      DWORD in_len,
+                                      LPBYTE out,
+                                      DWORD out_size,
+                                      DWORD* out_len) {
+    return SCardControl(m_card, control_code, in, in_len, out, out_size, out_len);
+}
+
+void AccessRule::PCSCChannel::Disconnect() {
+    if (m_card) {
+        SCardDisconnect(m_card, SCARD_LEAVE_CARD);
+        m_card = 0;
+    }
+}
+
+void AccessRule::Run(Channel* channel, Outcome* outcome) const {
+
+    uint64_t start = uv_hrtime();
+    outcome->result = SCARD_S_SUCCESS;
+    outcome->method = NULL;
+    outcome->allowed = false;
+    outcome->uidlen = 0;
+    outcome->sw = 0;
+
+    DWORD protocol;
+    const char* method = NULL;
+    LONG result = channel->Connect(&protocol, &method);
+    if (result != SCARD_S_SUCCESS) {
+        outcome->result = result;
+        outcome->method = method;
+        outcome->elapsed = (uv_hrtime() - start) / 1e6;
+        return;
+    }
+
+    BYTE response[RULE_MAX_UID + 2];
+    DWORD len = sizeof(response);
+    result = channel->Transmit(protocol, &m_apdu[0], m_apdu.size(), response, &len);
+    if (result != SCARD_S_SUCCESS) {
+        outcome->result = result;
+        outcome->method = "SCardTransmit";
+    } else if (len >= 2) {
+        outcome->sw = (response[len - 2] << 8) | response[len - 1];
+        if (outcome->sw == 0x9000) {
+            outcome->uidlen = len - 2;
+            memcpy(outcome->uid, response, outcome->uidlen);
+            std::string uid(reinterpret_cast<const char*>(response), outcome->uidlen);
+            outcome->allowed = m_uids.find(uid) != m_uids.end();
+        }
+    }
+
+    const std::vector<BYTE>& command = outcome->allowed ? m_on_allow : m_on_deny;
+    if ((result == SCARD_S_SUCCESS) && !command.empty()) {
+        BYTE out[256];
+        DWORD out_len = 0;
+        result = channel->Control(m_control_code, &command[0], command.size(), out, sizeof(out), &out_len);
+        if (result != SCARD_S_SUCCESS) {
+            outcome->result = result;
+            outcome->method = "SCardControl";
+        }
+    }
+
+    outcome->elapsed = (uv_hrtime() - start) / 1e6;
+    channel->Disconnect();
+}
@@ -0,0 +1,111 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#ifdef __APPLE__
+#include <PCSC/winscard.h>
+#include <PCSC/wintypes.h>
+#else
+#include <winscard.h>
+#endif
+
+#define RULE_MAX_UID 32
+
+/*
+ * A rule a reader runs in a thread of its own as soon as a card is inserted,
+ * without going through the event loop: it sends a fixed APDU to read the card
+ * identifier, looks it up in an allow list and sends the escape command
+ * configured for the outcome, e.g. to fire a door relay. JS only gets notified
+ * afterwards.
+ *
+ * A rule is immutable once built: a new allow list means a new rule, so the
+ * status thread can run one while JS replaces it.
+ */
+class AccessRule {
+
+    public:
+
+        struct Outcome {
+            LONG result;
+            const char* method;
+            bool allowed;
+            BYTE uid[RULE_MAX_UID];
+            DWORD uidlen;
+            uint16_t sw;
+            double elapsed;
+        };
+
+        // What the rule reaches the card through: PC/SC, or a replayed trace
+        class Channel {
+
+            public:
+
+                virtual ~Channel() {}
+
+                // method is the call that failed
+                virtual LONG Connect(DWORD* protocol, const char** method) = 0;
+                virtual LONG Transmit(DWORD protocol, const BYTE* in, DWORD in_len, LPBYTE out, DWORD* out_len) = 0;
+                virtual LONG Control(DWORD control_code,
+                                     const BYTE* in,
+                                     DWORD in_len,
+                                     LPBYTE out,
+                                     DWORD out_size,
+                                     DWORD* out_len) = 0;
+                virtual void Disconnect() = 0;
+        };
+
+        // A card connection of its own, in a PC/SC context of its own, as
+        // the reader may never be connected from JS
+        class PCSCChannel: public Channel {
+
+            public:
+
+                PCSCChannel(const char* reader);
+                ~PCSCChannel();
+
+                LONG Connect(DWORD* protocol, const char** method);
+                LONG Transmit(DWORD protocol, const BYTE* in, DWORD in_len, LPBYTE out, DWORD* out_len);
+                LONG Control(DWORD control_code,
+                             const BYTE* in,
+                             DWORD in_len,
+                             LPBYTE out,
+                             DWORD out_size,
+                             DWORD* out_len);
+                void Disconnect();
+
+            private:
+
+                const char* m_reader;
+                SCARDCONTEXT m_context;
+                SCARDHANDLE m_card;
+        };
+
+        AccessRule(const std::vector<BYTE>& apdu,
+                   DWORD control_code,
+                   const std::vector<BYTE>& on_allow,
+                   const std::vector<BYTE>& on_deny,
+                   bool initial);
+
+        void Allow(const BYTE* uid, size_t len);
+
+        // Whether it also runs for the card found when monitoring starts
+        bool Initial() const { return m_initial; }
+
+        // Empty commands are not sent
+        void Run(Channel* channel, Outcome* outcome) const;
+
+    private:
+
+        std::vector<BYTE> m_apdu;
+        DWORD m_control_code;
+        std::vector<BYTE> m_on_allow;
+        std::vector<BYTE> m_on_deny;
+        bool m_initial;
+        std::unordered_set<std::string> m_uids;
+};
+
+#endif /* RULES_H */
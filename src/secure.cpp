@@ -0,0 +1,406 @@
+#include "secure.h"
+#include <string.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#define SM_MAC_LEN 8
+
+namespace {
+
+    bool crypt(const EVP_CIPHER* cipher,
+               const uint8_t* key,
+               const uint8_t* iv,
+               bool encrypt,
+               const uint8_t* in,
+               size_t len,
+               uint8_t* out) {
+
+        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+        int out_len = 0;
+        int final_len = 0;
+        bool ok = (ctx != NULL) &&
+                  (EVP_CipherInit_ex(ctx, cipher, NULL, key, iv, encrypt ? 1 : 0) == 1) &&
+                  (EVP_CIPHER_CTX_set_padding(ctx, 0) == 1) &&
+                  (EVP_CipherUpdate(ctx, out, &out_len, in, (int)len) == 1) &&
+                  (EVP_CipherFinal_ex(ctx, out + out_len, &final_len) == 1);
+        EVP_CIPHER_CTX_free(ctx);
+        return ok;
+    }
+
+    const EVP_CIPHER* aes_cipher(size_t key_len, bool cbc) {
+        switch (key_len) {
+            case 16: return cbc ? EVP_aes_128_cbc() : EVP_aes_128_ecb();
+            case 24: return cbc ? EVP_aes_192_cbc() : EVP_aes_192_ecb();
+            case 32: return cbc ? EVP_aes_256_cbc() : EVP_aes_256_ecb();
+        }
+
+        return NULL;
+    }
+
+    const EVP_CIPHER* des_cipher(size_t key_len) {
+        return key_len == 24 ? EVP_des_ede3_cbc() : EVP_des_ede_cbc();
+    }
+
+    // Single DES through two key 3DES with K1 == K2, single DES itself is
+    // only in the OpenSSL 3 legacy provider
+    bool des(const uint8_t* key, bool encrypt, const uint8_t* in, uint8_t* out) {
+        uint8_t k[16];
+        memcpy(k, key, 8);
+        memcpy(k + 8, key, 8);
+        bool ok = crypt(EVP_des_ede_ecb(), k, NULL, encrypt, in, 8, out);
+        OPENSSL_cleanse(k, sizeof(k));
+        return ok;
+    }
+
+    // CMAC subkey derivation
+    void dbl(uint8_t* block) {
+        uint8_t carry = block[0] & 0x80;
+        for (int i = 0; i < 15; ++ i) {
+            block[i] = (uint8_t)((block[i] << 1) | (block[i + 1] >> 7));
+        }
+
+        block[15] = (uint8_t)(block[15] << 1);
+        if (carry) {
+            block[15] ^= 0x87;
+        }
+    }
+
+    void put_length(std::vector<uint8_t>& out, size_t len) {
+        if (len > 0xFF) {
+            out.push_back(0x82);
+            out.push_back((uint8_t)(len >> 8));
+        } else if (len > 0x7F) {
+            out.push_back(0x81);
+        }
+
+        out.push_back((uint8_t)len);
+    }
+}
+
+KeyWiper::~KeyWiper() {
+    for (size_t i = 0; i < m_count; ++ i) {
+        if (!m_buffers[i].empty()) {
+            OPENSSL_cleanse(&m_buffers[i][0], m_buffers[i].size());
+        }
+    }
+}
+
+SecureMessaging* SecureMessaging::Create(Algorithm alg,
+                                         const std::vector<uint8_t>& enc_key,
+                                         const std::vector<uint8_t>& mac_key,
+                                         const std::vector<uint8_t>& ssc) {
+
+    if (alg == SM_3DES) {
+        if (((enc_key.size() != 16) && (enc_key.size() != 24)) ||
+            (mac_key.size() != 16) || (ssc.size() != 8)) {
+            return NULL;
+        }
+    } else if (alg == SM_AES) {
+        if (!aes_cipher(enc_key.size(), true) || !aes_cipher(mac_key.size(), false) ||
+            (ssc.size() != 16)) {
+            return NULL;
+        }
+    } else {
+        return NULL;
+    }
+
+    return new SecureMessaging(alg, enc_key, mac_key, ssc);
+}
+
+SecureMessaging::SecureMessaging(Algorithm alg,
+                                 const std::vector<uint8_t>& enc_key,
+                                 const std::vector<uint8_t>& mac_key,
+                                 const std::vector<uint8_t>& ssc): m_alg(alg),
+                                                                   m_block(alg == SM_AES ? 16 : 8),
+                                                                   m_enc_key(enc_key),
+                                                                   m_mac_key(mac_key),
+                                                                   m_ssc(ssc) {
+}
+
+SecureMessaging::~SecureMessaging() {
+    std::vector<uint8_t> buffers[3];
+    buffers[0].swap(m_enc_key);
+    buffers[1].swap(m_mac_key);
+    buffers[2].swap(m_ssc);
+    KeyWiper wiper(buffers, 3);
+}
+
+const char* SecureMessaging::Wrap(const uint8_t* apdu, size_t len, std::vector<uint8_t>& out) {
+
+    if (len < 4) {
+        return "command too short";
+    }
+
+    // Short APDU cases: header [Lc data] [Le]
+    const uint8_t* data = NULL;
+    size_t lc = 0;
+    bool has_le = false;
+    uint8_t le = 0;
+    if (len == 5) {
+        has_le = true;
+        le = apdu[4];
+    } else if (len > 5) {
+        lc = apdu[4];
+        if ((lc == 0) || (len > lc + 6)) {
+            return "only short APDUs are supported";
+        } else if (len == lc + 6) {
+            has_le = true;
+            le = apdu[len - 1];
+        } else if (len != lc + 5) {
+            return "malformed command";
+        }
+
+        data = apdu + 5;
+    }
+
+    IncrementSsc();
+
+    std::vector<uint8_t> objects;
+    if (lc) {
+        std::vector<uint8_t> plain(data, data + lc);
+        std::vector<uint8_t> cipher;
+        Pad(plain);
+        if (!Crypt(true, plain, cipher)) {
+            return "encryption failed";
+        }
+
+        objects.push_back(0x87);
+        put_length(objects, cipher.size() + 1);
+        objects.push_back(0x01);
+        objects.insert(objects.end(), cipher.begin(), cipher.end());
+    }
+
+    if (has_le) {
+        objects.push_back(0x97);
+        objects.push_back(0x01);
+        objects.push_back(le);
+    }
+
+    uint8_t header[4] = { (uint8_t)(apdu[0] | 0x0C), apdu[1], apdu[2], apdu[3] };
+    std::vector<uint8_t> mac_input(m_ssc);
+    mac_input.insert(mac_input.end(), header, header + sizeof(header));
+    Pad(mac_input);
+    mac_input.insert(mac_input.end(), objects.begin(), objects.end());
+    Pad(mac_input);
+
+    uint8_t mac[SM_MAC_LEN];
+    if (!Mac(mac_input, mac)) {
+        return "MAC computation failed";
+    }
+
+    objects.push_back(0x8E);
+    objects.push_back(SM_MAC_LEN);
+    objects.insert(objects.end(), mac, mac + SM_MAC_LEN);
+    if (objects.size() > 0xFF) {
+        return "protected command too long";
+    }
+
+    out.assign(header, header + sizeof(header));
+    out.push_back((uint8_t)objects.size());
+    out.insert(out.end(), objects.begin(), objects.end());
+    out.push_back(0x00);
+    return NULL;
+}
+
+const char* SecureMessaging::Unwrap(const uint8_t* response, size_t len, std::vector<uint8_t>& out) {
+
+    if (len < 2) {
+        return "response too short";
+    }
+
+    // A bare status word: the card rejected the protected command
+    if (len == 2) {
+        out.assign(response, response + len);
+        return NULL;
+    }
+
+    IncrementSsc();
+
+    std::vector<uint8_t> authenticated;
+    const uint8_t* cryptogram = NULL;
+    size_t cryptogram_len = 0;
+    const uint8_t* sw = response + len - 2;
+    const uint8_t* mac = NULL;
+    size_t pos = 0;
+    while (pos < len - 2) {
+        size_t start = pos;
+        uint8_t tag = response[pos ++];
+        if (pos >= len - 2) {
+            return "malformed response";
+        }
+
+        size_t value_len = response[pos ++];
+        if (value_len == 0x81 || value_len == 0x82) {
+            size_t bytes = value_len - 0x80;
+            value_len = 0;
+            while (bytes -- > 0) {
+                if (pos >= len - 2) {
+                    return "malformed response";
+                }
+
+                value_len = (value_len << 8) | response[pos ++];
+            }
+        }
+
+        if (value_len > len - 2 - pos) {
+            return "malformed response";
+        }
+
+        const uint8_t* value = response + pos;
+        pos += value_len;
+        if (tag == 0x8E) {
+            if (value_len != SM_MAC_LEN) {
+                return "malformed response MAC";
+            }
+
+            mac = value;
+            continue;
+        }
+
+        if (tag == 0x87) {
+            if ((value_len < 1) || (value[0] != 0x01)) {
+                return "malformed response cryptogram";
+            }
+
+            cryptogram = value + 1;
+            cryptogram_len = value_len - 1;
+        } else if (tag == 0x99) {
+            if (value_len != 2) {
+                return "malformed response status";
+            }
+
+            sw = value;
+        } else {
+            return "unexpected response data object";
+        }
+
+        authenticated.insert(authenticated.end(), response + start, response + pos);
+    }
+
+    if (mac == NULL) {
+        return "response is not authenticated";
+    }
+
+    std::vector<uint8_t> mac_input(m_ssc);
+    mac_input.insert(mac_input.end(), authenticated.begin(), authenticated.end());
+    Pad(mac_input);
+
+    uint8_t expected[SM_MAC_LEN];
+    if (!Mac(mac_input, expected)) {
+        return "MAC computation failed";
+    }
+
+    uint8_t diff = 0;
+    for (size_t i = 0; i < SM_MAC_LEN; ++ i) {
+        diff |= (uint8_t)(expected[i] ^ mac[i]);
+    }
+
+    if (diff) {
+        return "response MAC mismatch";
+    }
+
+    out.clear();
+    if (cryptogram) {
+        if ((cryptogram_len == 0) || (cryptogram_len % m_block != 0)) {
+            return "malformed response cryptogram";
+        }
+
+        std::vector<uint8_t> cipher(cryptogram, cryptogram + cryptogram_len);
+        if (!Crypt(false, cipher, out)) {
+            return "decryption failed";
+        }
+
+        // Remove the ISO 9797-1 method 2 padding
+        while (!out.empty() && (out.back() == 0x00)) {
+            out.pop_back();
+        }
+
+        if (out.empty() || (out.back() != 0x80)) {
+            return "bad response padding";
+        }
+
+        out.pop_back();
+    }
+
+    out.push_back(sw[0]);
+    out.push_back(sw[1]);
+    return NULL;
+}
+
+void SecureMessaging::IncrementSsc() {
+    for (size_t i = m_ssc.size(); i > 0; -- i) {
+        if (++ m_ssc[i - 1] != 0) {
+            break;
+        }
+    }
+}
+
+void SecureMessaging::Pad(std::vector<uint8_t>& data) const {
+    data.push_back(0x80);
+    while (data.size() % m_block != 0) {
+        data.push_back(0x00);
+    }
+}
+
+bool SecureMessaging::Crypt(bool encrypt, const std::vector<uint8_t>& in, std::vector<uint8_t>& out) const {
+
+    out.resize(in.size());
+    if (m_alg == SM_3DES) {
+        uint8_t iv[8] = { 0 };
+        return crypt(des_cipher(m_enc_key.size()), &m_enc_key[0], iv, encrypt, &in[0], in.size(), &out[0]);
+    }
+
+    // AES: the IV is the send sequence counter encrypted with the session key
+    uint8_t iv[16];
+    return crypt(aes_cipher(m_enc_key.size(), false), &m_enc_key[0], NULL, true, &m_ssc[0], 16, iv) &&
+           crypt(aes_cipher(m_enc_key.size(), true), &m_enc_key[0], iv, encrypt, &in[0], in.size(), &out[0]);
+}
+
+bool SecureMessaging::Mac(const std::vector<uint8_t>& data, uint8_t* mac) const {
+
+    if (m_alg == SM_3DES) {
+        // ISO 9797-1 MAC algorithm 3: DES CBC with K1, then decrypt with K2
+        // and encrypt with K1 the last block
+        uint8_t y[8] = { 0 };
+        for (size_t i = 0; i < data.size(); i += 8) {
+            for (size_t j = 0; j < 8; ++ j) {
+                y[j] ^= data[i + j];
+            }
+
+            if (!des(&m_mac_key[0], true, y, y)) {
+                return false;
+            }
+        }
+
+        if (!des(&m_mac_key[8], false, y, y) || !des(&m_mac_key[0], true, y, y)) {
+            return false;
+        }
+
+        memcpy(mac, y, SM_MAC_LEN);
+        return true;
+    }
+
+    // AES CMAC over the already padded data, so the last block is complete
+    const EVP_CIPHER* ecb = aes_cipher(m_mac_key.size(), false);
+    uint8_t k1[16] = { 0 };
+    if (!crypt(ecb, &m_mac_key[0], NULL, true, k1, 16, k1)) {
+        return false;
+    }
+
+    dbl(k1);
+    uint8_t y[16] = { 0 };
+    bool ok = true;
+    for (size_t i = 0; (i < data.size()) && ok; i += 16) {
+        bool last = (i + 16 == data.size());
+        for (size_t j = 0; j < 16; ++ j) {
+            y[j] ^= data[i + j] ^ (last ? k1[j] : 0);
+        }
+
+        ok = crypt(ecb, &m_mac_key[0], NULL, true, y, 16, y);
+    }
+
+    // The subkey is as good as the key
+    OPENSSL_cleanse(k1, sizeof(k1));
+    memcpy(mac, y, SM_MAC_LEN);
+    return ok;
+}
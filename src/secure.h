@@ -0,0 +1,92 @@
+#ifndef SECURE_H
+#define SECURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/*
+ * A stage that protects the APDUs of a card session. It runs in the threadpool
+ * thread doing the transmit, with the reader lock held, so implementations
+ * don't need to be thread safe.
+ */
+class SessionWrapper {
+
+    public:
+
+        // Room needed in the response buffer on top of the plain response
+        enum { MAX_OVERHEAD = 64 };
+
+        virtual ~SessionWrapper() {}
+
+        // They return NULL on success or the reason of the failure
+        virtual const char* Wrap(const uint8_t* apdu, size_t len, std::vector<uint8_t>& out) = 0;
+        virtual const char* Unwrap(const uint8_t* response, size_t len, std::vector<uint8_t>& out) = 0;
+};
+
+/*
+ * It overwrites the buffers when it goes out of scope, so key material isn't
+ * left behind in memory given back to the allocator
+ */
+class KeyWiper {
+
+    public:
+
+        KeyWiper(std::vector<uint8_t>* buffers, size_t count): m_buffers(buffers), m_count(count) {}
+
+        ~KeyWiper();
+
+    private:
+
+        std::vector<uint8_t>* m_buffers;
+        size_t m_count;
+};
+
+/*
+ * ISO 7816-4 secure messaging as profiled by ICAO 9303: the command data goes
+ * CBC encrypted in a DO'87', the expected length in a DO'97' and a DO'8E' holds
+ * the MAC of the send sequence counter, the header and those objects. 3DES
+ * uses the ISO 9797-1 retail MAC and a zero IV, AES uses CMAC truncated to 8
+ * bytes and the counter encrypted as IV. Only short APDUs are supported.
+ */
+class SecureMessaging: public SessionWrapper {
+
+    public:
+
+        enum Algorithm {
+            SM_3DES = 1,
+            SM_AES = 2
+        };
+
+        // It returns NULL if the key or counter sizes don't fit the algorithm
+        static SecureMessaging* Create(Algorithm alg,
+                                       const std::vector<uint8_t>& enc_key,
+                                       const std::vector<uint8_t>& mac_key,
+                                       const std::vector<uint8_t>& ssc);
+
+        // The keys and the counter are wiped
+        ~SecureMessaging();
+
+        const char* Wrap(const uint8_t* apdu, size_t len, std::vector<uint8_t>& out);
+        const char* Unwrap(const uint8_t* response, size_t len, std::vector<uint8_t>& out);
+
+    private:
+
+        SecureMessaging(Algorithm alg,
+                        const std::vector<uint8_t>& enc_key,
+                        const std::vector<uint8_t>& mac_key,
+                        const std::vector<uint8_t>& ssc);
+
+        void IncrementSsc();
+        void Pad(std::vector<uint8_t>& data) const;
+        bool Crypt(bool encrypt, const std::vector<uint8_t>& in, std::vector<uint8_t>& out) const;
+        bool Mac(const std::vector<uint8_t>& data, uint8_t* mac) const;
+
+        Algorithm m_alg;
+        size_t m_block;
+        std::vector<uint8_t> m_enc_key;
+        std::vector<uint8_t> m_mac_key;
+        std::vector<uint8_t> m_ssc;
+};
+
+#endif /* SECURE_H */
@@ -0,0 +1,151 @@
+#include "statetable.h"
+#include <assert.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+
+using namespace v8;
+
+uv_once_t StateTable::s_once = UV_ONCE_INIT;
+uv_mutex_t StateTable::s_mutex;
+uint32_t StateTable::s_next_id = 0;
+alignas(8) uint32_t StateTable::s_words[HEADER_WORDS + SLOTS * SLOT_WORDS];
+
+namespace {
+
+    std::atomic<uint32_t>* seq_of(uint32_t* words) {
+        return reinterpret_cast<std::atomic<uint32_t>*>(&words[StateTable::SLOT_SEQ]);
+    }
+
+#if V8_MAJOR_VERSION >= 8
+    // The table outlives every isolate
+    void keep_table(void* data, size_t length, void* deleter_data) {
+    }
+#endif
+}
+
+void StateTable::Init() {
+    assert(uv_mutex_init(&s_mutex) == 0);
+    s_words[HEADER_MAGIC] = MAGIC;
+    s_words[HEADER_VERSION] = VERSION;
+    s_words[HEADER_SLOTS] = SLOTS;
+    s_words[HEADER_SLOT_WORDS] = SLOT_WORDS;
+}
+
+NAN_METHOD(StateTable::GetBuffer) {
+
+    Nan::HandleScope scope;
+
+    uv_once(&s_once, Init);
+#if V8_MAJOR_VERSION >= 8
+    std::shared_ptr<BackingStore> store = SharedArrayBuffer::NewBackingStore(s_words,
+                                                                             sizeof(s_words),
+                                                                             keep_table,
+                                                                             NULL);
+    info.GetReturnValue().Set(SharedArrayBuffer::New(Isolate::GetCurrent(), store));
+#elif NODE_MODULE_VERSION >= NODE_8_0_MODULE_VERSION
+    info.GetReturnValue().Set(SharedArrayBuffer::New(Isolate::GetCurrent(), s_words, sizeof(s_words)));
+#endif
+}
+
+int StateTable::Acquire(const std::string& name) {
+
+    uv_once(&s_once, Init);
+    uv_mutex_lock(&s_mutex);
+    int slot = -1;
+    for (int i = 0; i < SLOTS; ++ i) {
+        if (s_words[HEADER_WORDS + i * SLOT_WORDS + SLOT_ID] == 0) {
+            slot = i;
+            break;
+        }
+    }
+
+    if (slot >= 0) {
+        uint32_t* words = &s_words[HEADER_WORDS + slot * SLOT_WORDS];
+        uint32_t seq = Begin(words);
+        // Ids are never 0, that's a free slot
+        if (++ s_next_id == 0) {
+            ++ s_next_id;
+        }
+
+        size_t len = name.size();
+        size_t max = (SLOT_WORDS - SLOT_NAME) * sizeof(uint32_t);
+        if (len > max) {
+            len = max;
+        }
+
+        words[SLOT_ID] = s_next_id;
+        words[SLOT_STATE] = 0;
+        words[SLOT_EVENTS] = 0;
+        memset(&words[SLOT_TIME], 0, 2 * sizeof(uint32_t));
+        words[SLOT_ATR_LEN] = 0;
+        words[SLOT_NAME_LEN] = len;
+        memcpy(&words[SLOT_NAME], name.data(), len);
+        End(words, seq);
+    } else {
+        reinterpret_cast<std::atomic<uint32_t>*>(&s_words[HEADER_MISSED])->fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uv_mutex_unlock(&s_mutex);
+    return slot;
+}
+
+void StateTable::Release(int slot) {
+
+    if (slot < 0) {
+        return;
+    }
+
+    uv_mutex_lock(&s_mutex);
+    uint32_t* words = &s_words[HEADER_WORDS + slot * SLOT_WORDS];
+    uint32_t seq = Begin(words);
+    words[SLOT_ID] = 0;
+    words[SLOT_STATE] = 0;
+    words[SLOT_ATR_LEN] = 0;
+    words[SLOT_NAME_LEN] = 0;
+    End(words, seq);
+    uv_mutex_unlock(&s_mutex);
+}
+
+void StateTable::Update(int slot, uint32_t state, const uint8_t* atr, uint32_t atrlen) {
+
+    if (slot < 0) {
+        return;
+    }
+
+    double now = std::chrono::duration<double, std::milli>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    uint32_t max = (SLOT_NAME_LEN - SLOT_ATR) * sizeof(uint32_t);
+    if (atrlen > max) {
+        atrlen = max;
+    }
+
+    uint32_t* words = &s_words[HEADER_WORDS + slot * SLOT_WORDS];
+    uint32_t seq = Begin(words);
+    words[SLOT_STATE] = state;
+    ++ words[SLOT_EVENTS];
+    memcpy(&words[SLOT_TIME], &now, sizeof(now));
+    words[SLOT_ATR_LEN] = atrlen;
+    if (atrlen) {
+        memcpy(&words[SLOT_ATR], atr, atrlen);
+    }
+    End(words, seq);
+}
+
+uint32_t StateTable::Begin(uint32_t* words) {
+
+    // Wait for other writers, then make the sequence number odd
+    std::atomic<uint32_t>* seq = seq_of(words);
+    uint32_t current = seq->load(std::memory_order_relaxed);
+    while ((current & 1) ||
+           !seq->compare_exchange_weak(current, current + 1, std::memory_order_acquire)) {
+        current = seq->load(std::memory_order_relaxed);
+    }
+
+    std::atomic_thread_fence(std::memory_order_release);
+    return current + 1;
+}
+
+void StateTable::End(uint32_t* words, uint32_t seq) {
+    seq_of(words)->store(seq + 1, std::memory_order_release);
+}
@@ -0,0 +1,72 @@
+#ifndef STATETABLE_H
+#define STATETABLE_H
+
+#include <nan.h>
+#include <stdint.h>
+#include <string>
+
+/*
+ * Process wide table with the current state of every reader, for code that
+ * only needs to know whether there's a card and its ATR. The monitor threads
+ * write their reader's slot and JS gets the memory as a SharedArrayBuffer, so
+ * any thread can read it without callbacks nor allocations.
+ *
+ * The table is an array of 32 bits words: a header, then fixed size slots.
+ * Every slot is a seqlock: the sequence number is odd while the slot is being
+ * written, and a read is consistent if the number was even and didn't change
+ * across it. Writers take the slot by moving the number from even to odd, so
+ * several of them are serialized. The layout must match lib/statetable.js.
+ */
+class StateTable {
+
+    public:
+
+        enum {
+            // Header
+            HEADER_MAGIC = 0,
+            HEADER_VERSION = 1,
+            HEADER_SLOTS = 2,
+            HEADER_SLOT_WORDS = 3,
+            HEADER_MISSED = 4,  // readers left out because the table was full
+            HEADER_WORDS = 16,
+
+            // Slot
+            SLOT_SEQ = 0,
+            SLOT_ID = 1,        // 0 if the slot is free
+            SLOT_STATE = 2,     // dwEventState, SCARD_STATE_UNAVAILABLE on errors
+            SLOT_EVENTS = 3,    // number of updates
+            SLOT_TIME = 4,      // two words: float64 ms since the epoch
+            SLOT_ATR_LEN = 6,
+            SLOT_ATR = 7,       // 36 bytes
+            SLOT_NAME_LEN = 16,
+            SLOT_NAME = 17,     // up to 188 bytes of UTF-8
+            SLOT_WORDS = 64,
+
+            SLOTS = 64,
+            MAGIC = 0x50435343, // "PCSC"
+            VERSION = 1
+        };
+
+        // It returns the SharedArrayBuffer over the table, or undefined if the
+        // runtime doesn't have them
+        static NAN_METHOD(GetBuffer);
+
+        // It takes a free slot for the reader, -1 if the table is full
+        static int Acquire(const std::string& name);
+        static void Release(int slot);
+
+        static void Update(int slot, uint32_t state, const uint8_t* atr, uint32_t atrlen);
+
+    private:
+
+        static void Init();
+        static uint32_t Begin(uint32_t* words);
+        static void End(uint32_t* words, uint32_t seq);
+
+        static uv_once_t s_once;
+        static uv_mutex_t s_mutex;
+        static uint32_t s_next_id;
+        alignas(8) static uint32_t s_words[HEADER_WORDS + SLOTS * SLOT_WORDS];
+};
+
+#endif /* STATETABLE_H */
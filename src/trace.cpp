@@ -0,0 +1,361 @@
+#include "trace.h"
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define TRACE_MAGIC "PCSCTRC1"
+#define TRACE_MAGIC_LEN 8
+#define TRACE_HEADER_LEN 36
+
+namespace {
+
+    void put_u32(uint8_t* p, uint32_t v) {
+        p[0] = v & 0xff;
+        p[1] = (v >> 8) & 0xff;
+        p[2] = (v >> 16) & 0xff;
+        p[3] = (v >> 24) & 0xff;
+    }
+
+    void put_u64(uint8_t* p, uint64_t v) {
+        put_u32(p, (uint32_t)(v & 0xffffffff));
+        put_u32(p + 4, (uint32_t)(v >> 32));
+    }
+
+    uint32_t get_u32(const uint8_t* p) {
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+               ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    uint64_t get_u64(const uint8_t* p) {
+        return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+    }
+
+    void sleep_ns(uint64_t ns) {
+#ifdef _WIN32
+        Sleep((DWORD)(ns / 1000000));
+#else
+        usleep((useconds_t)(ns / 1000));
+#endif
+    }
+}
+
+TraceRecorder::TraceRecorder(): m_cells(NULL),
+                                m_enqueue_pos(0),
+                                m_dequeue_pos(0),
+                                m_active(false),
+                                m_running(false),
+                                m_writers(0),
+                                m_recorded(0),
+                                m_dropped(0),
+                                m_origin(0),
+                                m_file(NULL) {
+}
+
+TraceRecorder::~TraceRecorder() {
+    Stop();
+    delete[] m_cells;
+}
+
+int TraceRecorder::Start(const char* path) {
+
+    if (IsActive()) {
+        Stop();
+    }
+
+    m_file = fopen(path, "wb");
+    if (m_file == NULL) {
+        return errno;
+    }
+
+    // The ring and its buffers outlive the recording, for the next one
+    if (m_cells == NULL) {
+        m_cells = new Cell[CAPACITY];
+        for (size_t i = 0; i < CAPACITY; ++ i) {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+            m_cells[i].entry.in.reserve(PAYLOAD_RESERVE);
+            m_cells[i].entry.out.reserve(PAYLOAD_RESERVE);
+        }
+    }
+
+    fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, m_file);
+    m_origin = uv_hrtime();
+    m_recorded.store(0, std::memory_order_relaxed);
+    m_dropped.store(0, std::memory_order_relaxed);
+    m_running.store(true, std::memory_order_release);
+    int ret = uv_thread_create(&m_thread, WriterFunction, this);
+    assert(ret == 0);
+    m_active.store(true);
+    return 0;
+}
+
+void TraceRecorder::Stop() {
+
+    if (!IsActive()) {
+        return;
+    }
+
+    // Sequentially consistent on both sides: either Record() sees the store
+    // or this loop sees its writer, never neither
+    m_active.store(false);
+    // Let the threads already inside Record() finish their enqueue
+    while (m_writers.load() > 0) {
+        sleep_ns(100000);
+    }
+
+    m_running.store(false, std::memory_order_release);
+    assert(uv_thread_join(&m_thread) == 0);
+    Flush();
+    fclose(m_file);
+    m_file = NULL;
+}
+
+void TraceRecorder::Record(uint8_t type,
+                           int32_t result,
+                           uint32_t arg,
+                           uint64_t start,
+                           uint64_t end,
+                           const void* in,
+                           size_t in_len,
+                           const void* out,
+                           size_t out_len) {
+
+    m_writers.fetch_add(1);
+    if (m_active.load()) {
+        size_t pos;
+        Cell* cell = Claim(&pos);
+        if (cell) {
+            TraceEntry& entry = cell->entry;
+            entry.type = type;
+            entry.result = result;
+            entry.arg = arg;
+            entry.start = start > m_origin ? start - m_origin : 0;
+            entry.duration = end > start ? end - start : 0;
+            entry.in.assign(static_cast<const uint8_t*>(in),
+                            static_cast<const uint8_t*>(in) + in_len);
+            entry.out.assign(static_cast<const uint8_t*>(out),
+                             static_cast<const uint8_t*>(out) + out_len);
+            cell->seq.store(pos + 1, std::memory_order_release);
+            m_recorded.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    m_writers.fetch_sub(1);
+}
+
+TraceRecorder::Cell* TraceRecorder::Claim(size_t* pos) {
+
+    // Bounded multi-producer queue, see
+    // http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+    // The cell is published by storing pos + 1 in its sequence once filled.
+    Cell* cell;
+    size_t p = m_enqueue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+        cell = &m_cells[p & (CAPACITY - 1)];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)p;
+        if (dif == 0) {
+            if (m_enqueue_pos.compare_exchange_weak(p, p + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            p = m_enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    *pos = p;
+    return cell;
+}
+
+TraceRecorder::Cell* TraceRecorder::Peek() {
+
+    // Only the writer thread dequeues
+    Cell* cell = &m_cells[m_dequeue_pos & (CAPACITY - 1)];
+    size_t seq = cell->seq.load(std::memory_order_acquire);
+    return seq == m_dequeue_pos + 1 ? cell : NULL;
+}
+
+void TraceRecorder::Flush() {
+
+    uint8_t header[TRACE_HEADER_LEN];
+    Cell* cell;
+    while ((cell = Peek()) != NULL) {
+        const TraceEntry& entry = cell->entry;
+        memset(header, 0, sizeof(header));
+        header[0] = entry.type;
+        put_u32(header + 4, (uint32_t)entry.result);
+        put_u32(header + 8, entry.arg);
+        put_u32(header + 12, (uint32_t)entry.in.size());
+        put_u32(header + 16, (uint32_t)entry.out.size());
+        put_u64(header + 20, entry.start);
+        put_u64(header + 28, entry.duration);
+        fwrite(header, 1, sizeof(header), m_file);
+        if (!entry.in.empty()) {
+            fwrite(&entry.in[0], 1, entry.in.size(), m_file);
+        }
+
+        if (!entry.out.empty()) {
+            fwrite(&entry.out[0], 1, entry.out.size(), m_file);
+        }
+
+        // Hand the cell, buffers included, back to the producers
+        cell->seq.store(m_dequeue_pos + CAPACITY, std::memory_order_release);
+        ++ m_dequeue_pos;
+    }
+}
+
+void TraceRecorder::WriterFunction(void* arg) {
+
+    TraceRecorder* recorder = static_cast<TraceRecorder*>(arg);
+    while (recorder->m_running.load(std::memory_order_acquire)) {
+        recorder->Flush();
+        /* Nothing left, check again in 10ms */
+        sleep_ns(10000000);
+    }
+}
+
+TracePlayer::TracePlayer(double speed, bool loop): m_cancelled(false),
+                                                   m_speed(speed),
+                                                   m_loop(loop),
+                                                   m_served(0) {
+    assert(uv_mutex_init(&m_mutex) == 0);
+    assert(uv_cond_init(&m_cond) == 0);
+    for (int i = 0; i < TRACE_TYPES; ++ i) {
+        m_cursor[i] = 0;
+    }
+}
+
+TracePlayer::~TracePlayer() {
+    uv_cond_destroy(&m_cond);
+    uv_mutex_destroy(&m_mutex);
+}
+
+int TracePlayer::Load(const char* path) {
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return errno;
+    }
+
+    int ret = 0;
+    char magic[TRACE_MAGIC_LEN];
+    if ((fread(magic, 1, TRACE_MAGIC_LEN, file) != TRACE_MAGIC_LEN) ||
+        (memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0)) {
+        ret = -1;
+    }
+
+    // The payload lengths come from the file: they can't be larger than what
+    // is left of it
+    long size = 0;
+    if ((fseek(file, 0, SEEK_END) != 0) || ((size = ftell(file)) < 0) ||
+        (fseek(file, TRACE_MAGIC_LEN, SEEK_SET) != 0)) {
+        ret = -1;
+    }
+
+    uint8_t header[TRACE_HEADER_LEN];
+    while ((ret == 0) && (fread(header, 1, sizeof(header), file) == sizeof(header))) {
+        uint64_t left = (uint64_t)(size - ftell(file));
+        uint32_t in_len = get_u32(header + 12);
+        uint32_t out_len = get_u32(header + 16);
+        if ((uint64_t)in_len + out_len > left) {
+            ret = -1;
+            break;
+        }
+
+        TraceEntry entry;
+        entry.type = header[0];
+        entry.result = (int32_t)get_u32(header + 4);
+        entry.arg = get_u32(header + 8);
+        entry.in.resize(in_len);
+        entry.out.resize(out_len);
+        entry.start = get_u64(header + 20);
+        entry.duration = get_u64(header + 28);
+        if ((entry.type == 0) || (entry.type >= TRACE_TYPES) ||
+            (!entry.in.empty() &&
+             fread(&entry.in[0], 1, entry.in.size(), file) != entry.in.size()) ||
+            (!entry.out.empty() &&
+             fread(&entry.out[0], 1, entry.out.size(), file) != entry.out.size())) {
+            ret = -1;
+            break;
+        }
+
+        m_index[entry.type].push_back(m_entries.size());
+        m_entries.push_back(entry);
+    }
+
+    fclose(file);
+    return ret;
+}
+
+const TraceEntry* TracePlayer::Next(uint8_t type) {
+
+    const TraceEntry* entry = NULL;
+    uv_mutex_lock(&m_mutex);
+    std::vector<size_t>& index = m_index[type];
+    if (!index.empty()) {
+        // Status changes are replayed once, looping them would flood the reader
+        if ((m_cursor[type] == index.size()) && m_loop && (type != TRACE_STATUS)) {
+            m_cursor[type] = 0;
+        }
+
+        if (m_cursor[type] < index.size()) {
+            entry = &m_entries[index[m_cursor[type] ++]];
+            ++ m_served;
+        }
+    }
+
+    uv_mutex_unlock(&m_mutex);
+    return entry;
+}
+
+void TracePlayer::WaitDuration(const TraceEntry* entry) const {
+    Wait(entry->duration);
+}
+
+void TracePlayer::WaitGap(const TraceEntry* prev, const TraceEntry* entry) const {
+    if (prev && (entry->start > prev->start)) {
+        Wait(entry->start - prev->start);
+    }
+}
+
+void TracePlayer::WaitCancel() const {
+    uv_mutex_lock(&m_mutex);
+    while (!m_cancelled) {
+        uv_cond_wait(&m_cond, &m_mutex);
+    }
+
+    uv_mutex_unlock(&m_mutex);
+}
+
+void TracePlayer::Cancel() {
+    uv_mutex_lock(&m_mutex);
+    m_cancelled = true;
+    uv_cond_broadcast(&m_cond);
+    uv_mutex_unlock(&m_mutex);
+}
+
+void TracePlayer::Wait(uint64_t ns) const {
+    if ((m_speed <= 0) || (ns == 0)) {
+        return;
+    }
+
+    uint64_t timeout = (uint64_t)(ns / m_speed);
+    uint64_t deadline = uv_hrtime() + timeout;
+    uv_mutex_lock(&m_mutex);
+    while (!m_cancelled && (timeout > 0)) {
+        uv_cond_timedwait(&m_cond, &m_mutex, timeout);
+        uint64_t now = uv_hrtime();
+        timeout = now < deadline ? deadline - now : 0;
+    }
+
+    uv_mutex_unlock(&m_mutex);
+}
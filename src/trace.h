@@ -0,0 +1,159 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <uv.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+/*
+ * Binary trace of the operations run on a reader. The file starts with an
+ * 8 byte magic ("PCSCTRC1") followed by the records, each one made of a
+ * fixed 36 byte little endian header and the input and output payloads:
+ *
+ *   u8  type       TRACE_CONNECT, TRACE_TRANSMIT...
+ *   u8  reserved[3]
+ *   i32 result     PC/SC return code
+ *   u32 arg        share mode, disposition, control code or reader state
+ *   u32 in_len
+ *   u32 out_len
+ *   u64 start      nanoseconds since the recording started
+ *   u64 duration   nanoseconds spent in the PC/SC call
+ */
+enum TraceType {
+    TRACE_CONNECT = 1,
+    TRACE_DISCONNECT = 2,
+    TRACE_TRANSMIT = 3,
+    TRACE_CONTROL = 4,
+    TRACE_STATUS = 5,
+    TRACE_TYPES = 6
+};
+
+struct TraceEntry {
+    uint8_t type;
+    int32_t result;
+    uint32_t arg;
+    uint64_t start;
+    uint64_t duration;
+    std::vector<uint8_t> in;
+    std::vector<uint8_t> out;
+};
+
+/*
+ * Records trace entries from any thread. Record() never blocks nor does any
+ * I/O: entries are copied into the cells of a bounded lock-free ring that a
+ * background thread drains to the file. The cells keep their buffers, so only
+ * payloads larger than a short APDU allocate. If the ring is full the entry is
+ * dropped and counted.
+ */
+class TraceRecorder {
+
+    struct Cell {
+        std::atomic<size_t> seq;
+        TraceEntry entry;
+    };
+
+    public:
+
+        TraceRecorder();
+
+        ~TraceRecorder();
+
+        // It returns 0 on success or the errno of the failed fopen
+        int Start(const char* path);
+
+        void Stop();
+
+        bool IsActive() const { return m_active.load(); }
+
+        void Record(uint8_t type,
+                    int32_t result,
+                    uint32_t arg,
+                    uint64_t start,
+                    uint64_t end,
+                    const void* in,
+                    size_t in_len,
+                    const void* out,
+                    size_t out_len);
+
+        uint64_t Recorded() const { return m_recorded.load(std::memory_order_relaxed); }
+
+        uint64_t Dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+    private:
+
+        static const size_t CAPACITY = 4096;
+        // Room kept in every cell: a short APDU and its response
+        static const size_t PAYLOAD_RESERVE = 261;
+
+        Cell* Claim(size_t* pos);
+        Cell* Peek();
+        void Flush();
+        static void WriterFunction(void* arg);
+
+        // Allocated by the first recording, as most readers never record
+        Cell* m_cells;
+        std::atomic<size_t> m_enqueue_pos;
+        size_t m_dequeue_pos;
+        std::atomic<bool> m_active;
+        std::atomic<bool> m_running;
+        std::atomic<int> m_writers;
+        std::atomic<uint64_t> m_recorded;
+        std::atomic<uint64_t> m_dropped;
+        uint64_t m_origin;
+        FILE* m_file;
+        uv_thread_t m_thread;
+};
+
+/*
+ * Serves the entries of a trace in the order they were recorded, one cursor
+ * per entry type. The speed scales the recorded timings: 1 replays them as
+ * recorded, 2 twice as fast and 0 doesn't wait at all.
+ */
+class TracePlayer {
+
+    public:
+
+        TracePlayer(double speed, bool loop);
+
+        ~TracePlayer();
+
+        // It returns 0 on success, the errno of the failed fopen or -1 if the
+        // file isn't a valid trace
+        int Load(const char* path);
+
+        // It returns NULL when there are no more entries of that type
+        const TraceEntry* Next(uint8_t type);
+
+        // Wait the (scaled) time the entry took when it was recorded
+        void WaitDuration(const TraceEntry* entry) const;
+
+        // Wait the (scaled) time between two consecutive entries
+        void WaitGap(const TraceEntry* prev, const TraceEntry* entry) const;
+
+        // Wait until Cancel() is called
+        void WaitCancel() const;
+
+        // It interrupts the current and future waits
+        void Cancel();
+
+        uint64_t Served() const { return m_served; }
+
+    private:
+
+        void Wait(uint64_t ns) const;
+
+        std::vector<TraceEntry> m_entries;
+        std::vector<size_t> m_index[TRACE_TYPES];
+        size_t m_cursor[TRACE_TYPES];
+        mutable uv_mutex_t m_mutex;
+        mutable uv_cond_t m_cond;
+        bool m_cancelled;
+        double m_speed;
+        bool m_loop;
+        uint64_t m_served;
+};
+
+#endif /* TRACE_H */
@@ -1,7 +1,49 @@
+var events = require('events');
+var fs = require('fs');
+var net = require('net');
+var os = require('os');
+var path = require('path');
 var should = require('should');
 var sinon = require('sinon');
 var pcsc = require('../lib/pcsclite');
 
+// Trace file with the given [type, result, arg, in, out, start_ms] records
+function write_trace(file, records) {
+    var chunks = [new Buffer('PCSCTRC1')];
+    records.forEach(function(r) {
+        var header = new Buffer(36);
+        header.fill(0);
+        header.writeUInt8(r[0], 0);
+        header.writeInt32LE(r[1], 4);
+        header.writeUInt32LE(r[2], 8);
+        header.writeUInt32LE(r[3].length, 12);
+        header.writeUInt32LE(r[4].length, 16);
+        header.writeUInt32LE((r[5] || 0) * 1e6, 20);
+        chunks.push(header, r[3], r[4]);
+    });
+
+    fs.writeFileSync(file, Buffer.concat(chunks));
+}
+
+// The { type, in, out } records of a trace file
+function read_trace(file) {
+    var data = fs.readFileSync(file);
+    var records = [];
+    for (var offset = 8; offset < data.length; ) {
+        var in_len = data.readUInt32LE(offset + 12);
+        var out_len = data.readUInt32LE(offset + 16);
+        offset += 36;
+        records.push({
+            type : data.readUInt8(offset - 36),
+            in : data.slice(offset, offset + in_len),
+            out : data.slice(offset + in_len, offset + in_len + out_len)
+        });
+        offset += in_len + out_len;
+    }
+
+    return records;
+}
+
 describe('Testing PCSCLite private', function() {
 
     describe('#start()', function() {
@@ -58,6 +100,534 @@ describe('Testing PCSCLite private', function() {
             this.clock.restore();
         });
     });
+
+    describe('#closeAll()', function() {
+
+        it('#closeAll() ends every reader and the monitor', function(done) {
+            var p = pcsc();
+            var stub = sinon.stub(p, 'start', function(my_cb) {
+                my_cb(undefined, new Buffer("MyReader1\0MyReader2\0\0"));
+            });
+
+            var readers = 0;
+            p.on('reader', function(reader) {
+                if (++ readers < 2) {
+                    return;
+                }
+
+                var ended = 0;
+                Object.keys(p.readers).forEach(function(name) {
+                    p.readers[name].on('end', function() {
+                        ++ ended;
+                    });
+                });
+
+                p.closeAll(function(err) {
+                    (err === null).should.equal(true);
+                    ended.should.equal(2);
+                    done();
+                });
+            });
+        });
+    });
+
+    describe('#snapshot', function() {
+
+        it('#snapshot sets the initial state and defers monitoring', function(done) {
+            var p = pcsc({ lazy : true });
+            var stub = sinon.stub(p, 'start', function(my_cb) {
+                my_cb(undefined, new Buffer("MyReader\0\0"), false, {
+                    MyReader : { state : 0x22, atr : new Buffer([0x3B, 0x00]) }
+                });
+            });
+
+            p.on('reader', function(reader) {
+                reader.state.should.equal(0x22);
+                reader.atr.should.eql(new Buffer([0x3B, 0x00]));
+                var status_stub = sinon.stub(reader, 'get_status');
+                setImmediate(function() {
+                    sinon.assert.notCalled(status_stub);
+                    reader.on('status', function() {});
+                    setImmediate(function() {
+                        sinon.assert.calledOnce(status_stub);
+                        status_stub.restore();
+                        reader.close();
+                        p.close();
+                        done();
+                    });
+                });
+            });
+        });
+
+        it('#snapshot seeds the tables and starts monitoring for a job', function(done) {
+            var p = pcsc({ lazy : true });
+            var stub = sinon.stub(p, 'start', function(my_cb) {
+                my_cb(undefined, new Buffer("MyReader\0\0"), false, {
+                    MyReader : { state : 0x22, atr : new Buffer([0x3B, 0x00]) }
+                });
+            });
+
+            p.on('reader', function(reader) {
+                var slot = pcsc.stateTable().read(reader.slot);
+                slot.state.should.equal(0x22);
+                slot.atr.should.eql(new Buffer([0x3B, 0x00]));
+                var status_stub = sinon.stub(reader, 'get_status');
+                var submit_stub = sinon.stub(reader.constructor, 'submit_job');
+                p.submit({ apdus : [new Buffer([0x00, 0xA4, 0x04, 0x00])] }, function() {});
+                sinon.assert.calledOnce(status_stub);
+                sinon.assert.calledOnce(submit_stub);
+                submit_stub.restore();
+                status_stub.restore();
+                reader.close();
+                p.close();
+                done();
+            });
+        });
+    });
+
+    describe('#debounce', function() {
+
+        it('#debounce drops the connection of a reader that came back', function(done) {
+            var p = pcsc({ debounce : 1000, lazy : true });
+            var stub = sinon.stub(p, 'start', function(my_cb) {
+                my_cb(undefined, new Buffer("MyReader\0\0"));
+            });
+
+            p.on('reader', function(reader) {
+                var status_stub = sinon.stub(reader, 'get_status', function(cb) {
+                    reader.connected = true;
+                    cb(undefined, 0x22, new Buffer([0x3B, 0x00]));
+                    reader.connected.should.equal(true);
+                    cb(undefined, 0x22, new Buffer([0x3B, 0x00]), undefined, undefined, true);
+                });
+
+                var statuses = 0;
+                reader.on('status', function(status) {
+                    if (++ statuses === 2) {
+                        status.state.should.equal(0x22);
+                        reader.connected.should.equal(false);
+                        status_stub.restore();
+                        reader.close();
+                        p.close();
+                        done();
+                    }
+                });
+            });
+        });
+    });
+
+    describe('#resync', function() {
+
+        it('#resync after pcscd comes back', function(done) {
+            var p = pcsc({ recover : true });
+            var stub = sinon.stub(p, 'start', function(my_cb) {
+                my_cb(undefined, new Buffer("MyReader1\0MyReader2\0\0"));
+                p.readers["MyReader1"].connected = true;
+                my_cb(undefined, new Buffer("MyReader1\0MyReader3\0\0"), true);
+            });
+
+            p.on('resync', function(resync) {
+                resync.readers.map(function(r) {
+                    return r.name;
+                }).should.eql(["MyReader1", "MyReader3"]);
+                resync.added.length.should.equal(1);
+                resync.added[0].name.should.equal("MyReader3");
+                resync.removed.should.eql(["MyReader2"]);
+                resync.readers[0].connected.should.equal(false);
+                resync.readers.forEach(function(r) {
+                    r.close();
+                });
+
+                p.close();
+                done();
+            });
+        });
+    });
+});
+
+describe('Testing reader groups', function() {
+
+    describe('#group', function() {
+
+        it('#group joins the slots of a device', function(done) {
+            var p = pcsc({ group : true });
+            var stub = sinon.stub(p, 'start', function(my_cb) {
+                my_cb(undefined, new Buffer("ACS Dual [PICC] 00 00\0ACS Dual [SAM] 00 01\0ACS Dual [PICC] 01 00\0\0"));
+            });
+
+            p.on('group', function(group) {
+                group.name.should.equal("ACS Dual 00");
+                group.readers.map(function(r) {
+                    return r.name;
+                }).should.eql(["ACS Dual [PICC] 00 00", "ACS Dual [SAM] 00 01"]);
+                (group.active === null).should.equal(true);
+                (p.readers["ACS Dual [PICC] 01 00"].group === undefined).should.equal(true);
+                group.close();
+                p.readers["ACS Dual [PICC] 01 00"].close();
+                p.close();
+                done();
+            });
+        });
+    });
+});
+
+describe('Testing load generator', function() {
+
+    var load = require('../bin/pcsc-load');
+
+    describe('#parse_mix()', function() {
+
+        it('#parse_mix() weights', function() {
+            var mix = load.parse_mix(['00A4040000', '0084000008:3']);
+            mix.length.should.equal(2);
+            mix[0].data.should.eql(new Buffer([0x00, 0xA4, 0x04, 0x00, 0x00]));
+            mix[0].weight.should.equal(1);
+            mix[1].weight.should.equal(3);
+            (function() {
+                load.parse_mix(['00A4']);
+            }).should.throw();
+        });
+    });
+
+    describe('#percentile()', function() {
+
+        it('#percentile() nearest rank', function() {
+            var sorted = [1, 2, 3, 4, 5, 6, 7, 8, 9, 10];
+            load.percentile(sorted, 50).should.equal(5);
+            load.percentile(sorted, 99).should.equal(10);
+            load.percentile([], 50).should.equal(0);
+        });
+    });
+
+    describe('#parse_args()', function() {
+
+        it('#parse_args() priority', function() {
+            load.parse_args(['--priority', 'bulk']).priority.should.equal('bulk');
+            (function() {
+                load.parse_args(['--priority', 'urgent']);
+            }).should.throw('Unknown priority urgent');
+        });
+    });
+});
+
+describe('Testing state table', function() {
+
+    describe('#read()', function() {
+
+        it('#read() slot', function() {
+            // Header plus two slots, as laid out by src/statetable.cpp
+            var buffer = new SharedArrayBuffer((16 + 2 * 64) * 4);
+            var words = new Uint32Array(buffer);
+            words.set([0x50435343, 1, 2, 64]);
+            var base = 16 + 64;
+            words[base + 1] = 7;
+            words[base + 2] = 0x22;
+            words[base + 3] = 3;
+            words[base + 6] = 2;
+            words[base + 16] = 8;
+            new Uint8Array(buffer).set([0x3B, 0x00], (base + 7) * 4);
+            new Uint8Array(buffer).set(new Buffer('MyReader'), (base + 17) * 4);
+
+            var table = new pcsc.StateTable(buffer);
+            table.find('MyReader').should.equal(1);
+            table.state(0).should.equal(-1);
+            table.present(1).should.equal(true);
+            var slot = table.read(1);
+            slot.id.should.equal(7);
+            slot.events.should.equal(3);
+            slot.atr.should.eql(new Buffer([0x3B, 0x00]));
+            (table.read(0) === null).should.equal(true);
+        });
+    });
+
+    describe('#find()', function() {
+
+        it('#find() prefers the newest reader', function() {
+            var buffer = new SharedArrayBuffer((16 + 2 * 64) * 4);
+            var words = new Uint32Array(buffer);
+            words.set([0x50435343, 1, 2, 64, 3]);
+            [[0, 9], [1, 4]].forEach(function(slot) {
+                var base = 16 + slot[0] * 64;
+                words[base + 1] = slot[1];
+                words[base + 16] = 8;
+                new Uint8Array(buffer).set(new Buffer('MyReader'), (base + 17) * 4);
+            });
+
+            var table = new pcsc.StateTable(buffer);
+            table.find('MyReader').should.equal(0);
+            table.find('OtherReader').should.equal(-1);
+            table.missed().should.equal(3);
+        });
+    });
+});
+
+describe('Testing timeline', function() {
+
+    var timeline = require('../lib/timeline');
+
+    describe('#transmit()', function() {
+
+        it('#transmit() strips the timings', function() {
+            var cb = sinon.spy();
+            var reader = { name : 'MyReader' };
+            timeline.enable(false);
+            timeline.transmit(reader, cb).should.equal(cb);
+            timeline.enable(true);
+            var wrapped = timeline.transmit(reader, cb);
+            var t = process.hrtime();
+            var now = t[0] * 1e3 + t[1] / 1e6;
+            wrapped(null, new Buffer([0x90, 0x00]), [now - 4, now - 3, now - 2, now - 1]);
+            timeline.enable(false);
+            sinon.assert.calledWith(cb, null, new Buffer([0x90, 0x00]));
+            cb.args[0].length.should.equal(2);
+        });
+    });
+});
+
+describe('Testing ATR filters', function() {
+
+    var EMPTY = 0x10;
+    var PRESENT = 0x20;
+    var ATR = new Buffer('3B8F8001804F0CA000000306030001000000006A', 'hex');
+    var filter = {
+        atr : ATR,
+        mask : new Buffer('FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF0000FFFF', 'hex')
+    };
+
+    // It replays the status changes through the native filters and calls cb
+    // with the statuses delivered once `count` of them arrived. They are 50ms
+    // apart, so the notifications don't coalesce.
+    var replay_statuses = function(statuses, count, cb) {
+        var file = path.join(os.tmpdir(), 'pcsc-test-filter-' + process.pid + '.trc');
+        write_trace(file, statuses.map(function(s, i) {
+            return [5, 0, s[0], new Buffer(0), s[1] || new Buffer(0), i * 50];
+        }));
+
+        var reader = pcsc.replay('Virtual reader', file);
+        reader.setAtrFilters([filter]);
+        var delivered = [];
+        reader.on('status', function(status) {
+            delivered.push(status);
+            if (delivered.length === count) {
+                var stats = reader.getStats();
+                reader.close();
+                fs.unlinkSync(file);
+                cb(delivered, stats);
+            }
+        });
+    };
+
+    describe('#setAtrFilters()', function() {
+
+        it('#setAtrFilters() delivers a matching card and its removal', function(done) {
+            replay_statuses([[EMPTY], [PRESENT, ATR], [EMPTY]], 3, function(delivered, stats) {
+                delivered[1].atr.should.eql(ATR);
+                delivered[2].state.should.equal(EMPTY);
+                stats.events_filtered.should.equal(0);
+                done();
+            });
+        });
+
+        it('#setAtrFilters() drops other cards', function(done) {
+            var other = new Buffer('3B6800000073C84013009000', 'hex');
+            replay_statuses([[EMPTY], [PRESENT, other], [EMPTY], [PRESENT, ATR]], 2, function(delivered, stats) {
+                delivered[1].atr.should.eql(ATR);
+                stats.events_filtered.should.equal(2);
+                done();
+            });
+        });
+
+        it('#setAtrFilters() ignores the masked out bytes', function(done) {
+            var masked = new Buffer(ATR);
+            masked[16] = 0xAA;
+            masked[17] = 0x55;
+            replay_statuses([[EMPTY], [PRESENT, masked]], 2, function(delivered, stats) {
+                delivered[1].atr.should.eql(masked);
+                stats.events_filtered.should.equal(0);
+                done();
+            });
+        });
+    });
+});
+
+describe('Testing trace replay', function() {
+
+    describe('#replay()', function() {
+
+        it('#replay() serves the recorded responses', function(done) {
+            var file = path.join(os.tmpdir(), 'pcsc-test-' + process.pid + '.trc');
+            write_trace(file, [
+                [1, 0, 2, new Buffer(0), new Buffer([2, 0, 0, 0])],
+                [3, 0, 2, new Buffer('00A4040000', 'hex'), new Buffer('9000', 'hex')]
+            ]);
+
+            var reader = pcsc.replay('Virtual reader', file, { speed : 0 });
+            reader.connect(function(err, protocol) {
+                (err === undefined || err === null).should.equal(true);
+                protocol.should.equal(2);
+                reader.transmit(new Buffer('00A4040000', 'hex'), 2, protocol, function(err, data) {
+                    (err === undefined || err === null).should.equal(true);
+                    data.should.eql(new Buffer('9000', 'hex'));
+                    reader.close();
+                    fs.unlinkSync(file);
+                    done();
+                });
+            });
+        });
+
+        it('#replay() rejects lengths beyond the end of the file', function() {
+            var file = path.join(os.tmpdir(), 'pcsc-test-bad-' + process.pid + '.trc');
+            write_trace(file, [[3, 0, 2, new Buffer(0), new Buffer(0)]]);
+            var data = fs.readFileSync(file);
+            data.writeUInt32LE(0xFFFFFFFF, 8 + 16);
+            fs.writeFileSync(file, data);
+            (function() {
+                pcsc.replay('Virtual reader', file, { speed : 0 });
+            }).should.throw(/invalid format/);
+            fs.unlinkSync(file);
+        });
+
+        // A card inserted, removed and, if `back`, inserted again 200ms apart,
+        // with two connects and a transmit to replay
+        var replay_removal = function(back) {
+            var file = path.join(os.tmpdir(), 'pcsc-test-removal-' + process.pid + '.trc');
+            var atr = new Buffer('3B00', 'hex');
+            var statuses = [[0x20, atr], [0x10, new Buffer(0)]];
+            if (back) {
+                statuses.push([0x20, atr]);
+            }
+
+            write_trace(file, statuses.map(function(s, i) {
+                return [5, 0, s[0], new Buffer(0), s[1], i * 200];
+            }).concat([
+                [1, 0, 2, new Buffer(0), new Buffer([2, 0, 0, 0])],
+                [1, 0, 2, new Buffer(0), new Buffer([2, 0, 0, 0])],
+                [3, 0, 2, new Buffer('00A4040000', 'hex'), new Buffer('9000', 'hex')]
+            ]));
+
+            var reader = pcsc.replay('Virtual reader', file);
+            reader.once('end', function() {
+                fs.unlinkSync(file);
+            });
+
+            return reader;
+        };
+
+        it('#replay() fails the queued transmits at once after a removal', function(done) {
+            var reader = replay_removal(false);
+            var apdu = new Buffer('00A4040000', 'hex');
+            var errors = [];
+            reader.on('status', function(status) {
+                if (status.state === 0x20) {
+                    return reader.connect(function() {});
+                }
+
+                for (var i = 0; i < 3; ++ i) {
+                    reader.transmit(apdu, 2, 2, function(err) {
+                        errors.push(err);
+                        if (errors.length === 3) {
+                            errors.forEach(function(err) {
+                                err.code.should.equal(0x80100069);
+                            });
+
+                            reader.getStats().failed_fast.should.equal(3);
+                            reader.close();
+                            done();
+                        }
+                    });
+                }
+            });
+        });
+
+        it('#replay() starts a new session when connecting after the card is back', function(done) {
+            var reader = replay_removal(true);
+            var apdu = new Buffer('00A4040000', 'hex');
+            var inserted = 0;
+            reader.on('status', function(status) {
+                if (status.state === 0x10) {
+                    return reader.transmit(apdu, 2, 2, function(err) {
+                        err.code.should.equal(0x80100069);
+                    });
+                }
+
+                if (++ inserted === 1) {
+                    return reader.connect(function() {});
+                }
+
+                reader.connect(function(err) {
+                    (err === undefined || err === null).should.equal(true);
+                    reader.transmit(apdu, 2, 2, function(err, data) {
+                        (err === undefined || err === null).should.equal(true);
+                        data.should.eql(new Buffer('9000', 'hex'));
+                        reader.getStats().failed_fast.should.equal(1);
+                        reader.close();
+                        done();
+                    });
+                });
+            });
+        });
+    });
+});
+
+describe('Testing batch delivery', function() {
+
+    describe('#dispatch()', function() {
+
+        it('#dispatch() runs the callbacks in order', function() {
+            var reader = {};
+            var calls = [];
+            var status_cb = function(err, state) {
+                this.should.equal(reader);
+                calls.push(state);
+            };
+
+            var transmit_cb = function(err, data) {
+                calls.push(data);
+            };
+
+            pcsc.dispatch([
+                { reader : reader, type : 'status', callback : status_cb, args : [undefined, 34] },
+                { reader : reader, type : 'transmit', callback : transmit_cb, args : [null, 'data'] },
+                { reader : reader, type : 'status', callback : status_cb, args : [undefined, 18] }
+            ]);
+
+            calls.should.eql([34, 'data', 18]);
+        });
+
+        it('#dispatch() runs every callback before rethrowing', function() {
+            var calls = [];
+            var failing = function() {
+                calls.push('failing');
+                throw new Error('callback failed');
+            };
+
+            var cb = function(err, data) {
+                calls.push(data);
+            };
+
+            (function() {
+                pcsc.dispatch([
+                    { reader : {}, type : 'transmit', callback : failing, args : [] },
+                    { reader : {}, type : 'transmit', callback : cb, args : [null, 'data'] }
+                ]);
+            }).should.throw('callback failed');
+            calls.should.eql(['failing', 'data']);
+        });
+    });
+});
+
+describe('Testing errors', function() {
+
+    describe('PCSCError', function() {
+
+        it('PCSCError builds its message lazily', function() {
+            var err = new pcsc.PCSCError('SCardTransmit', 0x80100069);
+            err.should.be.an.instanceOf(Error);
+            err.code.should.equal(0x80100069);
+            err.name.should.equal('SCARD_W_REMOVED_CARD');
+            err.message.should.match(/^SCardTransmit error: .*\(0x80100069\)$/);
+        });
+    });
 });
 
 describe('Testing CardReader private', function() {
@@ -72,6 +642,52 @@ describe('Testing CardReader private', function() {
         return p;
     };
 
+    describe('#submit()', function() {
+
+        it('#submit() defaults', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                var cb = sinon.spy();
+                var submit_stub = sinon.stub(reader.constructor, 'submit_job', function(atr, mask, apdus,
+                                                                                        share_mode, protocol,
+                                                                                        disposition, res_len,
+                                                                                        job_cb, flags, owner,
+                                                                                        timeout) {
+                    share_mode.should.equal(reader.SCARD_SHARE_SHARED);
+                    protocol.should.equal(reader.SCARD_PROTOCOL_T0 | reader.SCARD_PROTOCOL_T1);
+                    disposition.should.equal(reader.SCARD_LEAVE_CARD);
+                    res_len.should.equal(258);
+                    flags.should.equal(reader.PRIORITY_NORMAL);
+                    owner.should.equal(p);
+                    (timeout === undefined).should.equal(true);
+                    job_cb(null, [new Buffer([0x90, 0x00])], reader);
+                });
+
+                p.submit({ atr : new Buffer([0x3B, 0x8F]), apdus : [new Buffer([0x00, 0xA4, 0x04, 0x00])] }, cb);
+                submit_stub.restore();
+                sinon.assert.calledOnce(cb);
+                cb.args[0][2].should.equal(reader);
+            });
+        });
+
+        it('#submit() timeout', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                var submit_stub = sinon.stub(reader.constructor, 'submit_job', function(atr, mask, apdus,
+                                                                                        share_mode, protocol,
+                                                                                        disposition, res_len,
+                                                                                        job_cb, flags, owner,
+                                                                                        timeout) {
+                    timeout.should.equal(500);
+                });
+
+                p.submit({ apdus : [new Buffer([0x00, 0xA4, 0x04, 0x00])], timeout : 500 }, function() {});
+                submit_stub.restore();
+                sinon.assert.calledOnce(submit_stub);
+            });
+        });
+    });
+
     describe('#_connect()', function() {
 
         it('#_connect() success', function(done) {
@@ -152,6 +768,23 @@ describe('Testing CardReader private', function() {
             });
         });
 
+        it('#_disconnect() release', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                var cb = sinon.spy();
+                var disconnect_stub = sinon.stub(reader, '_disconnect', function(disposition,
+                                                                                 disconnect_cb,
+                                                                                 flags) {
+                    disposition.should.equal(reader.SCARD_LEAVE_CARD);
+                    (flags & 0x08).should.equal(0x08);
+                    disconnect_cb(undefined);
+                });
+
+                reader.disconnect(reader.SCARD_LEAVE_CARD, { release : true }, cb);
+                sinon.assert.calledOnce(cb);
+            });
+        });
+
         it('#_disconnect() already disconnected', function() {
             var p = get_reader();
             p.on('reader', function(reader) {
@@ -168,4 +801,581 @@ describe('Testing CardReader private', function() {
             });
         });
     });
+
+    describe('#_transmit()', function() {
+
+        it('#_transmit() priority', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                reader.connected = true;
+                var cb = sinon.spy();
+                var transmit_stub = sinon.stub(reader, '_transmit', function(data,
+                                                                             res_len,
+                                                                             protocol,
+                                                                             transmit_cb,
+                                                                             flags) {
+                    flags.should.equal(reader.PRIORITY_INTERACTIVE);
+                    transmit_cb(undefined, new Buffer([0x90, 0x00]));
+                });
+
+                reader.transmit(new Buffer([0x00, 0xB0, 0x00, 0x00, 0x20]), 40, 1,
+                                { priority : reader.PRIORITY_INTERACTIVE }, cb);
+                sinon.assert.calledOnce(cb);
+            });
+        });
+
+        it('#_transmit() plain', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                reader.connected = true;
+                var cb = sinon.spy();
+                var transmit_stub = sinon.stub(reader, '_transmit', function(data,
+                                                                             res_len,
+                                                                             protocol,
+                                                                             transmit_cb,
+                                                                             flags) {
+                    flags.should.equal(reader.PRIORITY_NORMAL | 0x04);
+                    transmit_cb(undefined, new Buffer([0x90, 0x00]));
+                });
+
+                reader.transmit(new Buffer([0x00, 0xA4, 0x04, 0x00]), 2, 1, { plain : true }, cb);
+                sinon.assert.calledOnce(cb);
+            });
+        });
+
+        it('#_transmit() code only', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                reader.connected = true;
+                var cb = sinon.spy();
+                var transmit_stub = sinon.stub(reader, '_transmit', function(data,
+                                                                             res_len,
+                                                                             protocol,
+                                                                             transmit_cb,
+                                                                             flags) {
+                    (flags & 0x10).should.equal(0x10);
+                    transmit_cb(0x80100069);
+                });
+
+                reader.transmit(new Buffer([0x00, 0xB0, 0x00, 0x00, 0x20]), 40, 1, { codeOnly : true }, cb);
+                sinon.assert.calledWith(cb, 0x80100069);
+            });
+        });
+
+        it('#transmit() code only with secure messaging', function(done) {
+            var file = path.join(os.tmpdir(), 'pcsc-test-sm-' + process.pid + '.trc');
+            write_trace(file, [
+                [1, 0, 2, new Buffer(0), new Buffer([2, 0, 0, 0])],
+                [3, 0, 2, new Buffer(0), new Buffer('8E109000', 'hex')]
+            ]);
+
+            var reader = pcsc.replay('Virtual reader', file, { speed : 0 });
+            reader.connect(function(err, protocol) {
+                reader.setSecureMessaging({ encKey : new Buffer(16).fill(1), macKey : new Buffer(16).fill(2) });
+                reader.transmit(new Buffer('00B0000004', 'hex'), 40, protocol, { codeOnly : true }, function(err) {
+                    err.should.equal(0x8010006A);
+                    reader.close();
+                    fs.unlinkSync(file);
+                    done();
+                });
+            });
+        });
+
+        it('#_transmit() not connected', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                var cb = sinon.spy();
+                reader.transmit(new Buffer([0x00]), 2, 1, cb);
+                sinon.assert.calledOnce(cb);
+            });
+        });
+    });
+
+    describe('#_transmit_chained()', function() {
+
+        it('#_transmit_chained() options', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                reader.connected = true;
+                var cb = sinon.spy();
+                var chained_stub = sinon.stub(reader, '_transmit_chained', function(header, data, chunk, envelope,
+                                                                                    le, res_len, protocol,
+                                                                                    chained_cb, flags) {
+                    data.length.should.equal(600);
+                    chunk.should.equal(255);
+                    envelope.should.equal(false);
+                    le.should.equal(-1);
+                    flags.should.equal(reader.PRIORITY_NORMAL);
+                    chained_cb(null, new Buffer([0x90, 0x00]));
+                });
+
+                reader.transmitChained(new Buffer([0x00, 0xD6, 0x00, 0x00]), new Buffer(600), 2, 1, cb);
+                sinon.assert.calledWith(cb, null, new Buffer([0x90, 0x00]));
+            });
+        });
+
+        it('#transmitChained() rejects a bad Le and oversized ENVELOPE data', function(done) {
+            var file = path.join(os.tmpdir(), 'pcsc-test-chained-' + process.pid + '.trc');
+            write_trace(file, [[1, 0, 2, new Buffer(0), new Buffer([2, 0, 0, 0])]]);
+            var reader = pcsc.replay('Virtual reader', file, { speed : 0 });
+            reader.connect(function(err, protocol) {
+                var header = new Buffer('00DA0000', 'hex');
+                (function() {
+                    reader.transmitChained(header, new Buffer(10), 2, protocol, { le : -5 }, function() {});
+                }).should.throw(/Fifth argument/);
+                (function() {
+                    reader.transmitChained(header, new Buffer(65536), 2, protocol, { envelope : true }, function() {});
+                }).should.throw(/65535/);
+                reader.close();
+                fs.unlinkSync(file);
+                done();
+            });
+        });
+
+        it('#transmitChained() ends an ENVELOPE with an empty one', function(done) {
+            var file = path.join(os.tmpdir(), 'pcsc-test-envelope-' + process.pid + '.trc');
+            var recorded = path.join(os.tmpdir(), 'pcsc-test-envelope-out-' + process.pid + '.trc');
+            var ok = new Buffer('9000', 'hex');
+            write_trace(file, [
+                [1, 0, 2, new Buffer(0), new Buffer([2, 0, 0, 0])],
+                [3, 0, 2, new Buffer(0), ok],
+                [3, 0, 2, new Buffer(0), ok],
+                [3, 0, 2, new Buffer(0), new Buffer('AABB9000', 'hex')]
+            ]);
+
+            var reader = pcsc.replay('Virtual reader', file, { speed : 0 });
+            reader.connect(function(err, protocol) {
+                reader.record(recorded);
+                var data = new Buffer('00112233445566778899', 'hex');
+                reader.transmitChained(new Buffer('00DA0000', 'hex'), data, 258, protocol,
+                                       { envelope : true, chunkSize : 8 }, function(err, response) {
+                    (err === undefined || err === null).should.equal(true);
+                    response.should.eql(new Buffer('AABB9000', 'hex'));
+                    reader.stopRecording();
+                    var sent = read_trace(recorded).map(function(r) {
+                        return r.in.toString('hex');
+                    });
+
+                    sent.should.eql([
+                        '00c200000800da00000a001122',
+                        '00c200000733445566778899',
+                        '00c2000000'
+                    ]);
+                    reader.close();
+                    fs.unlinkSync(file);
+                    fs.unlinkSync(recorded);
+                    done();
+                });
+            });
+        });
+    });
+
+    describe('#setRecovery()', function() {
+
+        it('#setRecovery() defaults', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                var recovery_stub = sinon.stub(reader, '_set_recovery');
+                reader.setRecovery({});
+                reader.setRecovery(null);
+                recovery_stub.restore();
+                recovery_stub.args[0][0].should.eql({ setup : [], deadline : 2000 });
+                (recovery_stub.args[1][0] === null).should.equal(true);
+            });
+        });
+    });
+
+    describe('#_verify()', function() {
+
+        it('#_verify() digests', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                reader.connected = true;
+                var cb = sinon.spy();
+                var sha = new Buffer(32);
+                var verify_stub = sinon.stub(reader, '_verify', function(apdus, kinds, expected, res_len,
+                                                                         protocol, verify_cb, flags) {
+                    apdus.length.should.equal(3);
+                    apdus[0].should.eql([read]);
+                    apdus[1].should.eql([read, next]);
+                    kinds.should.eql([0, 1, 2]);
+                    expected[1].should.eql(new Buffer([0xCB, 0xF4, 0x39, 0x26]));
+                    expected[2].should.equal(sha);
+                    verify_cb(null, [{ ok : true, sw : 0x9000, offset : null }]);
+                });
+
+                var read = new Buffer([0x00, 0xB0, 0x00, 0x00, 0x10]);
+                var next = new Buffer([0x00, 0xB0, 0x00, 0x10, 0x10]);
+                reader.verify([
+                    { apdu : read, expected : new Buffer(16) },
+                    { apdu : [read, next], crc32 : 0xCBF43926 },
+                    { apdu : read, sha256 : sha }
+                ], 258, 1, cb);
+                verify_stub.restore();
+                sinon.assert.calledOnce(cb);
+                cb.args[0][1][0].ok.should.equal(true);
+            });
+        });
+    });
+
+    describe('#_transmit_template()', function() {
+
+        it('#compileApdu() placeholders', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                var compile_stub = sinon.stub(reader, '_compile_apdu', function(header, mask, data, le) {
+                    header.should.eql(new Buffer([0x00, 0xB0, 0x00, 0x00]));
+                    mask.should.equal(0x01 | 0x08);
+                    (data === undefined).should.equal(true);
+                    le.should.equal(-1);
+                    return 0;
+                });
+
+                reader.compileApdu({ cla : 0x00, ins : 0xB0, p1 : null, p2 : 0x00, le : null }).should.equal(0);
+                sinon.assert.calledOnce(compile_stub);
+            });
+        });
+
+        it('#transmitSweep() responses', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                reader.connected = true;
+                var cb = sinon.spy();
+                var sweep_stub = sinon.stub(reader, '_transmit_sweep', function(handle, p1, p2, le, data,
+                                                                                res_len, protocol,
+                                                                                sweep_cb, flags, last) {
+                    p1.should.equal(1);
+                    last.should.equal(3);
+                    sweep_cb(null, new Buffer([0x01, 0x90, 0x00, 0x02, 0x90, 0x00, 0x6A, 0x83]), [3, 3, 2]);
+                });
+
+                reader.transmitSweep(0, { from : 1, to : 3, le : 1 }, 3, 1, cb);
+                var responses = cb.args[0][1];
+                responses.length.should.equal(3);
+                responses[1].should.eql(new Buffer([0x02, 0x90, 0x00]));
+                responses[2].should.eql(new Buffer([0x6A, 0x83]));
+            });
+        });
+    });
+
+    describe('#_control_batch()', function() {
+
+        it('#_control_batch() success', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                reader.connected = true;
+                var cb = sinon.spy();
+                var commands = [
+                    { data : new Buffer([0x01]), control_code : reader.SCARD_CTL_CODE(3500), res_len : 2 },
+                    { data : new Buffer([0x02]), control_code : reader.SCARD_CTL_CODE(3500), res_len : 2 }
+                ];
+
+                var batch_stub = sinon.stub(reader, '_control_batch', function(list, batch_cb, flags) {
+                    list.should.equal(commands);
+                    flags.should.equal(reader.PRIORITY_NORMAL);
+                    batch_cb(null, [new Buffer([0x90, 0x00]), new Buffer([0x90, 0x00])]);
+                });
+
+                reader.controlBatch(commands, cb);
+                sinon.assert.calledOnce(cb);
+            });
+        });
+
+        it('#_control_batch() not connected', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                var cb = sinon.spy();
+                reader.controlBatch([], cb);
+                sinon.assert.calledOnce(cb);
+            });
+        });
+    });
+
+    describe('#_set_rule()', function() {
+
+        it('#_set_rule() options', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                var uid = new Buffer([0x04, 0xA2, 0x3B, 0x12]);
+                var relay = new Buffer([0xE0, 0x00, 0x00, 0x29, 0x01, 0x01]);
+                var rule_stub = sinon.stub(reader, '_set_rule', function(rule) {
+                    rule.apdu.should.eql(new Buffer([0xFF, 0xCA, 0x00, 0x00, 0x00]));
+                    rule.uids.should.eql([uid]);
+                    rule.control_code.should.equal(reader.SCARD_CTL_CODE(3500));
+                    rule.on_allow.should.equal(relay);
+                    (rule.on_deny === undefined).should.equal(true);
+                });
+
+                reader.setRule({ allow : [uid], controlCode : reader.SCARD_CTL_CODE(3500), onAllow : relay });
+                sinon.assert.calledOnce(rule_stub);
+            });
+        });
+
+        it('#_set_rule() initial', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                var rule_stub = sinon.stub(reader, '_set_rule', function(rule) {
+                    rule.initial.should.equal(true);
+                });
+
+                reader.setRule({ allow : [], initial : true });
+                sinon.assert.calledOnce(rule_stub);
+            });
+        });
+    });
+
+    describe('#rule', function() {
+
+        it('#rule only fires for the cards the rule handled', function(done) {
+            var p = pcsc({ lazy : true });
+            var stub = sinon.stub(p, 'start', function(my_cb) {
+                my_cb(undefined, new Buffer("MyReader\0\0"));
+            });
+
+            p.on('reader', function(reader) {
+                var outcome = { uid : new Buffer([0x04, 0xA2]), allowed : true, sw : 0x9000, elapsed : 1, error : null };
+                var status_stub = sinon.stub(reader, 'get_status', function(cb) {
+                    // Inserted with no rule run, then the rule done on its own
+                    cb(undefined, 0x22, new Buffer([0x3B, 0x00]));
+                    cb(undefined, undefined, undefined, outcome);
+                });
+
+                var statuses = 0;
+                reader.on('status', function(status) {
+                    ++ statuses;
+                });
+
+                reader.on('rule', function(rule) {
+                    statuses.should.equal(1);
+                    rule.should.equal(outcome);
+                    reader.state.should.equal(0x22);
+                    status_stub.restore();
+                    reader.close();
+                    p.close();
+                    done();
+                });
+            });
+        });
+
+        it('#rule runs on a reader never connected', function(done) {
+            var file = path.join(os.tmpdir(), 'pcsc-test-rule-' + process.pid + '.trc');
+            var uid = new Buffer([0x04, 0xA2]);
+            var relay = new Buffer([0x01]);
+            write_trace(file, [
+                [5, 0, 0x10, new Buffer(0), new Buffer(0), 0],
+                [5, 0, 0x20, new Buffer(0), new Buffer('3B00', 'hex'), 50],
+                [1, 0, 2, new Buffer(0), new Buffer([2, 0, 0, 0])],
+                [3, 0, 2, new Buffer('FFCA000000', 'hex'), new Buffer('04A29000', 'hex')],
+                [4, 0, 0x42000DAC, relay, new Buffer(0)]
+            ]);
+
+            var reader = pcsc.replay('Virtual reader', file);
+            reader.setRule({ allow : [uid], controlCode : reader.SCARD_CTL_CODE(3500), onAllow : relay });
+            reader.on('status', function() {});
+            reader.on('rule', function(rule) {
+                (rule.error === undefined || rule.error === null).should.equal(true);
+                rule.uid.should.eql(uid);
+                rule.allowed.should.equal(true);
+                reader.connected.should.equal(false);
+                reader.getStats().rules_allowed.should.equal(1);
+                reader.close();
+                fs.unlinkSync(file);
+                done();
+            });
+        });
+    });
+
+    describe('#_read_memory()', function() {
+
+        it('#_read_memory() options', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                reader.connected = true;
+                var cb = sinon.spy();
+                var key = new Buffer([0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF]);
+                var read_stub = sinon.stub(reader, '_read_memory', function(start,
+                                                                             length,
+                                                                             options,
+                                                                             read_cb,
+                                                                             flags) {
+                    start.should.equal(4);
+                    length.should.equal(48);
+                    options.key.should.equal(key);
+                    options.key_type.should.equal(0x61);
+                    flags.should.equal(reader.PRIORITY_NORMAL);
+                    read_cb(null, new Buffer(48));
+                });
+
+                reader.readMemory(4, 48, { key : key, keyType : 'B' }, cb);
+                sinon.assert.calledOnce(cb);
+            });
+        });
+
+        it('#_read_memory() not connected', function() {
+            var p = get_reader();
+            p.on('reader', function(reader) {
+                var cb = sinon.spy();
+                reader.readMemory(4, 48, cb);
+                sinon.assert.calledOnce(cb);
+            });
+        });
+    });
+});
+
+describe('Testing broker', function() {
+
+    describe('#serve()', function() {
+
+        it('#serve() shares the readers', function(done) {
+            var p = new events.EventEmitter();
+            var reader = new events.EventEmitter();
+            reader.name = "MyReader";
+            reader.connect = function(options, cb) {
+                options.share_mode.should.equal(2);
+                cb(null, 2);
+            };
+
+            reader.transmit = function(data, res_len, protocol, cb) {
+                res_len.should.equal(10);
+                protocol.should.equal(2);
+                cb(null, Buffer.concat([data, new Buffer([0x90, 0x00])]));
+            };
+
+            reader.disconnect = function(disposition, cb) {
+                cb(null);
+            };
+
+            var socket_path = path.join(os.tmpdir(), 'pcsc-broker-' + process.pid + '.sock');
+            var server = pcsc.serve(socket_path, { pcsc : p });
+            p.emit('reader', reader);
+            reader.emit('status', { state : 0x22, atr : new Buffer([0x3B, 0x00]) });
+            server.on('listening', function() {
+                var client = pcsc.connect(socket_path);
+                client.on('reader', function(remote) {
+                    remote.name.should.equal("MyReader");
+                    remote.once('status', function(status) {
+                        status.state.should.equal(0x22);
+                        status.atr.should.eql(new Buffer([0x3B, 0x00]));
+                        remote.connect(function(err, protocol) {
+                            (err === null).should.equal(true);
+                            remote.transmit(new Buffer([0x00, 0x84]), 10, protocol, function(err, data) {
+                                data.should.eql(new Buffer([0x00, 0x84, 0x90, 0x00]));
+                                client.close();
+                                server.close(function() {
+                                    done();
+                                });
+                            });
+                        });
+                    });
+                });
+            });
+        });
+
+        it('#serve() takes over a stale socket', function(done) {
+            var socket_path = path.join(os.tmpdir(), 'pcsc-broker-stale-' + process.pid + '.sock');
+            fs.writeFileSync(socket_path, '');
+            var server = pcsc.serve(socket_path, { pcsc : new events.EventEmitter() });
+            server.on('listening', function() {
+                (fs.statSync(socket_path).mode & parseInt('777', 8)).should.equal(parseInt('600', 8));
+                server.close(function() {
+                    done();
+                });
+            });
+        });
+
+        it('#serve() gives the card to one client at a time', function(done) {
+            var p = new events.EventEmitter();
+            var reader = new events.EventEmitter();
+            reader.name = "MyReader";
+            reader.connect = function(options, cb) {
+                cb(null, 2);
+            };
+
+            reader.disconnect = function(disposition, cb) {
+                cb(null);
+            };
+
+            var socket_path = path.join(os.tmpdir(), 'pcsc-broker-owner-' + process.pid + '.sock');
+            var server = pcsc.serve(socket_path, { pcsc : p });
+            p.emit('reader', reader);
+            server.on('listening', function() {
+                var first = pcsc.connect(socket_path);
+                first.on('reader', function(mine) {
+                    mine.connect(function(err) {
+                        (err === null).should.equal(true);
+                        var second = pcsc.connect(socket_path);
+                        second.on('reader', function(theirs) {
+                            theirs.connect(function(err) {
+                                err.code.should.equal(0x8010000B);
+                                mine.disconnect(function() {
+                                    theirs.connect(function(err) {
+                                        (err === null).should.equal(true);
+                                        first.close();
+                                        second.close();
+                                        server.close(function() {
+                                            done();
+                                        });
+                                    });
+                                });
+                            });
+                        });
+                    });
+                });
+            });
+        });
+
+        it('#serve() rejects oversized responses', function(done) {
+            var p = new events.EventEmitter();
+            var reader = new events.EventEmitter();
+            reader.name = "MyReader";
+            reader.connect = function(options, cb) {
+                cb(null, 2);
+            };
+
+            reader.transmit = sinon.spy();
+            reader.disconnect = function(disposition, cb) {
+                cb(null);
+            };
+
+            var socket_path = path.join(os.tmpdir(), 'pcsc-broker-res-' + process.pid + '.sock');
+            var server = pcsc.serve(socket_path, { pcsc : p });
+            p.emit('reader', reader);
+            server.on('listening', function() {
+                var client = pcsc.connect(socket_path);
+                client.on('reader', function(remote) {
+                    remote.connect(function(err, protocol) {
+                        remote.transmit(new Buffer([0x00, 0x84, 0x00, 0x00, 0x08]), 0xFFFFFFFF, protocol, function(err) {
+                            err.message.should.equal('Malformed request');
+                            sinon.assert.notCalled(reader.transmit);
+                            client.close();
+                            server.close(function() {
+                                done();
+                            });
+                        });
+                    });
+                });
+            });
+        });
+
+        it('#serve() drops oversized frames', function(done) {
+            var socket_path = path.join(os.tmpdir(), 'pcsc-broker-frame-' + process.pid + '.sock');
+            var server = pcsc.serve(socket_path, { pcsc : new events.EventEmitter() });
+            server.on('listening', function() {
+                var socket = net.connect(socket_path);
+                socket.on('connect', function() {
+                    var header = new Buffer(9);
+                    header.writeUInt32BE(0x7FFFFFFF, 0);
+                    socket.write(header);
+                });
+
+                socket.resume();
+                socket.on('error', function() {});
+                socket.on('close', function() {
+                    server.close(function() {
+                        done();
+                    });
+                });
+            });
+        });
+    });
 });